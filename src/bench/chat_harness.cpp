@@ -0,0 +1,310 @@
+// In-process harness: runs a ChatServer on its own threads and connects
+// thousands of simulated clients to it over socketpair(2), with no TCP,
+// discovery or timing noise. The workload is fixed (every sender sends the
+// same number of messages, round-robin, with a bounded number in flight),
+// so two runs do the same work and the forwarding engine can be profiled
+// deterministically, e.g. perf record -g build/src/bench/chat_harness.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "../common/common.hpp"
+#include "../common/histogram.hpp"
+#include "../server/chat_server.hpp"
+#include "../server/logger.hpp"
+
+// Payload prefix: the magic, then the message's index as 16 hex digits, so
+// the frame is plain text the server relays untouched. The rest is filler.
+static const char HARNESS_MAGIC[] = "CHBT";
+static const uint32_t HARNESS_HEADER = 20;
+
+// How long the run may go without a single delivery before it gives up
+static const uint64_t STALL_NS = 10000000000ull;
+
+struct Sim {
+    int fd{ -1 };
+    uint32_t room{ 0 };
+    bool joined{ false };
+    bool want_out{ false };
+    Buffer inbuf{};
+    Buffer outbuf{};
+};
+
+// The server's clock: virtual, moved 1 ms per harness iteration, so its
+// timing wheel does the same work on every run whatever the machine
+static std::atomic<uint64_t> g_virtual_ns{ 0 };
+
+static uint64_t virtual_clock() {
+    return g_virtual_ns.load(std::memory_order_relaxed);
+}
+
+static void put_hex64(uint8_t *out, uint64_t v) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 15; i >= 0; --i, v >>= 4) out[i] = static_cast<uint8_t>(digits[v & 15]);
+}
+
+static int get_hex64(const uint8_t *in, uint64_t *out) {
+    uint64_t v = 0;
+    for (int i = 0; i < 16; ++i) {
+        uint8_t c = in[i];
+        if (c >= '0' && c <= '9') v = v << 4 | static_cast<uint64_t>(c - '0');
+        else if (c >= 'a' && c <= 'f') v = v << 4 | static_cast<uint64_t>(c - 'a' + 10);
+        else return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static void raise_fd_limit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void update_out_interest(int epfd, Sim &c, size_t index) {
+    bool want = c.outbuf.length > 0;
+    if (want == c.want_out) return;
+    epoll_event ev{};
+    ev.events = want ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.u64 = index;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+    c.want_out = want;
+}
+
+static uint64_t percentile_us(const Histogram &h, double q) {
+    return h.percentile(q) / 1000;
+}
+
+static void print_usage(const char *prog) {
+    std::printf("Usage: %s [--clients N] [--senders N] [--messages N] [--size BYTES] [--rooms N]\n"
+                "          [--window N] [--threads N] [--io-uring] [--real-clock] [--stats]\n"
+                "Every sender sends --messages frames of --size bytes (at least %u) to its room;\n"
+                "client i is in room i %% --rooms, and at most --window messages are in flight.\n",
+                prog, HARNESS_HEADER);
+}
+
+int main(int argc, char **argv) {
+    int num_clients = 2000;
+    int num_senders = 20;
+    long messages = 500;
+    uint32_t size = 128;
+    int num_rooms = 1;
+    long window = 256;
+    ChatServerConfig cfg;
+    cfg.tcp_port = 0;
+    cfg.discovery_port = 0;
+    cfg.deadlines = Deadlines{ 0, 0, 0 };
+    cfg.clock_ns = virtual_clock;
+    bool show_stats = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if ((std::strcmp(argv[i], "--clients") == 0 || std::strcmp(argv[i], "-c") == 0) && i + 1 < argc) {
+            num_clients = std::atoi(argv[++i]);
+        } else if ((std::strcmp(argv[i], "--senders") == 0 || std::strcmp(argv[i], "-s") == 0) && i + 1 < argc) {
+            num_senders = std::atoi(argv[++i]);
+        } else if ((std::strcmp(argv[i], "--messages") == 0 || std::strcmp(argv[i], "-m") == 0) && i + 1 < argc) {
+            messages = std::atol(argv[++i]);
+        } else if (std::strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            size = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--rooms") == 0 && i + 1 < argc) {
+            num_rooms = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            window = std::atol(argv[++i]);
+        } else if ((std::strcmp(argv[i], "--threads") == 0 || std::strcmp(argv[i], "-t") == 0) && i + 1 < argc) {
+            cfg.threads = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--io-uring") == 0) {
+            cfg.io_uring = true;
+        } else if (std::strcmp(argv[i], "--real-clock") == 0) {
+            cfg.clock_ns = monotonic_ns;
+        } else if (std::strcmp(argv[i], "--stats") == 0) {
+            show_stats = true;
+        } else {
+            print_usage(argv[0]);
+            return std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0 ? 0 : 1;
+        }
+    }
+    if (num_clients < 2) num_clients = 2;
+    if (num_senders < 1) num_senders = 1;
+    if (num_senders > num_clients) num_senders = num_clients;
+    if (num_rooms < 1) num_rooms = 1;
+    if (num_rooms > num_clients / 2) num_rooms = num_clients / 2;
+    if (messages < 1) messages = 1;
+    if (window < 1) window = 1;
+    if (size < HARNESS_HEADER) size = HARNESS_HEADER;
+    if (size > MAX_MESSAGE_SIZE) size = MAX_MESSAGE_SIZE;
+
+    std::signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+    g_log_threshold = LOG_WARN; // one line per connection would drown the results
+
+    ChatServer server(cfg);
+    if (server.open() != 0) return 1;
+    std::thread serving([&server] { server.run(); });
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        std::perror("epoll_create1");
+        server.stop();
+        serving.join();
+        return 1;
+    }
+
+    // every client joins its room; the server's notices show when they all
+    // have, so no message can reach a room before its members
+    std::vector<Sim> sims(static_cast<size_t>(num_clients));
+    std::vector<uint64_t> room_size(static_cast<size_t>(num_rooms), 0);
+    for (size_t i = 0; i < sims.size(); ++i) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+            std::fprintf(stderr, "socketpair #%zu: %s\n", i, std::strerror(errno));
+            server.stop();
+            serving.join();
+            return 1;
+        }
+        server.add_client(sv[1]);
+        Sim &c = sims[i];
+        c.fd = sv[0];
+        c.room = static_cast<uint32_t>(i % static_cast<size_t>(num_rooms));
+        ++room_size[c.room];
+        set_socket_nonblocking(c.fd);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+        std::string join = "/join r" + std::to_string(c.room);
+        send_framed_or_buffer(c.fd, c.outbuf, reinterpret_cast<const uint8_t *>(join.data()),
+                              static_cast<uint32_t>(join.size()));
+        update_out_interest(epfd, c, i);
+    }
+
+    uint64_t total = static_cast<uint64_t>(messages) * static_cast<uint64_t>(num_senders);
+    std::vector<uint64_t> sent_at(total, 0);
+    std::vector<uint32_t> pending(total, 0); // recipients still waiting for each message
+    std::vector<uint8_t> payload(size, 'x');
+    std::memcpy(payload.data(), HARNESS_MAGIC, 4);
+    std::unique_ptr<Histogram> latency(new Histogram());
+
+    size_t joined = 0;
+    uint64_t sent = 0, completed = 0, delivered = 0, foreign = 0;
+    uint64_t start = 0;
+    uint64_t last_progress = monotonic_ns();
+    bool failed = false;
+    epoll_event events[256];
+
+    while (completed < total && !failed) {
+        g_virtual_ns.fetch_add(1000000, std::memory_order_relaxed);
+
+        // round-robin over the senders while the window has room
+        while (joined == sims.size() && sent < total && sent - completed < static_cast<uint64_t>(window)) {
+            if (start == 0) start = monotonic_ns();
+            size_t from = static_cast<size_t>(sent % static_cast<uint64_t>(num_senders));
+            Sim &c = sims[from];
+            pending[sent] = static_cast<uint32_t>(room_size[c.room] - 1);
+            put_hex64(payload.data() + 4, sent);
+            sent_at[sent] = monotonic_ns();
+            if (pending[sent] == 0) ++completed;
+            ++sent;
+            if (send_framed_or_buffer(c.fd, c.outbuf, payload.data(), size) < 0) {
+                std::fprintf(stderr, "send failed on client %zu\n", from);
+                failed = true;
+                break;
+            }
+            update_out_interest(epfd, c, from);
+        }
+
+        int n = epoll_wait(epfd, events, 256, 10);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::perror("epoll_wait");
+            break;
+        }
+        uint64_t now = monotonic_ns();
+        for (int i = 0; i < n && !failed; ++i) {
+            size_t index = static_cast<size_t>(events[i].data.u64);
+            Sim &c = sims[index];
+            if (events[i].events & EPOLLOUT) {
+                if (flush_buffered_writes(c.fd, c.outbuf) < 0) {
+                    std::fprintf(stderr, "write failed on client %zu\n", index);
+                    failed = true;
+                }
+                update_out_interest(epfd, c, index);
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+            ssize_t r = read_into_buffer_nonblocking(c.fd, c.inbuf);
+            if (r <= 0) {
+                std::fprintf(stderr, "server closed client %zu\n", index);
+                failed = true;
+                break;
+            }
+            for (;;) {
+                uint32_t len = 0;
+                const uint8_t *p = nullptr;
+                if (get_frame_view(c.inbuf, &p, &len) != 1) break;
+                uint64_t id = 0;
+                if (len >= HARNESS_HEADER && std::memcmp(p, HARNESS_MAGIC, 4) == 0 && get_hex64(p + 4, &id) == 0 &&
+                    id < sent && pending[id] > 0) {
+                    latency->record(now - sent_at[id]);
+                    ++delivered;
+                    if (--pending[id] == 0) ++completed;
+                    last_progress = now;
+                } else if (!c.joined && len > 0 && p[0] == '*') {
+                    c.joined = true;
+                    ++joined;
+                    last_progress = now;
+                } else {
+                    ++foreign;
+                }
+                c.inbuf.consume(4 + len);
+            }
+        }
+        if (now - last_progress > STALL_NS) {
+            std::fprintf(stderr, "no progress for %llu s: %zu/%zu joined, %llu/%llu messages complete\n",
+                         static_cast<unsigned long long>(STALL_NS / 1000000000), joined, sims.size(),
+                         static_cast<unsigned long long>(completed), static_cast<unsigned long long>(total));
+            failed = true;
+        }
+    }
+    uint64_t end = monotonic_ns();
+
+    if (start != 0 && completed == total) {
+        double secs = static_cast<double>(end - start) / 1e9;
+        std::printf("clients: %d  senders: %d  rooms: %d  threads: %d (%s)  window: %ld\n", num_clients, num_senders,
+                    num_rooms, cfg.threads, cfg.io_uring ? "io_uring" : "epoll", window);
+        std::printf("sent:      %12llu msgs  %12.0f msgs/s  in %.3fs\n", static_cast<unsigned long long>(total),
+                    static_cast<double>(total) / secs, secs);
+        std::printf("delivered: %12llu msgs  %12.0f msgs/s  %10.2f MB/s  (%llu unexpected frames)\n",
+                    static_cast<unsigned long long>(delivered), static_cast<double>(delivered) / secs,
+                    static_cast<double>(delivered) * (4 + size) / secs / 1e6, static_cast<unsigned long long>(foreign));
+        std::printf("fan-out latency (us): p50 %llu  p99 %llu  p999 %llu  max %llu\n",
+                    static_cast<unsigned long long>(percentile_us(*latency, 0.50)),
+                    static_cast<unsigned long long>(percentile_us(*latency, 0.99)),
+                    static_cast<unsigned long long>(percentile_us(*latency, 0.999)),
+                    static_cast<unsigned long long>(latency->max() / 1000));
+    }
+    if (show_stats) {
+        std::string report;
+        server.stats(&report);
+        std::fputs(report.c_str(), stdout);
+    }
+
+    server.stop();
+    serving.join();
+    for (Sim &c : sims) close(c.fd);
+    close(epfd);
+    return failed || completed != total ? 1 : 0;
+}
@@ -0,0 +1,441 @@
+// End-to-end load generator: opens many connections to a running server,
+// sends timestamped frames at a fixed aggregate rate from a subset of them
+// and measures the fan-out latency seen by every receiver.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../common/common.hpp"
+#include "../common/histogram.hpp"
+#include "../common/shm_ring.hpp"
+
+// Payload prefix stamped by the sender: the magic, then the send time as
+// 16 hex digits, so the frame is plain text the server relays untouched.
+// The rest is filler.
+static const uint32_t BENCH_MAGIC = 0x43484254; // "CHBT"
+static const uint32_t BENCH_HEADER = 20;
+
+static void put_hex64(uint8_t *out, uint64_t v) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 15; i >= 0; --i, v >>= 4) out[i] = static_cast<uint8_t>(digits[v & 15]);
+}
+
+static int get_hex64(const uint8_t *in, uint64_t *out) {
+    uint64_t v = 0;
+    for (int i = 0; i < 16; ++i) {
+        uint8_t c = in[i];
+        if (c >= '0' && c <= '9') v = v << 4 | static_cast<uint64_t>(c - '0');
+        else if (c >= 'a' && c <= 'f') v = v << 4 | static_cast<uint64_t>(c - 'a' + 10);
+        else return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+// Senders skip their turn while this much output is still unsent
+static const size_t SENDER_BACKLOG_LIMIT = 64 * 1024;
+
+// epoll data of a connection's shared-memory doorbell: its index with the
+// top bit set
+static const uint64_t BELL_TAG = 1ull << 63;
+
+struct Conn {
+    int fd{ -1 };
+    uint32_t id{ 0 };
+    Buffer inbuf{};
+    Buffer outbuf{};
+    bool want_out{ false };
+    std::unique_ptr<ShmLink> shm{}; // --shm: frames go through the rings
+};
+
+// Message sizes: a fixed size, a uniform MIN-MAX range, or a weighted mix
+// written as SIZE:WEIGHT,SIZE:WEIGHT,...
+struct SizeDist {
+    std::vector<uint32_t> sizes;
+    std::vector<double> weights;
+    uint32_t lo{ 0 };
+    uint32_t hi{ 0 };
+    bool uniform{ false };
+};
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void handle_sigint(int /*sig*/) {
+    g_stop = 1;
+}
+
+static uint32_t clamp_size(unsigned long v) {
+    if (v < BENCH_HEADER) return BENCH_HEADER;
+    if (v > MAX_MESSAGE_SIZE) return MAX_MESSAGE_SIZE;
+    return static_cast<uint32_t>(v);
+}
+
+static bool parse_size_dist(const char *spec, SizeDist &out) {
+    out = SizeDist{};
+    if (std::strchr(spec, ':')) {
+        std::string s(spec);
+        size_t pos = 0;
+        while (pos < s.size()) {
+            size_t comma = s.find(',', pos);
+            std::string item = s.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+            unsigned long size = 0;
+            double weight = 0;
+            if (std::sscanf(item.c_str(), "%lu:%lf", &size, &weight) != 2 || weight <= 0) return false;
+            out.sizes.push_back(clamp_size(size));
+            out.weights.push_back(weight);
+            if (comma == std::string::npos) break;
+            pos = comma + 1;
+        }
+        return !out.sizes.empty();
+    }
+    unsigned long lo = 0, hi = 0;
+    int n = std::sscanf(spec, "%lu-%lu", &lo, &hi);
+    if (n == 2) {
+        out.uniform = true;
+        out.lo = clamp_size(lo);
+        out.hi = clamp_size(hi);
+        if (out.hi < out.lo) return false;
+        return true;
+    }
+    if (n == 1) {
+        out.sizes.push_back(clamp_size(lo));
+        out.weights.push_back(1);
+        return true;
+    }
+    return false;
+}
+
+static uint64_t percentile_us(const Histogram &h, double q) {
+    return h.percentile(q) / 1000;
+}
+
+static void raise_fd_limit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int connect_one(const sockaddr_in &addr) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (::connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    set_socket_nonblocking(fd);
+    return fd;
+}
+
+// Connects to a --unix-socket and, with shm, moves the connection onto
+// shared memory; frames the server sent before it agreed land in c.inbuf.
+static int connect_local(const char *path, bool shm, Conn &c) {
+    sockaddr_un addr{};
+    if (std::strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (::connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    if (shm) {
+        c.shm.reset(new ShmLink());
+        if (shm_request(fd, c.shm.get(), c.inbuf) != 1) {
+            std::fprintf(stderr, "shared memory refused\n");
+            errno = EPROTO;
+            ::close(fd);
+            return -1;
+        }
+    }
+    set_socket_nonblocking(fd);
+    return fd;
+}
+
+static void update_out_interest(int epfd, Conn &c, size_t index) {
+    if (c.shm) return;
+    bool want = c.outbuf.length > 0;
+    if (want == c.want_out) return;
+    epoll_event ev{};
+    ev.events = want ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.u64 = index;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+    c.want_out = want;
+}
+
+static void print_usage(const char *prog) {
+    std::printf("Usage: %s [--host IP] [--port PORT] [--unix PATH [--shm]] [--clients N] [--senders N]\n"
+                "          [--rate MSGS_PER_SEC] [--size SPEC] [--duration SEC] [--warmup SEC]\n"
+                "--unix connects every client to the server's --unix-socket instead of TCP;\n"
+                "--shm then moves them onto its shared-memory rings.\n"
+                "SPEC is a fixed size (128), a uniform range (64-1024) or a weighted mix\n"
+                "(64:90,1024:9,4096:1). Sizes include the %u-byte timestamp header.\n",
+                prog, BENCH_HEADER);
+}
+
+int main(int argc, char **argv) {
+    std::string host = "127.0.0.1";
+    uint16_t port = DEFAULT_TCP_PORT;
+    int num_clients = 1000;
+    int num_senders = 10;
+    double rate = 1000;
+    double duration = 10;
+    double warmup = 2;
+    SizeDist sizes;
+    parse_size_dist("128", sizes);
+    const char *unix_path = nullptr;
+    bool use_shm = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if ((std::strcmp(argv[i], "--port") == 0 || std::strcmp(argv[i], "-p") == 0) && i + 1 < argc) {
+            port = static_cast<uint16_t>(std::atoi(argv[++i]));
+        } else if ((std::strcmp(argv[i], "--clients") == 0 || std::strcmp(argv[i], "-c") == 0) && i + 1 < argc) {
+            num_clients = std::atoi(argv[++i]);
+        } else if ((std::strcmp(argv[i], "--senders") == 0 || std::strcmp(argv[i], "-s") == 0) && i + 1 < argc) {
+            num_senders = std::atoi(argv[++i]);
+        } else if ((std::strcmp(argv[i], "--rate") == 0 || std::strcmp(argv[i], "-r") == 0) && i + 1 < argc) {
+            rate = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (!parse_size_dist(argv[++i], sizes)) {
+                std::fprintf(stderr, "Invalid size spec: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((std::strcmp(argv[i], "--duration") == 0 || std::strcmp(argv[i], "-t") == 0) && i + 1 < argc) {
+            duration = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--shm") == 0) {
+            use_shm = true;
+        } else if (std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        }
+    }
+    if (num_clients < 2) num_clients = 2;
+    if (num_senders < 1) num_senders = 1;
+    if (num_senders > num_clients) num_senders = num_clients;
+    if (rate <= 0 || duration <= 0 || (use_shm && !unix_path)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::signal(SIGINT, handle_sigint);
+    std::signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        std::fprintf(stderr, "Invalid host IP: %s\n", host.c_str());
+        return 1;
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        std::perror("epoll_create1");
+        return 1;
+    }
+
+    std::vector<Conn> conns(static_cast<size_t>(num_clients));
+    for (size_t i = 0; i < conns.size(); ++i) {
+        int fd = unix_path ? connect_local(unix_path, use_shm, conns[i]) : connect_one(addr);
+        if (fd < 0) {
+            std::fprintf(stderr, "connect #%zu: %s\n", i, std::strerror(errno));
+            return 1;
+        }
+        conns[i].fd = fd;
+        conns[i].id = static_cast<uint32_t>(i);
+        epoll_event ev{};
+        // on shared memory the socket only reports the server hanging up
+        ev.events = conns[i].shm ? 0u : static_cast<uint32_t>(EPOLLIN);
+        ev.data.u64 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        if (conns[i].shm) {
+            ev.events = EPOLLIN;
+            ev.data.u64 = i | BELL_TAG;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].shm->client_bell, &ev);
+        }
+    }
+    // let the server register every connection before the first message
+    usleep(500 * 1000);
+
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<uint32_t> uniform(sizes.lo, sizes.hi ? sizes.hi : sizes.lo);
+    std::discrete_distribution<size_t> pick(sizes.weights.begin(), sizes.weights.end());
+    std::vector<uint8_t> payload(MAX_MESSAGE_SIZE, 'x');
+
+    std::unique_ptr<Histogram> latency(new Histogram());
+    uint64_t sent = 0, sent_bytes = 0, due_total = 0;
+    uint64_t delivered = 0, delivered_bytes = 0, skipped = 0;
+    uint64_t next_sender = 0;
+
+    const uint64_t start = monotonic_ns();
+    const uint64_t measure_from = start + static_cast<uint64_t>(warmup * 1e9);
+    const uint64_t send_until = measure_from + static_cast<uint64_t>(duration * 1e9);
+    const uint64_t drain_until = send_until + 1000000000ull;
+    bool measuring = false;
+
+    if (unix_path) {
+        std::printf("Connected %d clients (%d senders) to %s%s, warming up %.1fs\n", num_clients, num_senders,
+                    unix_path, use_shm ? " (shared memory)" : "", warmup);
+    } else {
+        std::printf("Connected %d clients (%d senders) to %s:%u, warming up %.1fs\n",
+                    num_clients, num_senders, host.c_str(), port, warmup);
+    }
+
+    // records every complete benchmark frame in c.inbuf
+    auto take_frames = [&](Conn &c, uint64_t recv_at) {
+        for (;;) {
+            uint32_t mlen = 0;
+            const uint8_t *p = nullptr;
+            if (get_frame_view(c.inbuf, &p, &mlen) != 1) break;
+            uint32_t magic = 0;
+            uint64_t ts = 0;
+            if (mlen >= BENCH_HEADER && get_hex64(p + 4, &ts) == 0) std::memcpy(&magic, p, 4);
+            if (magic == BENCH_MAGIC && (!measuring || ts >= measure_from)) {
+                latency->record(recv_at - ts);
+                ++delivered;
+                delivered_bytes += 4 + mlen;
+            }
+            c.inbuf.consume(4 + mlen);
+        }
+    };
+
+    epoll_event events[256];
+    while (!g_stop) {
+        uint64_t now = monotonic_ns();
+        if (now >= drain_until) break;
+        if (!measuring && now >= measure_from) {
+            measuring = true;
+            latency->reset();
+            sent = sent_bytes = delivered = delivered_bytes = skipped = 0;
+            due_total = 0;
+        }
+
+        // pace sends against the aggregate rate
+        if (now < send_until) {
+            uint64_t phase_start = measuring ? measure_from : start;
+            uint64_t due = static_cast<uint64_t>(static_cast<double>(now - phase_start) * rate / 1e9);
+            while (due_total < due) {
+                ++due_total;
+                Conn &c = conns[next_sender++ % static_cast<uint64_t>(num_senders)];
+                if (c.outbuf.length > SENDER_BACKLOG_LIMIT) {
+                    ++skipped;
+                    continue;
+                }
+                uint32_t len = sizes.uniform ? uniform(rng) : sizes.sizes[pick(rng)];
+                uint64_t ts = monotonic_ns();
+                std::memcpy(payload.data(), &BENCH_MAGIC, 4);
+                put_hex64(payload.data() + 4, ts);
+                if (send_framed_or_buffer(c.shm ? -1 : c.fd, c.outbuf, payload.data(), len) < 0 ||
+                    (c.shm && shm_write_buffer(c.shm->up, c.shm->server_bell, c.outbuf) < 0)) {
+                    std::fprintf(stderr, "send failed on client %u\n", c.id);
+                    g_stop = 1;
+                    break;
+                }
+                update_out_interest(epfd, c, c.id);
+                ++sent;
+                sent_bytes += 4 + len;
+            }
+        }
+
+        int n = epoll_wait(epfd, events, 256, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            uint64_t data = events[i].data.u64;
+            Conn &c = conns[data & ~BELL_TAG];
+            if (c.shm) {
+                if (!(data & BELL_TAG)) {
+                    std::fprintf(stderr, "server closed client %u\n", c.id);
+                    g_stop = 1;
+                    break;
+                }
+                // the server wrote to our parked ring, or made room in its own
+                shm_doorbell_drain(c.shm->client_bell);
+                if (c.outbuf.length > 0 && shm_write_buffer(c.shm->up, c.shm->server_bell, c.outbuf) < 0) g_stop = 1;
+                uint64_t recv_at = monotonic_ns();
+                for (;;) {
+                    ssize_t r = shm_read_buffer(c.shm->down, c.shm->server_bell, c.inbuf, SIZE_MAX);
+                    if (r < 0) {
+                        std::fprintf(stderr, "bad ring on client %u\n", c.id);
+                        g_stop = 1;
+                        break;
+                    }
+                    if (r > 0) take_frames(c, recv_at);
+                    else if (c.shm->down.park_reader()) break;
+                }
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (flush_buffered_writes(c.fd, c.outbuf) < 0) {
+                    std::fprintf(stderr, "write failed on client %u\n", c.id);
+                    g_stop = 1;
+                }
+                update_out_interest(epfd, c, c.id);
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+            ssize_t r = read_into_buffer_nonblocking(c.fd, c.inbuf);
+            if (r <= 0) {
+                std::fprintf(stderr, "server closed client %u\n", c.id);
+                g_stop = 1;
+                break;
+            }
+            take_frames(c, monotonic_ns());
+        }
+    }
+
+    double secs = duration;
+    uint64_t end = monotonic_ns();
+    if (end < send_until && end > measure_from) secs = static_cast<double>(end - measure_from) / 1e9;
+
+    std::printf("\nclients: %d  senders: %d  duration: %.1fs  target rate: %.0f msgs/s\n", num_clients, num_senders, secs, rate);
+    std::printf("sent:      %12llu msgs  %12.0f msgs/s  %10.2f MB/s  (%llu skipped: sender backlogged)\n",
+                static_cast<unsigned long long>(sent), static_cast<double>(sent) / secs,
+                static_cast<double>(sent_bytes) / secs / 1e6, static_cast<unsigned long long>(skipped));
+    std::printf("delivered: %12llu msgs  %12.0f msgs/s  %10.2f MB/s  (expected %llu)\n",
+                static_cast<unsigned long long>(delivered), static_cast<double>(delivered) / secs,
+                static_cast<double>(delivered_bytes) / secs / 1e6,
+                static_cast<unsigned long long>(sent * static_cast<uint64_t>(num_clients - 1)));
+    std::printf("fan-out latency (us): p50 %llu  p99 %llu  p999 %llu  max %llu\n",
+                static_cast<unsigned long long>(percentile_us(*latency, 0.50)),
+                static_cast<unsigned long long>(percentile_us(*latency, 0.99)),
+                static_cast<unsigned long long>(percentile_us(*latency, 0.999)),
+                static_cast<unsigned long long>(latency->max() / 1000));
+
+    for (Conn &c : conns) close(c.fd);
+    close(epfd);
+    return 0;
+}
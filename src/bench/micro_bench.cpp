@@ -0,0 +1,489 @@
+// Microbenchmarks for the per-byte hot path in src/common: Buffer append and
+// consume, frame parsing (has_complete_frame / get_frame_view) and
+// send_framed_or_buffer, plus the text scans (UTF-8/control checks and
+// newline search) per kernel. Reports ns/frame, MB/s and heap
+// allocations/frame. Exits non-zero if a text kernel disagrees with the
+// scalar one.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../common/buffer_pool.hpp"
+#include "../common/common.hpp"
+#include "../common/text_scan.hpp"
+
+// Every operator new in the process is counted so each case can report
+// allocations per frame; single threaded, so a plain counter is enough.
+// Kept out of line so GCC does not pair the builtin new with free().
+static uint64_t g_allocs = 0;
+
+// Buffer storage comes from the pool, which mallocs directly, so its
+// misses are heap allocations too
+static uint64_t heap_allocs() {
+    BufferPoolStats pool;
+    buffer_pool_stats(&pool);
+    return g_allocs + pool.misses;
+}
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    ++g_allocs;
+    void *p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t /*size*/) noexcept {
+    std::free(p);
+}
+
+// Keeps results observable so the work is not optimised away
+static volatile uint64_t g_sink = 0;
+
+static double g_min_time_s = 0.3;
+static const char *g_filter = nullptr;
+
+struct Result {
+    uint64_t frames{ 0 };
+    uint64_t bytes{ 0 };
+};
+
+// Runs body until g_min_time_s has passed and prints per-frame figures.
+// body performs one iteration and returns how much it processed.
+template <typename Fn>
+static void run_case(const std::string &name, Fn body) {
+    if (g_filter && name.find(g_filter) == std::string::npos) return;
+    body(); // warm caches and let buffers reach their steady size
+
+    Result total;
+    uint64_t allocs_before = heap_allocs();
+    uint64_t start = monotonic_ns();
+    uint64_t deadline = start + static_cast<uint64_t>(g_min_time_s * 1e9);
+    uint64_t now = start;
+    do {
+        Result r = body();
+        total.frames += r.frames;
+        total.bytes += r.bytes;
+        now = monotonic_ns();
+    } while (now < deadline);
+    uint64_t allocs = heap_allocs() - allocs_before;
+
+    double ns = static_cast<double>(now - start);
+    double frames = static_cast<double>(total.frames ? total.frames : 1);
+    std::printf("%-40s %10.1f ns/frame %10.1f MB/s %10.4f allocs/frame\n", name.c_str(), ns / frames,
+                static_cast<double>(total.bytes) / ns * 1e3, static_cast<double>(allocs) / frames);
+}
+
+// Payload size mixes, drawn with a fixed seed so runs are comparable
+struct SizeMix {
+    const char *name;
+    std::vector<uint32_t> sizes;
+    std::vector<double> weights;
+    uint32_t lo;
+    uint32_t hi;
+};
+
+static std::vector<uint32_t> draw_sizes(const SizeMix &mix, size_t n) {
+    std::mt19937 rng(7);
+    std::vector<uint32_t> out;
+    out.reserve(n);
+    if (mix.sizes.empty()) {
+        std::uniform_int_distribution<uint32_t> d(mix.lo, mix.hi);
+        for (size_t i = 0; i < n; ++i) out.push_back(d(rng));
+    } else {
+        std::discrete_distribution<size_t> d(mix.weights.begin(), mix.weights.end());
+        for (size_t i = 0; i < n; ++i) out.push_back(mix.sizes[d(rng)]);
+    }
+    return out;
+}
+
+// Concatenated wire frames, as they would arrive on a socket
+static std::vector<uint8_t> encode_stream(const std::vector<uint32_t> &sizes) {
+    std::vector<uint8_t> wire;
+    for (uint32_t len : sizes) {
+        uint32_t nlen = htonl(len);
+        const uint8_t *h = reinterpret_cast<const uint8_t *>(&nlen);
+        wire.insert(wire.end(), h, h + 4);
+        wire.insert(wire.end(), len, static_cast<uint8_t>('a' + len % 26));
+    }
+    return wire;
+}
+
+// Feeds the stream into a Buffer chunk bytes at a time and drains every
+// complete frame after each chunk, like the server's read loop does.
+static Result parse_stream(Buffer &inbuf, const std::vector<uint8_t> &wire, size_t chunk) {
+    Result r;
+    uint64_t acc = 0;
+    for (size_t off = 0; off < wire.size(); off += chunk) {
+        size_t n = std::min(chunk, wire.size() - off);
+        inbuf.append(wire.data() + off, n);
+        for (;;) {
+            const uint8_t *p = nullptr;
+            uint32_t len = 0;
+            if (get_frame_view(inbuf, &p, &len) != 1) break;
+            acc += len ? p[len - 1] : 0;
+            inbuf.consume(4 + len);
+            ++r.frames;
+        }
+    }
+    r.bytes = wire.size();
+    g_sink = g_sink + acc;
+    return r;
+}
+
+static void bench_parse_mixes() {
+    const std::vector<SizeMix> mixes = {
+        { "fixed-16", { 16 }, { 1 }, 0, 0 },
+        { "fixed-128", { 128 }, { 1 }, 0, 0 },
+        { "fixed-4096", { 4096 }, { 1 }, 0, 0 },
+        { "uniform-1-4096", {}, {}, 1, 4096 },
+        { "chat-64:90,1024:9,4000:1", { 64, 1024, 4000 }, { 90, 9, 1 }, 0, 0 },
+    };
+    for (const SizeMix &mix : mixes) {
+        std::vector<uint8_t> wire = encode_stream(draw_sizes(mix, 4096));
+        Buffer inbuf;
+        // 16K chunks: a typical readv into the ring
+        run_case(std::string("parse/") + mix.name, [&] { return parse_stream(inbuf, wire, 16384); });
+    }
+}
+
+static void bench_pipelined() {
+    std::vector<uint8_t> wire = encode_stream(std::vector<uint32_t>(16384, 8));
+    Buffer inbuf;
+    run_case("pipelined/8B-in-64K-reads", [&] { return parse_stream(inbuf, wire, 65536); });
+}
+
+static void bench_partial_arrival() {
+    SizeMix mix{ "", { 64, 1024, 4000 }, { 90, 9, 1 }, 0, 0 };
+    std::vector<uint8_t> wire = encode_stream(draw_sizes(mix, 2048));
+    // chunks smaller than a header, odd sizes that split headers, and
+    // MTU-ish segments
+    for (size_t chunk : { static_cast<size_t>(1), static_cast<size_t>(3), static_cast<size_t>(7),
+                          static_cast<size_t>(100), static_cast<size_t>(1448) }) {
+        Buffer inbuf;
+        run_case("partial/chunk-" + std::to_string(chunk), [&] { return parse_stream(inbuf, wire, chunk); });
+    }
+}
+
+static void bench_buffer_growth() {
+    std::vector<uint8_t> payload(4096, 'x');
+    // a fresh buffer per iteration: growth from empty to 1 MiB and back,
+    // all from the pool's caches, then to 2 MiB, past its largest class
+    for (uint32_t mib : { 1u, 2u }) {
+        run_case("buffer/grow-to-" + std::to_string(mib) + "M-4K-appends", [&] {
+            Buffer b;
+            Result r;
+            while (b.length < (mib << 20)) {
+                b.append(payload.data(), payload.size());
+                ++r.frames;
+            }
+            r.bytes = b.length;
+            b.consume(b.length);
+            return r;
+        });
+    }
+    // a long-lived buffer that hovers around a fixed depth: the ring keeps
+    // its capacity and only wraps
+    Buffer steady;
+    run_case("buffer/steady-wrap-64B", [&] {
+        Result r;
+        for (int i = 0; i < 4096; ++i) {
+            steady.append(payload.data(), 64);
+            if (steady.length > 8192) steady.consume(steady.length - 4096 + 13);
+            ++r.frames;
+        }
+        r.bytes = r.frames * 64;
+        return r;
+    });
+    // burst then drain: capacity stays at the burst high-water mark
+    Buffer burst;
+    run_case("buffer/burst-256K-drain", [&] {
+        Result r;
+        while (burst.length < (256u << 10)) {
+            burst.append(payload.data(), 1024);
+            ++r.frames;
+        }
+        r.bytes = burst.length;
+        burst.consume(burst.length);
+        return r;
+    });
+    // the same with the storage handed back to the pool after every drain,
+    // as the server does for idle connections: regrowth takes cached blocks
+    Buffer trimmed;
+    run_case("buffer/burst-256K-drain-trim", [&] {
+        Result r;
+        while (trimmed.length < (256u << 10)) {
+            trimmed.append(payload.data(), 1024);
+            ++r.frames;
+        }
+        r.bytes = trimmed.length;
+        trimmed.consume(trimmed.length);
+        trimmed.trim();
+        return r;
+    });
+}
+
+static void bench_send() {
+    std::vector<uint8_t> payload(4096, 'y');
+    int devnull = ::open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+        std::perror("open /dev/null");
+        return;
+    }
+    // empty outbuf: header and payload go out in one writev
+    for (uint32_t len : { 16u, 1024u, 4096u }) {
+        Buffer outbuf;
+        run_case("send/direct-" + std::to_string(len), [&] {
+            Result r;
+            for (int i = 0; i < 1024; ++i) {
+                send_framed_or_buffer(devnull, outbuf, payload.data(), len);
+                ++r.frames;
+            }
+            r.bytes = r.frames * (4 + len);
+            return r;
+        });
+    }
+    ::close(devnull);
+
+    // backlogged outbuf: the frame is only appended behind pending bytes
+    for (uint32_t len : { 16u, 1024u, 4096u }) {
+        Buffer outbuf;
+        run_case("send/queued-" + std::to_string(len), [&] {
+            Result r;
+            uint8_t pending = 0;
+            outbuf.append(&pending, 1);
+            for (int i = 0; i < 1024; ++i) {
+                send_framed_or_buffer(-1, outbuf, payload.data(), len);
+                ++r.frames;
+            }
+            r.bytes = r.frames * (4 + len);
+            outbuf.consume(outbuf.length);
+            return r;
+        });
+    }
+}
+
+// Chat lines of 40-200 bytes, one per frame: plain ASCII, or a mix of
+// Latin, CJK and emoji as sent by real clients
+static std::vector<std::string> make_lines(bool ascii, size_t n) {
+    static const char *words[] = { "hello", "chat", "relay", "the", "message", "héllo", "wörld", "日本語",
+                                   "テキスト", "emoji", "\xf0\x9f\x98\x80", "ça", "straße", "Ωμέγα" };
+    std::mt19937 rng(11);
+    std::uniform_int_distribution<size_t> len(40, 200);
+    std::uniform_int_distribution<size_t> word(0, ascii ? 4 : sizeof(words) / sizeof(words[0]) - 1);
+    std::vector<std::string> out(n);
+    for (std::string &line : out) {
+        size_t want = len(rng);
+        while (line.size() < want) {
+            line += words[word(rng)];
+            line += ' ';
+        }
+    }
+    return out;
+}
+
+// Inputs that probe the kernels' block edges: chat lines, each cut short
+// around 16 and 32 bytes, and copies with one bad sequence (control byte,
+// stray continuation, overlong, surrogate, past U+10FFFF, cut short) put
+// at or across an edge. The scalar kernel's answers are the reference.
+struct TextCases {
+    std::vector<std::string> inputs;
+    std::vector<uint8_t> clean;
+    std::vector<std::string> sanitized;
+    std::vector<uint8_t> text;      // every input, one per line
+    std::vector<uint32_t> newlines; // its line ends
+};
+
+static TextCases make_text_cases() {
+    static const char *bad[] = { "\x01", "\x1b", "\x7f", "\x80", "\xbf", "\xc0\xaf", "\xc1\xbf", "\xe0\x80\xaf",
+                                 "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xf8\x88\x80\x80", "\xe6\x97", "\xf0\x9f\x98",
+                                 "\xff" };
+    std::vector<std::string> lines = make_lines(false, 96);
+    std::vector<std::string> ascii = make_lines(true, 32);
+    lines.insert(lines.end(), ascii.begin(), ascii.end());
+    TextCases t;
+    for (const std::string &line : lines) {
+        t.inputs.push_back(line);
+        for (size_t cut : { 1, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65 }) {
+            if (cut < line.size()) t.inputs.push_back(line.substr(0, cut));
+        }
+        for (const char *b : bad) {
+            for (size_t at : { 0, 13, 14, 15, 16, 29, 30, 31, 32, 62, 63, 64 }) {
+                if (at > line.size()) continue;
+                std::string s = line;
+                s.insert(at, b);
+                t.inputs.push_back(s);
+                t.inputs.push_back(s.substr(0, at + 1)); // the bad sequence ends the input
+            }
+        }
+    }
+    if (text_kernel_select(TEXT_KERNEL_SCALAR) != 0) std::abort();
+    for (const std::string &s : t.inputs) {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(s.data());
+        t.clean.push_back(text_is_clean(p, s.size()));
+        std::string fixed = s;
+        text_sanitize(reinterpret_cast<uint8_t *>(&fixed[0]), fixed.size());
+        t.sanitized.push_back(fixed);
+        t.text.insert(t.text.end(), s.begin(), s.end());
+        t.text.push_back('\n');
+    }
+    for (size_t i = 0; i < t.text.size(); ++i) {
+        if (t.text[i] == '\n') t.newlines.push_back(static_cast<uint32_t>(i));
+    }
+    return t;
+}
+
+// `at` is the case, or for newlines the offset the scan started from
+[[noreturn]] static void text_mismatch(TextKernel k, const char *what, size_t at, size_t len) {
+    std::fprintf(stderr, "text/%s: %s disagrees with the scalar kernel (at %zu, %zu bytes)\n", text_kernel_name(k), what,
+                 at, len);
+    std::exit(1);
+}
+
+// Fails the run unless kernel k, already selected, gives the scalar
+// kernel's answers on every case: cleanliness, sanitized text that checks
+// clean, and line ends at every alignment and length around a block.
+static void check_text_kernel(TextKernel k, const TextCases &t) {
+    for (size_t i = 0; i < t.inputs.size(); ++i) {
+        const std::string &s = t.inputs[i];
+        if (text_is_clean(reinterpret_cast<const uint8_t *>(s.data()), s.size()) != (t.clean[i] != 0)) {
+            text_mismatch(k, "text_is_clean", i, s.size());
+        }
+        std::string fixed = s;
+        size_t replaced = text_sanitize(reinterpret_cast<uint8_t *>(&fixed[0]), fixed.size());
+        if (fixed != t.sanitized[i] || (replaced == 0) != (t.clean[i] != 0) ||
+            !text_is_clean(reinterpret_cast<const uint8_t *>(fixed.data()), fixed.size())) {
+            text_mismatch(k, "text_sanitize", i, s.size());
+        }
+    }
+    std::vector<uint32_t> got(t.newlines.size() + 1);
+    for (size_t start = 0; start < 40; ++start) {
+        for (size_t len = 0; start + len <= t.text.size(); len = len < 72 ? len + 1 : t.text.size() - start) {
+            for (size_t max : { static_cast<size_t>(1), static_cast<size_t>(3), got.size() }) {
+                size_t n = scan_newlines(t.text.data() + start, len, got.data(), max);
+                size_t want = 0;
+                for (uint32_t at : t.newlines) {
+                    if (at < start) continue;
+                    if (at >= start + len || want == max) break;
+                    if (want >= n || got[want] != at - start) text_mismatch(k, "scan_newlines", start, len);
+                    ++want;
+                }
+                if (n != want) text_mismatch(k, "scan_newlines", start, len);
+            }
+            if (start + len == t.text.size()) break;
+        }
+    }
+}
+
+static void bench_text() {
+    // a kernel's speed only counts once it agrees with the scalar one
+    TextCases cases = make_text_cases();
+    for (TextKernel k : { TEXT_KERNEL_SCALAR, TEXT_KERNEL_SSE2, TEXT_KERNEL_AVX2 }) {
+        if (text_kernel_select(k) == 0) check_text_kernel(k, cases);
+    }
+
+    for (bool ascii : { true, false }) {
+        std::vector<std::string> lines = make_lines(ascii, 1024);
+        size_t bytes = 0;
+        for (const std::string &l : lines) bytes += l.size();
+        const char *mix = ascii ? "ascii" : "utf8";
+
+        // the floor: touching the same bytes once
+        std::vector<uint8_t> dst(256);
+        run_case(std::string("text/memcpy-") + mix, [&] {
+            for (const std::string &l : lines) std::memcpy(dst.data(), l.data(), l.size());
+            g_sink = g_sink + dst[0];
+            return Result{ lines.size(), bytes };
+        });
+        for (TextKernel k : { TEXT_KERNEL_SCALAR, TEXT_KERNEL_SSE2, TEXT_KERNEL_AVX2 }) {
+            if (text_kernel_select(k) != 0) continue;
+            run_case(std::string("text/clean-") + text_kernel_name(k) + "-" + mix, [&] {
+                uint64_t clean = 0;
+                for (const std::string &l : lines)
+                    clean += text_is_clean(reinterpret_cast<const uint8_t *>(l.data()), l.size());
+                g_sink = g_sink + clean;
+                return Result{ lines.size(), bytes };
+            });
+        }
+    }
+
+    // newline search over a 256K stdin chunk, as the client's --pipe mode
+    // splits it; frames are lines
+    std::vector<std::string> lines = make_lines(true, 2048);
+    std::vector<uint8_t> chunk;
+    for (const std::string &l : lines) {
+        chunk.insert(chunk.end(), l.begin(), l.end());
+        chunk.push_back('\n');
+    }
+    run_case("newlines/memchr", [&] {
+        uint64_t found = 0, acc = 0;
+        for (size_t off = 0; off < chunk.size(); ++found) {
+            const void *nl = std::memchr(chunk.data() + off, '\n', chunk.size() - off);
+            if (!nl) break;
+            size_t at = static_cast<size_t>(static_cast<const uint8_t *>(nl) - chunk.data());
+            acc += at;
+            off = at + 1;
+        }
+        g_sink = g_sink + acc;
+        return Result{ found, chunk.size() };
+    });
+    std::vector<uint32_t> offsets(1024);
+    for (TextKernel k : { TEXT_KERNEL_SCALAR, TEXT_KERNEL_SSE2, TEXT_KERNEL_AVX2 }) {
+        if (text_kernel_select(k) != 0) continue;
+        run_case(std::string("newlines/scan-") + text_kernel_name(k), [&] {
+            uint64_t found = 0, acc = 0;
+            size_t off = 0;
+            for (;;) {
+                size_t n = scan_newlines(chunk.data() + off, chunk.size() - off, offsets.data(), offsets.size());
+                for (size_t i = 0; i < n; ++i) acc += offsets[i];
+                found += n;
+                if (n < offsets.size()) break;
+                off += offsets[n - 1] + 1;
+            }
+            g_sink = g_sink + acc;
+            return Result{ found, chunk.size() };
+        });
+    }
+    // leave the best kernel in place
+    for (TextKernel k : { TEXT_KERNEL_AVX2, TEXT_KERNEL_SSE2, TEXT_KERNEL_SCALAR }) {
+        if (text_kernel_select(k) == 0) break;
+    }
+}
+
+static void print_usage(const char *prog) {
+    std::printf("Usage: %s [--filter SUBSTRING] [--min-time SECONDS]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            g_filter = argv[++i];
+        } else if (std::strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            g_min_time_s = std::atof(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return std::strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    bench_parse_mixes();
+    bench_pipelined();
+    bench_partial_arrival();
+    bench_buffer_growth();
+    bench_send();
+    bench_text();
+    return 0;
+}
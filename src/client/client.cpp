@@ -1,208 +1,954 @@
-#include <cstdio>
-#include <cstdlib>
-#include <cstdint>
-#include <cstring>
-#include <cerrno>
-#include <string>
-#include <vector>
-#include <unistd.h>
-#include <fcntl.h>
-#include <poll.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-
-#include "../common/common.hpp"
-
-static int enable_broadcast(int fd) {
-    int yes = 1;
-    return setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
-}
-
-static bool discover_server(uint16_t disc_port, std::string &out_ip, uint16_t &out_port) {
-    int fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd < 0) { std::perror("socket UDP"); return false; }
-    enable_broadcast(fd);
-
-    // Set receive timeout
-    timeval tv{}; tv.tv_sec = 1; tv.tv_usec = 0;
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-    sockaddr_in baddr{}; baddr.sin_family = AF_INET; baddr.sin_port = htons(disc_port);
-    baddr.sin_addr.s_addr = inet_addr("255.255.255.255");
-
-    const char *msg = DISCOVER_REQUEST;
-    if (sendto(fd, msg, std::strlen(msg), 0, reinterpret_cast<sockaddr*>(&baddr), sizeof(baddr)) < 0) {
-        std::perror("sendto");
-        close(fd);
-        return false;
-    }
-
-    uint8_t buf[256];
-    sockaddr_in src{}; socklen_t slen = sizeof(src);
-    ssize_t r = recvfrom(fd, buf, sizeof(buf)-1, 0, reinterpret_cast<sockaddr*>(&src), &slen);
-    if (r < 0) {
-        std::perror("recvfrom");
-        close(fd);
-        return false;
-    }
-    buf[r] = 0;
-    // Expect: "CHAT_HERE <port>"
-    if (r >= static_cast<ssize_t>(std::strlen(DISCOVER_RESPONSE)) && std::memcmp(buf, DISCOVER_RESPONSE, std::strlen(DISCOVER_RESPONSE)) == 0) {
-        unsigned p = 0;
-        std::sscanf(reinterpret_cast<char*>(buf) + std::strlen(DISCOVER_RESPONSE), "%u", &p);
-        char ipstr[64];
-        inet_ntop(AF_INET, &src.sin_addr, ipstr, sizeof(ipstr));
-        out_ip = ipstr;
-        out_port = static_cast<uint16_t>(p);
-        close(fd);
-        return true;
-    }
-    close(fd);
-    return false;
-}
-
-static void print_usage(const char *prog) {
-    std::printf("Usage: %s [--host IP] [--port PORT] [--discover-port UDP_PORT]\n", prog);
-    std::printf("If --host is omitted, UDP discovery is used.\n");
-}
-
-int main(int argc, char **argv) {
-    std::string host;
-    uint16_t tcp_port = 0; // 0 means unknown yet
-    uint16_t disc_port = DEFAULT_DISCOVERY_PORT;
-
-    for (int i = 1; i < argc; ++i) {
-        if ((std::strcmp(argv[i], "--host") == 0 || std::strcmp(argv[i], "-h") == 0) && i + 1 < argc) {
-            host = argv[++i];
-        } else if ((std::strcmp(argv[i], "--port") == 0 || std::strcmp(argv[i], "-p") == 0) && i + 1 < argc) {
-            tcp_port = static_cast<uint16_t>(std::atoi(argv[++i]));
-        } else if ((std::strcmp(argv[i], "--discover-port") == 0 || std::strcmp(argv[i], "-d") == 0) && i + 1 < argc) {
-            disc_port = static_cast<uint16_t>(std::atoi(argv[++i]));
-        } else if (std::strcmp(argv[i], "--help") == 0) {
-            print_usage(argv[0]);
-            return 0;
-        }
-    }
-
-    if (host.empty()) {
-        std::string ip;
-        uint16_t port = 0;
-        if (!discover_server(disc_port, ip, port)) {
-            std::fprintf(stderr, "Discovery failed. Provide --host and --port.\n");
-            return 1;
-        }
-        host = ip;
-        tcp_port = port;
-        std::printf("Discovered server %s:%u\n", host.c_str(), tcp_port);
-    } else if (tcp_port == 0) {
-        tcp_port = DEFAULT_TCP_PORT;
-    }
-
-    // Connect TCP
-    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) { std::perror("socket"); return 1; }
-    set_socket_nonblocking(fd);
-
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(tcp_port);
-    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
-        std::fprintf(stderr, "Invalid host IP: %s\n", host.c_str());
-        close(fd);
-        return 1;
-    }
-
-    int cr = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
-    if (cr < 0 && errno != EINPROGRESS) {
-        std::perror("connect");
-        close(fd);
-        return 1;
-    }
-
-    // Non-blocking stdin as well
-    set_socket_nonblocking(STDIN_FILENO);
-
-    Buffer inbuf;
-    Buffer outbuf;
-    std::vector<uint8_t> stdin_buf; // accumulate line input
-    stdin_buf.reserve(4096);
-
-    std::printf("Connected. Type messages and press Enter to send. Ctrl+C to quit.\n");
-
-    for (;;) {
-        pollfd fds[2];
-        fds[0].fd = fd; fds[0].events = POLLIN | (outbuf.length > 0 ? POLLOUT : 0); fds[0].revents = 0;
-        fds[1].fd = STDIN_FILENO; fds[1].events = POLLIN; fds[1].revents = 0;
-
-        int pn = ::poll(fds, 2, 500);
-        if (pn < 0) {
-            if (errno == EINTR) continue;
-            std::perror("poll");
-            break;
-        }
-
-        // Socket readable/writable
-        if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) {
-            std::fprintf(stderr, "Connection closed.\n");
-            break;
-        }
-        if (fds[0].revents & POLLIN) {
-            ssize_t r = read_into_buffer_nonblocking(fd, inbuf);
-            if (r <= 0) { std::fprintf(stderr, "Disconnected.\n"); break; }
-            for (;;) {
-                uint32_t mlen = 0;
-                int hr = has_complete_frame(inbuf, &mlen);
-                if (hr == -2) { std::fprintf(stderr, "Protocol error.\n"); goto done; }
-                if (hr != 1) break;
-                const uint8_t *payload = nullptr; get_frame_view(inbuf, &payload, &mlen);
-                std::fwrite(payload, 1, mlen, stdout);
-                std::fputc('\n', stdout);
-                std::fflush(stdout);
-                inbuf.consume(4 + mlen);
-            }
-        }
-        if ((fds[0].revents & POLLOUT) && outbuf.length > 0) {
-            int flushed = flush_buffered_writes(fd, outbuf);
-            if (flushed < 0) { std::fprintf(stderr, "Write error.\n"); break; }
-        }
-
-        // Stdin readable
-        if (fds[1].revents & POLLIN) {
-            uint8_t tmp[1024];
-            ssize_t r = ::read(STDIN_FILENO, tmp, sizeof(tmp));
-            if (r > 0) {
-                stdin_buf.insert(stdin_buf.end(), tmp, tmp + r);
-                // Split on newlines
-                size_t start = 0;
-                for (size_t i = 0; i < stdin_buf.size(); ++i) {
-                    if (stdin_buf[i] == '\n') {
-                        size_t len = i - start;
-                        if (len > 0 && stdin_buf[i-1] == '\r') len -= 1; // trim CR
-                        if (len > 0) {
-                            if (send_framed_or_buffer(fd, outbuf, stdin_buf.data() + start, static_cast<uint32_t>(len)) < 0) {
-                                std::fprintf(stderr, "Send failed.\n");
-                                goto done;
-                            }
-                        }
-                        start = i + 1;
-                    }
-                }
-                // remove consumed
-                if (start > 0) {
-                    stdin_buf.erase(stdin_buf.begin(), stdin_buf.begin() + static_cast<long>(start));
-                }
-            } else if (r == 0) {
-                // stdin closed
-                goto done;
-            }
-        }
-    }
-
-done:
-    close(fd);
-    return 0;
-}
-
-
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../common/common.hpp"
+#include "../common/shm_ring.hpp"
+#include "../common/text_scan.hpp"
+#include "../common/wire_v2.hpp"
+
+static int enable_broadcast(int fd) {
+    int yes = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+}
+
+static bool discover_server(uint16_t disc_port, std::string &out_ip, uint16_t &out_port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) { std::perror("socket UDP"); return false; }
+    enable_broadcast(fd);
+
+    // Set receive timeout
+    timeval tv{}; tv.tv_sec = 1; tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    sockaddr_in baddr{}; baddr.sin_family = AF_INET; baddr.sin_port = htons(disc_port);
+    baddr.sin_addr.s_addr = inet_addr("255.255.255.255");
+
+    const char *msg = DISCOVER_REQUEST;
+    if (sendto(fd, msg, std::strlen(msg), 0, reinterpret_cast<sockaddr*>(&baddr), sizeof(baddr)) < 0) {
+        std::perror("sendto");
+        close(fd);
+        return false;
+    }
+
+    uint8_t buf[256];
+    sockaddr_in src{}; socklen_t slen = sizeof(src);
+    ssize_t r = recvfrom(fd, buf, sizeof(buf)-1, 0, reinterpret_cast<sockaddr*>(&src), &slen);
+    if (r < 0) {
+        std::perror("recvfrom");
+        close(fd);
+        return false;
+    }
+    buf[r] = 0;
+    // Expect: "CHAT_HERE <port>"
+    if (r >= static_cast<ssize_t>(std::strlen(DISCOVER_RESPONSE)) && std::memcmp(buf, DISCOVER_RESPONSE, std::strlen(DISCOVER_RESPONSE)) == 0) {
+        unsigned p = 0;
+        std::sscanf(reinterpret_cast<char*>(buf) + std::strlen(DISCOVER_RESPONSE), "%u", &p);
+        char ipstr[64];
+        inet_ntop(AF_INET, &src.sin_addr, ipstr, sizeof(ipstr));
+        out_ip = ipstr;
+        out_port = static_cast<uint16_t>(p);
+        close(fd);
+        return true;
+    }
+    close(fd);
+    return false;
+}
+
+static void print_usage(const char *prog) {
+    std::printf("Usage: %s [--host IP] [--port PORT] [--discover-port UDP_PORT] [--unix PATH [--shm]]\n"
+                "          [--v2] [--resume SEQ] [--pipe [--reconnect]]\n", prog);
+    std::printf("If --host is omitted, UDP discovery is used.\n");
+    std::printf("--unix PATH connects to a server on this host through its --unix-socket; --shm then\n");
+    std::printf("     asks to exchange frames through shared memory instead of the socket.\n");
+    std::printf("--v2 speaks the binary protocol; /join, /leave, /nick and /msg become typed frames,\n");
+    std::printf("     /send NICK PATH and /share PATH stream a file to a nick or the current room.\n");
+    std::printf("/history [N] shows the last N messages of the current room (server needs --log-dir).\n");
+    std::printf("--resume SEQ (implies --v2) replays the lobby messages after sequence number SEQ\n");
+    std::printf("     (0 for all the server kept); the last number seen is printed on exit.\n");
+    std::printf("--pipe runs headless for pipelines and bots: every stdin line is a message, messages\n");
+    std::printf("     received go to stdout, and the client exits once stdin ends and all was sent.\n");
+    std::printf("     --reconnect then redials with backoff when the connection drops, restoring the\n");
+    std::printf("     last /nick and /join (and resuming after the last message seen with --resume).\n");
+}
+
+// A file being streamed to the server: its raw bytes follow the V2_STREAM
+// header and nothing else may be sent until they are all out.
+struct OutgoingFile {
+    int fd{ -1 };
+    uint64_t left{ 0 };
+};
+
+// A transfer being received into received-ID-NAME in the working directory.
+struct IncomingFile {
+    uint64_t id{ 0 };
+    uint64_t left{ 0 };
+    int fd{ -1 };
+    std::string path;
+};
+
+// "/send NICK PATH" or "/share PATH": opens the file and sends the
+// V2_STREAM header. Returns -1 only when the connection failed.
+static int start_file(int fd, Buffer &outbuf, const std::string &nick, const std::string &path, OutgoingFile &out) {
+    int ffd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (ffd < 0 || fstat(ffd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        std::fprintf(stderr, "Cannot send %s\n", path.c_str());
+        if (ffd >= 0) close(ffd);
+        return 0;
+    }
+    size_t slash = path.rfind('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    if (name.size() > V2_MAX_STREAM_NAME) name.resize(V2_MAX_STREAM_NAME);
+    std::vector<uint8_t> body(20);
+    size_t n = varint_put(static_cast<uint64_t>(st.st_size), body.data());
+    n += varint_put(nick.size(), body.data() + n);
+    body.resize(n);
+    body.insert(body.end(), nick.begin(), nick.end());
+    body.insert(body.end(), name.begin(), name.end());
+    if (send_v2_or_buffer(fd, outbuf, V2_STREAM, body.data(), static_cast<uint32_t>(body.size())) < 0) {
+        close(ffd);
+        return -1;
+    }
+    out.fd = ffd;
+    out.left = static_cast<uint64_t>(st.st_size);
+    return 0;
+}
+
+// Streams the file with sendfile(2) once everything queued before it is
+// out. Returns 1 when the file is done, 0 when the socket is full, -1 on
+// error. Without a socket (fd < 0, on shared memory) the file is read into
+// outbuf a chunk at a time instead, and 0 means outbuf has enough for now.
+static int pump_file(int fd, Buffer &outbuf, OutgoingFile &out) {
+    if (fd < 0) {
+        uint8_t chunk[65536];
+        while (out.left > 0 && outbuf.length < sizeof(chunk)) {
+            ssize_t n = ::read(out.fd, chunk, out.left < sizeof(chunk) ? static_cast<size_t>(out.left) : sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1; // file shrank under us, or failed
+            if (outbuf.append(chunk, static_cast<size_t>(n)) != 0) return -1;
+            out.left -= static_cast<uint64_t>(n);
+        }
+        if (out.left > 0) return 0;
+        close(out.fd);
+        out.fd = -1;
+        return 1;
+    }
+    if (outbuf.length > 0) {
+        int flushed = flush_buffered_writes(fd, outbuf);
+        if (flushed <= 0) return flushed;
+    }
+    while (out.left > 0) {
+        ssize_t n = sendfile(fd, out.fd, nullptr, out.left < (1u << 20) ? out.left : (1u << 20));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return -1; // file shrank under us
+        out.left -= static_cast<uint64_t>(n);
+    }
+    close(out.fd);
+    out.fd = -1;
+    return 1;
+}
+
+static int write_fully(int fd, const uint8_t *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return 0;
+}
+
+static IncomingFile *find_incoming(std::vector<IncomingFile> &files, uint64_t id) {
+    for (IncomingFile &f : files) {
+        if (f.id == id) return &f;
+    }
+    return nullptr;
+}
+
+static void close_incoming(std::vector<IncomingFile> &files, IncomingFile *f, const char *what) {
+    close(f->fd);
+    std::printf("* %s %s\n", what, f->path.c_str());
+    *f = std::move(files.back());
+    files.pop_back();
+}
+
+// Handles a STREAM, STREAM_DATA or STREAM_ABORT body. Returns -1 when it
+// is malformed.
+static int on_stream_frame(uint8_t type, const uint8_t *body, uint32_t len, std::vector<IncomingFile> &files) {
+    uint64_t id = 0;
+    size_t used = 0;
+    if (varint_get(body, len, 10, &id, &used) != 1) return -1;
+    body += used;
+    len -= static_cast<uint32_t>(used);
+    if (type == V2_STREAM) {
+        uint64_t size = 0, from_len = 0;
+        size_t u1 = 0, u2 = 0;
+        if (varint_get(body, len, 10, &size, &u1) != 1) return -1;
+        if (varint_get(body + u1, len - u1, 2, &from_len, &u2) != 1 || from_len > len - u1 - u2) return -1;
+        std::string from(reinterpret_cast<const char *>(body + u1 + u2), from_len);
+        std::string name(reinterpret_cast<const char *>(body + u1 + u2 + from_len), len - u1 - u2 - from_len);
+        // never trust a remote name with a path
+        for (char &ch : name) {
+            if (ch == '/' || static_cast<unsigned char>(ch) < ' ') ch = '_';
+        }
+        IncomingFile in;
+        in.id = id;
+        in.left = size;
+        in.path = "received-" + std::to_string(id) + "-" + name;
+        in.fd = ::open(in.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (in.fd < 0) {
+            std::perror(in.path.c_str());
+            return 0;
+        }
+        std::printf("* receiving %s (%llu bytes) from %s\n", name.c_str(), static_cast<unsigned long long>(size),
+                    from.empty() ? "anonymous" : from.c_str());
+        files.push_back(std::move(in));
+        if (size == 0) close_incoming(files, &files.back(), "saved");
+        return 0;
+    }
+    IncomingFile *f = find_incoming(files, id);
+    if (!f) return 0;
+    if (type == V2_STREAM_ABORT) {
+        close_incoming(files, f, "aborted, partial file kept in");
+        return 0;
+    }
+    if (len > f->left) return -1;
+    if (write_fully(f->fd, body, len) != 0) std::perror(f->path.c_str());
+    f->left -= len;
+    if (f->left == 0) close_incoming(files, f, "saved");
+    return 0;
+}
+
+static bool line_has_prefix(const uint8_t *p, size_t len, const char *prefix) {
+    size_t n = std::strlen(prefix);
+    return len >= n && std::memcmp(p, prefix, n) == 0;
+}
+
+// Sends one input line as a v2 frame, turning the text commands into their
+// typed equivalents.
+static int send_line_v2(int fd, Buffer &outbuf, const uint8_t *p, uint32_t len) {
+    if (line_has_prefix(p, len, "/join ")) return send_v2_or_buffer(fd, outbuf, V2_JOIN, p + 6, len - 6);
+    if (len == 6 && line_has_prefix(p, len, "/leave")) return send_v2_or_buffer(fd, outbuf, V2_LEAVE, nullptr, 0);
+    if (line_has_prefix(p, len, "/leave ")) return send_v2_or_buffer(fd, outbuf, V2_LEAVE, p + 7, len - 7);
+    if (line_has_prefix(p, len, "/nick ")) return send_v2_or_buffer(fd, outbuf, V2_NICK, p + 6, len - 6);
+    if ((len == 8 && line_has_prefix(p, len, "/history")) || line_has_prefix(p, len, "/history ")) {
+        std::string n(reinterpret_cast<const char *>(p) + 8, len - 8);
+        uint8_t body[12];
+        size_t used = varint_put(std::strtoul(n.c_str(), nullptr, 10), body);
+        body[used++] = 0; // no time bounds
+        body[used++] = 0;
+        return send_v2_or_buffer(fd, outbuf, V2_HISTORY, body, static_cast<uint32_t>(used));
+    }
+    if (line_has_prefix(p, len, "/msg ")) {
+        uint32_t sp = 5;
+        while (sp < len && p[sp] != ' ') ++sp;
+        if (sp < len) {
+            std::vector<uint8_t> body(10);
+            body.resize(varint_put(sp - 5, body.data()));
+            body.insert(body.end(), p + 5, p + sp);
+            body.insert(body.end(), p + sp + 1, p + len);
+            return send_v2_or_buffer(fd, outbuf, V2_DIRECT, body.data(), static_cast<uint32_t>(body.size()));
+        }
+    }
+    return send_v2_or_buffer(fd, outbuf, V2_MSG, p, len);
+}
+
+// Blocking connect to a server's --unix-socket
+static int connect_unix(const char *path) {
+    sockaddr_un addr{};
+    if (std::strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Starts a non-blocking connect to host (dotted IPv4) and port; poll
+// reports when it completes or fails
+static int connect_tcp(const std::string &host, uint16_t port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    set_socket_nonblocking(fd);
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    return fd;
+}
+
+static void print_line(const uint8_t *p, uint32_t len) {
+    std::fwrite(p, 1, len, stdout);
+    std::fputc('\n', stdout);
+}
+
+// A v2 notice "* you are now NICK (reclaim key KEY)" turns *nick_line into
+// "/nick NICK KEY", which takes the nick back on a reconnect even while the
+// server still holds the old connection. v1 notices are plain messages that
+// anyone could forge, so only v2 ones count.
+static void note_nick_key(const uint8_t *p, uint32_t len, std::string *nick_line) {
+    static const char bound[] = "* you are now ";
+    static const char mark[] = " (reclaim key ";
+    if (!line_has_prefix(p, len, bound) || p[len - 1] != ')') return;
+    std::string rest(reinterpret_cast<const char *>(p) + sizeof(bound) - 1, len - (sizeof(bound) - 1) - 1);
+    size_t at = rest.find(mark);
+    if (at == std::string::npos) return;
+    *nick_line = "/nick " + rest.substr(0, at) + " " + rest.substr(at + sizeof(mark) - 1);
+}
+
+// Prints the frames buffered so far. Until the server echoes the v2 hello
+// the stream is v1; the echo is the only frame boundary whose first byte is
+// not 0. A server ping sets pong_owed; sequence numbers advance last_seq;
+// nick_line, when given, tracks the reclaim key (see note_nick_key).
+// Output stays in stdout's buffer until the caller flushes it. Returns -1 on
+// a protocol error.
+static int print_frames(Buffer &inbuf, bool want_v2, bool &v2_active, bool &pong_owed, uint64_t &last_seq,
+                        std::vector<IncomingFile> &files, std::string *nick_line = nullptr) {
+    for (;;) {
+        if (want_v2 && !v2_active && inbuf.length >= 1) {
+            uint8_t first = 0;
+            inbuf.peek(0, &first, 1);
+            if (first != 0) {
+                if (inbuf.length < V2_HELLO_LEN) break;
+                uint8_t hello[V2_HELLO_LEN];
+                inbuf.peek(0, hello, V2_HELLO_LEN);
+                if (std::memcmp(hello, V2_HELLO, V2_HELLO_LEN) != 0) return -1;
+                inbuf.consume(V2_HELLO_LEN);
+                v2_active = true;
+                continue;
+            }
+        }
+        if (!v2_active) {
+            uint32_t mlen = 0;
+            int hr = has_complete_frame(inbuf, &mlen);
+            if (hr == -2) return -1;
+            if (hr != 1) break;
+            const uint8_t *payload = nullptr; get_frame_view(inbuf, &payload, &mlen);
+            print_line(payload, mlen);
+            inbuf.consume(4 + mlen);
+            continue;
+        }
+        uint8_t type = 0;
+        uint32_t len = 0, hdr_len = 0;
+        int hr = v2_has_complete_frame(inbuf, &type, &len, &hdr_len);
+        if (hr == -2) return -1;
+        if (hr != 1) break;
+        const uint8_t *body = buffer_view(inbuf, hdr_len, len);
+        if (type == V2_BATCH) {
+            uint32_t off = 0;
+            const uint8_t *m = nullptr;
+            uint32_t mlen = 0;
+            int r;
+            while ((r = v2_batch_next(body, len, &off, &m, &mlen)) == 1) print_line(m, mlen);
+            if (r < 0) return -1;
+        } else if (type == V2_MSG || type == V2_NOTICE) {
+            print_line(body, len);
+            if (type == V2_NOTICE && nick_line) note_nick_key(body, len, nick_line);
+        } else if (type == V2_STREAM || type == V2_STREAM_DATA || type == V2_STREAM_ABORT) {
+            if (on_stream_frame(type, body, len, files) < 0) return -1;
+        } else if (type == V2_HISTORY) {
+            uint64_t count = 0;
+            size_t used = 0;
+            if (varint_get(body, len, 10, &count, &used) != 1) return -1;
+            std::printf("* end of history (%llu messages)\n", static_cast<unsigned long long>(count));
+        } else if (type == V2_PING) {
+            pong_owed = true;
+        } else if (type == V2_SEQ || type == V2_RESUME) {
+            uint64_t seq = 0;
+            size_t used = 0;
+            if (varint_get(body, len, 10, &seq, &used) != 1) return -1;
+            // the RESUME reply comes before any SEQ, so last_seq is still
+            // the number we asked for
+            if (type == V2_RESUME && seq > last_seq) {
+                std::fprintf(stderr, "Messages %llu to %llu are no longer available.\n",
+                             static_cast<unsigned long long>(last_seq + 1), static_cast<unsigned long long>(seq));
+            }
+            if (seq > last_seq) last_seq = seq;
+        }
+        inbuf.consume(hdr_len + len);
+    }
+    return 0;
+}
+
+// Headless mode (--pipe). Stdin is read in large chunks, split with one
+// vectorized scan per chunk (scan_newlines) and framed into outbuf, which goes out with one
+// writev per loop iteration however many lines it holds; on v2 runs of
+// plain lines travel as BATCH frames. Received messages collect in a large
+// stdout buffer that is flushed only before the loop blocks.
+static const size_t PIPE_READ_CHUNK = 256 * 1024;  // bytes per stdin read
+static const size_t PIPE_SOCKET_BUDGET = 1u << 20; // bytes read from the server per iteration
+static const size_t PIPE_HIGH_WATER = 1u << 20;    // stdin waits while this much is unsent
+static const size_t PIPE_LINES_PER_SCAN = 1024;
+static const size_t PIPE_STDOUT_BUFFER = 1u << 20;
+static const uint64_t PIPE_BACKOFF_MIN_MS = 100;
+static const uint64_t PIPE_BACKOFF_MAX_MS = 10000;
+static const uint64_t PIPE_LINGER_MS = 5000; // for the server to close after our EOF
+
+struct PipeOptions {
+    std::string host;
+    uint16_t port{ 0 };
+    std::string unix_path;
+    bool v2{ false };
+    bool resume{ false };
+    uint64_t last_seq{ 0 };
+    bool reconnect{ false };
+};
+
+// What a new connection replays so a reconnect lands where the last one
+// was: the latest /nick (with the server's reclaim key on v2) and /join
+// lines read from stdin
+struct PipeSession {
+    std::string nick;
+    std::string room;
+};
+
+// Queues a message: v1 frames it on its own, v2 appends it to the batch
+// being built, which is sealed into outbuf when the next one would not fit
+static int pipe_queue_message(bool v2, Buffer &outbuf, std::vector<uint8_t> &batch, const uint8_t *p, uint32_t len) {
+    if (!v2) return send_framed_or_buffer(-1, outbuf, p, len);
+    if (batch.size() + 3 + len > V2_MAX_BODY) {
+        if (send_v2_or_buffer(-1, outbuf, V2_BATCH, batch.data(), static_cast<uint32_t>(batch.size())) < 0) return -1;
+        batch.clear();
+    }
+    uint8_t hdr[3];
+    size_t n = varint_put(len, hdr);
+    batch.insert(batch.end(), hdr, hdr + n);
+    batch.insert(batch.end(), p, p + len);
+    return 0;
+}
+
+static int pipe_seal_batch(Buffer &outbuf, std::vector<uint8_t> &batch) {
+    if (batch.empty()) return 0;
+    int r = send_v2_or_buffer(-1, outbuf, V2_BATCH, batch.data(), static_cast<uint32_t>(batch.size()));
+    batch.clear();
+    return r;
+}
+
+// Frames one stdin line. Commands go out on their own, after whatever was
+// batched ahead of them; lines over MAX_MESSAGE_SIZE are sent in pieces.
+static int pipe_send_line(bool v2, Buffer &outbuf, std::vector<uint8_t> &batch, PipeSession &session,
+                          const uint8_t *p, size_t len) {
+    if (len > 0 && p[len - 1] == '\r') --len;
+    if (len == 0) return 0;
+    if (p[0] == '/' && len <= MAX_MESSAGE_SIZE) {
+        if (line_has_prefix(p, len, "/nick ")) session.nick.assign(reinterpret_cast<const char *>(p), len);
+        if (line_has_prefix(p, len, "/join ")) session.room.assign(reinterpret_cast<const char *>(p), len);
+        if (line_has_prefix(p, len, "/leave")) session.room.clear();
+        if (!v2) return send_framed_or_buffer(-1, outbuf, p, static_cast<uint32_t>(len));
+        if (pipe_seal_batch(outbuf, batch) < 0) return -1;
+        return send_line_v2(-1, outbuf, p, static_cast<uint32_t>(len));
+    }
+    while (len > 0) {
+        uint32_t n = len > MAX_MESSAGE_SIZE ? MAX_MESSAGE_SIZE : static_cast<uint32_t>(len);
+        if (pipe_queue_message(v2, outbuf, batch, p, n) < 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Frames every complete line in buf, and at EOF the unterminated rest.
+// Returns how many bytes were used, or -1 when framing failed.
+static ssize_t pipe_frame_lines(bool v2, Buffer &outbuf, PipeSession &session, const uint8_t *buf, size_t len,
+                                bool eof) {
+    std::vector<uint8_t> batch;
+    uint32_t ends[PIPE_LINES_PER_SCAN];
+    size_t start = 0;
+    for (;;) {
+        size_t base = start;
+        size_t found = scan_newlines(buf + base, len - base, ends, PIPE_LINES_PER_SCAN);
+        for (size_t k = 0; k < found; ++k) {
+            size_t end = base + ends[k];
+            if (pipe_send_line(v2, outbuf, batch, session, buf + start, end - start) < 0) return -1;
+            start = end + 1;
+        }
+        if (found < PIPE_LINES_PER_SCAN) break;
+    }
+    if (eof && start < len) {
+        if (pipe_send_line(v2, outbuf, batch, session, buf + start, len - start) < 0) return -1;
+        start = len;
+    }
+    // pieces of an overlong line, so the rest always fits the next read
+    for (; len - start >= MAX_MESSAGE_SIZE; start += MAX_MESSAGE_SIZE) {
+        if (pipe_send_line(v2, outbuf, batch, session, buf + start, MAX_MESSAGE_SIZE) < 0) return -1;
+    }
+    if (v2 && pipe_seal_batch(outbuf, batch) < 0) return -1;
+    return static_cast<ssize_t>(start);
+}
+
+// Queues what a new connection starts with. Frames may follow the hello
+// right away; RESUME goes last so the replay covers the room just joined.
+static void pipe_start_session(const PipeOptions &o, const PipeSession &session, Buffer &outbuf) {
+    if (o.v2) outbuf.append(V2_HELLO, V2_HELLO_LEN);
+    std::vector<uint8_t> batch;
+    PipeSession ignored;
+    for (const std::string *line : { &session.nick, &session.room }) {
+        if (!line->empty()) {
+            pipe_send_line(o.v2, outbuf, batch, ignored, reinterpret_cast<const uint8_t *>(line->data()), line->size());
+        }
+    }
+    if (o.resume) {
+        uint8_t body[10];
+        uint8_t hdr[V2_MAX_HEADER];
+        size_t body_len = varint_put(o.last_seq, body);
+        outbuf.append(hdr, v2_put_header(V2_RESUME, static_cast<uint32_t>(body_len), hdr));
+        outbuf.append(body, body_len);
+    }
+}
+
+static int run_pipe(PipeOptions &o) {
+    // a dropped connection is redialled, not fatal; a closed stdout shows up
+    // as a stdio error instead
+    std::signal(SIGPIPE, SIG_IGN);
+    std::setvbuf(stdout, nullptr, _IOFBF, PIPE_STDOUT_BUFFER);
+    set_socket_nonblocking(STDIN_FILENO);
+
+    // framing leaves less than one message behind, so a chunk always fits
+    std::vector<uint8_t> pending(PIPE_READ_CHUNK + MAX_MESSAGE_SIZE);
+    size_t have = 0; // bytes of stdin not yet framed
+    bool stdin_eof = false;
+    PipeSession session;
+    int fd = -1;
+    Buffer inbuf;
+    Buffer outbuf;
+    bool v2_active = false;
+    bool pong_owed = false;
+    bool connected = false; // the connect went through
+    bool closing = false;   // our side is shut, waiting for the server to close
+    std::vector<IncomingFile> receiving;
+    uint64_t backoff = PIPE_BACKOFF_MIN_MS;
+    uint64_t retry_at = 0;
+    uint64_t linger_until = 0;
+    int status = 0;
+
+    for (;;) {
+        std::fflush(stdout);
+        if (std::ferror(stdout)) {
+            status = 1;
+            break;
+        }
+        uint64_t now = monotonic_ns() / 1000000;
+        if (fd < 0) {
+            if (now < retry_at) {
+                ::poll(nullptr, 0, static_cast<int>(retry_at - now));
+                continue;
+            }
+            fd = o.unix_path.empty() ? connect_tcp(o.host, o.port) : connect_unix(o.unix_path.c_str());
+            if (fd >= 0) {
+                set_socket_nonblocking(fd);
+                connected = !o.unix_path.empty(); // that connect blocks
+                v2_active = pong_owed = false;
+                pipe_start_session(o, session, outbuf);
+            } else if (o.reconnect) {
+                std::perror("connect");
+                retry_at = now + backoff;
+                backoff = backoff * 2 > PIPE_BACKOFF_MAX_MS ? PIPE_BACKOFF_MAX_MS : backoff * 2;
+                continue;
+            } else {
+                std::perror("connect");
+                status = 1;
+                break;
+            }
+        }
+
+        pollfd fds[2];
+        fds[0].fd = fd; fds[0].events = POLLIN | (outbuf.length > 0 || !connected ? POLLOUT : 0); fds[0].revents = 0;
+        // stdin waits until the connect is through and while the server is
+        // behind: the backlog stays bounded and little is lost if the
+        // connection drops
+        bool want_stdin = connected && !stdin_eof && outbuf.length < PIPE_HIGH_WATER;
+        fds[1].fd = STDIN_FILENO; fds[1].events = want_stdin ? POLLIN : 0; fds[1].revents = 0;
+        int timeout = closing ? static_cast<int>(linger_until > now ? linger_until - now : 0) : -1;
+        int pn = ::poll(fds, 2, timeout);
+        if (pn < 0) {
+            if (errno == EINTR) continue;
+            std::perror("poll");
+            status = 1;
+            break;
+        }
+        if (closing && pn == 0) break; // the server never closed; all was sent anyway
+
+        bool lost = false;
+        if (fds[0].revents & POLLIN) {
+            ReadStop stop = READ_STOP_AGAIN;
+            ssize_t r = read_into_buffer_nonblocking(fd, inbuf, PIPE_SOCKET_BUDGET, &stop);
+            if (r > 0) connected = true;
+            if (r < 0 || stop == READ_STOP_EOF) lost = true;
+            if (r > 0 && print_frames(inbuf, o.v2, v2_active, pong_owed, o.last_seq, receiving, &session.nick) < 0) {
+                std::fprintf(stderr, "Protocol error.\n");
+                status = 1;
+                break;
+            }
+        } else if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            lost = true;
+        }
+        if (!lost && (fds[0].revents & POLLOUT)) {
+            connected = true;
+            if (flush_buffered_writes(fd, outbuf) < 0) lost = true;
+        }
+        if (!lost && pong_owed) {
+            send_v2_or_buffer(-1, outbuf, V2_PONG, nullptr, 0);
+            pong_owed = false;
+        }
+        if (lost) {
+            close(fd);
+            fd = -1;
+            for (IncomingFile &f : receiving) close(f.fd);
+            receiving.clear();
+            inbuf.consume(inbuf.length);
+            inbuf.trim();
+            if (closing) break; // the server closed after reading our EOF
+            if (!connected) {
+                // outbuf holds only what pipe_start_session queued
+                std::fprintf(stderr, "Cannot connect.\n");
+            } else if (outbuf.length > 0) {
+                std::fprintf(stderr, "Connection lost, %zu unsent bytes dropped.\n", outbuf.length);
+                backoff = PIPE_BACKOFF_MIN_MS;
+            } else {
+                std::fprintf(stderr, "Connection lost.\n");
+                backoff = PIPE_BACKOFF_MIN_MS;
+            }
+            outbuf.consume(outbuf.length);
+            outbuf.trim();
+            if (!o.reconnect) {
+                status = 1;
+                break;
+            }
+            retry_at = monotonic_ns() / 1000000 + backoff;
+            backoff = backoff * 2 > PIPE_BACKOFF_MAX_MS ? PIPE_BACKOFF_MAX_MS : backoff * 2;
+            continue;
+        }
+
+        // a closed pipe reports POLLHUP without POLLIN
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t r = ::read(STDIN_FILENO, pending.data() + have, PIPE_READ_CHUNK);
+            if (r > 0) {
+                have += static_cast<size_t>(r);
+            } else if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+                stdin_eof = true;
+            }
+        }
+        if (have > 0 || stdin_eof) {
+            ssize_t used = pipe_frame_lines(o.v2, outbuf, session, pending.data(), have, stdin_eof);
+            if (used < 0) {
+                std::fprintf(stderr, "Send failed.\n");
+                status = 1;
+                break;
+            }
+            // what is left is one partial line, so this moves little
+            if (used > 0) std::memmove(pending.data(), pending.data() + used, have - static_cast<size_t>(used));
+            have -= static_cast<size_t>(used);
+        }
+        if (outbuf.length > 0 && flush_buffered_writes(fd, outbuf) < 0) continue; // poll reports the error
+        if (stdin_eof && have == 0 && outbuf.length == 0 && !closing) {
+            // everything is out: the server closes once it has read it all
+            shutdown(fd, SHUT_WR);
+            closing = true;
+            linger_until = monotonic_ns() / 1000000 + PIPE_LINGER_MS;
+        }
+    }
+
+    std::fflush(stdout);
+    if (o.resume) std::fprintf(stderr, "Last sequence number: %llu\n", static_cast<unsigned long long>(o.last_seq));
+    for (IncomingFile &f : receiving) close(f.fd);
+    if (fd >= 0) close(fd);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    std::string host;
+    uint16_t tcp_port = 0; // 0 means unknown yet
+    uint16_t disc_port = DEFAULT_DISCOVERY_PORT;
+    bool want_v2 = false;
+    bool resume = false;
+    uint64_t last_seq = 0;
+    std::string unix_path;
+    bool want_shm = false;
+    bool pipe = false;
+    bool reconnect = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if ((std::strcmp(argv[i], "--host") == 0 || std::strcmp(argv[i], "-h") == 0) && i + 1 < argc) {
+            host = argv[++i];
+        } else if ((std::strcmp(argv[i], "--port") == 0 || std::strcmp(argv[i], "-p") == 0) && i + 1 < argc) {
+            tcp_port = static_cast<uint16_t>(std::atoi(argv[++i]));
+        } else if ((std::strcmp(argv[i], "--discover-port") == 0 || std::strcmp(argv[i], "-d") == 0) && i + 1 < argc) {
+            disc_port = static_cast<uint16_t>(std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--shm") == 0) {
+            want_shm = true;
+        } else if (std::strcmp(argv[i], "--v2") == 0) {
+            want_v2 = true;
+        } else if (std::strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+            last_seq = std::strtoull(argv[++i], nullptr, 10);
+            resume = want_v2 = true;
+        } else if (std::strcmp(argv[i], "--pipe") == 0) {
+            pipe = true;
+        } else if (std::strcmp(argv[i], "--reconnect") == 0) {
+            reconnect = true;
+        } else if (std::strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        }
+    }
+
+    if (want_shm && unix_path.empty()) {
+        std::fprintf(stderr, "--shm needs --unix PATH\n");
+        return 1;
+    }
+    if (reconnect && !pipe) {
+        std::fprintf(stderr, "--reconnect needs --pipe\n");
+        return 1;
+    }
+    if (pipe && want_shm) {
+        std::fprintf(stderr, "--pipe does not support --shm\n");
+        return 1;
+    }
+
+    if (unix_path.empty() && host.empty()) {
+        std::string ip;
+        uint16_t port = 0;
+        if (!discover_server(disc_port, ip, port)) {
+            std::fprintf(stderr, "Discovery failed. Provide --host and --port.\n");
+            return 1;
+        }
+        host = ip;
+        tcp_port = port;
+        // stdout carries only messages in pipe mode
+        std::fprintf(pipe ? stderr : stdout, "Discovered server %s:%u\n", host.c_str(), tcp_port);
+    } else if (unix_path.empty() && tcp_port == 0) {
+        tcp_port = DEFAULT_TCP_PORT;
+    }
+    in_addr probe;
+    if (unix_path.empty() && inet_pton(AF_INET, host.c_str(), &probe) != 1) {
+        std::fprintf(stderr, "Invalid host IP: %s\n", host.c_str());
+        return 1;
+    }
+
+    if (pipe) {
+        PipeOptions o;
+        o.host = host;
+        o.port = tcp_port;
+        o.unix_path = unix_path;
+        o.v2 = want_v2;
+        o.resume = resume;
+        o.last_seq = last_seq;
+        o.reconnect = reconnect;
+        return run_pipe(o);
+    }
+
+    int fd = -1;
+    if (!unix_path.empty()) {
+        fd = connect_unix(unix_path.c_str());
+        if (fd < 0) { std::perror(unix_path.c_str()); return 1; }
+    } else {
+        fd = connect_tcp(host, tcp_port);
+        if (fd < 0) { std::perror("connect"); return 1; }
+    }
+
+    Buffer inbuf;
+    Buffer outbuf;
+    // Shared memory replaces the socket's byte stream in both directions;
+    // the send helpers then only buffer (wire_fd -1) and the loop moves
+    // outbuf into the ring
+    std::unique_ptr<ShmLink> shm;
+    if (want_shm) {
+        shm.reset(new ShmLink());
+        int r = shm_request(fd, shm.get(), inbuf);
+        if (r < 0) {
+            std::fprintf(stderr, "Shared memory handshake failed.\n");
+            close(fd);
+            return 1;
+        }
+        if (r == 0) {
+            std::fprintf(stderr, "Server declined shared memory, using the socket.\n");
+            shm.reset();
+        }
+    }
+    int wire_fd = shm ? -1 : fd;
+    if (!unix_path.empty()) set_socket_nonblocking(fd);
+
+    // Non-blocking stdin as well
+    set_socket_nonblocking(STDIN_FILENO);
+
+    std::vector<uint8_t> stdin_buf; // accumulate line input
+    stdin_buf.reserve(4096);
+    bool v2_active = false;
+    bool pong_owed = false;
+    OutgoingFile sending;
+    std::vector<IncomingFile> receiving;
+    bool stdin_eof = false;
+    // the hello goes out once the connect completes; v2 frames may follow it
+    // right away, the server switches as soon as it reads the hello
+    if (want_v2) outbuf.append(V2_HELLO, V2_HELLO_LEN);
+    if (resume) {
+        uint8_t body[10];
+        uint8_t hdr[V2_MAX_HEADER];
+        size_t body_len = varint_put(last_seq, body);
+        outbuf.append(hdr, v2_put_header(V2_RESUME, static_cast<uint32_t>(body_len), hdr));
+        outbuf.append(body, body_len);
+    }
+
+    std::printf("Connected%s. Type messages and press Enter to send. Ctrl+C to quit.\n",
+                shm ? " (shared memory)" : "");
+    // frames that arrived ahead of the shared memory reply
+    if (inbuf.length > 0 && print_frames(inbuf, want_v2, v2_active, pong_owed, last_seq, receiving) < 0) {
+        std::fprintf(stderr, "Protocol error.\n");
+        close(fd);
+        return 1;
+    }
+
+    for (;;) {
+        int timeout = 500;
+        if (shm) {
+            if (sending.fd >= 0 && pump_file(-1, outbuf, sending) < 0) { std::fprintf(stderr, "Write error.\n"); break; }
+            if (shm_write_buffer(shm->up, shm->server_bell, outbuf) < 0) { std::fprintf(stderr, "Write error.\n"); break; }
+            // more of the file fits now, or the server wrote while we were busy
+            if ((sending.fd >= 0 && outbuf.length == 0) || !shm->down.park_reader()) timeout = 0;
+        }
+        pollfd fds[3];
+        bool busy = sending.fd >= 0;
+        // on shared memory the socket only reports the server going away
+        fds[0].fd = fd; fds[0].events = shm ? 0 : POLLIN | (outbuf.length > 0 || busy ? POLLOUT : 0); fds[0].revents = 0;
+        // stdin waits while a file is streaming: its bytes own the socket
+        fds[1].fd = STDIN_FILENO; fds[1].events = busy || stdin_eof ? 0 : POLLIN; fds[1].revents = 0;
+        fds[2].fd = shm ? shm->client_bell : -1; fds[2].events = POLLIN; fds[2].revents = 0;
+
+        std::fflush(stdout);
+        int pn = ::poll(fds, 3, timeout);
+        if (pn < 0) {
+            if (errno == EINTR) continue;
+            std::perror("poll");
+            break;
+        }
+
+        if (shm) {
+            if (fds[2].revents & POLLIN) shm_doorbell_drain(shm->client_bell);
+            ssize_t r = shm_read_buffer(shm->down, shm->server_bell, inbuf, 1u << 20);
+            if (r < 0 || (r > 0 && print_frames(inbuf, want_v2, v2_active, pong_owed, last_seq, receiving) < 0)) {
+                std::fprintf(stderr, "Protocol error.\n");
+                goto done;
+            }
+        }
+        // Socket readable/writable; a Unix socket may report the hangup
+        // together with the last frames
+        if (fds[0].revents & POLLIN) {
+            ssize_t r = read_into_buffer_nonblocking(fd, inbuf);
+            if (r <= 0) { std::fprintf(stderr, "Disconnected.\n"); break; }
+            if (print_frames(inbuf, want_v2, v2_active, pong_owed, last_seq, receiving) < 0) { std::fprintf(stderr, "Protocol error.\n"); goto done; }
+        } else if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            std::fprintf(stderr, "Connection closed.\n");
+            break;
+        }
+        if ((fds[0].revents & POLLOUT) && sending.fd >= 0) {
+            int pr = pump_file(fd, outbuf, sending);
+            if (pr < 0) { std::fprintf(stderr, "Write error.\n"); break; }
+        } else if ((fds[0].revents & POLLOUT) && outbuf.length > 0) {
+            int flushed = flush_buffered_writes(fd, outbuf);
+            if (flushed < 0) { std::fprintf(stderr, "Write error.\n"); break; }
+        }
+        // a file's raw bytes own the socket; they keep the server happy meanwhile
+        if (pong_owed && sending.fd < 0) {
+            if (send_v2_or_buffer(wire_fd, outbuf, V2_PONG, nullptr, 0) < 0) { std::fprintf(stderr, "Write error.\n"); break; }
+            pong_owed = false;
+        }
+
+        // Stdin readable; a closed pipe reports POLLHUP without POLLIN
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            uint8_t tmp[1024];
+            ssize_t r = ::read(STDIN_FILENO, tmp, sizeof(tmp));
+            if (r > 0) {
+                stdin_buf.insert(stdin_buf.end(), tmp, tmp + r);
+            } else if (r == 0) {
+                stdin_eof = true;
+            }
+        }
+        if (sending.fd < 0) {
+            // Split on newlines; lines after a /send wait for the file
+            size_t start = 0;
+            for (size_t i = 0; i < stdin_buf.size() && sending.fd < 0; ++i) {
+                if (stdin_buf[i] == '\n') {
+                    size_t len = i - start;
+                    if (len > 0 && stdin_buf[i-1] == '\r') len -= 1; // trim CR
+                    if (len > 0) {
+                        const uint8_t *line = stdin_buf.data() + start;
+                        std::string text(reinterpret_cast<const char *>(line), len);
+                        int sr;
+                        if (want_v2 && text.compare(0, 6, "/send ") == 0 && text.find(' ', 6) != std::string::npos) {
+                            size_t sp = text.find(' ', 6);
+                            sr = start_file(wire_fd, outbuf, text.substr(6, sp - 6), text.substr(sp + 1), sending);
+                        } else if (want_v2 && text.compare(0, 7, "/share ") == 0) {
+                            sr = start_file(wire_fd, outbuf, std::string(), text.substr(7), sending);
+                        } else {
+                            sr = want_v2 ? send_line_v2(wire_fd, outbuf, line, static_cast<uint32_t>(len))
+                                         : send_framed_or_buffer(wire_fd, outbuf, line, static_cast<uint32_t>(len));
+                        }
+                        if (sr < 0) {
+                            std::fprintf(stderr, "Send failed.\n");
+                            goto done;
+                        }
+                    }
+                    start = i + 1;
+                }
+            }
+            // remove consumed
+            if (start > 0) {
+                stdin_buf.erase(stdin_buf.begin(), stdin_buf.begin() + static_cast<long>(start));
+            }
+            // stdin closed and nothing left to stream or send
+            if (stdin_eof && sending.fd < 0 && outbuf.length == 0) goto done;
+        }
+    }
+
+done:
+    // what the ring takes before we hang up still reaches the server
+    if (shm) shm_write_buffer(shm->up, shm->server_bell, outbuf);
+    if (resume) std::fprintf(stderr, "Last sequence number: %llu\n", static_cast<unsigned long long>(last_seq));
+    if (sending.fd >= 0) close(sending.fd);
+    for (IncomingFile &f : receiving) close(f.fd);
+    close(fd);
+    return 0;
+}
+
+
@@ -0,0 +1,157 @@
+#include "buffer_pool.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct FreeBlock {
+    FreeBlock *next;
+};
+
+// Written only by its thread (relaxed load+store, like the shard metrics);
+// read by buffer_pool_stats from any thread.
+struct Tally {
+    std::atomic<uint64_t> v{ 0 };
+    void add(uint64_t n) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+};
+
+// One thread's free lists and counters. Never freed: a thread that exits
+// drops its cached blocks but leaves its counters for the totals, since
+// blocks it handed out may still be returned elsewhere. In-use counts are
+// taken minus returned, which only adds up across threads, so each side
+// wraps freely.
+struct ThreadCache {
+    FreeBlock *free[BUFFER_POOL_CLASSES]{};
+    uint32_t free_count[BUFFER_POOL_CLASSES]{};
+    Tally taken[BUFFER_POOL_CLASSES + 1];
+    Tally returned[BUFFER_POOL_CLASSES + 1];
+    Tally cached[BUFFER_POOL_CLASSES];
+    Tally large_taken_bytes;
+    Tally large_returned_bytes;
+    Tally misses; // acquisitions served by malloc
+    bool alive{ true };
+};
+
+std::mutex g_caches_mu;
+std::vector<ThreadCache *> *g_caches = nullptr; // outlives static destructors
+
+void flush_cache(ThreadCache *c) {
+    for (int k = 0; k < BUFFER_POOL_CLASSES; ++k) {
+        while (FreeBlock *b = c->free[k]) {
+            c->free[k] = b->next;
+            std::free(b);
+        }
+        c->cached[k].add(0 - static_cast<uint64_t>(c->free_count[k]));
+        c->free_count[k] = 0;
+    }
+}
+
+// Flushes the thread's cache when it exits; later returns on the same
+// thread (from other thread-local destructors) go straight to free().
+struct CacheReaper {
+    ThreadCache *cache{ nullptr };
+    ~CacheReaper() {
+        if (!cache) return;
+        flush_cache(cache);
+        cache->alive = false;
+    }
+};
+
+thread_local ThreadCache *tl_cache = nullptr;
+thread_local CacheReaper tl_reaper;
+
+ThreadCache *thread_cache() {
+    if (tl_cache) return tl_cache;
+    ThreadCache *c = new ThreadCache();
+    {
+        std::lock_guard<std::mutex> lock(g_caches_mu);
+        if (!g_caches) g_caches = new std::vector<ThreadCache *>();
+        g_caches->push_back(c);
+    }
+    tl_cache = c;
+    tl_reaper.cache = c;
+    return c;
+}
+
+int class_of(size_t size) {
+    int k = 0;
+    for (size_t s = BUFFER_POOL_MIN; s < size; s <<= 1) ++k;
+    return k;
+}
+
+uint32_t cache_limit(int k) {
+    size_t size = BUFFER_POOL_MIN << k;
+    return size >= BUFFER_POOL_CACHE ? 1 : static_cast<uint32_t>(BUFFER_POOL_CACHE / size);
+}
+
+} // namespace
+
+uint8_t *buffer_block_acquire(size_t size) {
+    ThreadCache *c = thread_cache();
+    if (size > BUFFER_POOL_MAX) {
+        uint8_t *p = static_cast<uint8_t *>(std::malloc(size));
+        if (!p) return nullptr;
+        c->misses.add(1);
+        c->taken[BUFFER_POOL_CLASSES].add(1);
+        c->large_taken_bytes.add(size);
+        return p;
+    }
+    int k = class_of(size);
+    uint8_t *p;
+    if (FreeBlock *b = c->free[k]) {
+        c->free[k] = b->next;
+        --c->free_count[k];
+        c->cached[k].add(0 - static_cast<uint64_t>(1));
+        p = reinterpret_cast<uint8_t *>(b);
+    } else {
+        p = static_cast<uint8_t *>(std::malloc(size));
+        if (!p) return nullptr;
+        c->misses.add(1);
+    }
+    c->taken[k].add(1);
+    return p;
+}
+
+void buffer_block_release(uint8_t *block, size_t size) {
+    if (!block) return;
+    ThreadCache *c = thread_cache();
+    if (size > BUFFER_POOL_MAX) {
+        c->returned[BUFFER_POOL_CLASSES].add(1);
+        c->large_returned_bytes.add(size);
+        std::free(block);
+        return;
+    }
+    int k = class_of(size);
+    c->returned[k].add(1);
+    if (!c->alive || c->free_count[k] >= cache_limit(k)) {
+        std::free(block);
+        return;
+    }
+    FreeBlock *b = reinterpret_cast<FreeBlock *>(block);
+    b->next = c->free[k];
+    c->free[k] = b;
+    ++c->free_count[k];
+    c->cached[k].add(1);
+}
+
+void buffer_pool_stats(BufferPoolStats *out) {
+    *out = BufferPoolStats();
+    uint64_t large_bytes = 0;
+    std::lock_guard<std::mutex> lock(g_caches_mu);
+    if (!g_caches) return;
+    for (const ThreadCache *c : *g_caches) {
+        for (int k = 0; k <= BUFFER_POOL_CLASSES; ++k) out->in_use[k] += c->taken[k].get() - c->returned[k].get();
+        for (int k = 0; k < BUFFER_POOL_CLASSES; ++k) out->cached[k] += c->cached[k].get();
+        large_bytes += c->large_taken_bytes.get() - c->large_returned_bytes.get();
+        out->misses += c->misses.get();
+    }
+    for (int k = 0; k < BUFFER_POOL_CLASSES; ++k) {
+        out->in_use_bytes += out->in_use[k] * (BUFFER_POOL_MIN << k);
+        out->cached_bytes += out->cached[k] * (BUFFER_POOL_MIN << k);
+    }
+    out->in_use_bytes += large_bytes;
+}
@@ -0,0 +1,38 @@
+// Size-classed storage for Buffer, cached per thread
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Blocks are powers of two from BUFFER_POOL_MIN up to BUFFER_POOL_MAX; a
+// larger request gets its exact power of two straight from malloc. Every
+// thread keeps its own free list per class, so taking and returning a block
+// on the hot path is a pointer swap with no lock and no locked instruction.
+// A thread caches at most BUFFER_POOL_CACHE bytes per class (at least one
+// block) and frees the rest, so a burst does not pin its peak footprint.
+// Blocks may be returned on any thread; the counts still add up across
+// threads.
+static const size_t BUFFER_POOL_MIN = 1024;
+static const size_t BUFFER_POOL_MAX = 1u << 20;
+static const int BUFFER_POOL_CLASSES = 11; // 1K .. 1M
+static const size_t BUFFER_POOL_CACHE = 256 * 1024;
+
+// Returns a block of exactly size bytes, a power of two no smaller than
+// BUFFER_POOL_MIN, or nullptr on allocation failure.
+uint8_t *buffer_block_acquire(size_t size);
+// Returns a block acquired with the same size.
+void buffer_block_release(uint8_t *block, size_t size);
+
+// Occupancy summed over every thread that ever used the pool. Index
+// BUFFER_POOL_CLASSES of in_use counts blocks larger than the biggest class.
+// misses counts acquisitions the caches could not serve, i.e. the calls to
+// malloc the pool made on behalf of its users.
+struct BufferPoolStats {
+    uint64_t in_use[BUFFER_POOL_CLASSES + 1]{};
+    uint64_t cached[BUFFER_POOL_CLASSES]{};
+    uint64_t in_use_bytes{ 0 };
+    uint64_t cached_bytes{ 0 };
+    uint64_t misses{ 0 };
+};
+
+void buffer_pool_stats(BufferPoolStats *out);
@@ -1,198 +1,356 @@
-#include "common.hpp"
-
-#include <cerrno>
-#include <cstring>
-#include <limits>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-
-int Buffer::reserve(size_t min_capacity) {
-    if (data.capacity() >= min_capacity) return 0;
-    size_t new_cap = data.capacity() ? data.capacity() : static_cast<size_t>(1024);
-    const size_t max_size = std::numeric_limits<size_t>::max();
-    while (new_cap < min_capacity) {
-        if (new_cap > max_size / 2) { new_cap = min_capacity; break; }
-        new_cap *= 2;
-    }
-    try {
-        data.reserve(new_cap);
-        if (data.size() < length) data.resize(length);
-        return 0;
-    } catch (...) {
-        return -1;
-    }
-}
-
-int Buffer::append(const void *src, size_t len) {
-    if (len == 0) return 0;
-    if (reserve(length + len) != 0) return -1;
-    const uint8_t *p = static_cast<const uint8_t *>(src);
-    if (data.size() < length) data.resize(length);
-    size_t old_size = data.size();
-    data.resize(length + len);
-    std::memcpy(data.data() + length, p, len);
-    (void)old_size;
-    length += len;
-    return 0;
-}
-
-void Buffer::consume(size_t len) {
-    if (len == 0) return;
-    if (len >= length) {
-        length = 0;
-        return;
-    }
-    std::memmove(data.data(), data.data() + len, length - len);
-    length -= len;
-}
-
-int set_socket_nonblocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags == -1) return -1;
-    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) return -1;
-    return 0;
-}
-
-int create_tcp_listener(uint16_t port) {
-    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) return -1;
-
-    int yes = 1;
-    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-
-    if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
-        ::close(fd);
-        return -1;
-    }
-    if (::listen(fd, SOMAXCONN) < 0) {
-        ::close(fd);
-        return -1;
-    }
-    if (set_socket_nonblocking(fd) != 0) {
-        ::close(fd);
-        return -1;
-    }
-    return fd;
-}
-
-int create_udp_discovery_socket(uint16_t port) {
-    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd < 0) return -1;
-
-    int yes = 1;
-    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-    if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
-        ::close(fd);
-        return -1;
-    }
-    if (set_socket_nonblocking(fd) != 0) {
-        ::close(fd);
-        return -1;
-    }
-    return fd;
-}
-
-ssize_t write_fully_nonblocking(int fd, const uint8_t *data, size_t len) {
-    size_t total = 0;
-    while (total < len) {
-        ssize_t n = ::write(fd, data + total, len - total);
-        if (n > 0) {
-            total += static_cast<size_t>(n);
-            continue;
-        }
-        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            break;
-        }
-        return -1;
-    }
-    return static_cast<ssize_t>(total);
-}
-
-ssize_t read_into_buffer_nonblocking(int fd, Buffer &buffer) {
-    uint8_t temp[8192];
-    ssize_t total = 0;
-    for (;;) {
-        ssize_t n = ::read(fd, temp, sizeof(temp));
-        if (n > 0) {
-            if (buffer.append(temp, static_cast<size_t>(n)) != 0) return -1;
-            total += n;
-            continue;
-        }
-        if (n == 0) return total; // peer closed
-        if (errno == EAGAIN || errno == EWOULDBLOCK) return total;
-        return -1;
-    }
-}
-
-int flush_buffered_writes(int fd, Buffer &outbuf) {
-    if (outbuf.length == 0) return 0;
-    ssize_t n = write_fully_nonblocking(fd, outbuf.begin(), outbuf.length);
-    if (n < 0) return -1;
-    outbuf.consume(static_cast<size_t>(n));
-    return (outbuf.length == 0) ? 1 : 0; // 1 means fully flushed
-}
-
-int send_framed_or_buffer(int fd, Buffer &outbuf, const uint8_t *payload, uint32_t len) {
-    if (len > MAX_MESSAGE_SIZE) return -1;
-    uint32_t nlen = htonl(len);
-    uint8_t hdr[4];
-    std::memcpy(hdr, &nlen, 4);
-
-    if (outbuf.length == 0) {
-        ssize_t n = write_fully_nonblocking(fd, hdr, 4);
-        if (n < 0) return -1;
-        if (static_cast<size_t>(n) < 4) {
-            if (outbuf.append(hdr + n, 4 - static_cast<size_t>(n)) != 0) return -1;
-            if (outbuf.append(payload, len) != 0) return -1;
-            return 0;
-        }
-        ssize_t m = write_fully_nonblocking(fd, payload, len);
-        if (m < 0) return -1;
-        if (static_cast<size_t>(m) < len) {
-            if (outbuf.append(payload + m, len - static_cast<size_t>(m)) != 0) return -1;
-        }
-        return 0;
-    } else {
-        if (outbuf.append(hdr, 4) != 0) return -1;
-        if (outbuf.append(payload, len) != 0) return -1;
-        return 0;
-    }
-}
-
-int has_complete_frame(const Buffer &inbuf, uint32_t *out_len) {
-    if (inbuf.length < 4) return 0;
-    uint32_t nlen;
-    std::memcpy(&nlen, inbuf.begin(), 4);
-    uint32_t len = ntohl(nlen);
-    if (len > MAX_MESSAGE_SIZE) return -2;
-    if (inbuf.length >= 4 + len) {
-        if (out_len) *out_len = len;
-        return 1;
-    }
-    return 0;
-}
-
-int get_frame_view(const Buffer &inbuf, const uint8_t **payload, uint32_t *len) {
-    uint32_t l = 0;
-    int r = has_complete_frame(inbuf, &l);
-    if (r != 1) return r;
-    if (payload) *payload = inbuf.begin() + 4;
-    if (len) *len = l;
-    return 1;
-}
-
-
+#include "common.hpp"
+#include "buffer_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Free space a read must find before it is worth issuing
+static const size_t READ_MIN_SPACE = 1024;
+
+Buffer &Buffer::operator=(Buffer &&other) noexcept {
+    if (this == &other) return *this;
+    buffer_block_release(data, cap);
+    data = other.data;
+    cap = other.cap;
+    head = other.head;
+    length = other.length;
+    other.data = nullptr;
+    other.cap = other.head = other.length = 0;
+    return *this;
+}
+
+Buffer::~Buffer() { buffer_block_release(data, cap); }
+
+// Moves the contents, unwrapped, into a pool block of new_cap bytes.
+static int rehome(Buffer &b, size_t new_cap) {
+    uint8_t *block = buffer_block_acquire(new_cap);
+    if (!block) return -1;
+    b.peek(0, block, b.length);
+    buffer_block_release(b.data, b.cap);
+    b.data = block;
+    b.cap = new_cap;
+    b.head = 0;
+    return 0;
+}
+
+int Buffer::reserve(size_t min_capacity) {
+    if (cap >= min_capacity) return 0;
+    size_t new_cap = cap ? cap : BUFFER_POOL_MIN;
+    const size_t max_size = std::numeric_limits<size_t>::max();
+    while (new_cap < min_capacity) {
+        if (new_cap > max_size / 2) return -1;
+        new_cap *= 2;
+    }
+    return rehome(*this, new_cap);
+}
+
+void Buffer::trim() {
+    if (length == 0) {
+        buffer_block_release(data, cap);
+        data = nullptr;
+        cap = head = 0;
+        return;
+    }
+    // keep twice what is left, so the next few reads still fit
+    if (cap <= BUFFER_POOL_MIN || length > cap / 8) return;
+    size_t new_cap = BUFFER_POOL_MIN;
+    while (new_cap < length * 2) new_cap *= 2;
+    rehome(*this, new_cap); // on failure the old block simply stays
+}
+
+int Buffer::append(const void *src, size_t len) {
+    if (len == 0) return 0;
+    if (reserve(length + len) != 0) return -1;
+    const uint8_t *p = static_cast<const uint8_t *>(src);
+    size_t mask = cap - 1;
+    size_t tail = (head + length) & mask;
+    size_t first = std::min(len, cap - tail);
+    std::memcpy(data + tail, p, first);
+    std::memcpy(data, p + first, len - first);
+    length += len;
+    return 0;
+}
+
+void Buffer::consume(size_t len) {
+    if (len == 0) return;
+    if (len >= length) {
+        // empty: rewind so the next read gets one contiguous region
+        head = 0;
+        length = 0;
+        return;
+    }
+    head = (head + len) & (cap - 1);
+    length -= len;
+}
+
+void Buffer::peek(size_t offset, void *dst, size_t len) const {
+    if (len == 0) return;
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    size_t start = (head + offset) & (cap - 1);
+    size_t first = std::min(len, cap - start);
+    std::memcpy(out, data + start, first);
+    std::memcpy(out + first, data, len - first);
+}
+
+int Buffer::readable_iov(struct iovec *iov) const {
+    if (length == 0) return 0;
+    size_t first = std::min(length, cap - head);
+    iov[0].iov_base = data + head;
+    iov[0].iov_len = first;
+    if (first == length) return 1;
+    iov[1].iov_base = data;
+    iov[1].iov_len = length - first;
+    return 2;
+}
+
+int Buffer::writable_iov(struct iovec *iov) {
+    size_t free_bytes = space();
+    if (free_bytes == 0) return 0;
+    size_t tail = (head + length) & (cap - 1);
+    size_t first = std::min(free_bytes, cap - tail);
+    iov[0].iov_base = data + tail;
+    iov[0].iov_len = first;
+    if (first == free_bytes) return 1;
+    iov[1].iov_base = data;
+    iov[1].iov_len = free_bytes - first;
+    return 2;
+}
+
+void Buffer::commit(size_t n) {
+    length += n;
+}
+
+uint64_t monotonic_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+int set_socket_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) return -1;
+    return 0;
+}
+
+int create_tcp_listener(uint16_t port, bool reuse_port, bool loopback_only) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    int yes = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (reuse_port && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(loopback_only ? INADDR_LOOPBACK : INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    if (::listen(fd, SOMAXCONN) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    if (set_socket_nonblocking(fd) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int create_unix_listener(const char *path) {
+    sockaddr_un addr{};
+    if (std::strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path);
+    ::unlink(path);
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    if (::listen(fd, SOMAXCONN) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    if (set_socket_nonblocking(fd) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int create_udp_discovery_socket(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+
+    int yes = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    if (set_socket_nonblocking(fd) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+ssize_t write_fully_nonblocking(int fd, const uint8_t *data, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = ::write(fd, data + total, len - total);
+        if (n > 0) {
+            total += static_cast<size_t>(n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        return -1;
+    }
+    return static_cast<ssize_t>(total);
+}
+
+ssize_t read_into_buffer_nonblocking(int fd, Buffer &buffer, size_t max_bytes, ReadStop *stop) {
+    ssize_t total = 0;
+    ReadStop why = READ_STOP_BUDGET;
+    while (static_cast<size_t>(total) < max_bytes) {
+        if (buffer.space() < READ_MIN_SPACE && buffer.reserve(buffer.length + READ_MIN_SPACE * 4) != 0) return -1;
+        // read straight into the ring's free space, both halves at once
+        iovec iov[2];
+        int cnt = buffer.writable_iov(iov);
+        size_t left = max_bytes - static_cast<size_t>(total);
+        if (iov[0].iov_len >= left) {
+            iov[0].iov_len = left;
+            cnt = 1;
+        } else if (cnt == 2 && iov[0].iov_len + iov[1].iov_len > left) {
+            iov[1].iov_len = left - iov[0].iov_len;
+        }
+        ssize_t n = ::readv(fd, iov, cnt);
+        if (n > 0) {
+            buffer.commit(static_cast<size_t>(n));
+            total += n;
+            continue;
+        }
+        if (n == 0) { why = READ_STOP_EOF; break; } // peer closed
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) { why = READ_STOP_AGAIN; break; }
+        return -1;
+    }
+    if (stop) *stop = why;
+    return total;
+}
+
+int flush_buffered_writes(int fd, Buffer &outbuf) {
+    while (outbuf.length > 0) {
+        iovec iov[2];
+        int cnt = outbuf.readable_iov(iov);
+        ssize_t n = ::writev(fd, iov, cnt);
+        if (n > 0) {
+            outbuf.consume(static_cast<size_t>(n));
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        return -1;
+    }
+    return (outbuf.length == 0) ? 1 : 0; // 1 means fully flushed
+}
+
+int send_with_header_or_buffer(int fd, Buffer &outbuf, const uint8_t *hdr, size_t hlen, const uint8_t *body, size_t len) {
+    if (outbuf.length == 0 && fd >= 0) {
+        // header and payload leave in one syscall; a short write means the
+        // socket buffer is full, so the remainder is buffered
+        iovec iov[2];
+        iov[0].iov_base = const_cast<uint8_t *>(hdr);
+        iov[0].iov_len = hlen;
+        iov[1].iov_base = const_cast<uint8_t *>(body);
+        iov[1].iov_len = len;
+        ssize_t w = ::writev(fd, iov, 2);
+        if (w < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            w = 0;
+        }
+        size_t n = static_cast<size_t>(w);
+        if (n < hlen) {
+            if (outbuf.append(hdr + n, hlen - n) != 0) return -1;
+            if (outbuf.append(body, len) != 0) return -1;
+        } else if (n < hlen + len) {
+            if (outbuf.append(body + (n - hlen), len - (n - hlen)) != 0) return -1;
+        }
+        return 0;
+    } else {
+        if (outbuf.append(hdr, hlen) != 0) return -1;
+        if (outbuf.append(body, len) != 0) return -1;
+        return 0;
+    }
+}
+
+int send_framed_or_buffer(int fd, Buffer &outbuf, const uint8_t *payload, uint32_t len) {
+    if (len > MAX_MESSAGE_SIZE) return -1;
+    uint32_t nlen = htonl(len);
+    uint8_t hdr[4];
+    std::memcpy(hdr, &nlen, 4);
+    return send_with_header_or_buffer(fd, outbuf, hdr, 4, payload, len);
+}
+
+int has_complete_frame(const Buffer &inbuf, uint32_t *out_len) {
+    if (inbuf.length < 4) return 0;
+    uint32_t nlen;
+    inbuf.peek(0, &nlen, 4);
+    uint32_t len = ntohl(nlen);
+    if (len > MAX_MESSAGE_SIZE) return -2;
+    if (inbuf.length >= 4 + len) {
+        if (out_len) *out_len = len;
+        return 1;
+    }
+    return 0;
+}
+
+const uint8_t *buffer_view(const Buffer &buf, size_t offset, size_t len) {
+    size_t start = (buf.head + offset) & (buf.capacity() - 1);
+    if (start + len <= buf.capacity()) return buf.data + start;
+    // the bytes wrap: hand out a contiguous copy instead
+    static thread_local std::vector<uint8_t> scratch;
+    if (scratch.size() < len) scratch.resize(len);
+    buf.peek(offset, scratch.data(), len);
+    return scratch.data();
+}
+
+int get_frame_view(const Buffer &inbuf, const uint8_t **payload, uint32_t *len) {
+    uint32_t l = 0;
+    int r = has_complete_frame(inbuf, &l);
+    if (r != 1) return r;
+    if (payload) *payload = buffer_view(inbuf, 4, l);
+    if (len) *len = l;
+    return 1;
+}
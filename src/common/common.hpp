@@ -1,52 +1,105 @@
-// Common utilities and definitions for the chat project (C++)
-#pragma once
-
-#include <cstdint>
-#include <cstddef>
-#include <vector>
-#include <sys/types.h> // for ssize_t
-
-// Default ports
-#define DEFAULT_TCP_PORT 5050
-#define DEFAULT_DISCOVERY_PORT 55555
-
-// Limits
-#define MAX_CLIENTS 1024
-#define MAX_MESSAGE_SIZE 4096
-
-// UDP discovery protocol
-#define DISCOVER_REQUEST "CHAT_DISCOVER?"
-#define DISCOVER_RESPONSE "CHAT_HERE"
-
-// Simple dynamically growing byte buffer
-struct Buffer {
-    std::vector<uint8_t> data;
-    size_t length{0};
-
-    // Ensures capacity >= min_capacity
-    int reserve(size_t min_capacity);
-    // Appends len bytes from src
-    int append(const void *src, size_t len);
-    // Consumes len bytes from the front
-    void consume(size_t len);
-    // Returns raw pointer to start
-    uint8_t *begin() { return data.data(); }
-    const uint8_t *begin() const { return data.data(); }
-};
-
-// Socket helpers
-int set_socket_nonblocking(int fd);
-int create_tcp_listener(uint16_t port);
-int create_udp_discovery_socket(uint16_t port);
-
-// I/O helpers
-ssize_t write_fully_nonblocking(int fd, const uint8_t *data, size_t len);
-ssize_t read_into_buffer_nonblocking(int fd, Buffer &buffer);
-int flush_buffered_writes(int fd, Buffer &outbuf);
-
-// Message framing (uint32 length prefix, network byte order)
-int send_framed_or_buffer(int fd, Buffer &outbuf, const uint8_t *payload, uint32_t len);
-int has_complete_frame(const Buffer &inbuf, uint32_t *out_len);
-int get_frame_view(const Buffer &inbuf, const uint8_t **payload, uint32_t *len);
-
-
+// Common utilities and definitions for the chat project (C++)
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <sys/types.h> // for ssize_t
+
+// Default ports
+#define DEFAULT_TCP_PORT 5050
+#define DEFAULT_DISCOVERY_PORT 55555
+
+// Limits
+#define MAX_CLIENTS 1024
+#define MAX_MESSAGE_SIZE 4096
+
+// UDP discovery protocol
+#define DISCOVER_REQUEST "CHAT_DISCOVER?"
+#define DISCOVER_RESPONSE "CHAT_HERE"
+
+struct iovec;
+
+// Growable ring of bytes. Capacity is a power of two; consume() only moves
+// the head, and readers fill free space in place through writable_iov().
+// Readable bytes may wrap around the end of the storage.
+//
+// Storage comes from the buffer pool (buffer_pool.hpp) and an empty buffer
+// holds none after trim(), so an idle connection costs no buffer memory.
+// Owners call trim() where no view into the buffer is still in use.
+struct Buffer {
+    uint8_t *data{nullptr}; // pool block, null until first use
+    size_t cap{0};
+    size_t head{0};
+    size_t length{0};
+
+    Buffer() = default;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    Buffer(Buffer &&other) noexcept { *this = static_cast<Buffer &&>(other); }
+    Buffer &operator=(Buffer &&other) noexcept;
+    ~Buffer();
+
+    // Ensures capacity >= min_capacity
+    int reserve(size_t min_capacity);
+    // Appends len bytes from src
+    int append(const void *src, size_t len);
+    // Consumes len bytes from the front
+    void consume(size_t len);
+    // Copies len bytes starting offset bytes past the head into dst
+    void peek(size_t offset, void *dst, size_t len) const;
+    // Fills up to two iovecs covering the readable bytes; returns the count
+    int readable_iov(struct iovec *iov) const;
+    // Fills up to two iovecs covering the free space; returns the count
+    int writable_iov(struct iovec *iov);
+    // Accounts for n bytes written into the space from writable_iov()
+    void commit(size_t n);
+    // Returns the storage to the pool when empty, or moves a few bytes left
+    // in a mostly unused block into a smaller one
+    void trim();
+
+    size_t capacity() const { return cap; }
+    size_t space() const { return cap - length; }
+};
+
+// Monotonic clock in nanoseconds
+uint64_t monotonic_ns();
+
+// Socket helpers
+int set_socket_nonblocking(int fd);
+// reuse_port binds with SO_REUSEPORT so several listeners can share one port;
+// loopback_only binds 127.0.0.1 instead of every interface
+int create_tcp_listener(uint16_t port, bool reuse_port = false, bool loopback_only = false);
+// Replaces any stale socket file at path
+int create_unix_listener(const char *path);
+int create_udp_discovery_socket(uint16_t port);
+
+// Why read_into_buffer_nonblocking returned
+enum ReadStop {
+    READ_STOP_AGAIN,  // socket drained (EAGAIN)
+    READ_STOP_EOF,    // peer closed
+    READ_STOP_BUDGET, // max_bytes read, more may be pending
+};
+
+// I/O helpers
+ssize_t write_fully_nonblocking(int fd, const uint8_t *data, size_t len);
+ssize_t read_into_buffer_nonblocking(int fd, Buffer &buffer, size_t max_bytes = SIZE_MAX, ReadStop *stop = nullptr);
+int flush_buffered_writes(int fd, Buffer &outbuf);
+
+// Writes header and body with one writev when nothing is buffered ahead of
+// them and buffers whatever the socket did not take. With fd < 0 (a
+// transport other than the socket drains outbuf) it only buffers.
+int send_with_header_or_buffer(int fd, Buffer &outbuf, const uint8_t *hdr, size_t hlen, const uint8_t *body, size_t len);
+
+// Message framing (uint32 length prefix, network byte order)
+int send_framed_or_buffer(int fd, Buffer &outbuf, const uint8_t *payload, uint32_t len);
+int has_complete_frame(const Buffer &inbuf, uint32_t *out_len);
+// Contiguous view of len bytes starting offset bytes past the head. It
+// points into the buffer, or for bytes that wrap around the end of the ring
+// into a per-thread scratch copy; either way it stays valid until the
+// buffer is modified or buffer_view is called again on this thread.
+const uint8_t *buffer_view(const Buffer &buf, size_t offset, size_t len);
+// Frame payload view, with the same lifetime rules as buffer_view
+int get_frame_view(const Buffer &inbuf, const uint8_t **payload, uint32_t *len);
+
+
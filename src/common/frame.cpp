@@ -0,0 +1,276 @@
+#include "frame.hpp"
+#include "common.hpp"
+#include "wire_v2.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+// iovecs handed to a single writev
+static const int FLUSH_IOV_BATCH = 64;
+
+Frame *frame_alloc(size_t size) {
+    void *mem = std::malloc(sizeof(Frame) + size);
+    if (!mem) return nullptr;
+    Frame *f = new (mem) Frame();
+    f->size = static_cast<uint32_t>(size);
+    return f;
+}
+
+Frame *frame_encode(const uint8_t *payload, uint32_t len) {
+    if (len > MAX_MESSAGE_SIZE) return nullptr;
+    Frame *f = frame_alloc(4 + static_cast<size_t>(len));
+    if (!f) return nullptr;
+    uint32_t nlen = htonl(len);
+    std::memcpy(f->data(), &nlen, 4);
+    if (len) std::memcpy(f->data() + 4, payload, len);
+    return f;
+}
+
+void frame_ref(Frame *f) {
+    f->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void frame_unref(Frame *f) {
+    if (f->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        f->~Frame();
+        std::free(f);
+    }
+}
+
+Frame *frame_encode_v2(uint8_t type, const uint8_t *body, uint32_t len) {
+    if (len > V2_MAX_BODY) return nullptr;
+    uint8_t hdr[V2_MAX_HEADER];
+    size_t hlen = v2_put_header(type, len, hdr);
+    Frame *f = frame_alloc(hlen + len);
+    if (!f) return nullptr;
+    std::memcpy(f->data(), hdr, hlen);
+    if (len) std::memcpy(f->data() + hlen, body, len);
+    return f;
+}
+
+// Walks a run of v1 frames. Returns 1 with the next payload, 0 at the end
+// and -1 if the run is truncated.
+static int v1_run_next(const Frame *f, size_t *off, const uint8_t **payload, uint32_t *len) {
+    if (*off >= f->size) return 0;
+    if (f->size - *off < 4) return -1;
+    uint32_t nlen;
+    std::memcpy(&nlen, f->data() + *off, 4);
+    uint32_t l = ntohl(nlen);
+    if (l > f->size - *off - 4) return -1;
+    *payload = f->data() + *off + 4;
+    *len = l;
+    *off += 4 + static_cast<size_t>(l);
+    return 1;
+}
+
+Frame *frame_v1_to_v2(const Frame *f) {
+    size_t off = 0, body = 0, count = 0;
+    const uint8_t *p = nullptr;
+    uint32_t len = 0;
+    int r;
+    uint8_t tmp[10];
+    while ((r = v1_run_next(f, &off, &p, &len)) == 1) {
+        body += varint_put(len, tmp) + len;
+        ++count;
+    }
+    if (r < 0 || count == 0) return nullptr;
+    if (count == 1) {
+        off = 0;
+        v1_run_next(f, &off, &p, &len);
+        return frame_encode_v2(V2_MSG, p, len);
+    }
+    if (body > V2_MAX_BODY) return nullptr;
+
+    uint8_t hdr[V2_MAX_HEADER];
+    size_t hlen = v2_put_header(V2_BATCH, static_cast<uint32_t>(body), hdr);
+    Frame *out = frame_alloc(hlen + body);
+    if (!out) return nullptr;
+    uint8_t *w = out->data();
+    std::memcpy(w, hdr, hlen);
+    w += hlen;
+    off = 0;
+    while (v1_run_next(f, &off, &p, &len) == 1) {
+        w += varint_put(len, w);
+        std::memcpy(w, p, len);
+        w += len;
+    }
+    return out;
+}
+
+Frame *frame_v2_to_v1(const Frame *f) {
+    if (f->size < 2) return nullptr;
+    uint8_t type = f->data()[0];
+    uint64_t blen = 0;
+    size_t used = 0;
+    if (varint_get(f->data() + 1, f->size - 1, V2_MAX_HEADER - 1, &blen, &used) != 1) return nullptr;
+    if (1 + used + blen != f->size) return nullptr;
+    const uint8_t *body = f->data() + 1 + used;
+    uint32_t body_len = static_cast<uint32_t>(blen);
+    if (type == V2_MSG || type == V2_NOTICE) return frame_encode(body, body_len);
+    if (type != V2_BATCH) return nullptr;
+
+    size_t total = 0;
+    uint32_t off = 0;
+    const uint8_t *m = nullptr;
+    uint32_t mlen = 0;
+    int r;
+    while ((r = v2_batch_next(body, body_len, &off, &m, &mlen)) == 1) total += 4 + static_cast<size_t>(mlen);
+    if (r < 0 || total == 0) return nullptr;
+    Frame *out = frame_alloc(total);
+    if (!out) return nullptr;
+    uint8_t *w = out->data();
+    off = 0;
+    while (v2_batch_next(body, body_len, &off, &m, &mlen) == 1) {
+        uint32_t nlen = htonl(mlen);
+        std::memcpy(w, &nlen, 4);
+        std::memcpy(w + 4, m, mlen);
+        w += 4 + mlen;
+    }
+    return out;
+}
+
+Frame *wire_frames_get(WireFrames &w, int version) {
+    if (w.v[version]) return w.v[version];
+    int other = version == WIRE_V1 ? WIRE_V2 : WIRE_V1;
+    if (!w.v[other]) return nullptr;
+    w.v[version] = version == WIRE_V1 ? frame_v2_to_v1(w.v[other]) : frame_v1_to_v2(w.v[other]);
+    return w.v[version];
+}
+
+void wire_frames_ref(const WireFrames &src, WireFrames *dst) {
+    for (int i = 0; i < WIRE_VERSIONS; ++i) {
+        dst->v[i] = src.v[i];
+        if (src.v[i]) frame_ref(src.v[i]);
+    }
+}
+
+void wire_frames_unref(WireFrames &w) {
+    for (int i = 0; i < WIRE_VERSIONS; ++i) {
+        if (w.v[i]) frame_unref(w.v[i]);
+        w.v[i] = nullptr;
+    }
+}
+
+FrameQueue &FrameQueue::operator=(FrameQueue &&other) noexcept {
+    if (this == &other) return *this;
+    clear();
+    std::free(slots);
+    slots = other.slots;
+    capacity = other.capacity;
+    head = other.head;
+    count = other.count;
+    offset = other.offset;
+    bytes = other.bytes;
+    other.slots = nullptr;
+    other.capacity = other.head = other.count = 0;
+    other.offset = other.bytes = 0;
+    return *this;
+}
+
+int FrameQueue::push(Frame *f, size_t sent) {
+    if (count == capacity) {
+        uint32_t new_cap = capacity ? capacity * 2 : 8;
+        Frame **grown = static_cast<Frame **>(std::malloc(sizeof(Frame *) * new_cap));
+        if (!grown) return -1;
+        for (uint32_t i = 0; i < count; ++i) grown[i] = slots[(head + i) & (capacity - 1)];
+        std::free(slots);
+        slots = grown;
+        capacity = new_cap;
+        head = 0;
+    }
+    frame_ref(f);
+    slots[(head + count) & (capacity - 1)] = f;
+    if (count == 0) offset = sent;
+    ++count;
+    bytes += f->size - sent;
+    return 0;
+}
+
+void FrameQueue::advance(size_t n) {
+    bytes -= n;
+    while (n > 0 && count > 0) {
+        Frame *f = slots[head];
+        size_t left = f->size - offset;
+        if (n < left) {
+            offset += n;
+            return;
+        }
+        n -= left;
+        offset = 0;
+        frame_unref(f);
+        head = (head + 1) & (capacity - 1);
+        --count;
+    }
+    if (count == 0) clear();
+}
+
+uint32_t FrameQueue::drop_oldest(uint32_t keep, size_t need) {
+    if (offset > 0 && keep == 0) keep = 1;
+    uint32_t dropped = 0;
+    size_t freed = 0;
+    // pinned frames stay put; sliding keeps them at the same index
+    uint32_t v = keep;
+    while (freed < need) {
+        while (v < count && slots[(head + v) & (capacity - 1)]->pinned) ++v;
+        if (v >= count) break;
+        Frame *victim = slots[(head + v) & (capacity - 1)];
+        // slide the frames ahead of the victim up over its slot
+        for (uint32_t j = v; j-- > 0;) {
+            slots[(head + j + 1) & (capacity - 1)] = slots[(head + j) & (capacity - 1)];
+        }
+        head = (head + 1) & (capacity - 1);
+        --count;
+        bytes -= victim->size;
+        freed += victim->size;
+        frame_unref(victim);
+        ++dropped;
+    }
+    if (count == 0) clear();
+    return dropped;
+}
+
+void FrameQueue::clear() {
+    for (uint32_t i = 0; i < count; ++i) frame_unref(slots[(head + i) & (capacity - 1)]);
+    std::free(slots);
+    slots = nullptr;
+    capacity = head = count = 0;
+    offset = bytes = 0;
+}
+
+int flush_frame_queue(int fd, FrameQueue &q) {
+    while (!q.empty()) {
+        iovec iov[FLUSH_IOV_BATCH];
+        int n = 0;
+        size_t want = 0;
+        for (uint32_t i = 0; i < q.count && n < FLUSH_IOV_BATCH; ++i) {
+            Frame *f = q.slots[(q.head + i) & (q.capacity - 1)];
+            size_t skip = (i == 0) ? q.offset : 0;
+            iov[n].iov_base = f->data() + skip;
+            iov[n].iov_len = f->size - skip;
+            want += iov[n].iov_len;
+            ++n;
+        }
+        ssize_t w = ::writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        q.advance(static_cast<size_t>(w));
+        if (static_cast<size_t>(w) < want) return 0; // socket buffer full
+    }
+    return 1;
+}
+
+int send_frame_or_queue(int fd, FrameQueue &q, Frame *f) {
+    if (!q.empty()) return q.push(f);
+    ssize_t n = write_fully_nonblocking(fd, f->data(), f->size);
+    if (n < 0) return -1;
+    if (static_cast<size_t>(n) < f->size) return q.push(f, static_cast<size_t>(n));
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Encode-once, reference-counted wire frames and per-connection send queues
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h> // for ssize_t
+
+// A complete wire frame (length prefix + payload) shared read-only by every
+// connection it is queued on. The bytes follow the header in one allocation.
+struct Frame {
+    std::atomic<uint32_t> refs{ 1 };
+    uint32_t size{ 0 }; // wire bytes, header included
+    // never dropped to make room for other frames (transfer frames: their
+    // sender's window already bounds how many a recipient can hold)
+    bool pinned{ false };
+
+    uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+    const uint8_t *data() const { return reinterpret_cast<const uint8_t *>(this + 1); }
+};
+
+// Allocates a frame with room for size wire bytes and one reference held by
+// the caller. Returns nullptr on allocation failure.
+Frame *frame_alloc(size_t size);
+// Encodes payload with the 4-byte big-endian length prefix.
+Frame *frame_encode(const uint8_t *payload, uint32_t len);
+void frame_ref(Frame *f);
+void frame_unref(Frame *f);
+
+// Protocol versions a connection can speak (see wire_v2.hpp)
+enum WireVersion { WIRE_V1 = 0, WIRE_V2 = 1, WIRE_VERSIONS = 2 };
+
+// Encodes one v2 frame: type, varint length, body.
+Frame *frame_encode_v2(uint8_t type, const uint8_t *body, uint32_t len);
+// Re-encodes chat messages for the other wire version. A run of v1 frames
+// becomes one V2_MSG, or a V2_BATCH when it holds several messages; a v2
+// MSG, NOTICE or BATCH becomes the equivalent run of v1 frames; other v2
+// types have no v1 form. Returns nullptr for those, on allocation failure
+// or on malformed input.
+Frame *frame_v1_to_v2(const Frame *f);
+Frame *frame_v2_to_v1(const Frame *f);
+
+// One outgoing message (or batch) for recipients of either version. Only
+// the sender's encoding is built up front; the other is converted the
+// first time a recipient needs it. Holds a reference on each non-null
+// frame. Filling in a variant mutates the struct, so each copy belongs to
+// one thread: forwarding takes new references into a fresh copy.
+struct WireFrames {
+    Frame *v[WIRE_VERSIONS]{};
+};
+
+// Returns the encoding for version, converting on first use (nullptr if
+// that fails). The reference stays owned by w.
+Frame *wire_frames_get(WireFrames &w, int version);
+// Makes dst hold references to the encodings src has so far.
+void wire_frames_ref(const WireFrames &src, WireFrames *dst);
+void wire_frames_unref(WireFrames &w);
+
+// FIFO of frame references waiting to be written to one socket. Holding a
+// reference instead of a copy keeps a broadcast at O(1) memory however many
+// recipients are slow. Storage is allocated on first push and released again
+// once the queue drains.
+struct FrameQueue {
+    Frame **slots{ nullptr };
+    uint32_t capacity{ 0 };
+    uint32_t head{ 0 };
+    uint32_t count{ 0 };
+    size_t offset{ 0 }; // bytes of the head frame already written
+    size_t bytes{ 0 };  // unsent bytes across all queued frames
+
+    FrameQueue() = default;
+    FrameQueue(const FrameQueue &) = delete;
+    FrameQueue &operator=(const FrameQueue &) = delete;
+    FrameQueue &operator=(FrameQueue &&other) noexcept;
+    ~FrameQueue() { clear(); }
+
+    bool empty() const { return count == 0; }
+    // Takes a new reference on f. `sent` bytes of it are already on the wire.
+    int push(Frame *f, size_t sent = 0);
+    // Marks n bytes written, dropping references to completed frames.
+    void advance(size_t n);
+    // Drops whole unsent frames from the front, sparing the first `keep`
+    // (and always a partially written head) and pinned frames, until `need`
+    // bytes are freed. Returns the number of frames dropped.
+    uint32_t drop_oldest(uint32_t keep, size_t need);
+    void clear();
+};
+
+// Writes as much of the queue as the socket accepts, batching frames into
+// writev calls. Returns 1 when drained, 0 if data remains, -1 on error.
+int flush_frame_queue(int fd, FrameQueue &q);
+// Writes f straight to the socket when nothing is queued ahead of it (one
+// syscall for header and payload) and queues whatever is left.
+int send_frame_or_queue(int fd, FrameQueue &q, Frame *f);
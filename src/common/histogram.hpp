@@ -0,0 +1,91 @@
+// Log-linear histogram for latencies and sizes
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Values below 64 get exact buckets; above that every power of two is split
+// into 32 buckets, so a reported value is within ~3% of the real one.
+// record() is meant for a single writer: counters are relaxed atomics so
+// another thread can take a snapshot without locks or torn reads.
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 5;
+    static constexpr uint64_t SUB_COUNT = 1ull << SUB_BITS;
+    static constexpr size_t BUCKETS = 2 * SUB_COUNT + (64 - SUB_BITS - 1) * SUB_COUNT;
+
+    static size_t bucket_of(uint64_t v) {
+        if (v < 2 * SUB_COUNT) return static_cast<size_t>(v);
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - SUB_BITS;
+        return static_cast<size_t>(2 * SUB_COUNT + static_cast<uint64_t>(shift - 1) * SUB_COUNT + ((v >> shift) - SUB_COUNT));
+    }
+
+    // Midpoint of the range of values that land in bucket b.
+    static uint64_t bucket_value(size_t b) {
+        if (b < 2 * SUB_COUNT) return b;
+        size_t rel = b - 2 * SUB_COUNT;
+        int shift = static_cast<int>(rel / SUB_COUNT) + 1;
+        uint64_t low = (SUB_COUNT + rel % SUB_COUNT) << shift;
+        return low + ((1ull << shift) >> 1);
+    }
+
+    void record(uint64_t v) {
+        bump(counts_[bucket_of(v)], 1);
+        bump(total_, 1);
+        bump(sum_, v);
+        if (v > max_.load(std::memory_order_relaxed)) max_.store(v, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return total_.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    uint64_t bucket_count(size_t b) const { return counts_[b].load(std::memory_order_relaxed); }
+
+    // Value at quantile q (0..1), 0 when empty.
+    uint64_t percentile(double q) const {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total));
+        if (rank >= total) rank = total - 1;
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            seen += bucket_count(b);
+            if (seen > rank) {
+                uint64_t v = bucket_value(b);
+                return v < max() ? v : max();
+            }
+        }
+        return max();
+    }
+
+    // Adds other's counts into this one (same single-writer rule applies).
+    void merge(const Histogram &other) {
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            uint64_t n = other.bucket_count(b);
+            if (n) bump(counts_[b], n);
+        }
+        bump(total_, other.count());
+        bump(sum_, other.sum());
+        if (other.max() > max()) max_.store(other.max(), std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (size_t b = 0; b < BUCKETS; ++b) counts_[b].store(0, std::memory_order_relaxed);
+        total_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    // load+store instead of fetch_add: no locked instruction for the writer
+    static void bump(std::atomic<uint64_t> &a, uint64_t n) {
+        a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> counts_[BUCKETS]{};
+    std::atomic<uint64_t> total_{ 0 };
+    std::atomic<uint64_t> sum_{ 0 };
+    std::atomic<uint64_t> max_{ 0 };
+};
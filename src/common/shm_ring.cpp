@@ -0,0 +1,287 @@
+#include "shm_ring.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "common.hpp"
+
+// Layout of the memfd: this header on its own page(s), then the up ring's
+// bytes, then the down ring's
+struct ShmRegion {
+    char magic[8];
+    uint64_t ring_bytes;
+    ShmRingControl up;
+    ShmRingControl down;
+};
+
+static const char SHM_MAGIC[8] = { 'C', 'H', 'A', 'T', 'S', 'H', 'M', '1' };
+static const size_t SHM_HEADER_BYTES = (sizeof(ShmRegion) + 4095) & ~static_cast<size_t>(4095);
+
+void ShmRing::attach(ShmRingControl *ctl, uint8_t *data, size_t capacity, bool producer) {
+    ctl_ = ctl;
+    data_ = data;
+    cap_ = capacity;
+    pos_ = producer ? ctl->tail.load(std::memory_order_relaxed) : ctl->head.load(std::memory_order_relaxed);
+}
+
+ssize_t ShmRing::write(const void *src, size_t len) {
+    uint64_t used = pos_ - ctl_->head.load(std::memory_order_acquire);
+    if (used > cap_) return -1;
+    size_t n = cap_ - static_cast<size_t>(used);
+    if (n > len) n = len;
+    if (n == 0) return 0;
+    size_t off = static_cast<size_t>(pos_) & (cap_ - 1);
+    size_t first = n < cap_ - off ? n : cap_ - off;
+    std::memcpy(data_ + off, src, first);
+    if (n > first) std::memcpy(data_, static_cast<const uint8_t *>(src) + first, n - first);
+    pos_ += n;
+    ctl_->tail.store(pos_, std::memory_order_release);
+    return static_cast<ssize_t>(n);
+}
+
+// The parked flags pair with the positions Dekker-style: each side stores
+// one, fences, then loads the other, so either the sleeper sees the new
+// position or the waker sees the flag. The exchange makes one wake per park.
+bool ShmRing::reader_needs_wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ctl_->reader_parked.load(std::memory_order_relaxed) == 0) return false;
+    return ctl_->reader_parked.exchange(0, std::memory_order_acq_rel) != 0;
+}
+
+bool ShmRing::park_writer() {
+    ctl_->writer_parked.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (pos_ - ctl_->head.load(std::memory_order_acquire) < cap_) {
+        ctl_->writer_parked.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+ssize_t ShmRing::read_into(Buffer &b, size_t max) {
+    uint64_t avail = ctl_->tail.load(std::memory_order_acquire) - pos_;
+    if (avail > cap_) return -1;
+    size_t n = static_cast<size_t>(avail) < max ? static_cast<size_t>(avail) : max;
+    if (n == 0) return 0;
+    size_t off = static_cast<size_t>(pos_) & (cap_ - 1);
+    size_t first = n < cap_ - off ? n : cap_ - off;
+    if (b.append(data_ + off, first) != 0) return -1;
+    if (n > first && b.append(data_, n - first) != 0) return -1;
+    pos_ += n;
+    ctl_->head.store(pos_, std::memory_order_release);
+    return static_cast<ssize_t>(n);
+}
+
+bool ShmRing::writer_needs_wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ctl_->writer_parked.load(std::memory_order_relaxed) == 0) return false;
+    return ctl_->writer_parked.exchange(0, std::memory_order_acq_rel) != 0;
+}
+
+bool ShmRing::park_reader() {
+    ctl_->reader_parked.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ctl_->tail.load(std::memory_order_acquire) != pos_) {
+        ctl_->reader_parked.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool ShmRing::readable() const {
+    return ctl_->tail.load(std::memory_order_acquire) != pos_;
+}
+
+ShmLink::~ShmLink() {
+    if (map) munmap(map, map_bytes);
+    if (server_bell >= 0) close(server_bell);
+    if (client_bell >= 0) close(client_bell);
+}
+
+int shm_link_create(ShmLink *link, size_t ring_bytes) {
+    size_t ring = SHM_RING_MIN;
+    while (ring < ring_bytes && ring < SHM_RING_MAX) ring <<= 1;
+    size_t map_bytes = SHM_HEADER_BYTES + 2 * ring;
+
+    int memfd = memfd_create("chat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) return -1;
+    // sealed at its size: a client cannot shrink it under our mapping
+    if (ftruncate(memfd, static_cast<off_t>(map_bytes)) != 0 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        close(memfd);
+        return -1;
+    }
+    void *map = mmap(nullptr, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED) {
+        close(memfd);
+        return -1;
+    }
+    // a fresh memfd reads as zeros: both rings empty. Both readers start
+    // out parked, so the first bytes either way ring a doorbell.
+    ShmRegion *r = static_cast<ShmRegion *>(map);
+    std::memcpy(r->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+    r->ring_bytes = ring;
+    r->up.reader_parked.store(1, std::memory_order_relaxed);
+    r->down.reader_parked.store(1, std::memory_order_relaxed);
+
+    link->server_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    link->client_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    link->map = map;
+    link->map_bytes = map_bytes;
+    // the server consumes up and produces down
+    uint8_t *base = static_cast<uint8_t *>(map) + SHM_HEADER_BYTES;
+    link->up.attach(&r->up, base, ring, false);
+    link->down.attach(&r->down, base + ring, ring, true);
+    if (link->server_bell < 0 || link->client_bell < 0) {
+        close(memfd);
+        return -1;
+    }
+    return memfd;
+}
+
+int shm_link_attach(ShmLink *link, int memfd, int server_bell, int client_bell) {
+    link->server_bell = server_bell;
+    link->client_bell = client_bell;
+    struct stat st;
+    if (fstat(memfd, &st) != 0 || static_cast<size_t>(st.st_size) < SHM_HEADER_BYTES) {
+        close(memfd);
+        return -1;
+    }
+    size_t map_bytes = static_cast<size_t>(st.st_size);
+    void *map = mmap(nullptr, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (map == MAP_FAILED) return -1;
+    const ShmRegion *r = static_cast<const ShmRegion *>(map);
+    uint64_t ring = r->ring_bytes;
+    if (std::memcmp(r->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0 || ring < SHM_RING_MIN || ring > SHM_RING_MAX ||
+        (ring & (ring - 1)) != 0 || map_bytes != SHM_HEADER_BYTES + 2 * ring) {
+        munmap(map, map_bytes);
+        return -1;
+    }
+    ShmRegion *w = static_cast<ShmRegion *>(map);
+    uint8_t *base = static_cast<uint8_t *>(map) + SHM_HEADER_BYTES;
+    link->map = map;
+    link->map_bytes = map_bytes;
+    link->up.attach(&w->up, base, static_cast<size_t>(ring), true);
+    link->down.attach(&w->down, base + ring, static_cast<size_t>(ring), false);
+    return 0;
+}
+
+void shm_doorbell_ring(int fd) {
+    uint64_t one = 1;
+    ssize_t r = ::write(fd, &one, sizeof(one));
+    (void)r;
+}
+
+void shm_doorbell_drain(int fd) {
+    uint64_t v;
+    ssize_t r = ::read(fd, &v, sizeof(v));
+    (void)r;
+}
+
+static void move_bytes(Buffer &from, Buffer &to, size_t n) {
+    iovec iov[2];
+    int cnt = from.readable_iov(iov);
+    size_t left = n;
+    for (int i = 0; i < cnt && left > 0; ++i) {
+        size_t take = iov[i].iov_len < left ? iov[i].iov_len : left;
+        to.append(iov[i].iov_base, take);
+        left -= take;
+    }
+    from.consume(n);
+}
+
+int shm_request(int fd, ShmLink *link, Buffer &early) {
+    if (write_fully_nonblocking(fd, reinterpret_cast<const uint8_t *>(SHM_HELLO), SHM_HELLO_LEN) !=
+        static_cast<ssize_t>(SHM_HELLO_LEN)) {
+        return -1;
+    }
+    Buffer in;
+    int fds[3];
+    size_t nfds = 0;
+    int result = -1;
+    for (;;) {
+        // the reply is the first frame boundary that does not start with 0
+        bool more = true;
+        while (more && in.length > 0) {
+            uint8_t first = 0;
+            in.peek(0, &first, 1);
+            if (first != 0) {
+                if (in.length < SHM_HELLO_LEN) break;
+                char reply[SHM_HELLO_LEN];
+                in.peek(0, reply, SHM_HELLO_LEN);
+                in.consume(SHM_HELLO_LEN);
+                move_bytes(in, early, in.length);
+                if (std::memcmp(reply, SHM_ACCEPT, SHM_HELLO_LEN) == 0 && nfds == 3) {
+                    nfds = 0;
+                    return shm_link_attach(link, fds[0], fds[1], fds[2]) == 0 ? 1 : -1;
+                }
+                if (std::memcmp(reply, SHM_DECLINE, SHM_HELLO_LEN) == 0) result = 0;
+                goto out;
+            }
+            uint32_t len = 0;
+            int hr = has_complete_frame(in, &len);
+            if (hr == -2) goto out;
+            if (hr == 1) move_bytes(in, early, 4 + len);
+            else more = false;
+        }
+
+        uint8_t buf[4096];
+        iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 3)];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t r = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) goto out;
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+            size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < n; ++i) {
+                int got;
+                std::memcpy(&got, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+                if (nfds < 3) fds[nfds++] = got;
+                else close(got);
+            }
+        }
+        if (in.append(buf, static_cast<size_t>(r)) != 0) goto out;
+    }
+out:
+    for (size_t i = 0; i < nfds; ++i) close(fds[i]);
+    return result;
+}
+
+int shm_write_buffer(ShmRing &ring, int bell, Buffer &out) {
+    for (;;) {
+        size_t moved = 0;
+        while (out.length > 0) {
+            iovec iov[2];
+            out.readable_iov(iov);
+            ssize_t n = ring.write(iov[0].iov_base, iov[0].iov_len);
+            if (n < 0) return -1;
+            out.consume(static_cast<size_t>(n));
+            moved += static_cast<size_t>(n);
+            if (static_cast<size_t>(n) < iov[0].iov_len) break;
+        }
+        if (moved > 0 && ring.reader_needs_wake()) shm_doorbell_ring(bell);
+        if (out.length == 0 || ring.park_writer()) return 0;
+    }
+}
+
+ssize_t shm_read_buffer(ShmRing &ring, int bell, Buffer &in, size_t max) {
+    ssize_t n = ring.read_into(in, max);
+    if (n > 0 && ring.writer_needs_wake()) shm_doorbell_ring(bell);
+    return n;
+}
@@ -0,0 +1,111 @@
+// Shared-memory transport for clients on the same host as the server
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h> // for ssize_t
+
+struct Buffer;
+
+// Asked for on a Unix socket connection in place of the protocol's first
+// bytes: the client sends SHM_HELLO, and the server answers SHM_ACCEPT with
+// three fds attached (SCM_RIGHTS): the memfd holding both rings, the
+// doorbell the server waits on and the one the client waits on. After
+// SHM_ACCEPT the framed protocol (v1, or v2 after its hello) runs over the
+// rings and the socket only signals a hangup. SHM_DECLINE leaves everything
+// on the socket. Either reply arrives at a frame boundary, after any v1
+// frames the server had already sent.
+#define SHM_HELLO "CHSM"
+#define SHM_ACCEPT "CHSY"
+#define SHM_DECLINE "CHSN"
+static const size_t SHM_HELLO_LEN = 4;
+
+static const size_t SHM_RING_DEFAULT = 1u << 20;
+static const size_t SHM_RING_MIN = 64 * 1024;
+static const size_t SHM_RING_MAX = 64u << 20;
+
+// One direction's positions and sleep flags, in the shared region. Positions
+// count every byte ever written or read and never wrap. A side with nothing
+// to do raises its parked flag before it sleeps on its doorbell, so the
+// other side only makes the eventfd syscall for a peer that is waiting.
+struct ShmRingControl {
+    alignas(64) std::atomic<uint64_t> tail; // written by the producer
+    alignas(64) std::atomic<uint64_t> head; // written by the consumer
+    alignas(64) std::atomic<uint32_t> reader_parked;
+    std::atomic<uint32_t> writer_parked;
+};
+
+// One side's view of a ring. Each side keeps its own position privately and
+// only publishes it, so a peer scribbling over the shared control block can
+// corrupt its own stream but not make this side read or write out of
+// bounds; write() and read_into() return -1 once the peer's position stops
+// making sense.
+class ShmRing {
+public:
+    void attach(ShmRingControl *ctl, uint8_t *data, size_t capacity, bool producer);
+
+    // Producer: copies as much of src as fits and returns the count
+    ssize_t write(const void *src, size_t len);
+    // Producer: true when the consumer is asleep and wants its doorbell rung
+    bool reader_needs_wake();
+    // Producer with output left over: marks it parked until space frees up.
+    // Returns false when space freed up meanwhile and it must not sleep.
+    bool park_writer();
+
+    // Consumer: appends up to max readable bytes to b and returns the count
+    ssize_t read_into(Buffer &b, size_t max);
+    // Consumer: true when the producer waits for space
+    bool writer_needs_wake();
+    // Consumer found the ring empty: marks it parked. Returns false when
+    // data arrived meanwhile and it must not sleep.
+    bool park_reader();
+    bool readable() const;
+
+private:
+    ShmRingControl *ctl_{ nullptr };
+    uint8_t *data_{ nullptr };
+    size_t cap_{ 0 };
+    uint64_t pos_{ 0 }; // our own tail (producer) or head (consumer)
+};
+
+// Both rings of one connection, mapped from a memfd. "up" carries the
+// client's bytes to the server and "down" the server's to the client.
+struct ShmLink {
+    void *map{ nullptr };
+    size_t map_bytes{ 0 };
+    ShmRing up{};
+    ShmRing down{};
+    int server_bell{ -1 }; // eventfd the server waits on
+    int client_bell{ -1 }; // eventfd the client waits on
+
+    ShmLink() = default;
+    ShmLink(const ShmLink &) = delete;
+    ShmLink &operator=(const ShmLink &) = delete;
+    ~ShmLink();
+};
+
+// Server side: creates the memfd and both doorbells. ring_bytes is rounded
+// up to a power of two within SHM_RING_MIN..SHM_RING_MAX. Returns the memfd,
+// which only needs to stay open until it has been sent, or -1.
+int shm_link_create(ShmLink *link, size_t ring_bytes);
+// Client side: maps a region received with SHM_ACCEPT and takes ownership
+// of the doorbells. Returns 0 or -1 (memfd is closed either way).
+int shm_link_attach(ShmLink *link, int memfd, int server_bell, int client_bell);
+
+// Doorbells are eventfds: ringing adds one, draining resets to zero
+void shm_doorbell_ring(int fd);
+void shm_doorbell_drain(int fd);
+
+// Client side of the handshake, on a connected blocking Unix socket: sends
+// SHM_HELLO and waits for the reply. v1 frames the server sent ahead of it
+// are moved to early in order, as are bytes behind a decline. Returns 1
+// with link attached, 0 when the server declined, -1 on error.
+int shm_request(int fd, ShmLink *link, Buffer &early);
+// Moves what fits of out into ring, rings bell if the reader sleeps, and
+// parks as the writer when the ring fills up. Returns -1 once the peer has
+// corrupted the ring.
+int shm_write_buffer(ShmRing &ring, int bell, Buffer &out);
+// Appends up to max bytes from ring to in and rings bell if the writer
+// waits for the space. Returns the count, or -1 as for read_into.
+ssize_t shm_read_buffer(ShmRing &ring, int bell, Buffer &in, size_t max);
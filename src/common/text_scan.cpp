@@ -0,0 +1,345 @@
+#include "text_scan.hpp"
+
+#include <cstring>
+#include <initializer_list>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+inline bool is_control(uint8_t b) { return (b < 0x20 && b != '\t') || b == 0x7F; }
+
+// Length of the well-formed UTF-8 sequence at p (Unicode table 3-7), or 0
+// when p[0] does not start one
+size_t utf8_length(const uint8_t *p, size_t left) {
+    uint8_t b = p[0];
+    size_t n;
+    uint8_t lo = 0x80, hi = 0xBF; // allowed range of the second byte
+    if (b >= 0xC2 && b <= 0xDF) {
+        n = 2;
+    } else if (b >= 0xE0 && b <= 0xEF) {
+        n = 3;
+        if (b == 0xE0) lo = 0xA0; // overlong
+        if (b == 0xED) hi = 0x9F; // surrogates
+    } else if (b >= 0xF0 && b <= 0xF4) {
+        n = 4;
+        if (b == 0xF0) lo = 0x90; // overlong
+        if (b == 0xF4) hi = 0x8F; // past U+10FFFF
+    } else {
+        return 0;
+    }
+    if (left < n || p[1] < lo || p[1] > hi) return 0;
+    for (size_t i = 2; i < n; ++i) {
+        if (p[i] < 0x80 || p[i] > 0xBF) return 0;
+    }
+    return n;
+}
+
+// Bytes at p that are clean, one character's worth; 0 when p[0] is not
+inline size_t clean_step(const uint8_t *p, size_t left) {
+    if (p[0] < 0x80) return is_control(p[0]) ? 0 : 1;
+    return utf8_length(p, left);
+}
+
+const uint64_t ONES = 0x0101010101010101ull;
+const uint64_t HIGHS = 0x8080808080808080ull;
+
+// Eight bytes of printable ASCII: no high bit, nothing below 0x20 and no
+// DEL (a tab takes the byte-wise step, which allows it)
+inline bool word_printable(uint64_t w) {
+    uint64_t del = w ^ (ONES * 0x7F);
+    return ((w | ((w - ONES * 0x20) & ~w) | ((del - ONES) & ~del)) & HIGHS) == 0;
+}
+
+bool clean_scalar(const uint8_t *p, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        if (len - i >= 8) {
+            uint64_t w;
+            std::memcpy(&w, p + i, 8);
+            if (word_printable(w)) {
+                i += 8;
+                continue;
+            }
+        }
+        size_t n = clean_step(p + i, len - i);
+        if (n == 0) return false;
+        i += n;
+    }
+    return true;
+}
+
+// memchr, which libc vectorizes on most architectures
+size_t newlines_scalar(const uint8_t *p, size_t len, uint32_t *offsets, size_t max) {
+    size_t n = 0;
+    for (size_t i = 0; i < len && n < max; ++n) {
+        const void *nl = std::memchr(p + i, '\n', len - i);
+        if (!nl) break;
+        i = static_cast<size_t>(static_cast<const uint8_t *>(nl) - p);
+        offsets[n] = static_cast<uint32_t>(i++);
+    }
+    return n;
+}
+
+#if defined(__x86_64__)
+
+// SSE2 checks 16 bytes of ASCII at a time and walks non-ASCII blocks with
+// the scalar step: a quick pass for mostly-English text.
+bool clean_sse2(const uint8_t *p, size_t len) {
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i del = _mm_set1_epi8(0x7F);
+    size_t i = 0;
+    while (len - i >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        if (_mm_movemask_epi8(v) == 0) {
+            __m128i bad = _mm_or_si128(_mm_andnot_si128(_mm_cmpeq_epi8(v, tab), _mm_cmplt_epi8(v, space)),
+                                       _mm_cmpeq_epi8(v, del));
+            if (_mm_movemask_epi8(bad) != 0) return false;
+            i += 16;
+            continue;
+        }
+        // a sequence may run past the block; the next one starts after it
+        for (size_t stop = i + 16; i < stop;) {
+            size_t n = clean_step(p + i, len - i);
+            if (n == 0) return false;
+            i += n;
+        }
+    }
+    return clean_scalar(p + i, len - i);
+}
+
+// AVX2 validates UTF-8 32 bytes at a time without branching on the
+// content, after Keiser and Lemire, "Validating UTF-8 in less than one
+// instruction per byte" (2021). Each byte is classified by three 16-entry
+// table lookups (vpshufb) on the high nibble of the byte before it, the
+// low nibble of the byte before it and its own high nibble; ANDing the
+// three leaves a bit set for every two-byte error pattern. Whether a byte
+// must be the third or fourth of a sequence comes from the bytes two and
+// three back. Control characters are caught in the same pass, and errors
+// are ORed into one register that is tested once at the end.
+
+// Error patterns, in the bits of the lookup results
+const uint8_t TOO_SHORT = 1 << 0;      // lead followed by a lead or ASCII
+const uint8_t TOO_LONG = 1 << 1;       // ASCII followed by a continuation
+const uint8_t OVERLONG_3 = 1 << 2;     // E0 80..9F
+const uint8_t TOO_LARGE = 1 << 3;      // F4 90..BF, F5..FF 90..BF
+const uint8_t SURROGATE = 1 << 4;      // ED A0..BF
+const uint8_t OVERLONG_2 = 1 << 5;     // C0..C1 any
+const uint8_t TOO_LARGE_1000 = 1 << 6; // F5..FF 80..8F
+const uint8_t OVERLONG_4 = 1 << 6;     // F0 80..8F
+const uint8_t TWO_CONTS = 1 << 7;      // continuation after continuation
+const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+#define TEXT_TABLE(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)                                               \
+    _mm256_setr_epi8(                                                                                          \
+        static_cast<char>(a), static_cast<char>(b), static_cast<char>(c), static_cast<char>(d),                \
+        static_cast<char>(e), static_cast<char>(f), static_cast<char>(g), static_cast<char>(h),                \
+        static_cast<char>(i), static_cast<char>(j), static_cast<char>(k), static_cast<char>(l),                \
+        static_cast<char>(m), static_cast<char>(n), static_cast<char>(o), static_cast<char>(p),                \
+        static_cast<char>(a), static_cast<char>(b), static_cast<char>(c), static_cast<char>(d),                \
+        static_cast<char>(e), static_cast<char>(f), static_cast<char>(g), static_cast<char>(h),                \
+        static_cast<char>(i), static_cast<char>(j), static_cast<char>(k), static_cast<char>(l),                \
+        static_cast<char>(m), static_cast<char>(n), static_cast<char>(o), static_cast<char>(p))
+
+// The register holding in, shifted N bytes later with the end of prev in front
+template <int N>
+__attribute__((target("avx2"))) inline __m256i prev_bytes(__m256i in, __m256i prev) {
+    return _mm256_alignr_epi8(in, _mm256_permute2x128_si256(prev, in, 0x21), 16 - N);
+}
+
+__attribute__((target("avx2"))) inline __m256i high_nibbles(__m256i v) {
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+}
+
+__attribute__((target("avx2"))) inline __m256i utf8_errors(__m256i in, __m256i prev) {
+    const __m256i byte_1_high = TEXT_TABLE(
+        // 0xxx: ASCII
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        // 10xx: continuation
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        // 1100, 1101: two-byte lead
+        TOO_SHORT | OVERLONG_2, TOO_SHORT,
+        // 1110: three-byte lead
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        // 1111: four-byte lead
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const __m256i byte_1_low = TEXT_TABLE(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY, CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000);
+    const __m256i byte_2_high = TEXT_TABLE(
+        // 0xxx: ASCII
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        // 1000, 1001, 101x: continuation
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        // 11xx: lead
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+    __m256i prev1 = prev_bytes<1>(in, prev);
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high, high_nibbles(prev1)),
+                         _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)))),
+        _mm256_shuffle_epi8(byte_2_high, high_nibbles(in)));
+    // only a byte two after an E0..FF or three after an F0..FF lead keeps its
+    // high bit here, and those are exactly the bytes that must continue
+    __m256i third = _mm256_subs_epu8(prev_bytes<2>(in, prev), _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(prev_bytes<3>(in, prev), _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+    __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+    return _mm256_xor_si256(must_continue, special);
+}
+
+// Nonzero when the block ends inside a sequence that needs more bytes
+__attribute__((target("avx2"))) inline __m256i utf8_incomplete(__m256i in) {
+    const __m256i max = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+    return _mm256_subs_epu8(in, max);
+}
+
+__attribute__((target("avx2"))) inline __m256i control_bytes(__m256i in) {
+    // signed compares: bytes from 0x80 up are negative, so they are taken
+    // back out of the "below 0x20" set
+    __m256i below = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), in);
+    __m256i high = _mm256_cmpgt_epi8(_mm256_setzero_si256(), in);
+    __m256i tab = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\t'));
+    return _mm256_or_si256(_mm256_andnot_si256(_mm256_or_si256(high, tab), below),
+                           _mm256_cmpeq_epi8(in, _mm256_set1_epi8(0x7F)));
+}
+
+struct Utf8State {
+    __m256i error;
+    __m256i prev;
+    __m256i incomplete;
+};
+
+__attribute__((target("avx2"))) inline void check_block(Utf8State &st, __m256i in) {
+    st.error = _mm256_or_si256(st.error, control_bytes(in));
+    if (_mm256_movemask_epi8(in) == 0) {
+        // ASCII: only a sequence the previous block cut off can be wrong
+        st.error = _mm256_or_si256(st.error, st.incomplete);
+    } else {
+        st.error = _mm256_or_si256(st.error, utf8_errors(in, st.prev));
+        st.incomplete = utf8_incomplete(in);
+    }
+    st.prev = in;
+}
+
+__attribute__((target("avx2"))) bool clean_avx2(const uint8_t *p, size_t len) {
+    Utf8State st{ _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) check_block(st, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i)));
+    if (i < len) {
+        // padded with spaces: clean ASCII that still ends a cut-off sequence
+        alignas(32) uint8_t tail[32];
+        std::memset(tail, ' ', sizeof(tail));
+        std::memcpy(tail, p + i, len - i);
+        check_block(st, _mm256_load_si256(reinterpret_cast<const __m256i *>(tail)));
+    }
+    __m256i error = _mm256_or_si256(st.error, st.incomplete);
+    return _mm256_testz_si256(error, error) != 0;
+}
+
+// Continues a scan at offset i with n offsets already stored
+size_t newlines_from(const uint8_t *p, size_t i, size_t len, uint32_t *offsets, size_t n, size_t max) {
+    for (; i < len && n < max; ++i) {
+        if (p[i] == '\n') offsets[n++] = static_cast<uint32_t>(i);
+    }
+    return n;
+}
+
+__attribute__((target("avx2"))) size_t newlines_avx2(const uint8_t *p, size_t len, uint32_t *offsets, size_t max) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        unsigned m = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i)), nl)));
+        for (; m != 0; m &= m - 1) {
+            if (n == max) return n;
+            offsets[n++] = static_cast<uint32_t>(i + static_cast<size_t>(__builtin_ctz(m)));
+        }
+    }
+    return newlines_from(p, i, len, offsets, n, max);
+}
+
+#endif // __x86_64__
+
+struct Kernels {
+    TextKernel id;
+    bool (*clean)(const uint8_t *p, size_t len);
+    size_t (*newlines)(const uint8_t *p, size_t len, uint32_t *offsets, size_t max);
+};
+
+bool cpu_has(TextKernel k) {
+#if defined(__x86_64__)
+    __builtin_cpu_init(); // may run before libgcc's own constructor
+    return k != TEXT_KERNEL_AVX2 || __builtin_cpu_supports("avx2");
+#else
+    return k == TEXT_KERNEL_SCALAR;
+#endif
+}
+
+Kernels kernels_for(TextKernel k) {
+    switch (k) {
+#if defined(__x86_64__)
+    case TEXT_KERNEL_AVX2:
+        return Kernels{ k, clean_avx2, newlines_avx2 };
+    case TEXT_KERNEL_SSE2:
+        return Kernels{ k, clean_sse2, newlines_scalar }; // memchr already uses SSE2
+#endif
+    default:
+        return Kernels{ TEXT_KERNEL_SCALAR, clean_scalar, newlines_scalar };
+    }
+}
+
+Kernels best_kernels() {
+    for (TextKernel k : { TEXT_KERNEL_AVX2, TEXT_KERNEL_SSE2 }) {
+        if (cpu_has(k)) return kernels_for(k);
+    }
+    return kernels_for(TEXT_KERNEL_SCALAR);
+}
+
+Kernels g_kernels = best_kernels();
+
+} // namespace
+
+TextKernel text_kernel() { return g_kernels.id; }
+
+const char *text_kernel_name(TextKernel k) {
+    static const char *names[] = { "scalar", "sse2", "avx2" };
+    return k <= TEXT_KERNEL_AVX2 ? names[k] : "?";
+}
+
+int text_kernel_select(TextKernel k) {
+    if (k > TEXT_KERNEL_AVX2 || !cpu_has(k)) return -1;
+    g_kernels = kernels_for(k);
+    return 0;
+}
+
+bool text_is_clean(const uint8_t *p, size_t len) { return g_kernels.clean(p, len); }
+
+size_t text_sanitize(uint8_t *p, size_t len) {
+    size_t replaced = 0;
+    for (size_t i = 0; i < len;) {
+        size_t n = clean_step(p + i, len - i);
+        if (n == 0) {
+            p[i] = '?';
+            ++replaced;
+            n = 1;
+        }
+        i += n;
+    }
+    return replaced;
+}
+
+size_t scan_newlines(const uint8_t *p, size_t len, uint32_t *offsets, size_t max) {
+    return g_kernels.newlines(p, len, offsets, max);
+}
@@ -0,0 +1,36 @@
+// Vectorized scans over chat text: UTF-8 and control character checks for
+// the server's relay path, and newline search for the client's line splitting
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Kernels, fastest last. The best one the CPU supports is picked at startup;
+// SSE2 is part of x86-64 and AVX2 is probed at runtime, so one binary runs
+// everywhere. Other architectures use the scalar kernel.
+enum TextKernel : uint8_t {
+    TEXT_KERNEL_SCALAR = 0,
+    TEXT_KERNEL_SSE2 = 1,
+    TEXT_KERNEL_AVX2 = 2,
+};
+
+TextKernel text_kernel();
+const char *text_kernel_name(TextKernel k);
+// Switches every scan to kernel k (benchmarks compare them). Returns -1,
+// changing nothing, when the CPU lacks it.
+int text_kernel_select(TextKernel k);
+
+// True when p holds well-formed UTF-8 (no overlongs, surrogates or code
+// points past U+10FFFF, nothing cut short) with no ASCII control character
+// other than tab.
+bool text_is_clean(const uint8_t *p, size_t len);
+
+// Replaces each control character, and each byte that does not belong to a
+// well-formed UTF-8 sequence, with '?'. The length never changes, so text
+// inside an encoded frame can be fixed in place. Returns how many bytes
+// were replaced. Scalar: it only runs on text text_is_clean() refused.
+size_t text_sanitize(uint8_t *p, size_t len);
+
+// Stores the offsets of the first max '\n' bytes in p, in order, and
+// returns how many it stored. One pass finds every line end in a chunk.
+size_t scan_newlines(const uint8_t *p, size_t len, uint32_t *offsets, size_t max);
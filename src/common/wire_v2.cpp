@@ -0,0 +1,67 @@
+#include "wire_v2.hpp"
+#include "common.hpp"
+
+size_t varint_put(uint64_t v, uint8_t *out) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = static_cast<uint8_t>(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = static_cast<uint8_t>(v);
+    return n;
+}
+
+int varint_get(const uint8_t *p, size_t len, size_t max_bytes, uint64_t *v, size_t *used) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < max_bytes; ++i) {
+        if (i == len) return 0;
+        result |= static_cast<uint64_t>(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *v = result;
+            *used = i + 1;
+            return 1;
+        }
+    }
+    return -2;
+}
+
+size_t v2_put_header(uint8_t type, uint32_t body_len, uint8_t *out) {
+    out[0] = type;
+    return 1 + varint_put(body_len, out + 1);
+}
+
+int v2_has_complete_frame(const Buffer &inbuf, uint8_t *type, uint32_t *body_len, uint32_t *hdr_len) {
+    if (inbuf.length < 2) return 0;
+    uint8_t hdr[V2_MAX_HEADER];
+    size_t avail = inbuf.length < V2_MAX_HEADER ? inbuf.length : V2_MAX_HEADER;
+    inbuf.peek(0, hdr, avail);
+    uint64_t len = 0;
+    size_t used = 0;
+    int r = varint_get(hdr + 1, avail - 1, V2_MAX_HEADER - 1, &len, &used);
+    if (r != 1) return r;
+    if (len > V2_MAX_BODY) return -2;
+    if (inbuf.length < 1 + used + len) return 0;
+    *type = hdr[0];
+    *body_len = static_cast<uint32_t>(len);
+    *hdr_len = static_cast<uint32_t>(1 + used);
+    return 1;
+}
+
+int send_v2_or_buffer(int fd, Buffer &outbuf, uint8_t type, const uint8_t *body, uint32_t len) {
+    if (len > V2_MAX_BODY) return -1;
+    uint8_t hdr[V2_MAX_HEADER];
+    size_t hlen = v2_put_header(type, len, hdr);
+    return send_with_header_or_buffer(fd, outbuf, hdr, hlen, body, len);
+}
+
+int v2_batch_next(const uint8_t *body, uint32_t len, uint32_t *off, const uint8_t **msg, uint32_t *msg_len) {
+    if (*off >= len) return 0;
+    uint64_t mlen = 0;
+    size_t used = 0;
+    if (varint_get(body + *off, len - *off, 3, &mlen, &used) != 1) return -2;
+    if (mlen > MAX_MESSAGE_SIZE || mlen > len - *off - used) return -2;
+    *msg = body + *off + used;
+    *msg_len = static_cast<uint32_t>(mlen);
+    *off += static_cast<uint32_t>(used + mlen);
+    return 1;
+}
@@ -0,0 +1,89 @@
+// Protocol v2: typed frames with varint lengths, plus batch frames
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h> // for ssize_t
+
+struct Buffer;
+
+// Negotiation. A v1 stream always starts with a length prefix whose first
+// byte is 0 (payloads are capped at MAX_MESSAGE_SIZE), so a client opens a
+// v2 session by sending these 4 bytes first. The server answers with the
+// same bytes, placed after any v1 frames already queued to the client, and
+// speaks v2 from then on. A v1 server rejects the hello as an oversized
+// frame and closes the connection.
+#define V2_HELLO "CHT2"
+#define V2_HELLO_LEN 4
+
+// Frame layout: type (1 byte), body length (LEB128 varint, at most 3 bytes
+// for the sizes allowed here), body.
+enum V2Type : uint8_t {
+    V2_MSG = 1,    // chat text; server -> client for messages from others too
+    V2_BATCH = 2,  // body is a run of (varint length, text) messages
+    V2_JOIN = 3,   // body: room name
+    V2_LEAVE = 4,  // body: room name, or empty for the current room
+    V2_NICK = 5,   // body: nickname
+    V2_DIRECT = 6, // body: varint nick length, nick, text
+    V2_NOTICE = 7, // server -> client status text
+    // Streamed transfers, for payloads of any size. The client sends one
+    // STREAM (varint size, varint nick length, nick or empty for the current
+    // room, name) followed by exactly `size` raw bytes outside any frame.
+    // Recipients get a STREAM (varint id, varint size, varint sender nick
+    // length, sender nick, name), then STREAM_DATA frames (varint id, bytes)
+    // until `size` bytes have arrived, or a STREAM_ABORT (varint id) if the
+    // sender leaves first. Only v2 clients take part in transfers.
+    V2_STREAM = 8,
+    V2_STREAM_DATA = 9,
+    V2_STREAM_ABORT = 10,
+    // Heartbeats, empty bodies. The server pings v2 clients that have been
+    // silent for a while and closes them if nothing comes back; either side
+    // answers a PING with a PONG.
+    V2_PING = 11,
+    V2_PONG = 12,
+    // Sequencing. Every room broadcast gets a server-wide sequence number;
+    // a client sends RESUME (varint last sequence number seen, 0 for none)
+    // to have each later broadcast preceded by a SEQ (varint sequence
+    // number), and to get the retained broadcasts after that number in the
+    // rooms it is in replayed, each behind its SEQ. The server answers
+    // RESUME first with a RESUME (varint n): the replay holds everything
+    // after n, so if n is above the number asked for, the messages between
+    // the two are lost. Numbers grow but are not contiguous per room, and a
+    // broadcast racing the resume may arrive twice.
+    V2_SEQ = 13,
+    V2_RESUME = 14,
+    // History from the server's durable log, when it keeps one. The client
+    // sends HISTORY (varint limit, varint from_ms, varint to_ms; times are
+    // Unix milliseconds and 0 leaves a bound open) for the newest `limit`
+    // messages of its current room in that range. The server replies with
+    // them, oldest first, as the MSG or BATCH frames they were sent as, then
+    // a HISTORY (varint count).
+    V2_HISTORY = 15,
+};
+
+// Largest body of any v2 frame. Single messages are still capped at
+// MAX_MESSAGE_SIZE; only batches use the extra room.
+#define V2_MAX_BODY (64 * 1024)
+#define V2_MAX_HEADER 4
+// Largest data chunk the server puts in one STREAM_DATA frame
+#define V2_STREAM_CHUNK (32 * 1024)
+#define V2_MAX_STREAM_NAME 255
+
+// Writes v as a varint into out (up to 10 bytes); returns the byte count.
+size_t varint_put(uint64_t v, uint8_t *out);
+// Reads a varint of at most max_bytes. Returns 1 and sets *v and *used, 0
+// when p ends mid-varint, -2 when it is longer than max_bytes.
+int varint_get(const uint8_t *p, size_t len, size_t max_bytes, uint64_t *v, size_t *used);
+
+// Encodes a frame header into out (V2_MAX_HEADER bytes); returns its size.
+size_t v2_put_header(uint8_t type, uint32_t body_len, uint8_t *out);
+// Checks for a complete frame at the front of inbuf. Returns 1 and fills
+// the out-params when one is buffered, 0 if more bytes are needed and -2
+// when the header is malformed or the body too large.
+int v2_has_complete_frame(const Buffer &inbuf, uint8_t *type, uint32_t *body_len, uint32_t *hdr_len);
+// Frames and sends (or buffers) one v2 frame, like send_framed_or_buffer.
+int send_v2_or_buffer(int fd, Buffer &outbuf, uint8_t type, const uint8_t *body, uint32_t len);
+
+// Steps through the messages of a batch body. *off starts at 0. Returns 1
+// with the next message, 0 at the end, -2 on a malformed or oversized entry.
+int v2_batch_next(const uint8_t *body, uint32_t len, uint32_t *off, const uint8_t **msg, uint32_t *msg_len);
@@ -0,0 +1,42 @@
+#include "channels.hpp"
+
+ChannelDirectory::ChannelDirectory() : present_(new std::atomic<uint64_t>[MAX_CHANNELS]) {
+    for (uint32_t i = 0; i < MAX_CHANNELS; ++i) present_[i].store(0, std::memory_order_relaxed);
+    names_.reserve(64);
+    names_.push_back("lobby");
+    ids_.emplace("lobby", LOBBY_CHANNEL);
+}
+
+uint32_t ChannelDirectory::intern(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = ids_.find(name);
+    if (it != ids_.end()) return it->second;
+    if (names_.size() >= MAX_CHANNELS) return NO_CHANNEL;
+    uint32_t id = static_cast<uint32_t>(names_.size());
+    try {
+        names_.push_back(name);
+        ids_.emplace(name, id);
+    } catch (...) {
+        if (names_.size() > id) names_.pop_back();
+        return NO_CHANNEL;
+    }
+    return id;
+}
+
+uint32_t ChannelDirectory::find(const std::string &name) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = ids_.find(name);
+    return it == ids_.end() ? NO_CHANNEL : it->second;
+}
+
+std::string ChannelDirectory::name(uint32_t id) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return id < names_.size() ? names_[id] : std::string();
+}
+
+void ChannelDirectory::set_present(uint32_t id, int shard, bool present) {
+    if (shard >= 64) return;
+    uint64_t bit = 1ull << shard;
+    if (present) present_[id].fetch_or(bit, std::memory_order_release);
+    else present_[id].fetch_and(~bit, std::memory_order_release);
+}
@@ -0,0 +1,115 @@
+// Chat rooms: a server-wide channel name table and the per-shard
+// subscription index that broadcasts iterate
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Every client starts out subscribed to, and sending to, the lobby
+static const uint32_t LOBBY_CHANNEL = 0;
+static const uint32_t MAX_CHANNELS = 65536;
+static const uint32_t NO_CHANNEL = UINT32_MAX;
+static const size_t MAX_CHANNEL_NAME = 64;
+
+// Interns channel names to small ids shared by all shards. Ids are never
+// reused, so a frame tagged with an id stays unambiguous while it crosses
+// shards. Interning takes a lock, but it only happens on join; the hot path
+// uses the lock-free shard presence masks.
+class ChannelDirectory {
+public:
+    ChannelDirectory();
+
+    // Returns the id for name, creating it on first use, or NO_CHANNEL when
+    // the table is full.
+    uint32_t intern(const std::string &name);
+    // Returns the id for name without creating it, or NO_CHANNEL.
+    uint32_t find(const std::string &name) const;
+    std::string name(uint32_t id) const;
+
+    // Which shards have at least one member, so forwarding can skip the
+    // rest. Only the first 64 shards are tracked; later ones always "maybe".
+    void set_present(uint32_t id, int shard, bool present);
+    bool maybe_present(uint32_t id, int shard) const {
+        if (shard >= 64) return true;
+        return (present_[id].load(std::memory_order_acquire) >> shard) & 1;
+    }
+
+private:
+    mutable std::mutex mu_;
+    std::unordered_map<std::string, uint32_t> ids_;
+    std::vector<std::string> names_;
+    std::unique_ptr<std::atomic<uint64_t>[]> present_;
+};
+
+// Where a member sits in one channel's member array
+struct ChannelMembership {
+    uint32_t channel{ 0 };
+    uint32_t pos{ 0 };
+};
+
+// One shard's channel -> members index. Members are kept in a dense array
+// per channel so a broadcast walks contiguous pointers, and each member
+// records its position in every channel it is in (T::channels), so leaving
+// is an O(1) swap-remove.
+template <typename T>
+class SubscriptionIndex {
+public:
+    // Returns 1 if the channel just gained its first member, 0 if m was
+    // added to a non-empty channel or already a member, -1 on failure.
+    int join(uint32_t channel, T *m) {
+        for (const ChannelMembership &cm : m->channels) {
+            if (cm.channel == channel) return 0;
+        }
+        try {
+            std::vector<T *> &members = members_[channel];
+            m->channels.push_back(ChannelMembership{ channel, static_cast<uint32_t>(members.size()) });
+            members.push_back(m);
+            return members.size() == 1 ? 1 : 0;
+        } catch (...) {
+            return -1;
+        }
+    }
+
+    // Returns 1 if the channel is now empty, 0 if it still has members, -1
+    // if m was not a member.
+    int leave(uint32_t channel, T *m) {
+        size_t i = 0;
+        while (i < m->channels.size() && m->channels[i].channel != channel) ++i;
+        if (i == m->channels.size()) return -1;
+        uint32_t pos = m->channels[i].pos;
+        m->channels[i] = m->channels.back();
+        m->channels.pop_back();
+
+        auto it = members_.find(channel);
+        std::vector<T *> &members = it->second;
+        T *moved = members.back();
+        members[pos] = moved;
+        members.pop_back();
+        if (moved != m) {
+            for (ChannelMembership &cm : moved->channels) {
+                if (cm.channel == channel) {
+                    cm.pos = pos;
+                    break;
+                }
+            }
+        }
+        if (!members.empty()) return 0;
+        members_.erase(it);
+        return 1;
+    }
+
+    // Members of channel, or nullptr when it has none on this shard.
+    const std::vector<T *> *members(uint32_t channel) const {
+        auto it = members_.find(channel);
+        return it == members_.end() ? nullptr : &it->second;
+    }
+
+private:
+    std::unordered_map<uint32_t, std::vector<T *>> members_;
+};
@@ -0,0 +1,3050 @@
+#include "chat_server.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <cerrno>
+#include <csignal>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../common/buffer_pool.hpp"
+#include "../common/common.hpp"
+#include "../common/frame.hpp"
+#include "../common/shm_ring.hpp"
+#include "../common/text_scan.hpp"
+#include "../common/wire_v2.hpp"
+#include "channels.hpp"
+#include "client_registry.hpp"
+#include "federation.hpp"
+#include "handoff.hpp"
+#include "logger.hpp"
+#include "message_log.hpp"
+#include "metrics.hpp"
+#include "mpsc_queue.hpp"
+#include "nick_table.hpp"
+#include "replay_ring.hpp"
+#include "splice_relay.hpp"
+#include "timer_wheel.hpp"
+#include "uring.hpp"
+
+// Copied chunks a transfer may have in flight. A chunk stays in flight
+// while any recipient queue (or shard inbox) still references its frame,
+// so the slowest recipient paces the sender and a transfer holds at most
+// this many chunks however large it is.
+static const uint32_t TRANSFER_WINDOW = 8;
+// How often a sender stalled on a full window looks again
+static const int64_t TRANSFER_POLL_NS = 1000000;
+
+// A stream a client is sending: the raw bytes it still owes after its
+// V2_STREAM header, and where they go. Bytes already read into inbuf are
+// copied into STREAM_DATA frames; a transfer to one recipient on the same
+// shard is spliced straight from the socket instead (see SpliceRelay).
+struct Transfer {
+    uint64_t id{ 0 };
+    uint64_t remaining{ 0 };
+    ClientRoute to{};               // one recipient, or token 0 for a room
+    uint32_t channel{ NO_CHANNEL }; // the room; no route and no room drops the bytes
+    uint64_t splice_to{ 0 };        // local recipient whose relay reads our socket
+    Frame *window[TRANSFER_WINDOW]{}; // copied chunks in flight, oldest first
+    uint32_t window_len{ 0 };
+
+    Transfer() = default;
+    Transfer(const Transfer &) = delete;
+    Transfer &operator=(const Transfer &) = delete;
+    ~Transfer() {
+        for (uint32_t i = 0; i < window_len; ++i) frame_unref(window[i]);
+    }
+
+    // Retires chunks every recipient has written; true if another fits.
+    bool window_open() {
+        uint32_t done = 0;
+        while (done < window_len && window[done]->refs.load(std::memory_order_acquire) == 1) {
+            frame_unref(window[done++]);
+        }
+        for (uint32_t i = done; i < window_len; ++i) window[i - done] = window[i];
+        window_len -= done;
+        return window_len < TRANSFER_WINDOW;
+    }
+};
+
+struct Client {
+    int fd{ -1 };
+    uint64_t token{ 0 }; // registry handle, also the epoll user data
+    Buffer inbuf{};
+    FrameQueue outq{};
+    bool closed{ false };
+    // io_uring engine: submitted ops not yet completed, a sendmsg in flight,
+    // and whether the client sits on the shard's pending-send list
+    uint32_t pending_ops{ 0 };
+    uint32_t inflight_frames{ 0 };
+    bool send_inflight{ false };
+    bool send_dirty{ false };
+    bool recv_armed{ false };
+    bool recv_paused{ false }; // inbuf over the high-water mark
+    // fair read scheduling
+    bool in_ready{ false };  // on the shard's ready list
+    bool readable{ false };  // epoll: socket not known to be drained
+    bool peer_eof{ false };  // close once the buffered frames are out
+    double tokens{ 0 };      // rate limit bucket
+    uint64_t tokens_at{ 0 }; // last refill, server clock (ns)
+    // rooms: where this client's messages go, and what it is subscribed to
+    uint32_t channel{ LOBBY_CHANNEL };
+    std::vector<ChannelMembership> channels{};
+    std::string nick{}; // empty until /nick, bound in the server's NickTable
+    uint64_t nick_key{ 0 }; // the nick's reclaim key, issued with the bind
+    // protocol: v1 until the first bytes show a v2 hello
+    uint8_t wire{ WIRE_V1 };
+    bool wire_known{ false };
+    // streamed transfers: the one this client is sending, and a spliced one
+    // it is receiving
+    std::unique_ptr<Transfer> xfer{};
+    std::unique_ptr<SpliceRelay> relay{};
+    bool sequenced{ false }; // v2 client that resumed: broadcasts come with a V2_SEQ
+    uint64_t replayed_through{ 0 }; // newest broadcast its resume replayed
+    // deadlines: one wheel entry per client, re-armed lazily from these
+    // timestamps (shard clock, ms), so traffic never touches the wheel
+    TimerNode timer{};
+    uint64_t last_rx_ms{ 0 };     // bytes last arrived
+    uint64_t tx_progress_ms{ 0 }; // output last moved, or backlog began
+    uint64_t ping_sent_ms{ 0 };   // last heartbeat sent
+    // local clients: accepted on the Unix socket, and the shared-memory
+    // rings that replace its byte stream once the client asks for them
+    bool local{ false };
+    std::unique_ptr<ShmLink> shm{};
+};
+
+using ClientRegistry = SlabRegistry<Client>;
+
+// epoll tokens for a shard's own fds; client tokens always carry a non-zero
+// generation in the upper half, so these can never collide with them.
+static const uint64_t TOKEN_LISTENER = 1;
+static const uint64_t TOKEN_DISCOVERY = 2;
+static const uint64_t TOKEN_WAKE = 3;
+static const uint64_t TOKEN_IGNORE = 4; // completions nobody waits for
+static const uint64_t TOKEN_STATS = 5;
+static const uint64_t TOKEN_HANDOFF = 6;
+static const uint64_t TOKEN_UNIX_LISTENER = 7;
+static const uint64_t TOKEN_STOP = 8;
+
+// epoll data of a client's shared-memory doorbell: its token with the top
+// bit set. The io_uring engine tags sends with the same bit, but shared
+// memory is only offered on epoll shards, so the two never meet.
+static const uint64_t SHM_BELL_TAG = 1ull << 63;
+
+// Input buffered per client before the server stops reading from it, so a
+// client that is throttled or out of budget is pushed back on through TCP
+static const size_t INBUF_HIGH_WATER = 256 * 1024;
+
+#ifdef CHAT_IO_URING
+// Client tokens keep the top bit clear (see SlabRegistry), so it tells a
+// sendmsg completion apart from a recv completion for the same client.
+static const uint64_t URING_SEND_TAG = 1ull << 63;
+static const unsigned URING_ENTRIES = 1024;
+static const uint16_t URING_BUF_GROUP = 0;
+static const unsigned URING_BUF_COUNT = 256;
+static const unsigned URING_BUF_SIZE = 16384;
+static const int URING_SEND_IOV = 32;
+static const size_t URING_SEND_ARGS = 256;
+// How long a shard handing off waits for the kernel to finish with its clients
+static const uint64_t URING_QUIESCE_NS = 2000000000ull;
+
+// sendmsg arguments only need to live until the SQE is submitted
+// (IORING_FEAT_SUBMIT_STABLE), so a fixed per-shard pool is recycled after
+// every io_uring_enter.
+struct UringSendArgs {
+    msghdr msg;
+    iovec iov[URING_SEND_IOV];
+};
+#endif
+
+// A reference to an encoded frame handed from the shard that received it to
+// another shard, which fans it out to its own members of the channel, or
+// delivers it to the single client `target` when that is non-zero.
+// Sequenced broadcasts carry their number and V2_SEQ frame along. A
+// broadcast that still needs a number, from a client on another shard or
+// relayed by a federation peer, is `publish`: the shard it is posted to
+// numbers and publishes it as if one of its own clients had sent it.
+// Either way `sender` does not get it back.
+struct ShardMessage {
+    ShardMessage *next{ nullptr };
+    WireFrames frames{};
+    Frame *seq_frame{ nullptr };
+    uint64_t seq{ 0 };
+    uint32_t channel{ LOBBY_CHANNEL };
+    uint64_t target{ 0 };
+    ClientRoute sender{};
+    bool publish{ false };
+    int fd{ -1 };          // or a connected socket to serve (add_client)
+    uint64_t sent_at{ 0 }; // monotonic ns, for the inbox delay histogram
+};
+
+// One event loop: its own epoll set, SO_REUSEPORT listener and client set.
+// Only shard 0 owns the UDP discovery socket, the stats listener, the Unix
+// listener for local clients and the handoff socket.
+struct Shard {
+    ChatEngine *eng{ nullptr };
+    int index{ 0 };
+    int epfd{ -1 };
+    int listen_fd{ -1 };
+    int udp_fd{ -1 };
+    int stats_fd{ -1 };
+    int handoff_fd{ -1 };
+    int unix_fd{ -1 };
+    int wake_fd{ -1 };
+    ClientRegistry clients{};
+    SubscriptionIndex<Client> subs{};
+    std::vector<uint64_t> closing{}; // marked closed, removed at end of iteration
+    std::vector<uint64_t> ready{};   // clients with input left to serve, round-robin
+    std::vector<uint64_t> ready_batch{};
+    MpscQueue<ShardMessage> inbox{};
+    std::thread thread{};
+    bool want_uring{ false };
+    ShardMetrics metrics{};
+    TimerWheel timers{};
+    uint64_t now_ms{ 0 }; // server clock, refreshed on every wakeup
+    ReplayRing replay{};  // sequenced broadcasts, on the sequencer only
+#ifdef CHAT_IO_URING
+    std::unique_ptr<IoUring> ring{};
+    std::vector<uint64_t> dirty{}; // clients with queued frames to submit
+    std::vector<UringSendArgs> send_args{};
+    size_t send_args_used{ 0 };
+    bool quiescing{ false }; // handing off: stop re-arming accepts and recvs
+#endif
+};
+
+// History requests are capped at MAX_HISTORY
+static const uint32_t DEFAULT_HISTORY = 50;
+static const uint32_t MAX_HISTORY = 1000;
+
+struct SlowConsumerCounters {
+    std::atomic<uint64_t> dropped_oldest{ 0 }; // frames
+    std::atomic<uint64_t> dropped_newest{ 0 }; // frames
+    std::atomic<uint64_t> disconnects{ 0 };
+};
+
+// One ChatServer's state, shared by its shards, each of which points back
+// at it; open() copies the config in. Only the logger, the buffer pool and
+// the text kernel are process-wide.
+struct ChatEngine {
+    std::atomic<int> should_terminate{ 0 };
+    int stop_fd{ -1 }; // ChatServer::stop() rings it; shard 0 listens
+    std::vector<Shard *> shards{};
+    std::atomic<uint32_t> next_adopt{ 0 }; // add_client() round-robin
+    uint64_t (*clock)(){ monotonic_ns };
+    uint16_t tcp_port{ DEFAULT_TCP_PORT };
+    OutboundLimits limits{};
+    SchedulerConfig sched{};
+    TextPolicy text_policy{ TextPolicy::Sanitize };
+    Deadlines deadlines{};
+    ReplayConfig replay_config{};
+    LogConfig log_config{};
+    MessageLog *log{ nullptr };
+    FederationConfig fed_config{};
+    Federation *federation{ nullptr };
+    std::atomic<size_t> outbound_bytes{ 0 };
+    SlowConsumerCounters slow{};
+    ChannelDirectory channels{};
+    NickTable nicks{};
+    std::atomic<uint64_t> next_stream{ 1 };
+    // Server-wide so a resume can name one position across every shard's ring
+    std::atomic<uint64_t> next_seq{ 1 };
+    // Hot restart (--handoff): the successor's connection once one arrived,
+    // and how many clients this server took over from its predecessor
+    std::atomic<int> handoff_peer{ -1 };
+    uint64_t inherited_clients{ 0 };
+    // Size of each direction's ring for local clients on shared memory (0
+    // declines every request, leaving them on the Unix socket)
+    size_t shm_ring{ SHM_RING_DEFAULT };
+};
+
+// Opens the state a server hands its successor on a hot restart
+static const uint32_t HANDOFF_MAGIC = 0x43484834; // "CHH4"
+
+static void wake_shard(Shard *s) {
+    uint64_t one = 1;
+    ssize_t r = write(s->wake_fd, &one, sizeof(one));
+    (void)r;
+}
+
+static void epoll_update_events(int epfd, const Client *c, uint32_t events, bool enable_out) {
+    epoll_event ev{};
+    ev.data.u64 = c->token;
+    ev.events = events | EPOLLET | EPOLLRDHUP;
+    if (enable_out) ev.events |= EPOLLOUT;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        // Try add if mod fails (e.g., not present yet)
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+}
+
+// Clients are never unlinked mid-iteration; they are queued here and
+// reaped by remove_closed_clients() once the event batch is done.
+static void mark_closed(Shard *s, Client *c) {
+    if (c->closed) return;
+    c->closed = true;
+    s->closing.push_back(c->token);
+#ifdef CHAT_IO_URING
+    // completes the multishot recv and any in-flight send so the slot (and
+    // the frames the kernel may still be reading) can be released
+    if (s->ring) shutdown(c->fd, SHUT_RDWR);
+#endif
+}
+
+static void schedule_input(Shard *s, Client *c) {
+    if (c->in_ready) return;
+    c->in_ready = true;
+    s->ready.push_back(c->token);
+}
+
+// Applies the change in c's queued bytes since `before` to the global tally.
+static void account_outbound(Shard *s, const Client *c, size_t before) {
+    if (c->outq.bytes > before) {
+        s->eng->outbound_bytes.fetch_add(c->outq.bytes - before, std::memory_order_relaxed);
+    } else if (c->outq.bytes < before) {
+        s->eng->outbound_bytes.fetch_sub(before - c->outq.bytes, std::memory_order_relaxed);
+    }
+}
+
+// Pulls c's wheel entry forward to due_ms; a later deadline is picked up
+// when the entry fires and re-arms itself.
+static void arm_deadline(Shard *s, Client *c, uint64_t due_ms) {
+    if (!c->timer.armed() || due_ms < s->timers.due_ms(&c->timer)) s->timers.schedule(&c->timer, due_ms);
+}
+
+// c's output queue just went from empty to backlogged: start the write
+// stall clock.
+static void note_backlog(Shard *s, Client *c) {
+    c->tx_progress_ms = s->now_ms;
+    if (s->eng->deadlines.write_ms) arm_deadline(s, c, s->now_ms + s->eng->deadlines.write_ms);
+}
+
+// Subscribes c to channel on this shard and publishes the shard's presence
+// when it is the channel's first local member. Returns 0 on success.
+static int join_channel(Shard *s, Client *c, uint32_t channel) {
+    int r = s->subs.join(channel, c);
+    if (r == 1) s->eng->channels.set_present(channel, s->index, true);
+    return r < 0 ? -1 : 0;
+}
+
+static void leave_channel(Shard *s, Client *c, uint32_t channel) {
+    if (s->subs.leave(channel, c) == 1) s->eng->channels.set_present(channel, s->index, false);
+}
+
+static void end_transfer(Shard *s, Client *c);
+
+static void remove_client(Shard *s, Client *c) {
+    s->metrics.disconnected.add();
+    s->timers.cancel(&c->timer);
+    if (c->xfer) end_transfer(s, c);
+    // a sender stalled on this client's relay waits for an EPOLLOUT that
+    // will never come; its next turn notices the recipient is gone
+    if (c->relay && c->relay->src != 0) {
+        Client *src = s->clients.lookup(c->relay->src);
+        if (src && !src->closed) schedule_input(s, src);
+    }
+    while (!c->channels.empty()) leave_channel(s, c, c->channels.back().channel);
+    if (!c->nick.empty()) s->eng->nicks.unbind(c->nick, ClientRoute{ s->index, c->token });
+    s->eng->outbound_bytes.fetch_sub(c->outq.bytes, std::memory_order_relaxed);
+    if (c->shm) {
+        epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->shm->server_bell, nullptr);
+        c->shm.reset();
+    }
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, nullptr);
+    close(c->fd);
+    // Buffers free automatically
+    s->clients.release(c->token);
+}
+
+static void remove_closed_clients(Shard *s) {
+    size_t keep = 0;
+    for (uint64_t token : s->closing) {
+        Client *c = s->clients.lookup(token);
+        if (!c) continue;
+        if (c->pending_ops > 0) {
+            // io_uring still owns operations on this fd; retry next round
+            s->closing[keep++] = token;
+            continue;
+        }
+        log_msg(LOG_INFO, "Client disconnected (fd=%d)", c->fd);
+        remove_client(s, c);
+    }
+    s->closing.resize(keep);
+}
+
+// Makes room for f in a client that is already backlogged, per the slow
+// consumer policy. Returns false when f must not be queued. The drop
+// policies never drop a pinned frame: a transfer that lost a chunk would
+// be corrupt, and the sender's window stops it from queueing more than
+// TRANSFER_WINDOW chunks ahead of the slowest recipient anyway.
+static bool admit_frame(Shard *s, Client *c, const Frame *f) {
+    size_t per_client_over = 0;
+    if (c->outq.bytes + f->size > s->eng->limits.per_client) {
+        per_client_over = c->outq.bytes + f->size - s->eng->limits.per_client;
+    }
+    size_t total = s->eng->outbound_bytes.load(std::memory_order_relaxed);
+    size_t total_over = 0;
+    if (total + f->size > s->eng->limits.total) total_over = total + f->size - s->eng->limits.total;
+    size_t need = per_client_over > total_over ? per_client_over : total_over;
+    if (need == 0) return true;
+
+    switch (s->eng->limits.policy) {
+    case SlowPolicy::DropOldest: {
+        // frames the kernel may still be reading are never dropped
+        uint32_t keep = c->send_inflight ? c->inflight_frames : 0;
+        size_t before = c->outq.bytes;
+        uint32_t n = c->outq.drop_oldest(keep, need);
+        account_outbound(s, c, before);
+        s->eng->slow.dropped_oldest.fetch_add(n, std::memory_order_relaxed);
+        if (before - c->outq.bytes >= need || f->pinned) return true;
+        // not enough droppable backlog: fall back to dropping f
+        s->eng->slow.dropped_newest.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    case SlowPolicy::DropNewest:
+        if (f->pinned) return true;
+        s->eng->slow.dropped_newest.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    case SlowPolicy::Disconnect:
+        s->eng->slow.disconnects.fetch_add(1, std::memory_order_relaxed);
+        mark_closed(s, c);
+        return false;
+    }
+    return false;
+}
+
+// Copies what fits of c's queue into its shared-memory ring, waking the
+// client if it sleeps. When the ring fills we park as its writer, and the
+// client rings our doorbell once it has made room (see handle_client_event).
+static void flush_shm(Shard *s, Client *c) {
+    ShmRing &ring = c->shm->down;
+    FrameQueue &q = c->outq;
+    size_t before = q.bytes;
+    for (;;) {
+        size_t moved = 0;
+        while (!q.empty()) {
+            Frame *f = q.slots[q.head];
+            size_t want = f->size - q.offset;
+            ssize_t n = ring.write(f->data() + q.offset, want);
+            if (n < 0) {
+                mark_closed(s, c);
+                break;
+            }
+            q.advance(static_cast<size_t>(n));
+            moved += static_cast<size_t>(n);
+            if (static_cast<size_t>(n) < want) break;
+        }
+        if (moved > 0 && ring.reader_needs_wake()) {
+            shm_doorbell_ring(c->shm->client_bell);
+            s->metrics.shm_doorbells.add();
+        }
+        if (c->closed || q.empty() || ring.park_writer()) break;
+    }
+    account_outbound(s, c, before);
+    s->metrics.bytes_out.add(before - q.bytes);
+    if (q.bytes < before) c->tx_progress_ms = s->now_ms;
+}
+
+// Queues a frame for one client. epoll writes it right away when nothing is
+// pending; io_uring defers to one batched submission per loop iteration.
+static void queue_frame(Shard *s, Client *c, Frame *f) {
+#ifdef CHAT_IO_URING
+    if (s->ring) {
+        if (!admit_frame(s, c, f)) return;
+        size_t before = c->outq.bytes;
+        bool was_idle = c->outq.empty();
+        if (c->outq.push(f) != 0) {
+            mark_closed(s, c);
+            return;
+        }
+        if (was_idle) note_backlog(s, c);
+        account_outbound(s, c, before);
+        s->metrics.frames_out.add();
+        if (!c->send_dirty) {
+            c->send_dirty = true;
+            s->dirty.push_back(c->token);
+        }
+        return;
+    }
+#endif
+    bool was_idle = c->outq.empty();
+    if (c->shm) {
+        if (!was_idle && !admit_frame(s, c, f)) return;
+        size_t before = c->outq.bytes;
+        if (c->outq.push(f) != 0) {
+            mark_closed(s, c);
+            return;
+        }
+        account_outbound(s, c, before);
+        s->metrics.frames_out.add();
+        // a backlogged queue already waits for the client to make room
+        if (was_idle) flush_shm(s, c);
+        if (was_idle && !c->outq.empty()) note_backlog(s, c);
+        return;
+    }
+    // a spliced chunk that is partly on the wire has to finish first
+    bool held = c->relay && c->relay->pending();
+    // an idle client gets a direct write attempt; limits apply to backlog
+    if ((!was_idle || held) && !admit_frame(s, c, f)) return;
+    size_t before = c->outq.bytes;
+    if ((held ? c->outq.push(f) : send_frame_or_queue(c->fd, c->outq, f)) < 0) {
+        mark_closed(s, c);
+        return;
+    }
+    account_outbound(s, c, before);
+    s->metrics.frames_out.add();
+    s->metrics.bytes_out.add(before + f->size - c->outq.bytes);
+    if (was_idle && !held && !c->outq.empty()) {
+        note_backlog(s, c);
+        s->metrics.epollout_arms.add();
+        epoll_update_events(s->epfd, c, EPOLLIN, true);
+    }
+}
+
+// Writes what the socket takes of c's queue (epoll engine).
+static void flush_client(Shard *s, Client *c) {
+    if (c->shm) {
+        flush_shm(s, c);
+        return;
+    }
+    size_t before = c->outq.bytes;
+    int flushed = flush_frame_queue(c->fd, c->outq);
+    account_outbound(s, c, before);
+    s->metrics.bytes_out.add(before - c->outq.bytes);
+    if (c->outq.bytes < before) c->tx_progress_ms = s->now_ms;
+    if (flushed < 0) mark_closed(s, c);
+    else if (flushed == 1) epoll_update_events(s->epfd, c, EPOLLIN, false);
+}
+
+// Queues the encoding c speaks, converting it on first use.
+static void deliver(Shard *s, Client *c, WireFrames &w) {
+    Frame *f = wire_frames_get(w, c->wire);
+    if (f) queue_frame(s, c, f);
+}
+
+// Fans w out to this shard's members of channel. Costs O(members), not
+// O(clients): the member array is the only thing walked. Sequenced members
+// get seq_frame, when there is one, ahead of the message.
+static void broadcast_to_channel(Shard *s, const Client *sender, uint32_t channel, WireFrames &w, Frame *seq_frame,
+                                 uint64_t seq) {
+    const std::vector<Client *> *members = s->subs.members(channel);
+    if (!members) return;
+    uint64_t start = monotonic_ns();
+    uint64_t recipients = 0;
+    for (Client *c : *members) {
+        if (c == sender || c->closed) continue;
+        // a resume that raced this message's trip here already replayed it
+        if (seq != 0 && seq <= c->replayed_through) continue;
+        if (seq_frame && c->sequenced) queue_frame(s, c, seq_frame);
+        deliver(s, c, w);
+        ++recipients;
+    }
+    s->metrics.broadcasts.add();
+    s->metrics.fanout.record(recipients);
+    s->metrics.broadcast_ns.record(monotonic_ns() - start);
+}
+
+// Hands references to the frames to every other shard with members in the
+// channel. The doorbell is only rung when a target's inbox goes from empty
+// to non-empty.
+static void forward_to_shards(const Shard *from, uint32_t channel, const WireFrames &w, Frame *seq_frame, uint64_t seq,
+                              const ClientRoute &sender) {
+    for (Shard *s : from->eng->shards) {
+        if (s == from || !from->eng->channels.maybe_present(channel, s->index)) continue;
+        ShardMessage *m = new (std::nothrow) ShardMessage();
+        if (!m) continue;
+        wire_frames_ref(w, &m->frames);
+        if (seq_frame) {
+            frame_ref(seq_frame);
+            m->seq_frame = seq_frame;
+        }
+        m->seq = seq;
+        m->sender = sender;
+        m->channel = channel;
+        m->sent_at = monotonic_ns();
+        if (s->inbox.push(m)) wake_shard(s);
+    }
+}
+
+// Hands w to the inbox of the shard `to` lives on. Safe from any thread.
+static void post_direct(ChatEngine &e, const ClientRoute &to, const WireFrames &w) {
+    if (to.shard < 0 || static_cast<size_t>(to.shard) >= e.shards.size()) return;
+    Shard *target = e.shards[static_cast<size_t>(to.shard)];
+    ShardMessage *m = new (std::nothrow) ShardMessage();
+    if (!m) return;
+    wire_frames_ref(w, &m->frames);
+    m->target = to.token;
+    m->sent_at = monotonic_ns();
+    if (target->inbox.push(m)) wake_shard(target);
+}
+
+// Delivers w to exactly one client, wherever it lives: queued directly when
+// it is on this shard, otherwise through the owning shard's inbox.
+static void send_direct(Shard *s, const ClientRoute &to, WireFrames &w) {
+    s->metrics.unicasts.add();
+    if (to.shard == s->index) {
+        Client *c = s->clients.lookup(to.token);
+        if (c && !c->closed) deliver(s, c, w);
+        return;
+    }
+    post_direct(*s->eng, to, w);
+}
+
+static void publish_to_room(Shard *s, const ClientRoute &sender, uint32_t channel, WireFrames &w);
+
+// While broadcasts are numbered (for resume or the log), one shard numbers
+// all of them and fans each out in that order, so every client sees the
+// numbers rise: with a counter per publishing shard, a message from this
+// shard could reach a client before a lower-numbered one still in transit
+// from another, and a resume after it would skip the other for good.
+// Returns nullptr when broadcasts are not numbered and any shard publishes
+// its own.
+static Shard *sequencer(const ChatEngine &e) {
+    return e.replay_config.msgs > 0 || e.log ? e.shards[0] : nullptr;
+}
+
+// Hands a broadcast to `target` to be numbered and published there. Safe
+// from any thread.
+static void post_publish(Shard *target, const ClientRoute &sender, uint32_t channel, const WireFrames &w) {
+    ShardMessage *m = new (std::nothrow) ShardMessage();
+    if (!m) return;
+    wire_frames_ref(w, &m->frames);
+    m->channel = channel;
+    m->sender = sender;
+    m->publish = true;
+    m->sent_at = monotonic_ns();
+    if (target->inbox.push(m)) wake_shard(target);
+}
+
+// Called on the federation thread: a peer's broadcast is published by the
+// sequencer, or else by the shard its room hashes to, so one room's
+// messages keep their order.
+static void deliver_federated(uint32_t channel, const WireFrames &w, void *ctx) {
+    ChatEngine &e = *static_cast<ChatEngine *>(ctx);
+    Shard *target = sequencer(e);
+    if (!target) target = e.shards[channel % e.shards.size()];
+    post_publish(target, ClientRoute{}, channel, w);
+}
+
+// The client behind route when it lives on s, so a broadcast can skip it
+static const Client *local_client(Shard *s, const ClientRoute &route) {
+    return route.shard == s->index ? s->clients.lookup(route.token) : nullptr;
+}
+
+static Client *add_client(Shard *s, int cfd, const sockaddr_storage &addr);
+#ifdef CHAT_IO_URING
+static void uring_arm_recv(Shard *s, Client *c);
+#endif
+
+// A connected socket from ChatServer::add_client, served like an accepted
+// one. A peer that is already gone (ENOTCONN) is simply closed.
+static void adopt_socket(Shard *s, int fd) {
+    sockaddr_storage addr{};
+    socklen_t alen = sizeof(addr);
+    if (getpeername(fd, reinterpret_cast<sockaddr *>(&addr), &alen) != 0 || set_socket_nonblocking(fd) != 0) {
+        close(fd);
+        return;
+    }
+    Client *c = add_client(s, fd, addr);
+    if (!c) return;
+#ifdef CHAT_IO_URING
+    if (s->ring) {
+        if (!s->quiescing) uring_arm_recv(s, c);
+        return;
+    }
+#endif
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    ev.data.u64 = c->token;
+    epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// The loop rechecks should_terminate on every pass; the event only has to
+// get it out of its wait.
+static void drain_stop(Shard *s) {
+    uint64_t count;
+    ssize_t r = read(s->eng->stop_fd, &count, sizeof(count));
+    (void)r;
+}
+
+static void drain_inbox(Shard *s) {
+    uint64_t count;
+    ssize_t r = read(s->wake_fd, &count, sizeof(count));
+    (void)r;
+    ShardMessage *m = s->inbox.pop_all();
+    while (m) {
+        ShardMessage *next = m->next;
+        s->metrics.inbox_ns.record(monotonic_ns() - m->sent_at);
+        if (m->fd >= 0) {
+            adopt_socket(s, m->fd);
+        } else if (m->target != 0) {
+            // a client that left meanwhile leaves a stale token that misses
+            Client *c = s->clients.lookup(m->target);
+            if (c && !c->closed) deliver(s, c, m->frames);
+        } else if (m->publish) {
+            publish_to_room(s, m->sender, m->channel, m->frames);
+        } else {
+            broadcast_to_channel(s, local_client(s, m->sender), m->channel, m->frames, m->seq_frame, m->seq);
+        }
+        wire_frames_unref(m->frames);
+        if (m->seq_frame) frame_unref(m->seq_frame);
+        delete m;
+        m = next;
+    }
+}
+
+// A new connection owes nothing yet: its first deadline is a ping or the
+// idle limit, whichever comes sooner.
+static void start_deadlines(Shard *s, Client *c) {
+    c->timer.owner = c->token;
+    c->last_rx_ms = c->tx_progress_ms = s->now_ms;
+    const Deadlines &d = s->eng->deadlines;
+    uint64_t first = d.ping_ms;
+    if (d.idle_ms && (first == 0 || d.idle_ms < first)) first = d.idle_ms;
+    if (first) arm_deadline(s, c, s->now_ms + first);
+}
+
+static Client *add_client(Shard *s, int cfd, const sockaddr_storage &addr) {
+    uint64_t token = 0;
+    Client *c = s->clients.acquire(&token);
+    if (!c) { close(cfd); return nullptr; }
+    c->fd = cfd;
+    c->token = token;
+    c->closed = false;
+    if (join_channel(s, c, LOBBY_CHANNEL) != 0) {
+        s->clients.release(token);
+        close(cfd);
+        return nullptr;
+    }
+    s->metrics.accepted.add();
+    start_deadlines(s, c);
+
+    // the address is formatted on the logger thread
+    if (addr.ss_family == AF_INET) {
+        const sockaddr_in *in = reinterpret_cast<const sockaddr_in *>(&addr);
+        log_msg(LOG_INFO, "Client connected: %a (fd=%d, shard=%d)", log_ipv4(in->sin_addr.s_addr, in->sin_port), cfd,
+                s->index);
+    } else {
+        c->local = addr.ss_family == AF_UNIX;
+        log_msg(LOG_INFO, "Client connected: %s (fd=%d, shard=%d)", c->local ? "local" : "unknown", cfd, s->index);
+    }
+    if (c->local) s->metrics.local_accepted.add();
+    return c;
+}
+
+// Accepts from the TCP listener or, on shard 0, the Unix one.
+static void accept_clients(Shard *s, int listen_fd) {
+    for (;;) {
+        sockaddr_storage addr{};
+        socklen_t alen = sizeof(addr);
+        int cfd = accept(listen_fd, reinterpret_cast<sockaddr *>(&addr), &alen);
+        if (cfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_msg(LOG_ERROR, "accept: %e", errno);
+            break;
+        }
+        set_socket_nonblocking(cfd);
+
+        Client *c = add_client(s, cfd, addr);
+        if (!c) continue;
+
+        epoll_event cev{};
+        cev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+        cev.data.u64 = c->token;
+        epoll_ctl(s->epfd, EPOLL_CTL_ADD, cfd, &cev);
+    }
+}
+
+// A successor connected to the handoff socket: every shard stops, and main
+// passes it the sockets once they have (see hand_off).
+static void accept_handoff(Shard *s) {
+    int fd = accept4(s->handoff_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) log_msg(LOG_ERROR, "accept handoff: %e", errno);
+        return;
+    }
+    int none = -1;
+    if (!s->eng->handoff_peer.compare_exchange_strong(none, fd)) {
+        close(fd);
+        return;
+    }
+    log_msg(LOG_INFO, "Handing off to a new server process");
+    s->eng->should_terminate.store(1, std::memory_order_release);
+}
+
+static void answer_discovery(Shard *s) {
+    for (;;) {
+        uint8_t buf[512];
+        sockaddr_in src{};
+        socklen_t slen = sizeof(src);
+        ssize_t r = recvfrom(s->udp_fd, buf, sizeof(buf) - 1, 0, reinterpret_cast<sockaddr *>(&src), &slen);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_msg(LOG_ERROR, "recvfrom: %e", errno);
+            break;
+        }
+        buf[r] = 0;
+        if (r >= static_cast<ssize_t>(std::strlen(DISCOVER_REQUEST)) && std::memcmp(buf, DISCOVER_REQUEST, std::strlen(DISCOVER_REQUEST)) == 0) {
+            char reply[128];
+            int m = std::snprintf(reply, sizeof(reply), "%s %u", DISCOVER_RESPONSE,
+                                  static_cast<unsigned>(s->eng->tcp_port));
+            sendto(s->udp_fd, reply, static_cast<size_t>(m), 0, reinterpret_cast<sockaddr *>(&src), slen);
+        }
+    }
+}
+
+static void append_stat(std::string &out, const char *name, uint64_t v) {
+    char line[128];
+    int n = std::snprintf(line, sizeof(line), "%s %llu\n", name, static_cast<unsigned long long>(v));
+    out.append(line, static_cast<size_t>(n));
+}
+
+static void append_histogram(std::string &out, const char *name, const Histogram &h) {
+    char line[256];
+    int n = std::snprintf(line, sizeof(line), "%s count=%llu p50=%llu p99=%llu p999=%llu max=%llu\n", name,
+                          static_cast<unsigned long long>(h.count()), static_cast<unsigned long long>(h.percentile(0.5)),
+                          static_cast<unsigned long long>(h.percentile(0.99)),
+                          static_cast<unsigned long long>(h.percentile(0.999)), static_cast<unsigned long long>(h.max()));
+    out.append(line, static_cast<size_t>(n));
+}
+
+// Sums every shard's metrics into a plain-text report, one stat per line.
+// Counters are read without stopping the shards, so the snapshot is only
+// approximately consistent across lines.
+static void format_stats(const ChatEngine &e, std::string &out) {
+    uint64_t accepted = 0, disconnected = 0;
+    uint64_t frames_in = 0, bytes_in = 0, frames_out = 0, bytes_out = 0;
+    uint64_t broadcasts = 0, unicasts = 0, epollout_arms = 0, uring_sends = 0;
+    uint64_t streams = 0, spliced_bytes = 0;
+    uint64_t resumes = 0, replayed = 0, replay_gaps = 0;
+    uint64_t pings = 0, idle_timeouts = 0, heartbeat_timeouts = 0, write_timeouts = 0;
+    uint64_t local_accepted = 0, shm_links = 0, shm_doorbells = 0;
+    uint64_t text_rejected = 0, text_sanitized = 0;
+    std::unique_ptr<Histogram> loop_ns(new Histogram());
+    std::unique_ptr<Histogram> batch_size(new Histogram());
+    std::unique_ptr<Histogram> fanout(new Histogram());
+    std::unique_ptr<Histogram> broadcast_ns(new Histogram());
+    std::unique_ptr<Histogram> inbox_ns(new Histogram());
+    for (const Shard *sh : e.shards) {
+        const ShardMetrics &m = sh->metrics;
+        accepted += m.accepted.get();
+        disconnected += m.disconnected.get();
+        frames_in += m.frames_in.get();
+        bytes_in += m.bytes_in.get();
+        frames_out += m.frames_out.get();
+        bytes_out += m.bytes_out.get();
+        broadcasts += m.broadcasts.get();
+        epollout_arms += m.epollout_arms.get();
+        uring_sends += m.uring_sends.get();
+        unicasts += m.unicasts.get();
+        streams += m.streams.get();
+        spliced_bytes += m.spliced_bytes.get();
+        resumes += m.resumes.get();
+        replayed += m.replayed.get();
+        replay_gaps += m.replay_gaps.get();
+        pings += m.pings.get();
+        idle_timeouts += m.idle_timeouts.get();
+        heartbeat_timeouts += m.heartbeat_timeouts.get();
+        write_timeouts += m.write_timeouts.get();
+        local_accepted += m.local_accepted.get();
+        shm_links += m.shm_links.get();
+        shm_doorbells += m.shm_doorbells.get();
+        text_rejected += m.text_rejected.get();
+        text_sanitized += m.text_sanitized.get();
+        loop_ns->merge(m.loop_ns);
+        batch_size->merge(m.batch_size);
+        fanout->merge(m.fanout);
+        broadcast_ns->merge(m.broadcast_ns);
+        inbox_ns->merge(m.inbox_ns);
+    }
+
+    append_stat(out, "clients_connected", accepted - disconnected);
+    append_stat(out, "clients_accepted", accepted);
+    append_stat(out, "local_clients_accepted", local_accepted);
+    append_stat(out, "shm_links", shm_links);
+    append_stat(out, "shm_doorbells", shm_doorbells);
+    append_stat(out, "frames_in", frames_in);
+    append_stat(out, "bytes_in", bytes_in);
+    append_stat(out, "frames_out", frames_out);
+    append_stat(out, "text_rejected", text_rejected);
+    append_stat(out, "text_sanitized", text_sanitized);
+    append_stat(out, "bytes_out", bytes_out);
+    append_stat(out, "broadcasts", broadcasts);
+    append_stat(out, "unicasts", unicasts);
+    append_stat(out, "streams", streams);
+    append_stat(out, "spliced_bytes", spliced_bytes);
+    append_stat(out, "outbuf_bytes_queued", e.outbound_bytes.load(std::memory_order_relaxed));
+    BufferPoolStats pool;
+    buffer_pool_stats(&pool);
+    append_stat(out, "buffer_pool_bytes_in_use", pool.in_use_bytes);
+    append_stat(out, "buffer_pool_bytes_cached", pool.cached_bytes);
+    for (int k = 0; k < BUFFER_POOL_CLASSES; ++k) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "buffer_pool_%zuk_in_use", (BUFFER_POOL_MIN << k) >> 10);
+        append_stat(out, name, pool.in_use[k]);
+        std::snprintf(name, sizeof(name), "buffer_pool_%zuk_cached", (BUFFER_POOL_MIN << k) >> 10);
+        append_stat(out, name, pool.cached[k]);
+    }
+    append_stat(out, "buffer_pool_large_in_use", pool.in_use[BUFFER_POOL_CLASSES]);
+    append_stat(out, "buffer_pool_misses", pool.misses);
+    append_stat(out, "epollout_rearms", epollout_arms);
+    append_stat(out, "uring_sends", uring_sends);
+    append_stat(out, "slow_dropped_oldest", e.slow.dropped_oldest.load(std::memory_order_relaxed));
+    append_stat(out, "slow_dropped_newest", e.slow.dropped_newest.load(std::memory_order_relaxed));
+    append_stat(out, "slow_disconnects", e.slow.disconnects.load(std::memory_order_relaxed));
+    append_stat(out, "last_seq", e.next_seq.load(std::memory_order_relaxed) - 1);
+    append_stat(out, "inherited_clients", e.inherited_clients);
+    append_stat(out, "resumes", resumes);
+    append_stat(out, "replayed_frames", replayed);
+    append_stat(out, "replay_gaps", replay_gaps);
+    if (e.log) {
+        const LogMetrics &lm = e.log->metrics();
+        append_stat(out, "log_records", lm.records.get());
+        append_stat(out, "log_bytes", lm.bytes.get());
+        append_stat(out, "log_syncs", lm.syncs.get());
+        append_stat(out, "log_dropped", lm.dropped.load(std::memory_order_relaxed));
+        append_stat(out, "history_queries", lm.queries.get());
+    }
+    if (e.federation) {
+        const FederationMetrics &fm = e.federation->metrics();
+        append_stat(out, "fed_node_id", e.federation->node_id());
+        append_stat(out, "fed_links", fm.links.load(std::memory_order_relaxed));
+        append_stat(out, "fed_links_up", fm.links_up.get());
+        append_stat(out, "fed_links_down", fm.links_down.get());
+        append_stat(out, "fed_link_overflows", fm.overflows.get());
+        append_stat(out, "fed_records_sent", fm.sent.get());
+        append_stat(out, "fed_batches_sent", fm.batches.get());
+        append_stat(out, "fed_bytes_out", fm.bytes_out.get());
+        append_stat(out, "fed_bytes_in", fm.bytes_in.get());
+        append_stat(out, "fed_records_received", fm.received.get());
+        append_stat(out, "fed_duplicates", fm.duplicates.get());
+        append_stat(out, "fed_dropped", fm.dropped.load(std::memory_order_relaxed));
+    }
+    LoggerStats ls;
+    logger_stats(&ls);
+    append_stat(out, "logger_lines", ls.lines);
+    append_stat(out, "logger_dropped", ls.dropped);
+    append_stat(out, "pings_sent", pings);
+    append_stat(out, "idle_timeouts", idle_timeouts);
+    append_stat(out, "heartbeat_timeouts", heartbeat_timeouts);
+    append_stat(out, "write_timeouts", write_timeouts);
+    append_histogram(out, "loop_ns", *loop_ns);
+    append_histogram(out, "event_batch", *batch_size);
+    append_histogram(out, "fanout", *fanout);
+    append_histogram(out, "broadcast_ns", *broadcast_ns);
+    append_histogram(out, "inbox_delay_ns", *inbox_ns);
+    if (e.log) {
+        append_histogram(out, "log_batch", e.log->metrics().batch);
+        append_histogram(out, "log_sync_ns", e.log->metrics().sync_ns);
+    }
+    if (e.federation) append_histogram(out, "fed_batch", e.federation->metrics().batch);
+    for (const Shard *sh : e.shards) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "shard%d_clients", sh->index);
+        append_stat(out, name, sh->metrics.accepted.get() - sh->metrics.disconnected.get());
+    }
+}
+
+// Every connection to the stats listener gets one report and is closed; the
+// report is small enough to fit the socket buffer in a single write.
+static void serve_stats(Shard *s) {
+    for (;;) {
+        int cfd = accept(s->stats_fd, nullptr, nullptr);
+        if (cfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_msg(LOG_ERROR, "accept stats: %e", errno);
+            break;
+        }
+        set_socket_nonblocking(cfd);
+        std::string report;
+        format_stats(*s->eng, report);
+        write_fully_nonblocking(cfd, reinterpret_cast<const uint8_t *>(report.data()), report.size());
+        close(cfd);
+    }
+}
+
+// Server notices go only to c, as a V2_NOTICE or a plain v1 message.
+static void send_notice(Shard *s, Client *c, const std::string &text) {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(text.data());
+    uint32_t len = static_cast<uint32_t>(text.size());
+    Frame *f = c->wire == WIRE_V2 ? frame_encode_v2(V2_NOTICE, p, len) : frame_encode(p, len);
+    if (!f) return;
+    queue_frame(s, c, f);
+    frame_unref(f);
+}
+
+// Applies --text-policy to one message c sent, in the frame just encoded
+// from it: the check reads bytes the copy left in cache, and sanitizing
+// edits them in place. Returns false when the message must be dropped.
+static bool police_text(Shard *s, Client *c, uint8_t *p, uint32_t len) {
+    if (s->eng->text_policy == TextPolicy::Pass || text_is_clean(p, len)) return true;
+    if (s->eng->text_policy == TextPolicy::Reject) {
+        s->metrics.text_rejected.add();
+        send_notice(s, c, "* message dropped: it is not UTF-8 text or holds control characters");
+        return false;
+    }
+    text_sanitize(p, len);
+    s->metrics.text_sanitized.add();
+    return true;
+}
+
+// The same for a V2_MSG or V2_BATCH body; one bad message drops a whole
+// batch, which is relayed as a single frame
+static bool police_v2_text(Shard *s, Client *c, uint8_t type, uint8_t *body, uint32_t len) {
+    if (s->eng->text_policy == TextPolicy::Pass) return true;
+    if (type == V2_MSG) return police_text(s, c, body, len);
+    uint32_t off = 0;
+    const uint8_t *m = nullptr;
+    uint32_t mlen = 0;
+    while (v2_batch_next(body, len, &off, &m, &mlen) == 1) {
+        if (!police_text(s, c, body + (m - body), mlen)) return false;
+    }
+    return true;
+}
+
+// Room names and nicks are 1..max_len printable bytes without spaces.
+static bool parse_name(const uint8_t *p, uint32_t len, size_t max_len, std::string *out) {
+    if (len == 0 || len > max_len) return false;
+    for (uint32_t i = 0; i < len; ++i) {
+        if (p[i] <= ' ' || p[i] == 0x7f) return false;
+    }
+    out->assign(reinterpret_cast<const char *>(p), len);
+    return true;
+}
+
+// A leading '#' on a room name is accepted and dropped.
+static bool parse_channel_name(const uint8_t *p, uint32_t len, std::string *out) {
+    if (len > 0 && p[0] == '#') { ++p; --len; }
+    return parse_name(p, len, MAX_CHANNEL_NAME, out);
+}
+
+static bool has_prefix(const uint8_t *p, uint32_t len, const char *prefix) {
+    size_t n = std::strlen(prefix);
+    return len >= n && std::memcmp(p, prefix, n) == 0;
+}
+
+// Reclaim keys travel as 16 hex digits
+static bool parse_nick_key(const uint8_t *p, uint32_t len, uint64_t *out) {
+    if (len != 16) return false;
+    uint64_t v = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+        uint8_t ch = p[i];
+        if (ch >= '0' && ch <= '9') v = v << 4 | static_cast<uint64_t>(ch - '0');
+        else if (ch >= 'a' && ch <= 'f') v = v << 4 | static_cast<uint64_t>(ch - 'a' + 10);
+        else return false;
+    }
+    *out = v;
+    return true;
+}
+
+static void send_nick_bound(Shard *s, Client *c) {
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(c->nick_key));
+    send_notice(s, c, "* you are now " + c->nick + " (reclaim key " + key + ")");
+}
+
+// Binds the connection's identity: "NAME", or "NAME KEY" to take back a
+// nick from a connection of the same client that the server still holds
+// (a reconnect that beat the old socket's teardown). KEY is the reclaim key
+// issued with the earlier bind; without it a nick another connection holds
+// is refused. Every bind issues a new key.
+static void set_nick(Shard *s, Client *c, const uint8_t *p, uint32_t len) {
+    uint32_t name_len = 0;
+    while (name_len < len && p[name_len] != ' ') ++name_len;
+    std::string nick;
+    uint64_t key = 0;
+    if (!parse_name(p, name_len, MAX_NICK, &nick) ||
+        (name_len < len && !parse_nick_key(p + name_len + 1, len - name_len - 1, &key))) {
+        send_notice(s, c, "* usage: /nick NAME [RECLAIM_KEY]");
+        return;
+    }
+    ClientRoute self{ s->index, c->token };
+    ClientRoute bound;
+    if (nick == c->nick && s->eng->nicks.find(nick, &bound) && bound == self) {
+        send_nick_bound(s, c);
+        return;
+    }
+    uint64_t new_key = nick_key_new();
+    ClientRoute prev;
+    bool reclaimed = key != 0 && s->eng->nicks.reclaim(nick, self, key, new_key, &prev) == 0;
+    if (!reclaimed && s->eng->nicks.bind(nick, self, new_key) != 0) {
+        send_notice(s, c, "* nick " + nick + " is taken");
+        return;
+    }
+    if (!c->nick.empty() && c->nick != nick) s->eng->nicks.unbind(c->nick, self);
+    c->nick = nick;
+    c->nick_key = new_key;
+    if (reclaimed && !(prev == self)) {
+        std::string text = "* your nick " + nick + " was reclaimed by a new connection";
+        WireFrames w;
+        w.v[WIRE_V1] = frame_encode(reinterpret_cast<const uint8_t *>(text.data()), static_cast<uint32_t>(text.size()));
+        if (w.v[WIRE_V1]) send_direct(s, prev, w);
+        wire_frames_unref(w);
+    }
+    send_nick_bound(s, c);
+}
+
+// c's nick, or an empty one when it was reclaimed by another connection of
+// the same client: the old one must not speak under it any more.
+static const std::string &held_nick(Shard *s, Client *c) {
+    ClientRoute self;
+    if (!c->nick.empty() && (!s->eng->nicks.find(c->nick, &self) || !(self == ClientRoute{ s->index, c->token }))) {
+        c->nick.clear();
+        c->nick_key = 0;
+    }
+    return c->nick;
+}
+
+// A direct message goes to exactly one connection: one hash lookup and one
+// queued frame, however many clients are connected.
+static void send_private(Shard *s, Client *c, const uint8_t *to_p, uint32_t to_len, const uint8_t *text, uint32_t text_len) {
+    if (held_nick(s, c).empty()) {
+        send_notice(s, c, "* set a nick with /nick NAME first");
+        return;
+    }
+    std::string to;
+    if (!parse_name(to_p, to_len, MAX_NICK, &to)) {
+        send_notice(s, c, "* usage: /msg NICK TEXT");
+        return;
+    }
+    ClientRoute route;
+    if (!s->eng->nicks.find(to, &route)) {
+        send_notice(s, c, "* no such nick: " + to);
+        return;
+    }
+    const std::string prefix = "[" + c->nick + "] ";
+    if (prefix.size() + text_len > MAX_MESSAGE_SIZE) {
+        send_notice(s, c, "* message too long");
+        return;
+    }
+    WireFrames w;
+    Frame *f = frame_alloc(4 + prefix.size() + text_len);
+    if (!f) return;
+    uint32_t nlen = htonl(static_cast<uint32_t>(prefix.size() + text_len));
+    std::memcpy(f->data(), &nlen, 4);
+    std::memcpy(f->data() + 4, prefix.data(), prefix.size());
+    std::memcpy(f->data() + 4 + prefix.size(), text, text_len);
+    if (!police_text(s, c, f->data() + 4 + prefix.size(), text_len)) {
+        frame_unref(f);
+        return;
+    }
+    w.v[WIRE_V1] = f;
+    send_direct(s, route, w);
+    wire_frames_unref(w);
+}
+
+static void join_room(Shard *s, Client *c, const uint8_t *p, uint32_t len) {
+    std::string name;
+    if (!parse_channel_name(p, len, &name)) {
+        send_notice(s, c, "* invalid channel name");
+        return;
+    }
+    uint32_t id = s->eng->channels.intern(name);
+    if (id == NO_CHANNEL || join_channel(s, c, id) != 0) {
+        send_notice(s, c, "* cannot join #" + name);
+        return;
+    }
+    c->channel = id;
+    send_notice(s, c, "* now talking in #" + name);
+}
+
+// Leaves the named room, or the current one when len is 0.
+static void leave_room(Shard *s, Client *c, const uint8_t *p, uint32_t len) {
+    std::string name;
+    if (len == 0) {
+        if (c->channel == NO_CHANNEL) return;
+        name = s->eng->channels.name(c->channel);
+    } else if (!parse_channel_name(p, len, &name)) {
+        send_notice(s, c, "* invalid channel name");
+        return;
+    }
+    uint32_t id = s->eng->channels.find(name);
+    if (id != NO_CHANNEL) leave_channel(s, c, id);
+    // keep talking in whatever room is left, if any
+    if (c->channel == id) c->channel = c->channels.empty() ? NO_CHANNEL : c->channels.back().channel;
+    if (c->channel == NO_CHANNEL) send_notice(s, c, "* left #" + name + ", not in any channel");
+    else send_notice(s, c, "* left #" + name + ", now talking in #" + s->eng->channels.name(c->channel));
+}
+
+// Asks the log for up to limit of the newest messages in c's current room
+// logged within [from_ms, to_ms]; the answer arrives through c's inbox.
+static void request_history(Shard *s, Client *c, uint32_t limit, uint64_t from_ms, uint64_t to_ms) {
+    if (!s->eng->log) {
+        send_notice(s, c, "* history is not enabled on this server");
+        return;
+    }
+    if (c->channel == NO_CHANNEL) {
+        send_notice(s, c, "* not in a room");
+        return;
+    }
+    HistoryQuery q;
+    q.shard = s->index;
+    q.token = c->token;
+    q.channel = c->channel;
+    q.limit = limit == 0 ? DEFAULT_HISTORY : limit > MAX_HISTORY ? MAX_HISTORY : limit;
+    q.from_ms = from_ms;
+    q.to_ms = to_ms;
+    s->eng->log->query(q);
+}
+
+// Runs on the log thread: copies each match out of its mapped segment into a
+// frame of its own, posts it to the asking client, and ends with V2_HISTORY
+// (a notice for v1) carrying the count.
+static void deliver_history(const HistoryQuery &q, const std::vector<LogRecord> &records, void *ctx) {
+    ChatEngine &e = *static_cast<ChatEngine *>(ctx);
+    ClientRoute to{ q.shard, q.token };
+    for (const LogRecord &r : records) {
+        WireFrames w;
+        w.v[r.wire] = frame_alloc(r.size);
+        if (!w.v[r.wire]) break;
+        std::memcpy(w.v[r.wire]->data(), r.frame, r.size);
+        post_direct(e, to, w);
+        wire_frames_unref(w);
+    }
+    WireFrames end;
+    uint8_t body[10];
+    end.v[WIRE_V2] = frame_encode_v2(V2_HISTORY, body, static_cast<uint32_t>(varint_put(records.size(), body)));
+    std::string text = "* end of history (" + std::to_string(records.size()) + " messages)";
+    end.v[WIRE_V1] = frame_encode(reinterpret_cast<const uint8_t *>(text.data()), static_cast<uint32_t>(text.size()));
+    post_direct(e, to, end);
+    wire_frames_unref(end);
+}
+
+// v1 has no frame types, so control messages are text: "/join NAME",
+// "/leave [NAME]", "/nick NAME [KEY]" and "/msg NICK TEXT". Returns false when
+// the payload is not one, so it is broadcast as chat.
+static bool handle_control(Shard *s, Client *c, const uint8_t *p, uint32_t len) {
+    if (has_prefix(p, len, "/nick ")) {
+        set_nick(s, c, p + 6, len - 6);
+    } else if (has_prefix(p, len, "/msg ")) {
+        uint32_t sp = 5;
+        while (sp < len && p[sp] != ' ') ++sp;
+        if (sp == len) send_notice(s, c, "* usage: /msg NICK TEXT");
+        else send_private(s, c, p + 5, sp - 5, p + sp + 1, len - sp - 1);
+    } else if (has_prefix(p, len, "/join ")) {
+        join_room(s, c, p + 6, len - 6);
+    } else if (len == 6 && has_prefix(p, len, "/leave")) {
+        leave_room(s, c, nullptr, 0);
+    } else if (has_prefix(p, len, "/leave ")) {
+        leave_room(s, c, p + 7, len - 7);
+    } else if (len == 8 && has_prefix(p, len, "/history")) {
+        request_history(s, c, DEFAULT_HISTORY, 0, 0);
+    } else if (has_prefix(p, len, "/history ")) {
+        std::string n(reinterpret_cast<const char *>(p + 9), len - 9);
+        request_history(s, c, static_cast<uint32_t>(strtoul(n.c_str(), nullptr, 10)), 0, 0);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static Frame *encode_seq(uint64_t seq) {
+    uint8_t body[10];
+    return frame_encode_v2(V2_SEQ, body, static_cast<uint32_t>(varint_put(seq, body)));
+}
+
+// Sends a message (or batch) to a room on every shard, stamped with the
+// next sequence number, kept in the replay ring and handed to the durable
+// log. Runs on the sequencer while there is one. sender, when there is
+// one, does not get its own message back.
+static void publish_to_room(Shard *s, const ClientRoute &sender, uint32_t channel, WireFrames &w) {
+    Frame *seq_frame = nullptr;
+    uint64_t seq = 0;
+    if (s->replay.enabled() || s->eng->log) {
+        seq = s->eng->next_seq.fetch_add(1, std::memory_order_relaxed);
+        if (s->eng->log) s->eng->log->append(seq, channel, w);
+        if (s->replay.enabled()) {
+            seq_frame = encode_seq(seq);
+            if (seq_frame) s->replay.append(seq, channel, seq_frame, w);
+        }
+    }
+    broadcast_to_channel(s, local_client(s, sender), channel, w, seq_frame, seq);
+    forward_to_shards(s, channel, w, seq_frame, seq, sender);
+    if (seq_frame) frame_unref(seq_frame);
+}
+
+// Publishes what c sent to its current room, here and on every federation
+// peer. Broadcasts that came from a peer are published without going back
+// out (see deliver_federated).
+static void publish(Shard *s, Client *c, WireFrames &w) {
+    ClientRoute from{ s->index, c->token };
+    Shard *seq = sequencer(*s->eng);
+    if (seq && seq != s) post_publish(seq, from, c->channel, w);
+    else publish_to_room(s, from, c->channel, w);
+    if (s->eng->federation) s->eng->federation->forward(c->channel, w);
+}
+
+// V2_RESUME: numbers c's broadcasts from now on and replays what it missed,
+// i.e. every retained broadcast after `after` in the rooms it is in now, in
+// sequence order. The reply goes first and names the sequence number the
+// replay is complete from; anything between `after` and that number was
+// already evicted. Broadcasts still on their way from the sequencer that
+// the replay covered are skipped when they arrive.
+static int resume_client(Shard *s, Client *c, const uint8_t *body, uint32_t len) {
+    uint64_t after = 0;
+    size_t used = 0;
+    if (varint_get(body, len, 10, &after, &used) != 1 || used != len) return -1;
+    c->sequenced = true;
+    s->metrics.resumes.add();
+
+    std::vector<ReplayEntry> missed;
+    uint64_t complete = after;
+    auto member = [c](uint32_t channel) {
+        for (const ChannelMembership &cm : c->channels) {
+            if (cm.channel == channel) return true;
+        }
+        return false;
+    };
+    Shard *seq = sequencer(*s->eng);
+    try {
+        uint64_t evicted = seq ? seq->replay.collect(after, member, missed) : 0;
+        if (evicted > complete) complete = evicted;
+    } catch (...) {
+        // out of memory: whatever was gathered is still replayed in order
+    }
+    if (!missed.empty() && missed.back().seq > c->replayed_through) c->replayed_through = missed.back().seq;
+    if (complete > after) s->metrics.replay_gaps.add();
+
+    uint8_t reply[10];
+    Frame *f = frame_encode_v2(V2_RESUME, reply, static_cast<uint32_t>(varint_put(complete, reply)));
+    if (f) {
+        queue_frame(s, c, f);
+        frame_unref(f);
+    }
+    for (ReplayEntry &e : missed) {
+        if (!c->closed) {
+            // only messages from v1 senders lack a v2 encoding
+            Frame *msg = e.frames.v[WIRE_V2];
+            Frame *converted = msg ? nullptr : frame_v1_to_v2(e.frames.v[WIRE_V1]);
+            if (converted) msg = converted;
+            if (msg) {
+                queue_frame(s, c, e.seq_frame);
+                queue_frame(s, c, msg);
+                s->metrics.replayed.add();
+            }
+            if (converted) frame_unref(converted);
+        }
+        replay_entry_unref(e);
+    }
+    return 0;
+}
+
+static uint32_t process_input_v1(Shard *s, Client *c, uint32_t max_frames) {
+    uint32_t done = 0;
+    while (done < max_frames) {
+        uint32_t mlen = 0;
+        int hr = has_complete_frame(c->inbuf, &mlen);
+        if (hr == -2) { mark_closed(s, c); break; }
+        if (hr != 1) break;
+        const uint8_t *payload = nullptr;
+        get_frame_view(c->inbuf, &payload, &mlen);
+        ++done;
+        s->metrics.frames_in.add();
+        s->metrics.bytes_in.add(4 + mlen);
+        if (mlen > 0 && payload[0] == '/' && handle_control(s, c, payload, mlen)) {
+            c->inbuf.consume(4 + mlen);
+            continue;
+        }
+        if (c->channel == NO_CHANNEL) {
+            c->inbuf.consume(4 + mlen);
+            continue;
+        }
+        // encoded once, shared by every recipient on every shard
+        WireFrames w;
+        w.v[WIRE_V1] = frame_encode(payload, mlen);
+        c->inbuf.consume(4 + mlen);
+        if (w.v[WIRE_V1] && police_text(s, c, w.v[WIRE_V1]->data() + 4, mlen)) publish(s, c, w);
+        wire_frames_unref(w);
+    }
+    return done;
+}
+
+// Streamed transfers
+
+static Frame *encode_stream_abort(uint64_t id) {
+    uint8_t body[10];
+    Frame *f = frame_encode_v2(V2_STREAM_ABORT, body, static_cast<uint32_t>(varint_put(id, body)));
+    if (f) f->pinned = true;
+    return f;
+}
+
+// Sends a transfer frame to its recipient or room. Stream frames have no v1
+// form, so v1 members are skipped. They are pinned: a slow recipient holds
+// up the sender's window rather than losing chunks.
+static void send_stream_frame(Shard *s, Client *c, const Transfer &x, Frame *f) {
+    f->pinned = true;
+    WireFrames w;
+    frame_ref(f);
+    w.v[WIRE_V2] = f;
+    if (x.to.token != 0) {
+        send_direct(s, x.to, w);
+    } else if (x.channel != NO_CHANNEL) {
+        broadcast_to_channel(s, c, x.channel, w, nullptr, 0);
+        forward_to_shards(s, x.channel, w, nullptr, 0, ClientRoute{});
+    }
+    wire_frames_unref(w);
+}
+
+// Writes out dst's staged chunk. Returns 1 once nothing is staged, 0 when
+// dst is full (EPOLLOUT armed) and -1 after closing dst on error.
+static int relay_flush(Shard *s, Client *dst) {
+    size_t before = dst->relay->staged();
+    int r = dst->relay->drain(dst->fd);
+    size_t sent = before - dst->relay->staged();
+    s->metrics.bytes_out.add(sent);
+    s->metrics.spliced_bytes.add(sent);
+    if (sent > 0) dst->tx_progress_ms = s->now_ms;
+    if (r < 0) {
+        mark_closed(s, dst);
+    } else if (r == 0) {
+        if (s->eng->deadlines.write_ms) arm_deadline(s, dst, dst->tx_progress_ms + s->eng->deadlines.write_ms);
+        s->metrics.epollout_arms.add();
+        epoll_update_events(s->epfd, dst, EPOLLIN, true);
+    }
+    return r;
+}
+
+// Retires dst's relay once nothing is staged, telling dst when the sender
+// left before sending everything, and resumes its normal queue.
+static void relay_finish(Shard *s, Client *dst, bool aborted) {
+    uint64_t id = dst->relay->id;
+    dst->relay.reset();
+    if (aborted) {
+        Frame *f = encode_stream_abort(id);
+        if (f) {
+            queue_frame(s, dst, f);
+            frame_unref(f);
+        }
+    }
+    if (!dst->outq.empty()) flush_client(s, dst);
+}
+
+// Ends c's outgoing transfer, when its last byte is relayed or because c
+// is leaving. Recipients of an unfinished one get a STREAM_ABORT.
+static void end_transfer(Shard *s, Client *c) {
+    Transfer &x = *c->xfer;
+    Client *dst = x.splice_to ? s->clients.lookup(x.splice_to) : nullptr;
+    if (dst && dst->relay && dst->relay->src == c->token) {
+        if (dst->relay->pending()) {
+            // the staged chunk is still owed to dst; its EPOLLOUT retires the relay
+            dst->relay->src = 0;
+            dst->relay->complete = x.remaining == 0;
+        } else {
+            relay_finish(s, dst, x.remaining > 0);
+        }
+    } else if (x.remaining > 0) {
+        Frame *f = encode_stream_abort(x.id);
+        if (f) {
+            send_stream_frame(s, c, x, f);
+            frame_unref(f);
+        }
+    }
+    c->xfer.reset();
+}
+
+// V2_STREAM: announces the transfer to its recipients, then c's input is
+// raw bytes until `size` of them have been relayed. A malformed header
+// returns -1; a missing recipient only earns a notice, and the bytes that
+// follow are read and dropped.
+static int start_transfer(Shard *s, Client *c, const uint8_t *body, uint32_t len) {
+    uint64_t size = 0, to_len = 0;
+    size_t used = 0, to_used = 0;
+    if (varint_get(body, len, 10, &size, &used) != 1) return -1;
+    if (varint_get(body + used, len - used, 2, &to_len, &to_used) != 1 || to_len > len - used - to_used) return -1;
+    const uint8_t *to_p = body + used + to_used;
+    const uint8_t *name = to_p + to_len;
+    uint32_t name_len = static_cast<uint32_t>(len - used - to_used - to_len);
+    if (name_len > V2_MAX_STREAM_NAME) return -1;
+
+    std::unique_ptr<Transfer> x(new (std::nothrow) Transfer());
+    if (!x) return -1;
+    x->id = s->eng->next_stream.fetch_add(1, std::memory_order_relaxed);
+    x->remaining = size;
+    std::string target;
+    if (to_len == 0) {
+        x->channel = c->channel;
+        if (c->channel == NO_CHANNEL) send_notice(s, c, "* not in any channel, transfer dropped");
+        else target = "#" + s->eng->channels.name(c->channel);
+    } else if (!parse_name(to_p, static_cast<uint32_t>(to_len), MAX_NICK, &target)) {
+        send_notice(s, c, "* invalid nick, transfer dropped");
+    } else if (!s->eng->nicks.find(target, &x->to)) {
+        send_notice(s, c, "* no such nick: " + target + ", transfer dropped");
+        target.clear();
+    }
+
+    // splicing moves socket bytes; shared-memory clients have none
+    bool can_splice = size > 0 && x->to.token != 0 && x->to.shard == s->index && !c->shm;
+#ifdef CHAT_IO_URING
+    // the io_uring engine owns every socket read; its transfers are copied
+    if (s->ring) can_splice = false;
+#endif
+    if (can_splice) {
+        Client *dst = s->clients.lookup(x->to.token);
+        if (dst && dst != c && !dst->closed && dst->wire == WIRE_V2 && !dst->relay && !dst->shm) {
+            std::unique_ptr<SpliceRelay> relay(new (std::nothrow) SpliceRelay());
+            if (relay && relay->open(x->id, c->token) == 0) {
+                dst->relay = std::move(relay);
+                x->splice_to = dst->token;
+            }
+        }
+    }
+
+    if (!target.empty()) {
+        held_nick(s, c);
+        std::vector<uint8_t> out(30 + c->nick.size() + name_len);
+        size_t n = varint_put(x->id, out.data());
+        n += varint_put(size, out.data() + n);
+        n += varint_put(c->nick.size(), out.data() + n);
+        std::memcpy(out.data() + n, c->nick.data(), c->nick.size());
+        n += c->nick.size();
+        std::memcpy(out.data() + n, name, name_len);
+        n += name_len;
+        Frame *f = frame_encode_v2(V2_STREAM, out.data(), static_cast<uint32_t>(n));
+        if (f) {
+            send_stream_frame(s, c, *x, f);
+            frame_unref(f);
+        }
+        s->metrics.streams.add();
+        send_notice(s, c, "* sending " + std::to_string(size) + " bytes to " + target);
+    }
+    if (size > 0) c->xfer = std::move(x);
+    return 0;
+}
+
+// Relays transfer bytes already read into inbuf as one STREAM_DATA chunk.
+static void relay_buffered(Shard *s, Client *c) {
+    Transfer &x = *c->xfer;
+    size_t n = c->inbuf.length < V2_STREAM_CHUNK ? c->inbuf.length : V2_STREAM_CHUNK;
+    if (n > x.remaining) n = static_cast<size_t>(x.remaining);
+    uint8_t idbuf[10];
+    size_t idlen = varint_put(x.id, idbuf);
+    uint8_t hdr[V2_MAX_HEADER];
+    size_t hlen = v2_put_header(V2_STREAM_DATA, static_cast<uint32_t>(idlen + n), hdr);
+    bool routed = x.to.token != 0 || x.channel != NO_CHANNEL;
+    Frame *f = routed ? frame_alloc(hlen + idlen + n) : nullptr;
+    if (f) {
+        std::memcpy(f->data(), hdr, hlen);
+        std::memcpy(f->data() + hlen, idbuf, idlen);
+        c->inbuf.peek(0, f->data() + hlen + idlen, n);
+    }
+    c->inbuf.consume(n);
+    x.remaining -= n;
+    s->metrics.bytes_in.add(n);
+    if (f) {
+        send_stream_frame(s, c, x, f);
+        x.window[x.window_len++] = f; // our reference now tracks the chunk
+    } else if (routed) {
+        // a chunk we could not copy is gone, so the recipients must not
+        // take what follows for the whole payload; the rest is dropped
+        Frame *abort = encode_stream_abort(x.id);
+        if (abort) {
+            send_stream_frame(s, c, x, abort);
+            frame_unref(abort);
+        }
+        x.to = ClientRoute{};
+        x.channel = NO_CHANNEL;
+        send_notice(s, c, "* out of memory, transfer aborted");
+    }
+    if (x.remaining == 0) end_transfer(s, c);
+}
+
+// One turn of a spliced transfer, run for its sender. Returns -1 when it
+// has to wait (sender drained or recipient full), 0 when it wants another
+// turn and 1 once the transfer is over and c's input is frames again.
+static int relay_turn(Shard *s, Client *c) {
+    Transfer &x = *c->xfer;
+    Client *dst = s->clients.lookup(x.splice_to);
+    if (!dst || dst->closed || !dst->relay || dst->relay->src != c->token) {
+        // the recipient left: the rest is read and dropped like any
+        // undeliverable chunk
+        x.splice_to = 0;
+        return 0;
+    }
+    size_t budget = s->eng->sched.read_budget;
+    while (x.remaining > 0) {
+        if (relay_flush(s, dst) <= 0) return -1;
+        // the recipient's other frames go out between chunks
+        if (!dst->outq.empty()) {
+            flush_client(s, dst);
+            if (dst->closed || !dst->outq.empty()) return -1;
+        }
+        if (budget == 0) return 0;
+        size_t want = x.remaining < budget ? static_cast<size_t>(x.remaining) : budget;
+        ssize_t n = dst->relay->fill(c->fd, want);
+        if (n == 0) {
+            c->readable = false;
+            return -1;
+        }
+        if (n < 0) {
+            // the sender hung up or failed mid-transfer
+            mark_closed(s, c);
+            return -1;
+        }
+        x.remaining -= static_cast<uint64_t>(n);
+        budget -= static_cast<size_t>(n);
+        // a fill follows a fully drained chunk, so the stall clock restarts
+        c->last_rx_ms = dst->tx_progress_ms = s->now_ms;
+        s->metrics.bytes_in.add(static_cast<uint64_t>(n));
+    }
+    relay_flush(s, dst);
+    end_transfer(s, c);
+    return 1;
+}
+
+// EPOLLOUT for a client receiving a spliced transfer: finish the staged
+// chunk, then hand the turn back to the sender.
+static void relay_resume(Shard *s, Client *dst) {
+    if (relay_flush(s, dst) <= 0) return;
+    SpliceRelay &r = *dst->relay;
+    if (r.src == 0) {
+        relay_finish(s, dst, !r.complete);
+        return;
+    }
+    if (!dst->outq.empty()) flush_client(s, dst);
+    Client *src = s->clients.lookup(r.src);
+    if (src && !src->closed) schedule_input(s, src);
+}
+
+// Handles one complete v2 frame whose body is in view. Returns how many
+// chat messages it carried, or -1 on a protocol error.
+static int handle_v2_frame(Shard *s, Client *c, uint8_t type, const uint8_t *body, uint32_t len, uint32_t hdr_len) {
+    switch (type) {
+    case V2_MSG:
+    case V2_BATCH: {
+        uint32_t count = 1;
+        if (type == V2_MSG) {
+            if (len > MAX_MESSAGE_SIZE) return -1;
+        } else {
+            // validate every entry before relaying the batch untouched
+            uint32_t off = 0;
+            const uint8_t *m = nullptr;
+            uint32_t mlen = 0;
+            int r;
+            count = 0;
+            while ((r = v2_batch_next(body, len, &off, &m, &mlen)) == 1) ++count;
+            if (r < 0) return -1;
+            if (count == 0) return 0;
+        }
+        if (c->channel == NO_CHANNEL) return static_cast<int>(count);
+        // v2 recipients get the sender's frame as is; v1 ones a converted copy
+        WireFrames w;
+        w.v[WIRE_V2] = frame_alloc(hdr_len + len);
+        if (w.v[WIRE_V2]) {
+            c->inbuf.peek(0, w.v[WIRE_V2]->data(), hdr_len + len);
+            if (police_v2_text(s, c, type, w.v[WIRE_V2]->data() + hdr_len, len)) publish(s, c, w);
+        }
+        wire_frames_unref(w);
+        return static_cast<int>(count);
+    }
+    case V2_JOIN:
+        join_room(s, c, body, len);
+        return 0;
+    case V2_LEAVE:
+        leave_room(s, c, body, len);
+        return 0;
+    case V2_NICK:
+        set_nick(s, c, body, len);
+        return 0;
+    case V2_DIRECT: {
+        uint64_t nick_len = 0;
+        size_t used = 0;
+        if (varint_get(body, len, 2, &nick_len, &used) != 1 || nick_len > len - used) return -1;
+        send_private(s, c, body + used, static_cast<uint32_t>(nick_len), body + used + nick_len,
+                     static_cast<uint32_t>(len - used - nick_len));
+        return 0;
+    }
+    case V2_STREAM:
+        return start_transfer(s, c, body, len);
+    case V2_PING: {
+        Frame *f = frame_encode_v2(V2_PONG, nullptr, 0);
+        if (f) {
+            queue_frame(s, c, f);
+            frame_unref(f);
+        }
+        return 0;
+    }
+    case V2_PONG:
+        return 0; // arriving at all is what counts
+    case V2_RESUME:
+        return resume_client(s, c, body, len);
+    case V2_HISTORY: {
+        uint64_t v[3] = { 0, 0, 0 };
+        size_t off = 0;
+        for (uint64_t &x : v) {
+            size_t used = 0;
+            if (varint_get(body + off, len - off, 10, &x, &used) != 1) return -1;
+            off += used;
+        }
+        if (off != len) return -1;
+        request_history(s, c, v[0] > MAX_HISTORY ? MAX_HISTORY : static_cast<uint32_t>(v[0]), v[1], v[2]);
+        return 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+static uint32_t process_input_v2(Shard *s, Client *c, uint32_t max_frames) {
+    uint32_t done = 0;
+    while (done < max_frames) {
+        if (c->xfer) {
+            // mid-transfer the input is raw bytes, not frames; a spliced
+            // transfer only finds here what was read before it started
+            if (c->inbuf.length == 0 || !c->xfer->window_open()) break;
+            relay_buffered(s, c);
+            ++done;
+            continue;
+        }
+        uint8_t type = 0;
+        uint32_t len = 0, hdr_len = 0;
+        int hr = v2_has_complete_frame(c->inbuf, &type, &len, &hdr_len);
+        if (hr == -2) { mark_closed(s, c); break; }
+        if (hr != 1) break;
+        s->metrics.frames_in.add();
+        s->metrics.bytes_in.add(hdr_len + len);
+        int n = handle_v2_frame(s, c, type, buffer_view(c->inbuf, hdr_len, len), len, hdr_len);
+        c->inbuf.consume(hdr_len + len);
+        if (n < 0) { mark_closed(s, c); break; }
+        // a batch is charged for every message it carries
+        done += n > 0 ? static_cast<uint32_t>(n) : 1;
+    }
+    return done;
+}
+
+// Sends SHM_ACCEPT and the link's fds on c's socket.
+static int send_shm_accept(int fd, const ShmLink &link, int memfd) {
+    int fds[3] = { memfd, link.server_bell, link.client_bell };
+    iovec iov;
+    iov.iov_base = const_cast<char *>(SHM_ACCEPT);
+    iov.iov_len = SHM_HELLO_LEN;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    ssize_t r;
+    do {
+        r = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (r < 0 && errno == EINTR);
+    return r == static_cast<ssize_t>(SHM_HELLO_LEN) ? 0 : -1;
+}
+
+// A local client sent SHM_HELLO. The answer goes on the socket behind
+// everything already written there, so it needs an empty queue; io_uring
+// shards, a backlog or any failure get SHM_DECLINE instead, and the client
+// stays on the socket.
+static void offer_shm(Shard *s, Client *c) {
+    std::unique_ptr<ShmLink> link;
+    int memfd = -1;
+    bool ok = s->eng->shm_ring > 0 && c->outq.empty();
+#ifdef CHAT_IO_URING
+    if (s->ring) ok = false;
+#endif
+    if (ok) {
+        link.reset(new (std::nothrow) ShmLink());
+        memfd = link ? shm_link_create(link.get(), s->eng->shm_ring) : -1;
+        ok = memfd >= 0;
+    }
+    if (ok) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = c->token | SHM_BELL_TAG;
+        ok = epoll_ctl(s->epfd, EPOLL_CTL_ADD, link->server_bell, &ev) == 0;
+        if (ok && send_shm_accept(c->fd, *link, memfd) != 0) {
+            epoll_ctl(s->epfd, EPOLL_CTL_DEL, link->server_bell, nullptr);
+            ok = false;
+        }
+    }
+    if (memfd >= 0) close(memfd);
+    if (!ok) {
+        Frame *no = frame_alloc(SHM_HELLO_LEN);
+        if (!no) {
+            mark_closed(s, c);
+            return;
+        }
+        std::memcpy(no->data(), SHM_DECLINE, SHM_HELLO_LEN);
+        queue_frame(s, c, no);
+        frame_unref(no);
+        return;
+    }
+    c->shm = std::move(link);
+    s->metrics.shm_links.add();
+}
+
+// Decides the protocol from the first bytes: a v2 hello, or anything else
+// (a v1 length prefix starts with 0). A local client may first ask to move
+// to shared memory, after which the same choice is made on what follows.
+// Returns false until it can tell.
+static bool negotiate_wire(Shard *s, Client *c) {
+    if (c->inbuf.length == 0) return false;
+    uint8_t hello[V2_HELLO_LEN];
+    c->inbuf.peek(0, hello, 1);
+    if (hello[0] == static_cast<uint8_t>(V2_HELLO[0])) {
+        if (c->inbuf.length < V2_HELLO_LEN) return false;
+        c->inbuf.peek(0, hello, V2_HELLO_LEN);
+        if (c->local && !c->shm && std::memcmp(hello, SHM_HELLO, SHM_HELLO_LEN) == 0) {
+            c->inbuf.consume(SHM_HELLO_LEN);
+            offer_shm(s, c);
+            return !c->closed && negotiate_wire(s, c);
+        }
+        if (std::memcmp(hello, V2_HELLO, V2_HELLO_LEN) == 0) {
+            c->inbuf.consume(V2_HELLO_LEN);
+            // the echo lands after any v1 frames already queued, which is
+            // where the client switches its parser
+            Frame *ack = frame_alloc(V2_HELLO_LEN);
+            if (ack) {
+                std::memcpy(ack->data(), V2_HELLO, V2_HELLO_LEN);
+                queue_frame(s, c, ack);
+                frame_unref(ack);
+            }
+            c->wire = WIRE_V2;
+            if (s->eng->deadlines.ping_ms) arm_deadline(s, c, s->now_ms + s->eng->deadlines.ping_ms);
+        }
+    }
+    c->wire_known = true;
+    return true;
+}
+
+// Broadcasts up to max_frames messages from the client's input buffer.
+// Returns how many were consumed.
+static uint32_t process_input(Shard *s, Client *c, uint32_t max_frames) {
+    if (!c->wire_known && !negotiate_wire(s, c)) return 0;
+    return c->wire == WIRE_V2 ? process_input_v2(s, c, max_frames) : process_input_v1(s, c, max_frames);
+}
+
+// Whether the input buffer holds a frame (or an error) process_input
+// would act on.
+static bool input_pending(const Client *c) {
+    if (!c->wire_known) return c->inbuf.length >= V2_HELLO_LEN;
+    if (c->xfer) return c->inbuf.length > 0 && c->xfer->window_len < TRANSFER_WINDOW;
+    if (c->wire == WIRE_V1) return has_complete_frame(c->inbuf, nullptr) != 0;
+    uint8_t type;
+    uint32_t len, hdr_len;
+    return v2_has_complete_frame(c->inbuf, &type, &len, &hdr_len) != 0;
+}
+
+// A client's wheel entry came due: enforce its write-stall, idle and
+// heartbeat deadlines, send a ping when one is owed, and re-arm for the
+// earliest deadline still ahead.
+static void on_client_timer(Shard *s, uint64_t token) {
+    Client *c = s->clients.lookup(token);
+    if (!c || c->closed) return;
+    uint64_t now = s->now_ms;
+    uint64_t next = UINT64_MAX;
+    bool backlogged = !c->outq.empty() || (c->relay && c->relay->pending());
+    if (backlogged && s->eng->deadlines.write_ms) {
+        uint64_t due = c->tx_progress_ms + s->eng->deadlines.write_ms;
+        if (now >= due) {
+            s->metrics.write_timeouts.add();
+            mark_closed(s, c);
+            return;
+        }
+        next = due;
+    }
+    if (s->eng->deadlines.idle_ms) {
+        uint64_t due = c->last_rx_ms + s->eng->deadlines.idle_ms;
+        if (now >= due) {
+            s->metrics.idle_timeouts.add();
+            mark_closed(s, c);
+            return;
+        }
+        if (due < next) next = due;
+    }
+    if (s->eng->deadlines.ping_ms && c->wire == WIRE_V2) {
+        uint64_t due;
+        if (c->ping_sent_ms > c->last_rx_ms) {
+            // a ping is out and nothing has come back since
+            due = c->ping_sent_ms + s->eng->deadlines.ping_ms;
+            if (now >= due) {
+                s->metrics.heartbeat_timeouts.add();
+                mark_closed(s, c);
+                return;
+            }
+        } else {
+            due = c->last_rx_ms + s->eng->deadlines.ping_ms;
+            if (now >= due) {
+                Frame *f = frame_encode_v2(V2_PING, nullptr, 0);
+                if (f) {
+                    queue_frame(s, c, f);
+                    frame_unref(f);
+                }
+                s->metrics.pings.add();
+                c->ping_sent_ms = now;
+                due = now + s->eng->deadlines.ping_ms;
+            }
+        }
+        if (due < next) next = due;
+    }
+    if (next != UINT64_MAX && !c->closed) s->timers.schedule(&c->timer, next);
+}
+
+// Fires due deadlines and returns how long the loop may sleep: until the
+// ready list needs service (ready_ms, -1 for never) or the next timer.
+static int run_timers(Shard *s, int ready_ms) {
+    s->timers.advance(s->now_ms, [s](uint64_t token) { on_client_timer(s, token); });
+    int timer_ms = s->timers.next_timeout_ms(s->eng->clock() / 1000000);
+    if (ready_ms < 0) return timer_ms;
+    if (timer_ms < 0 || ready_ms < timer_ms) return ready_ms;
+    return timer_ms;
+}
+
+// Input of a client on shared memory: the ring stands in for the socket,
+// which is only read to notice the client going away; bytes there are a
+// protocol error. Returns -1 when the client must be closed.
+static int read_shm(Shard *s, Client *c) {
+    if (c->readable) {
+        char b;
+        ssize_t r = recv(c->fd, &b, 1, MSG_DONTWAIT);
+        if (r > 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return -1;
+        if (r == 0) c->peer_eof = true;
+        if (r == 0 || errno != EINTR) c->readable = false;
+    }
+    // checked after the socket, so bytes written before a hangup are seen
+    if (c->inbuf.length >= INBUF_HIGH_WATER) return 0;
+    ssize_t n = shm_read_buffer(c->shm->up, c->shm->client_bell, c->inbuf, s->eng->sched.read_budget);
+    if (n < 0) return -1;
+    if (n > 0) c->last_rx_ms = s->now_ms;
+    return 0;
+}
+
+// One turn for one client: read at most the byte budget, broadcast at most
+// the frame budget (and what its token bucket allows). Returns -1 when the
+// client has nothing left to do, 0 when it wants another turn right away,
+// or the nanoseconds until its bucket refills.
+static int64_t service_client(Shard *s, Client *c, uint64_t now) {
+    uint32_t allowed = s->eng->sched.frame_budget;
+    if (s->eng->sched.rate > 0) {
+        c->tokens += static_cast<double>(now - c->tokens_at) * s->eng->sched.rate / 1e9;
+        if (c->tokens > s->eng->sched.burst) c->tokens = s->eng->sched.burst;
+        c->tokens_at = now;
+        if (c->tokens < 1) return static_cast<int64_t>((1 - c->tokens) * 1e9 / s->eng->sched.rate) + 1;
+        if (c->tokens < allowed) allowed = static_cast<uint32_t>(c->tokens);
+    }
+
+    if (c->xfer && c->xfer->splice_to && c->inbuf.length == 0) {
+        int r = relay_turn(s, c);
+        if (r < 0 || c->closed) return -1;
+        if (r == 0) return 0;
+        // transfer over: carry on with the frames behind it
+    }
+
+    // while a relay splices from the socket, nothing may be read past it
+    bool spliced = c->xfer && c->xfer->splice_to;
+    if (c->shm) {
+        if (read_shm(s, c) != 0) {
+            mark_closed(s, c);
+            return -1;
+        }
+    } else if (c->readable && !spliced && c->inbuf.length < INBUF_HIGH_WATER) {
+        ReadStop stop = READ_STOP_AGAIN;
+        ssize_t r = read_into_buffer_nonblocking(c->fd, c->inbuf, s->eng->sched.read_budget, &stop);
+        if (r < 0) {
+            mark_closed(s, c);
+            return -1;
+        }
+        if (r > 0) c->last_rx_ms = s->now_ms;
+        if (stop != READ_STOP_BUDGET) c->readable = false;
+        if (stop == READ_STOP_EOF) c->peer_eof = true;
+    }
+
+    uint32_t n = process_input(s, c, allowed);
+    if (s->eng->sched.rate > 0) c->tokens -= n;
+    if (c->closed) return -1;
+
+#ifdef CHAT_IO_URING
+    if (s->ring && c->recv_paused && c->inbuf.length < INBUF_HIGH_WATER / 2) {
+        c->recv_paused = false;
+        if (!c->recv_armed) uring_arm_recv(s, c);
+    }
+#endif
+
+    // a transfer waiting on its slowest recipient is polled, not spun on
+    if (c->xfer && c->xfer->window_len == TRANSFER_WINDOW) return TRANSFER_POLL_NS;
+    if (c->readable || input_pending(c)) return 0;
+    // a ring with bytes left wants another turn; an empty one parks us
+    // until the client rings
+    if (c->shm && (c->peer_eof ? c->shm->up.readable() : !c->shm->up.park_reader())) return 0;
+    // idle until more arrives: the buffer's storage goes back to the pool
+    c->inbuf.trim();
+    if (c->peer_eof) mark_closed(s, c);
+    return -1;
+}
+
+// Gives every client on the ready list one turn, in arrival order, and
+// returns how long the loop may sleep before the list needs service again
+// (-1 when it is empty).
+static int service_ready(Shard *s) {
+    if (s->ready.empty()) return -1;
+    uint64_t now = s->eng->clock();
+    s->ready_batch.swap(s->ready);
+    bool runnable = false;
+    int64_t min_wait = INT64_MAX;
+    for (uint64_t token : s->ready_batch) {
+        Client *c = s->clients.lookup(token);
+        if (!c) continue;
+        c->in_ready = false;
+        if (c->closed) continue;
+        int64_t wait = service_client(s, c, now);
+        if (wait < 0 || c->closed) continue;
+        schedule_input(s, c);
+        if (wait == 0) runnable = true;
+        else if (wait < min_wait) min_wait = wait;
+    }
+    s->ready_batch.clear();
+    if (s->ready.empty()) return -1;
+    if (runnable) return 0;
+    int64_t ms = (min_wait + 999999) / 1000000;
+    return ms > 500 ? 500 : static_cast<int>(ms);
+}
+
+static void handle_client_event(Shard *s, uint64_t token, uint32_t e) {
+    // A stale token (client already removed, slot maybe reused) just misses
+    Client *c = s->clients.lookup(token & ~SHM_BELL_TAG);
+    if (!c || c->closed) return;
+
+    if (token & SHM_BELL_TAG) {
+        // the client wrote to our parked ring, or read from its full one
+        if (!c->shm) return;
+        shm_doorbell_drain(c->shm->server_bell);
+        schedule_input(s, c);
+        if (!c->outq.empty()) flush_shm(s, c);
+        return;
+    }
+
+    // a Unix socket reports its peer's close as a hangup, which like
+    // EPOLLRDHUP still lets the buffered frames through first
+    if ((e & EPOLLERR) || ((e & EPOLLHUP) && !(e & EPOLLRDHUP))) {
+        mark_closed(s, c);
+        return;
+    }
+
+    // reading happens in service_ready(); a peer that half-closed gets its
+    // remaining frames delivered before the read sees EOF
+    if (e & (EPOLLIN | EPOLLRDHUP)) {
+        c->readable = true;
+        schedule_input(s, c);
+    }
+
+    if ((e & EPOLLOUT) && c->relay) {
+        relay_resume(s, c);
+    } else if ((e & EPOLLOUT) && !c->outq.empty()) {
+        flush_client(s, c);
+    }
+}
+
+static void run_shard_epoll(Shard *s) {
+    const int MAX_EVENTS = 128;
+    epoll_event events[128];
+    // the first pass does not block: clients taken over in a handoff may
+    // arrive with input already buffered
+    int timeout = 0;
+
+    while (!s->eng->should_terminate.load(std::memory_order_relaxed)) {
+        int n = epoll_wait(s->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // a shard that cannot wait cannot serve its clients: take the
+            // whole server down rather than leave them hanging
+            log_msg(LOG_ERROR, "shard %d: epoll_wait: %e", s->index, errno);
+            s->eng->should_terminate.store(1, std::memory_order_release);
+            break;
+        }
+        uint64_t woke = monotonic_ns();
+        s->now_ms = s->eng->clock() / 1000000;
+
+        for (int i = 0; i < n; ++i) {
+            uint64_t token = events[i].data.u64;
+            uint32_t e = events[i].events;
+
+            if (token == TOKEN_LISTENER) {
+                accept_clients(s, s->listen_fd);
+            } else if (token == TOKEN_UNIX_LISTENER) {
+                accept_clients(s, s->unix_fd);
+            } else if (token == TOKEN_DISCOVERY) {
+                answer_discovery(s);
+            } else if (token == TOKEN_WAKE) {
+                drain_inbox(s);
+            } else if (token == TOKEN_STOP) {
+                drain_stop(s);
+            } else if (token == TOKEN_STATS) {
+                serve_stats(s);
+            } else if (token == TOKEN_HANDOFF) {
+                accept_handoff(s);
+            } else {
+                handle_client_event(s, token, e);
+            }
+        }
+        timeout = run_timers(s, service_ready(s));
+        remove_closed_clients(s);
+        s->metrics.batch_size.record(static_cast<uint64_t>(n));
+        s->metrics.loop_ns.record(monotonic_ns() - woke);
+    }
+}
+
+#ifdef CHAT_IO_URING
+static void uring_arm_accept(Shard *s, int fd, uint64_t token) {
+    io_uring_sqe *sqe = s->ring->get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = token;
+}
+
+static void uring_arm_poll(Shard *s, int fd, uint64_t token) {
+    io_uring_sqe *sqe = s->ring->get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = token;
+}
+
+static void uring_arm_recv(Shard *s, Client *c) {
+    io_uring_sqe *sqe = s->ring->get_sqe();
+    if (!sqe) {
+        mark_closed(s, c);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = c->token;
+    c->recv_armed = true;
+    ++c->pending_ops;
+}
+
+// Stops the multishot recv of a client whose input is backing up.
+static void uring_pause_recv(Shard *s, Client *c) {
+    c->recv_paused = true;
+    io_uring_sqe *sqe = s->ring->get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = c->token;
+    sqe->user_data = TOKEN_IGNORE;
+}
+
+// One sendmsg per client covering as many queued frames as fit in the iovec
+// batch; everything prepared during an iteration goes out in one enter.
+static void uring_arm_send(Shard *s, Client *c) {
+    if (s->send_args_used == s->send_args.size()) {
+        if (s->ring->submit() < 0) return;
+        s->send_args_used = 0;
+    }
+    io_uring_sqe *sqe = s->ring->get_sqe();
+    if (!sqe) return;
+    UringSendArgs &a = s->send_args[s->send_args_used++];
+    const FrameQueue &q = c->outq;
+    int n = 0;
+    for (uint32_t i = 0; i < q.count && n < URING_SEND_IOV; ++i) {
+        Frame *f = q.slots[(q.head + i) & (q.capacity - 1)];
+        size_t skip = (i == 0) ? q.offset : 0;
+        a.iov[n].iov_base = f->data() + skip;
+        a.iov[n].iov_len = f->size - skip;
+        ++n;
+    }
+    std::memset(&a.msg, 0, sizeof(a.msg));
+    a.msg.msg_iov = a.iov;
+    a.msg.msg_iovlen = static_cast<size_t>(n);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&a.msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = c->token | URING_SEND_TAG;
+    s->metrics.uring_sends.add();
+    c->send_inflight = true;
+    c->inflight_frames = static_cast<uint32_t>(n);
+    ++c->pending_ops;
+}
+
+static void uring_flush_dirty(Shard *s) {
+    for (uint64_t token : s->dirty) {
+        Client *c = s->clients.lookup(token);
+        if (!c) continue;
+        c->send_dirty = false;
+        if (c->closed || c->send_inflight || c->outq.empty()) continue;
+        uring_arm_send(s, c);
+    }
+    s->dirty.clear();
+}
+
+static void uring_on_accept(Shard *s, const io_uring_cqe &cqe) {
+    if (cqe.res >= 0) {
+        int cfd = cqe.res;
+        sockaddr_storage addr{};
+        socklen_t alen = sizeof(addr);
+        getpeername(cfd, reinterpret_cast<sockaddr *>(&addr), &alen);
+        Client *c = add_client(s, cfd, addr);
+        if (c && !s->quiescing) uring_arm_recv(s, c);
+    } else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECANCELED) {
+        log_msg(LOG_ERROR, "accept: %e", -cqe.res);
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE) && !s->quiescing) {
+        uring_arm_accept(s, cqe.user_data == TOKEN_LISTENER ? s->listen_fd : s->unix_fd, cqe.user_data);
+    }
+}
+
+static void uring_on_recv(Shard *s, Client *c, const io_uring_cqe &cqe) {
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe.res > 0 && !c->closed) {
+            c->last_rx_ms = s->now_ms;
+            if (c->inbuf.append(s->ring->buf_addr(bid), static_cast<size_t>(cqe.res)) != 0) {
+                mark_closed(s, c);
+            } else {
+                schedule_input(s, c);
+                if (c->inbuf.length >= INBUF_HIGH_WATER && !c->recv_paused) uring_pause_recv(s, c);
+            }
+        }
+        s->ring->recycle_buf(bid);
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        --c->pending_ops;
+        c->recv_armed = false;
+        if (c->closed) return;
+        if (cqe.res == 0) {
+            // peer closed: deliver what is buffered, then close
+            c->peer_eof = true;
+            schedule_input(s, c);
+        } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+            mark_closed(s, c);
+        } else if (!c->recv_paused && !s->quiescing) {
+            uring_arm_recv(s, c); // buffers ran dry or multishot ended
+        }
+    }
+}
+
+static void uring_on_send(Shard *s, Client *c, const io_uring_cqe &cqe) {
+    --c->pending_ops;
+    c->send_inflight = false;
+    if (cqe.res < 0) {
+        // a handoff cancels sends still waiting for socket space; those
+        // wrote nothing
+        if (!c->closed && !(s->quiescing && cqe.res == -ECANCELED)) mark_closed(s, c);
+        return;
+    }
+    size_t before = c->outq.bytes;
+    c->outq.advance(static_cast<size_t>(cqe.res));
+    account_outbound(s, c, before);
+    s->metrics.bytes_out.add(static_cast<uint64_t>(cqe.res));
+    if (cqe.res > 0) c->tx_progress_ms = s->now_ms;
+    if (!c->closed && !c->outq.empty() && !c->send_dirty) {
+        c->send_dirty = true;
+        s->dirty.push_back(c->token);
+    }
+}
+
+// Returns 0 once the shard is running on io_uring, -1 to stay on epoll.
+static int setup_uring(Shard *s) {
+    std::unique_ptr<IoUring> ring(new (std::nothrow) IoUring());
+    if (!ring) return -1;
+    int r = ring->init(URING_ENTRIES);
+    if (r == 0) r = ring->setup_buf_ring(URING_BUF_GROUP, URING_BUF_COUNT, URING_BUF_SIZE);
+    if (r != 0) {
+        log_msg(LOG_WARN, "shard %d: io_uring unavailable (%e), using epoll", s->index, -r);
+        return -1;
+    }
+    s->send_args.resize(URING_SEND_ARGS);
+    s->ring = std::move(ring);
+    return 0;
+}
+
+static void run_shard_uring(Shard *s) {
+    if (s->listen_fd >= 0) uring_arm_accept(s, s->listen_fd, TOKEN_LISTENER);
+    if (s->unix_fd >= 0) uring_arm_accept(s, s->unix_fd, TOKEN_UNIX_LISTENER);
+    uring_arm_poll(s, s->wake_fd, TOKEN_WAKE);
+    if (s->index == 0) uring_arm_poll(s, s->eng->stop_fd, TOKEN_STOP);
+    if (s->udp_fd >= 0) uring_arm_poll(s, s->udp_fd, TOKEN_DISCOVERY);
+    if (s->stats_fd >= 0) uring_arm_poll(s, s->stats_fd, TOKEN_STATS);
+    if (s->handoff_fd >= 0) uring_arm_poll(s, s->handoff_fd, TOKEN_HANDOFF);
+    // clients taken over in a handoff are live before the ring exists
+    for (Client *c : s->clients.live()) {
+        uring_arm_recv(s, c);
+        if (!c->outq.empty()) {
+            c->send_dirty = true;
+            s->dirty.push_back(c->token);
+        }
+    }
+    int timeout = 0;
+
+    while (!s->eng->should_terminate.load(std::memory_order_relaxed)) {
+        uring_flush_dirty(s);
+        int r = s->ring->submit_and_wait(timeout);
+        s->send_args_used = 0;
+        if (r < 0 && r != -ETIME && r != -EINTR && r != -EBUSY) {
+            log_msg(LOG_ERROR, "shard %d: io_uring_enter: %e", s->index, -r);
+            s->eng->should_terminate.store(1, std::memory_order_release);
+            break;
+        }
+        uint64_t woke = monotonic_ns();
+        s->now_ms = s->eng->clock() / 1000000;
+        uint64_t batch = 0;
+
+        while (io_uring_cqe *p = s->ring->peek_cqe()) {
+            io_uring_cqe cqe = *p;
+            s->ring->cqe_seen();
+            ++batch;
+
+            if (cqe.user_data == TOKEN_IGNORE) {
+                continue;
+            } else if (cqe.user_data == TOKEN_LISTENER || cqe.user_data == TOKEN_UNIX_LISTENER) {
+                uring_on_accept(s, cqe);
+            } else if (cqe.user_data == TOKEN_WAKE || cqe.user_data == TOKEN_DISCOVERY || cqe.user_data == TOKEN_STATS ||
+                       cqe.user_data == TOKEN_HANDOFF || cqe.user_data == TOKEN_STOP) {
+                int fd = s->wake_fd;
+                if (cqe.user_data == TOKEN_WAKE) {
+                    drain_inbox(s);
+                } else if (cqe.user_data == TOKEN_STOP) {
+                    drain_stop(s);
+                    fd = s->eng->stop_fd;
+                } else if (cqe.user_data == TOKEN_DISCOVERY) {
+                    answer_discovery(s);
+                    fd = s->udp_fd;
+                } else if (cqe.user_data == TOKEN_HANDOFF) {
+                    accept_handoff(s);
+                    fd = s->handoff_fd;
+                } else {
+                    serve_stats(s);
+                    fd = s->stats_fd;
+                }
+                if (!(cqe.flags & IORING_CQE_F_MORE)) uring_arm_poll(s, fd, cqe.user_data);
+            } else {
+                Client *c = s->clients.lookup(cqe.user_data & ~URING_SEND_TAG);
+                if (!c) continue;
+                if (cqe.user_data & URING_SEND_TAG) uring_on_send(s, c, cqe);
+                else uring_on_recv(s, c, cqe);
+            }
+        }
+        timeout = run_timers(s, service_ready(s));
+        remove_closed_clients(s);
+        s->metrics.batch_size.record(batch);
+        s->metrics.loop_ns.record(monotonic_ns() - woke);
+    }
+}
+
+// Before a handoff the kernel has to be done with every client socket: the
+// accept, the recvs and any send still waiting for socket space are
+// cancelled, so no byte is read into or written from a ring that is about
+// to go away. Whatever completes meanwhile is accounted as usual, and input
+// lands in inbuf to move with the client. The wait is bounded; a client
+// whose operations never finish is not handed over (see hand_off).
+static void uring_quiesce(Shard *s) {
+    s->quiescing = true;
+    io_uring_sqe *sqe = s->ring->get_sqe();
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = TOKEN_LISTENER;
+        sqe->user_data = TOKEN_IGNORE;
+    }
+    if (s->unix_fd >= 0 && (sqe = s->ring->get_sqe())) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = TOKEN_UNIX_LISTENER;
+        sqe->user_data = TOKEN_IGNORE;
+    }
+    for (Client *c : s->clients.live()) {
+        if (c->recv_armed && !c->recv_paused) uring_pause_recv(s, c);
+        if (c->send_inflight && (sqe = s->ring->get_sqe())) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = c->token | URING_SEND_TAG;
+            sqe->user_data = TOKEN_IGNORE;
+        }
+    }
+    uint64_t give_up = monotonic_ns() + URING_QUIESCE_NS;
+    for (;;) {
+        bool busy = false;
+        for (const Client *c : s->clients.live()) busy = busy || c->pending_ops > 0;
+        if (!busy || monotonic_ns() >= give_up) break;
+        int r = s->ring->submit_and_wait(10);
+        if (r < 0 && r != -ETIME && r != -EINTR && r != -EBUSY) break;
+        s->now_ms = s->eng->clock() / 1000000;
+        while (io_uring_cqe *p = s->ring->peek_cqe()) {
+            io_uring_cqe cqe = *p;
+            s->ring->cqe_seen();
+            if (cqe.user_data == TOKEN_LISTENER || cqe.user_data == TOKEN_UNIX_LISTENER) {
+                uring_on_accept(s, cqe);
+            } else if (cqe.user_data > TOKEN_STOP) {
+                Client *c = s->clients.lookup(cqe.user_data & ~URING_SEND_TAG);
+                if (!c) continue;
+                if (cqe.user_data & URING_SEND_TAG) uring_on_send(s, c, cqe);
+                else uring_on_recv(s, c, cqe);
+            }
+        }
+    }
+}
+#endif
+
+static void run_shard(Shard *s) {
+#ifdef CHAT_IO_URING
+    // the ring is created on the thread that drives it (single issuer)
+    if (s->want_uring && setup_uring(s) == 0) {
+        run_shard_uring(s);
+        bool handing_off = s->eng->handoff_peer.load() >= 0;
+        if (s->eng->should_terminate.load(std::memory_order_acquire) && handing_off) uring_quiesce(s);
+        s->ring.reset();
+    } else {
+        run_shard_epoll(s);
+    }
+#else
+    run_shard_epoll(s);
+#endif
+
+    // Whichever shard stops first, on request or because its loop failed,
+    // wakes the others so they notice termination without a timeout
+    for (Shard *other : s->eng->shards) {
+        if (other != s) wake_shard(other);
+    }
+}
+
+// A shard taking over from a predecessor arrives with its listener set;
+// without a TCP port it has none.
+static int setup_shard(Shard *s, bool reuse_port) {
+    if (s->listen_fd < 0 && s->eng->tcp_port != 0) s->listen_fd = create_tcp_listener(s->eng->tcp_port, reuse_port);
+    if (s->listen_fd < 0 && s->eng->tcp_port != 0) {
+        std::perror("listen socket");
+        return -1;
+    }
+    s->now_ms = s->eng->clock() / 1000000;
+    s->timers.start(s->now_ms);
+
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->wake_fd < 0) {
+        std::perror("eventfd");
+        return -1;
+    }
+
+    s->epfd = epoll_create1(0);
+    if (s->epfd < 0) {
+        std::perror("epoll_create1");
+        return -1;
+    }
+
+    epoll_event ev{};
+    if (s->listen_fd >= 0) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = TOKEN_LISTENER;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->listen_fd, &ev) < 0) {
+            std::perror("epoll add listen");
+            return -1;
+        }
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = TOKEN_WAKE;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wake_fd, &ev) < 0) {
+        std::perror("epoll add eventfd");
+        return -1;
+    }
+    if (s->index == 0) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = TOKEN_STOP;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->eng->stop_fd, &ev) < 0) {
+            std::perror("epoll add stop eventfd");
+            return -1;
+        }
+    }
+    if (s->udp_fd >= 0) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = TOKEN_DISCOVERY;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->udp_fd, &ev) < 0) {
+            std::perror("epoll add udp");
+            return -1;
+        }
+    }
+    if (s->stats_fd >= 0) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = TOKEN_STATS;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->stats_fd, &ev) < 0) {
+            std::perror("epoll add stats");
+            return -1;
+        }
+    }
+    if (s->handoff_fd >= 0) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = TOKEN_HANDOFF;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->handoff_fd, &ev) < 0) {
+            std::perror("epoll add handoff");
+            return -1;
+        }
+    }
+    if (s->unix_fd >= 0) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = TOKEN_UNIX_LISTENER;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->unix_fd, &ev) < 0) {
+            std::perror("epoll add unix listener");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void destroy_shard(Shard *s) {
+    while (s->clients.size() > 0) {
+        remove_client(s, s->clients.live().back());
+    }
+    ShardMessage *m = s->inbox.pop_all();
+    while (m) {
+        ShardMessage *next = m->next;
+        if (m->fd >= 0) close(m->fd);
+        wire_frames_unref(m->frames);
+        if (m->seq_frame) frame_unref(m->seq_frame);
+        delete m;
+        m = next;
+    }
+    if (s->udp_fd >= 0) close(s->udp_fd);
+    if (s->stats_fd >= 0) close(s->stats_fd);
+    if (s->handoff_fd >= 0) close(s->handoff_fd);
+    if (s->unix_fd >= 0) close(s->unix_fd);
+    if (s->listen_fd >= 0) close(s->listen_fd);
+    if (s->wake_fd >= 0) close(s->wake_fd);
+    if (s->epfd >= 0) close(s->epfd);
+    delete s;
+}
+
+// Whether c can move to a successor as it is. A client in the middle of a
+// streamed transfer, already closing, on shared memory (its rings live in
+// this process), or with io_uring operations that never finished stays
+// behind and is disconnected.
+static bool can_hand_off(const Client *c) {
+    return !c->closed && !c->peer_eof && !c->xfer && !c->relay && !c->shm && c->pending_ops == 0;
+}
+
+// One client record: its socket and shard, protocol, nick and rooms (by
+// name; ids are private to a process), input not yet parsed and output not
+// yet written.
+static void write_client(HandoffWriter &w, const Shard *s, const Client *c) {
+    w.u32(static_cast<uint32_t>(s->index));
+    w.fd(c->fd);
+    w.u8(c->wire);
+    w.u8(c->wire_known ? 1 : 0);
+    w.u8(c->sequenced ? 1 : 0);
+    w.str(c->nick);
+    w.u64(c->nick_key);
+    w.str(s->eng->channels.name(c->channel));
+    w.u32(static_cast<uint32_t>(c->channels.size()));
+    for (const ChannelMembership &m : c->channels) w.str(s->eng->channels.name(m.channel));
+    iovec iov[2];
+    int n = c->inbuf.readable_iov(iov);
+    w.u32(static_cast<uint32_t>(c->inbuf.length));
+    for (int i = 0; i < n; ++i) w.raw(iov[i].iov_base, iov[i].iov_len);
+    const FrameQueue &q = c->outq;
+    w.u64(q.bytes);
+    for (uint32_t i = 0; i < q.count; ++i) {
+        const Frame *f = q.slots[(q.head + i) & (q.capacity - 1)];
+        size_t skip = (i == 0) ? q.offset : 0;
+        w.raw(f->data() + skip, f->size - skip);
+    }
+}
+
+// Passes the listeners, the discovery, stats, Unix and peer sockets and every client
+// that can move to the successor on peer. Runs on the main thread once
+// every shard has stopped and its inbox is drained. Returns 0 when the
+// successor holds the fds: closing ours afterwards leaves its copies open.
+static int hand_off(ChatEngine &e, int peer) {
+    HandoffWriter w;
+    size_t moved = 0;
+    try {
+        for (const Shard *s : e.shards) {
+            for (const Client *c : s->clients.live()) moved += can_hand_off(c) ? 1 : 0;
+        }
+        w.u32(HANDOFF_MAGIC);
+        w.u64(e.next_seq.load());
+        w.fd(e.shards[0]->udp_fd);
+        w.fd(e.shards[0]->stats_fd);
+        w.fd(e.shards[0]->unix_fd);
+        w.fd(e.federation ? e.federation->listen_fd() : -1);
+        w.u32(static_cast<uint32_t>(e.shards.size()));
+        for (const Shard *s : e.shards) w.fd(s->listen_fd);
+        w.u32(static_cast<uint32_t>(moved));
+        for (const Shard *s : e.shards) {
+            for (const Client *c : s->clients.live()) {
+                if (can_hand_off(c)) write_client(w, s, c);
+            }
+        }
+    } catch (const std::bad_alloc &) {
+        std::fprintf(stderr, "Out of memory for the handoff state\n");
+        return -1;
+    }
+    if (handoff_send(peer, w) != 0) {
+        std::perror("handoff");
+        return -1;
+    }
+    log_msg(LOG_INFO, moved == 1 ? "Handed off %u client" : "Handed off %u clients", moved);
+    return 0;
+}
+
+// A client as the predecessor described it
+struct InheritedClient {
+    int fd{ -1 };
+    uint32_t shard{ 0 };
+    uint8_t wire{ WIRE_V1 };
+    bool wire_known{ false };
+    bool sequenced{ false };
+    std::string nick{};
+    uint64_t nick_key{ 0 };
+    std::string room{};
+    std::vector<std::string> rooms{};
+    std::string inbuf{};
+    std::string outbuf{};
+};
+
+// Everything taken over from a predecessor (--handoff)
+struct Inherited {
+    uint64_t next_seq{ 0 };
+    int udp_fd{ -1 };
+    int stats_fd{ -1 };
+    int unix_fd{ -1 };
+    int peer_fd{ -1 };
+    std::vector<int> listeners{};
+    std::vector<InheritedClient> clients{};
+};
+
+static bool read_client(HandoffReader &r, InheritedClient *c) {
+    uint8_t known = 0, sequenced = 0;
+    uint32_t rooms = 0, in_len = 0;
+    uint64_t out_len = 0;
+    const uint8_t *p = nullptr;
+    if (!(r.u32(&c->shard) && r.fd(&c->fd) && r.u8(&c->wire) && r.u8(&known) && r.u8(&sequenced) &&
+          r.str(&c->nick) && r.u64(&c->nick_key) && r.str(&c->room) && r.u32(&rooms))) {
+        return false;
+    }
+    c->wire_known = known != 0;
+    c->sequenced = sequenced != 0;
+    if (c->wire >= WIRE_VERSIONS) return false;
+    for (uint32_t i = 0; i < rooms; ++i) {
+        std::string name;
+        if (!r.str(&name)) return false;
+        c->rooms.push_back(name);
+    }
+    if (!r.u32(&in_len) || !r.raw(in_len, &p)) return false;
+    c->inbuf.assign(reinterpret_cast<const char *>(p), in_len);
+    if (!r.u64(&out_len) || !r.raw(static_cast<size_t>(out_len), &p)) return false;
+    c->outbuf.assign(reinterpret_cast<const char *>(p), static_cast<size_t>(out_len));
+    return true;
+}
+
+// Connects to a server already running with --handoff at path and takes
+// its sockets over; that server stops once it has passed them. Returns 1
+// with *out filled, 0 when nobody listens at path, -1 on failure.
+static int take_over(const char *path, Inherited *out) {
+    int sock = handoff_connect(path);
+    if (sock < 0) return 0;
+    log_msg(LOG_INFO, "Taking over from the server at %s", log_intern(path));
+    std::vector<uint8_t> data;
+    std::vector<int> fds;
+    int r = handoff_recv(sock, &data, &fds);
+    close(sock);
+    bool ok = r == 0;
+    try {
+        HandoffReader rd(data, fds);
+        uint32_t magic = 0, listeners = 0, clients = 0;
+        ok = ok && rd.u32(&magic) && magic == HANDOFF_MAGIC && rd.u64(&out->next_seq) &&
+             rd.fd(&out->udp_fd) && rd.fd(&out->stats_fd) && rd.fd(&out->unix_fd) &&
+             rd.fd(&out->peer_fd) && rd.u32(&listeners);
+        for (uint32_t i = 0; ok && i < listeners; ++i) {
+            int fd = -1;
+            ok = rd.fd(&fd) && fd >= 0;
+            if (ok) out->listeners.push_back(fd);
+        }
+        ok = ok && !out->listeners.empty() && rd.u32(&clients);
+        for (uint32_t i = 0; ok && i < clients; ++i) {
+            out->clients.emplace_back();
+            ok = read_client(rd, &out->clients.back());
+        }
+    } catch (const std::bad_alloc &) {
+        ok = false;
+    }
+    if (!ok) {
+        for (int fd : fds) close(fd);
+        return -1;
+    }
+    return 1;
+}
+
+// Registers a connection inherited from a predecessor on s as it was
+// there: same protocol, rooms and nick, buffered input parsed on its first
+// turn, and unsent output written as soon as the socket takes it.
+static void adopt_client(Shard *s, const InheritedClient &in) {
+    uint64_t token = 0;
+    Client *c = s->clients.acquire(&token);
+    if (!c) {
+        close(in.fd);
+        return;
+    }
+    c->fd = in.fd;
+    c->token = token;
+    c->closed = false;
+    c->wire = in.wire;
+    c->wire_known = in.wire_known;
+    c->sequenced = in.sequenced;
+    sockaddr_storage addr{};
+    socklen_t alen = sizeof(addr);
+    c->local = getsockname(c->fd, reinterpret_cast<sockaddr *>(&addr), &alen) == 0 && addr.ss_family == AF_UNIX;
+    s->metrics.accepted.add();
+    if (c->local) s->metrics.local_accepted.add();
+    start_deadlines(s, c);
+
+    bool ok = true;
+    for (const std::string &name : in.rooms) {
+        uint32_t id = s->eng->channels.intern(name);
+        if (id == NO_CHANNEL || join_channel(s, c, id) != 0) ok = false;
+    }
+    if (ok && c->channels.empty()) ok = join_channel(s, c, LOBBY_CHANNEL) == 0;
+    uint32_t room = s->eng->channels.find(in.room);
+    c->channel = room != NO_CHANNEL ? room : LOBBY_CHANNEL;
+    if (!in.nick.empty() && s->eng->nicks.bind(in.nick, ClientRoute{ s->index, token }, in.nick_key) == 0) {
+        c->nick = in.nick;
+        c->nick_key = in.nick_key;
+    }
+    if (!in.inbuf.empty() && c->inbuf.append(in.inbuf.data(), in.inbuf.size()) != 0) ok = false;
+    if (ok && !in.outbuf.empty()) {
+        Frame *f = frame_alloc(in.outbuf.size());
+        if (f) {
+            std::memcpy(f->data(), in.outbuf.data(), in.outbuf.size());
+            ok = c->outq.push(f) == 0;
+            frame_unref(f);
+        } else {
+            ok = false;
+        }
+        if (ok) {
+            account_outbound(s, c, 0);
+            note_backlog(s, c);
+        }
+    }
+    if (!ok) {
+        remove_client(s, c);
+        return;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    if (!c->outq.empty()) ev.events |= EPOLLOUT;
+    ev.data.u64 = token;
+    epoll_ctl(s->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    if (c->inbuf.length > 0) schedule_input(s, c);
+    ++s->eng->inherited_clients;
+}
+
+// Closes whatever a failed open() took over and had not handed to a shard
+static void close_inherited(Inherited &in) {
+    for (int fd : { in.udp_fd, in.stats_fd, in.unix_fd, in.peer_fd }) {
+        if (fd >= 0) close(fd);
+    }
+    for (int fd : in.listeners) close(fd);
+    for (const InheritedClient &c : in.clients) close(c.fd);
+    in = Inherited();
+}
+
+// Tears down what open() built: shards and their sockets, the history log
+// and the federation links. The threads have stopped by now.
+static void destroy_server(ChatEngine &e) {
+    for (Shard *s : e.shards) destroy_shard(s);
+    e.shards.clear();
+    delete e.log;
+    e.log = nullptr;
+    delete e.federation;
+    e.federation = nullptr;
+}
+
+ChatServer::ChatServer(const ChatServerConfig &config) : config_(config), eng_(new ChatEngine()) {
+    if (config_.threads < 1) config_.threads = 1;
+    if (config_.sched.rate > 0) {
+        // a bucket that cannot hold one whole token never lets a frame through
+        if (config_.sched.burst <= 0) config_.sched.burst = config_.sched.rate;
+        config_.sched.burst = std::max(config_.sched.burst, 1.0);
+    }
+    if (!config_.clock_ns) config_.clock_ns = monotonic_ns;
+    eng_->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+ChatServer::~ChatServer() {
+    if (open_) close();
+    if (eng_->stop_fd >= 0) ::close(eng_->stop_fd);
+}
+
+int ChatServer::open() {
+    if (open_ || ran_) return -1;
+    ChatEngine &e = *eng_;
+    if (e.stop_fd < 0) {
+        std::perror("eventfd");
+        return -1;
+    }
+    if (config_.handoff_path && config_.tcp_port == 0) {
+        std::fprintf(stderr, "A handoff needs a TCP listener\n");
+        return -1;
+    }
+#ifndef CHAT_IO_URING
+    if (config_.io_uring) {
+        std::fprintf(stderr, "Built without io_uring support, using epoll\n");
+        config_.io_uring = false;
+    }
+#endif
+    e.clock = config_.clock_ns;
+    e.tcp_port = config_.tcp_port;
+    e.limits = config_.limits;
+    e.sched = config_.sched;
+    e.text_policy = config_.text_policy;
+    e.deadlines = config_.deadlines;
+    e.replay_config = config_.replay;
+    e.log_config = config_.log;
+    e.fed_config = config_.federation;
+    e.shm_ring = config_.shm_ring;
+
+    // Hot restart: a server already running with the same handoff path
+    // passes over its sockets, which are kept exactly as they were opened
+    Inherited inherited;
+    int threads = config_.threads;
+    if (config_.handoff_path) {
+        if (take_over(config_.handoff_path, &inherited) < 0) {
+            std::fprintf(stderr, "Handoff from %s failed\n", config_.handoff_path);
+            return -1;
+        }
+        if (!inherited.listeners.empty() && inherited.listeners.size() != static_cast<size_t>(threads)) {
+            std::fprintf(stderr, "Running %zu threads, one per inherited listener\n", inherited.listeners.size());
+            threads = static_cast<int>(inherited.listeners.size());
+        }
+    }
+
+    // Sockets move into the shards as soon as they exist, so a failure
+    // below only has to destroy the shards
+    for (int i = 0; i < threads; ++i) {
+        Shard *s = new Shard();
+        s->eng = &e;
+        s->index = i;
+        s->want_uring = config_.io_uring;
+        if (static_cast<size_t>(i) < inherited.listeners.size()) s->listen_fd = inherited.listeners[i];
+        e.shards.push_back(s);
+    }
+    bool took_over = !inherited.listeners.empty();
+    inherited.listeners.clear();
+    Shard *first = e.shards[0];
+    auto fail = [&]() {
+        close_inherited(inherited);
+        destroy_server(e);
+        return -1;
+    };
+
+    std::swap(first->udp_fd, inherited.udp_fd);
+    if (config_.discovery_port != 0 && first->udp_fd < 0) {
+        first->udp_fd = create_udp_discovery_socket(config_.discovery_port);
+        if (first->udp_fd < 0) {
+            std::perror("udp discovery socket");
+            return fail();
+        }
+    }
+
+    // stats are local-only: loopback TCP or a Unix socket
+    if (config_.stats_path || config_.stats_port > 0) {
+        std::swap(first->stats_fd, inherited.stats_fd);
+        if (first->stats_fd < 0 && config_.stats_path) first->stats_fd = create_unix_listener(config_.stats_path);
+        else if (first->stats_fd < 0) first->stats_fd = create_tcp_listener(static_cast<uint16_t>(config_.stats_port), false, true);
+        if (first->stats_fd < 0) {
+            std::perror("stats socket");
+            return fail();
+        }
+    }
+
+    // local clients: the same protocol on a Unix socket, with shared memory
+    // on request
+    if (config_.unix_path) {
+        std::swap(first->unix_fd, inherited.unix_fd);
+        if (first->unix_fd < 0) first->unix_fd = create_unix_listener(config_.unix_path);
+        if (first->unix_fd < 0) {
+            std::perror("unix socket");
+            return fail();
+        }
+    }
+
+    // bound only now, so a successor cannot connect to us before we have
+    // finished taking over from our own predecessor
+    if (config_.handoff_path) {
+        first->handoff_fd = handoff_listen(config_.handoff_path);
+        if (first->handoff_fd < 0) {
+            std::perror("handoff socket");
+            return fail();
+        }
+    }
+
+    if (e.log_config.dir) {
+        e.log = new MessageLog();
+        if (e.log->open(e.log_config.dir, e.log_config.segment_bytes, e.log_config.retain_bytes) != 0) {
+            std::fprintf(stderr, "Cannot open message log in %s\n", e.log_config.dir);
+            return fail();
+        }
+        // numbering carries on where the previous run stopped
+        e.next_seq.store(e.log->last_seq() + 1);
+    }
+    if (inherited.next_seq > e.next_seq.load()) e.next_seq.store(inherited.next_seq);
+
+    // federation: peer links run on their own thread, started with the shards
+    if (e.fed_config.listen_port != 0 || !e.fed_config.peers.empty()) {
+        e.federation = new Federation();
+        int peer_fd = inherited.peer_fd;
+        inherited.peer_fd = -1;
+        if (e.federation->open(e.fed_config, &e.channels, peer_fd) != 0) {
+            std::fprintf(stderr, "Cannot set up federation\n");
+            return fail();
+        }
+    }
+
+    bool reuse_port = threads > 1;
+    for (Shard *s : e.shards) {
+        if (s == sequencer(e) && s->replay.init(e.replay_config.msgs, e.replay_config.bytes) != 0) {
+            std::fprintf(stderr, "Out of memory for the replay ring\n");
+            return fail();
+        }
+        if (setup_shard(s, reuse_port) != 0) return fail();
+    }
+
+    for (const InheritedClient &c : inherited.clients) adopt_client(e.shards[c.shard % e.shards.size()], c);
+    inherited.clients.clear();
+    close_inherited(inherited); // sockets this configuration does not serve
+    if (took_over) {
+        log_msg(LOG_INFO, e.inherited_clients == 1 ? "Took over %u client" : "Took over %u clients",
+                e.inherited_clients);
+    }
+
+    const char *engine = config_.io_uring ? "io_uring" : "epoll";
+    const char *plural = threads == 1 ? "" : "s";
+    if (e.tcp_port == 0) {
+        log_msg(LOG_INFO, "Server running without a TCP listener (%d thread%s, %s)", threads, plural, engine);
+    } else if (first->udp_fd < 0) {
+        log_msg(LOG_INFO, "Server listening on TCP %u (%d thread%s, %s)", e.tcp_port, threads, plural, engine);
+    } else {
+        log_msg(LOG_INFO, "Server listening on TCP %u, discovery UDP %u (%d thread%s, %s)", e.tcp_port,
+                config_.discovery_port, threads, plural, engine);
+    }
+    if (config_.unix_path) log_msg(LOG_INFO, "Local clients on %s", log_intern(config_.unix_path));
+    if (e.text_policy != TextPolicy::Pass) {
+        log_msg(LOG_INFO, e.text_policy == TextPolicy::Reject ? "Rejecting malformed text (%s checks)"
+                                                              : "Sanitizing malformed text (%s checks)",
+                text_kernel_name(text_kernel()));
+    }
+    if (e.federation && e.fed_config.listen_port) {
+        log_msg(LOG_INFO, "Federation node %u, %u peers to dial, peers accepted on TCP %u", e.federation->node_id(),
+                e.fed_config.peers.size(), e.fed_config.listen_port);
+    } else if (e.federation) {
+        log_msg(LOG_INFO, "Federation node %u, %u peers to dial", e.federation->node_id(), e.fed_config.peers.size());
+    }
+    open_ = true;
+    return 0;
+}
+
+void ChatServer::run() {
+    if (!open_ || ran_) return;
+    ran_ = true;
+    ChatEngine &e = *eng_;
+
+    // Worker shards never take SIGINT/SIGTERM; the calling thread (shard 0)
+    // handles them and wakes the others on its way out.
+    sigset_t block, prev;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &prev);
+    bool logger = log_start() == 0;
+    if (!logger) std::fprintf(stderr, "Cannot start the logger thread, logging synchronously\n");
+    if (e.log && e.log->start(deliver_history, &e) != 0) {
+        std::fprintf(stderr, "Cannot start the log thread\n");
+        delete e.log;
+        e.log = nullptr;
+    }
+    if (e.federation && e.federation->start(deliver_federated, &e) != 0) {
+        std::fprintf(stderr, "Cannot start the federation thread\n");
+        delete e.federation;
+        e.federation = nullptr;
+    }
+    for (size_t i = 1; i < e.shards.size(); ++i) {
+        e.shards[i]->thread = std::thread(run_shard, e.shards[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &prev, nullptr);
+
+    run_shard(e.shards[0]);
+
+    for (size_t i = 1; i < e.shards.size(); ++i) {
+        e.shards[i]->thread.join();
+    }
+    // broadcasts queued for the peers go out first, then every queued
+    // record is written and synced, and answers to pending history queries
+    // land in the inboxes destroy_shard drains
+    if (e.federation) e.federation->stop();
+    if (e.log) e.log->stop();
+    // nothing else logs from another thread now
+    if (logger) log_stop();
+    int peer = e.handoff_peer.exchange(-1);
+    if (peer >= 0) {
+        // cross-shard messages and history answers still queued go out
+        // with the clients they were meant for
+        for (Shard *s : e.shards) drain_inbox(s);
+        handed_off_ = hand_off(e, peer) == 0;
+        if (!handed_off_) log_msg(LOG_ERROR, "Handoff failed, closing every connection");
+        ::close(peer);
+    }
+    close();
+    log_msg(LOG_INFO, "Slow consumers: %u frames dropped (oldest), %u dropped (newest), %u disconnected",
+            e.slow.dropped_oldest.load(), e.slow.dropped_newest.load(), e.slow.disconnects.load());
+}
+
+void ChatServer::close() {
+    open_.store(false);
+    destroy_server(*eng_);
+    // the successor serves these paths now
+    if (config_.stats_path && !handed_off_) unlink(config_.stats_path);
+    if (config_.unix_path && !handed_off_) unlink(config_.unix_path);
+    if (config_.handoff_path && !handed_off_) unlink(config_.handoff_path);
+}
+
+void ChatServer::stop() {
+    eng_->should_terminate.store(1, std::memory_order_release);
+    uint64_t one = 1;
+    ssize_t r = write(eng_->stop_fd, &one, sizeof(one));
+    (void)r;
+}
+
+int ChatServer::add_client(int fd) {
+    if (!open_) {
+        ::close(fd);
+        return -1;
+    }
+    ChatEngine &e = *eng_;
+    Shard *s = e.shards[e.next_adopt.fetch_add(1, std::memory_order_relaxed) % e.shards.size()];
+    ShardMessage *m = new (std::nothrow) ShardMessage();
+    if (!m) {
+        ::close(fd);
+        return -1;
+    }
+    m->fd = fd;
+    m->sent_at = monotonic_ns();
+    if (s->inbox.push(m)) wake_shard(s);
+    return 0;
+}
+
+void ChatServer::stats(std::string *out) const {
+    format_stats(*eng_, *out);
+}
@@ -0,0 +1,132 @@
+// The chat server as a library: event loops, rooms, relays and every
+// optional subsystem behind one ChatServer object, configured in code.
+// server.cpp is its command-line front end; benchmarks drive it in-process.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "../common/common.hpp"
+#include "../common/shm_ring.hpp"
+#include "federation.hpp"
+
+// What to do with a client whose unsent output would cross a limit
+enum class SlowPolicy { DropOldest, DropNewest, Disconnect };
+
+// What to do with chat text that is not well-formed UTF-8 or holds control
+// characters: relay it as is, drop it, or replace the bad bytes with '?'
+enum class TextPolicy { Pass, Reject, Sanitize };
+
+// Outbound limits count the bytes each client still has queued. A frame
+// shared by many slow clients counts once per client, which is what it
+// would cost if they all had to be served from private copies.
+struct OutboundLimits {
+    size_t per_client{ 1u << 20 };
+    size_t total{ 256u << 20 };
+    SlowPolicy policy{ SlowPolicy::Disconnect };
+};
+
+// Per-client share of one loop iteration, plus an optional token bucket
+// on frames per second (rate 0 disables it; burst 0 means the rate, and
+// the burst is at least one frame).
+struct SchedulerConfig {
+    size_t read_budget{ 64 * 1024 };
+    uint32_t frame_budget{ 64 };
+    double rate{ 0 };
+    double burst{ 0 };
+};
+
+// Connection deadlines in ms (0 disables each). Silent v2 clients are
+// pinged after ping_ms and closed if another ping_ms passes without any
+// reply; idle_ms closes any client, v1 included, that sends nothing for
+// that long; write_ms closes a client whose queued output has not moved.
+struct Deadlines {
+    uint64_t idle_ms{ 0 };
+    uint64_t ping_ms{ 30000 };
+    uint64_t write_ms{ 30000 };
+};
+
+// Durable history (dir nullptr keeps none)
+struct LogConfig {
+    const char *dir{ nullptr };
+    size_t segment_bytes{ 64u << 20 }; // at most 4G
+    size_t retain_bytes{ 0 };           // 0: keep every segment
+};
+
+// Bounds of the replay ring. Sequencing funnels every broadcast through
+// one shard, so it is off unless a ring (msgs > 0) or the log asks for it.
+struct ReplayConfig {
+    size_t msgs{ 0 };
+    size_t bytes{ 4u << 20 };
+};
+
+struct ChatServerConfig {
+    uint16_t tcp_port{ DEFAULT_TCP_PORT };             // 0: no TCP listener
+    uint16_t discovery_port{ DEFAULT_DISCOVERY_PORT }; // 0: no UDP discovery
+    int threads{ 1 };
+    bool io_uring{ false };
+    int stats_port{ 0 };                  // loopback TCP, 0 for none
+    const char *stats_path{ nullptr };    // or a Unix socket
+    const char *unix_path{ nullptr };     // local clients
+    const char *handoff_path{ nullptr };  // hot restart
+    size_t shm_ring{ SHM_RING_DEFAULT };  // 0 keeps local clients on the socket
+    OutboundLimits limits{};
+    SchedulerConfig sched{};
+    TextPolicy text_policy{ TextPolicy::Sanitize };
+    Deadlines deadlines{};
+    ReplayConfig replay{};
+    LogConfig log{};
+    FederationConfig federation{};
+    // Monotonic ns for deadlines, rate limits and the timing wheel, read
+    // once per loop wakeup. Latency histograms always use monotonic_ns().
+    uint64_t (*clock_ns)(){ monotonic_ns };
+};
+
+struct ChatEngine;
+
+// Each object is opened and run once. Several can be open in one process,
+// each with its own shards, rooms and threads; they share only the logger,
+// the buffer pool and the text kernel. Writes raise SIGPIPE on a closed
+// peer: the embedding process ignores that signal.
+class ChatServer {
+public:
+    explicit ChatServer(const ChatServerConfig &config);
+    ChatServer(const ChatServer &) = delete;
+    ChatServer &operator=(const ChatServer &) = delete;
+    ~ChatServer();
+
+    // Takes over from a predecessor (handoff_path), opens the sockets and
+    // the history log, and sets up every shard. Returns -1 on failure,
+    // reported on stderr, with nothing left open.
+    int open();
+    // Serves on the calling thread (shard 0; the others get threads) until
+    // stop(), then hands off or closes every connection. SIGINT and SIGTERM
+    // are only ever delivered to the calling thread.
+    void run();
+    // Safe from any thread and from a signal handler, at any point in the
+    // object's life
+    void stop();
+
+    // Serves a connected stream socket as if it had been accepted, on the
+    // next shard in turn. Takes ownership of fd, even on failure. Safe from
+    // any thread between open() and the end of run(). Returns -1 when the
+    // server is not open.
+    int add_client(int fd);
+
+    // The plain-text report the stats endpoint serves
+    void stats(std::string *out) const;
+
+private:
+    void close();
+
+    ChatServerConfig config_;
+    // Lives as long as the object, with the fd stop() wakes shard 0
+    // through, so stop() never touches what close() tears down
+    std::unique_ptr<ChatEngine> eng_;
+    std::atomic<bool> open_{ false };
+    bool ran_{ false };
+    bool handed_off_{ false };
+};
@@ -0,0 +1,107 @@
+// Slab-backed registry mapping epoll tokens to per-connection state
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Entries live in fixed-size chunks so their addresses never move, and are
+// addressed by a token packing (generation << 32 | slot). The token is what
+// goes into epoll_event.data.u64: lookup is two array indexations, and an
+// event for a slot that was released (or released and reused) carries an old
+// generation and simply misses. Generation 0 is never handed out, so callers
+// may use tokens with a zero generation for their own non-client fds, and
+// generations stay below 2^31 so the top bit of a token is free for callers
+// to tag operations with.
+template <typename T>
+class SlabRegistry {
+public:
+    static constexpr uint32_t CHUNK_SHIFT = 8;
+    static constexpr uint32_t CHUNK_SIZE = 1u << CHUNK_SHIFT;
+    static constexpr uint32_t GEN_MAX = 0x7fffffffu;
+
+    static uint32_t token_slot(uint64_t token) { return static_cast<uint32_t>(token); }
+    static uint32_t token_gen(uint64_t token) { return static_cast<uint32_t>(token >> 32); }
+
+    // Returns a value-initialised entry, or nullptr on allocation failure.
+    T *acquire(uint64_t *token) {
+        if (free_slots_.empty() && grow() != 0) return nullptr;
+        uint32_t slot = free_slots_.back();
+        Entry &en = entry(slot);
+        free_slots_.pop_back();
+        live_.push_back(&en.value); // capacity reserved in grow()
+        live_slots_.push_back(slot);
+        en.used = true;
+        en.live_pos = static_cast<uint32_t>(live_.size() - 1);
+        *token = (static_cast<uint64_t>(en.gen) << 32) | slot;
+        return &en.value;
+    }
+
+    T *lookup(uint64_t token) {
+        uint32_t slot = token_slot(token);
+        if (slot >= capacity()) return nullptr;
+        Entry &en = entry(slot);
+        if (!en.used || en.gen != token_gen(token)) return nullptr;
+        return &en.value;
+    }
+
+    // Resets the entry and bumps its generation so outstanding tokens go stale.
+    void release(uint64_t token) {
+        uint32_t slot = token_slot(token);
+        if (slot >= capacity()) return;
+        Entry &en = entry(slot);
+        if (!en.used || en.gen != token_gen(token)) return;
+
+        // swap-remove from the dense live list
+        uint32_t last_slot = live_slots_.back();
+        live_[en.live_pos] = live_.back();
+        live_slots_[en.live_pos] = last_slot;
+        entry(last_slot).live_pos = en.live_pos;
+        live_.pop_back();
+        live_slots_.pop_back();
+
+        en.value = T{};
+        en.used = false;
+        if (++en.gen > GEN_MAX) en.gen = 1;
+        free_slots_.push_back(slot);
+    }
+
+    // Dense array of every live entry, for fan-out loops.
+    const std::vector<T *> &live() const { return live_; }
+    size_t size() const { return live_.size(); }
+    uint32_t capacity() const { return static_cast<uint32_t>(chunks_.size()) << CHUNK_SHIFT; }
+
+private:
+    struct Entry {
+        T value{};
+        uint32_t gen{ 1 };
+        uint32_t live_pos{ 0 };
+        bool used{ false };
+    };
+
+    Entry &entry(uint32_t slot) { return chunks_[slot >> CHUNK_SHIFT][slot & (CHUNK_SIZE - 1)]; }
+
+    int grow() {
+        uint32_t base = capacity();
+        try {
+            free_slots_.reserve(free_slots_.size() + CHUNK_SIZE);
+            live_.reserve(base + CHUNK_SIZE);
+            live_slots_.reserve(base + CHUNK_SIZE);
+            std::unique_ptr<Entry[]> chunk(new Entry[CHUNK_SIZE]);
+            chunks_.push_back(std::move(chunk));
+        } catch (...) {
+            return -1;
+        }
+        // hand out low slots first
+        for (uint32_t i = CHUNK_SIZE; i-- > 0;) free_slots_.push_back(base + i);
+        return 0;
+    }
+
+    std::vector<std::unique_ptr<Entry[]>> chunks_;
+    std::vector<uint32_t> free_slots_;
+    std::vector<T *> live_;
+    std::vector<uint32_t> live_slots_;
+};
@@ -0,0 +1,557 @@
+#include "federation.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <random>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "../common/wire_v2.hpp"
+#include "logger.hpp"
+
+// Largest message a record may carry: one v2 frame, header included
+static const size_t FED_MAX_MESSAGE = V2_MAX_HEADER + V2_MAX_BODY;
+// Bytes read from one link before its buffered frames are handled
+static const size_t FED_READ_CHUNK = 256 * 1024;
+
+static uint64_t monotonic_ms() { return monotonic_ns() / 1000000; }
+
+static int resolve_peer(const std::string &spec, sockaddr_in *out) {
+    size_t colon = spec.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == spec.size()) return -1;
+    std::string host = spec.substr(0, colon);
+    std::string port = spec.substr(colon + 1);
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) return -1;
+    std::memcpy(out, res->ai_addr, sizeof(*out));
+    freeaddrinfo(res);
+    return 0;
+}
+
+// Reads a varint field of a link frame body; false when it is cut short
+static bool get_field(const uint8_t *p, size_t len, size_t *off, uint64_t *v) {
+    size_t used = 0;
+    if (varint_get(p + *off, len - *off, 10, v, &used) != 1) return false;
+    *off += used;
+    return true;
+}
+
+// A relayed message must be exactly one V2_MSG or well-formed V2_BATCH
+static bool valid_message(const uint8_t *p, size_t len) {
+    if (len < 2 || (p[0] != V2_MSG && p[0] != V2_BATCH)) return false;
+    uint64_t body = 0;
+    size_t used = 0;
+    if (varint_get(p + 1, len - 1, V2_MAX_HEADER - 1, &body, &used) != 1) return false;
+    if (body > V2_MAX_BODY || 1 + used + body != len) return false;
+    if (p[0] == V2_MSG) return body <= MAX_MESSAGE_SIZE;
+    uint32_t off = 0;
+    const uint8_t *msg = nullptr;
+    uint32_t msg_len = 0;
+    int r;
+    while ((r = v2_batch_next(p + 1 + used, static_cast<uint32_t>(body), &off, &msg, &msg_len)) == 1) {
+    }
+    return r == 0;
+}
+
+Federation::~Federation() {
+    stop();
+    for (std::unique_ptr<Link> &l : links_) {
+        if (l->fd >= 0) close(l->fd);
+    }
+    for (Op *op = queue_.pop_all(); op;) {
+        Op *next = op->next;
+        frame_unref(op->frame);
+        delete op;
+        op = next;
+    }
+    if (listen_fd_ >= 0) close(listen_fd_);
+    if (epfd_ >= 0) close(epfd_);
+    if (wake_fd_ >= 0) close(wake_fd_);
+}
+
+int Federation::open(const FederationConfig &cfg, ChannelDirectory *channels, int listen_fd) {
+    channels_ = channels;
+    std::random_device rd;
+    node_id_ = cfg.node_id;
+    while (node_id_ == 0) node_id_ = rd();
+    incarnation_ = (static_cast<uint64_t>(rd()) << 32 | rd()) ^ monotonic_ns();
+    for (const std::string &spec : cfg.peers) {
+        Peer p;
+        p.name = spec;
+        if (resolve_peer(spec, &p.addr) != 0) {
+            std::fprintf(stderr, "Cannot resolve peer %s\n", spec.c_str());
+            return -1;
+        }
+        peers_.push_back(p);
+    }
+
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd_ < 0 || wake_fd_ < 0) {
+        std::perror("federation");
+        return -1;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_fd_;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+
+    listen_fd_ = listen_fd;
+    if (listen_fd_ < 0 && cfg.listen_port) {
+        listen_fd_ = create_tcp_listener(cfg.listen_port);
+        if (listen_fd_ < 0) {
+            std::perror("peer listener");
+            return -1;
+        }
+    }
+    if (listen_fd_ >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &listen_fd_;
+        epoll_ctl(epfd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+    }
+    return 0;
+}
+
+int Federation::start(FederatedDelivery deliver, void *ctx) {
+    deliver_ = deliver;
+    deliver_ctx_ = ctx;
+    try {
+        thread_ = std::thread([this] { run(); });
+    } catch (...) {
+        return -1;
+    }
+    return 0;
+}
+
+void Federation::stop() {
+    if (!thread_.joinable()) return;
+    stopping_.store(true, std::memory_order_release);
+    uint64_t one = 1;
+    ssize_t r = write(wake_fd_, &one, sizeof(one));
+    (void)r;
+    thread_.join();
+}
+
+void Federation::forward(uint32_t channel, const WireFrames &w) {
+    int wire = w.v[WIRE_V2] ? WIRE_V2 : WIRE_V1;
+    if (!w.v[wire]) return;
+    if (pending_.fetch_add(1, std::memory_order_relaxed) >= MAX_PENDING) {
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        metrics_.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Op *op = new (std::nothrow) Op();
+    if (!op) {
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        metrics_.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    op->frame = w.v[wire];
+    frame_ref(op->frame);
+    op->wire = static_cast<uint8_t>(wire);
+    op->channel = channel;
+    if (!queue_.push(op)) return;
+    uint64_t one = 1;
+    ssize_t r = write(wake_fd_, &one, sizeof(one));
+    (void)r;
+}
+
+void Federation::run() {
+    const int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+    for (;;) {
+        uint64_t now = monotonic_ms();
+        int timeout = -1;
+        for (const Peer &p : peers_) {
+            if (p.dialing || p.node == node_id_) continue;
+            int wait = p.redial_ms > now ? static_cast<int>(p.redial_ms - now) : 0;
+            if (timeout < 0 || wait < timeout) timeout = wait;
+        }
+        int n = epoll_wait(epfd_, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            log_msg(LOG_ERROR, "Federation: epoll_wait: %e", errno);
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            void *p = events[i].data.ptr;
+            if (p == &wake_fd_) {
+                uint64_t count;
+                ssize_t r = read(wake_fd_, &count, sizeof(count));
+                (void)r;
+            } else if (p == &listen_fd_) {
+                accept_links();
+            } else {
+                on_link_event(static_cast<Link *>(p), events[i].events);
+            }
+        }
+
+        bool stopping = stopping_.load(std::memory_order_acquire);
+        for (Op *op = queue_.pop_all(); op;) {
+            Op *next = op->next;
+            encode(op);
+            frame_unref(op->frame);
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            delete op;
+            op = next;
+        }
+        seal_batch();
+        for (std::unique_ptr<Link> &l : links_) {
+            if (!l->closed && l->out.length > 0) flush_link(l.get());
+        }
+
+        now = monotonic_ms();
+        for (size_t i = 0; i < peers_.size() && !stopping; ++i) {
+            Peer &p = peers_[i];
+            if (p.dialing || p.redial_ms > now || p.node == node_id_) continue;
+            // a node that dialled us first needs no second link
+            bool linked = false;
+            for (const std::unique_ptr<Link> &l : links_) {
+                if (!l->closed && l->greeted && p.node != 0 && l->node == p.node) linked = true;
+            }
+            if (linked) p.redial_ms = now + REDIAL_MS;
+            else dial(i);
+        }
+        reap();
+        if (stopping && queue_.empty()) break;
+    }
+}
+
+void Federation::dial(size_t peer) {
+    Peer &p = peers_[peer];
+    p.redial_ms = monotonic_ms() + REDIAL_MS;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    int r = connect(fd, reinterpret_cast<const sockaddr *>(&p.addr), sizeof(p.addr));
+    if (r != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return;
+    }
+    std::unique_ptr<Link> l(new (std::nothrow) Link());
+    if (!l) {
+        close(fd);
+        return;
+    }
+    l->fd = fd;
+    l->peer = static_cast<int>(peer);
+    l->connecting = r != 0;
+    p.dialing = true;
+    add_link(std::move(l));
+}
+
+// Queues our greeting and starts watching the socket. Edge-triggered, so
+// writability is only reported once the socket buffer frees up again.
+void Federation::add_link(std::unique_ptr<Link> l) {
+    int one = 1;
+    setsockopt(l->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    uint8_t body[20];
+    size_t len = varint_put(node_id_, body);
+    len += varint_put(incarnation_, body + len);
+    uint8_t hdr[V2_MAX_HEADER];
+    size_t hlen = v2_put_header(FED_HELLO, static_cast<uint32_t>(len), hdr);
+    if (l->out.append(FED_MAGIC, FED_MAGIC_LEN) != 0 || l->out.append(hdr, hlen) != 0 || l->out.append(body, len) != 0) {
+        close_link(l.get());
+        return;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = l.get();
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, l->fd, &ev) != 0) {
+        close_link(l.get());
+        return;
+    }
+    try {
+        links_.push_back(std::move(l));
+    } catch (...) {
+        close_link(l.get());
+    }
+}
+
+void Federation::accept_links() {
+    for (;;) {
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_msg(LOG_ERROR, "Federation: accept: %e", errno);
+            return;
+        }
+        std::unique_ptr<Link> l(new (std::nothrow) Link());
+        if (!l) {
+            close(fd);
+            continue;
+        }
+        l->fd = fd;
+        add_link(std::move(l));
+    }
+}
+
+void Federation::on_link_event(Link *l, uint32_t events) {
+    if (l->closed) return;
+    if (l->connecting) {
+        int err = 0;
+        socklen_t elen = sizeof(err);
+        if (getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &elen) != 0 || err != 0) {
+            close_link(l);
+            return;
+        }
+        if (!(events & EPOLLOUT)) return;
+        l->connecting = false;
+    }
+    if (events & EPOLLERR) {
+        close_link(l);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && read_link(l) != 0) {
+        close_link(l);
+        return;
+    }
+    if ((events & EPOLLOUT) && l->out.length > 0) flush_link(l);
+}
+
+// Reads until the socket is drained, handling frames as they complete.
+// Returns -1 when the link must close: EOF, an error or a bad frame.
+int Federation::read_link(Link *l) {
+    for (;;) {
+        ReadStop stop = READ_STOP_AGAIN;
+        ssize_t r = read_into_buffer_nonblocking(l->fd, l->in, FED_READ_CHUNK, &stop);
+        if (r < 0) return -1;
+        metrics_.bytes_in.add(static_cast<uint64_t>(r));
+
+        if (!l->opened && l->in.length >= FED_MAGIC_LEN) {
+            char magic[FED_MAGIC_LEN];
+            l->in.peek(0, magic, FED_MAGIC_LEN);
+            if (std::memcmp(magic, FED_MAGIC, FED_MAGIC_LEN) != 0) return -1;
+            l->in.consume(FED_MAGIC_LEN);
+            l->opened = true;
+        }
+        while (l->opened && l->in.length >= 2) {
+            uint8_t hdr[V2_MAX_HEADER];
+            size_t avail = l->in.length < V2_MAX_HEADER ? l->in.length : V2_MAX_HEADER;
+            l->in.peek(0, hdr, avail);
+            uint64_t len = 0;
+            size_t used = 0;
+            int hr = varint_get(hdr + 1, avail - 1, V2_MAX_HEADER - 1, &len, &used);
+            if (hr < 0 || len > FED_MAX_BODY) return -1;
+            if (hr == 0 || l->in.length < 1 + used + len) break;
+            const uint8_t *body = buffer_view(l->in, 1 + used, static_cast<size_t>(len));
+            if (handle_frame(l, hdr[0], body, static_cast<size_t>(len)) != 0) return -1;
+            l->in.consume(1 + used + static_cast<size_t>(len));
+        }
+        if (stop == READ_STOP_EOF) return -1;
+        if (stop == READ_STOP_AGAIN) break;
+    }
+    l->in.trim();
+    return 0;
+}
+
+int Federation::handle_frame(Link *l, uint8_t type, const uint8_t *body, size_t len) {
+    if (l->greeted) {
+        if (type == FED_BATCH) return handle_batch(l, body, len);
+        return type == FED_HELLO ? -1 : 0; // unknown types are skipped
+    }
+    uint64_t node = 0, incarnation = 0;
+    size_t off = 0;
+    if (type != FED_HELLO || !get_field(body, len, &off, &node) || !get_field(body, len, &off, &incarnation)) return -1;
+    if (node == 0 || node > UINT32_MAX) return -1;
+    if (node == node_id_) {
+        // we dialled ourselves: that peer is never dialled again
+        if (l->peer >= 0) {
+            peers_[static_cast<size_t>(l->peer)].node = node_id_;
+            // the entry may still be queued once peers_ is gone
+            log_msg(LOG_WARN, "Federation: peer %s is this node, not dialling it",
+                    log_intern(peers_[static_cast<size_t>(l->peer)].name.c_str()));
+        }
+        return -1;
+    }
+    l->greeted = true;
+    l->node = static_cast<uint32_t>(node);
+    l->primary = true;
+    for (const std::unique_ptr<Link> &o : links_) {
+        if (o.get() != l && !o->closed && o->primary && o->node == l->node) l->primary = false;
+    }
+    Origin &origin = origins_[l->node];
+    if (origin.incarnation != incarnation) {
+        // the node restarted: its numbering starts over
+        origin.incarnation = incarnation;
+        origin.seq = 0;
+    }
+    if (l->peer >= 0) peers_[static_cast<size_t>(l->peer)].node = l->node;
+    metrics_.links_up.add();
+    metrics_.links.fetch_add(1, std::memory_order_relaxed);
+    log_msg(LOG_INFO, "Federation: link to node %u up%s", l->node, l->primary ? "" : " (standby)");
+    return 0;
+}
+
+int Federation::handle_batch(Link *l, const uint8_t *body, size_t len) {
+    Origin &origin = origins_[l->node];
+    size_t off = 0;
+    while (off < len) {
+        uint64_t seq = 0, name_len = 0, msg_len = 0;
+        if (!get_field(body, len, &off, &seq) || !get_field(body, len, &off, &name_len)) return -1;
+        if (name_len == 0 || name_len > MAX_CHANNEL_NAME || name_len > len - off) return -1;
+        const uint8_t *name = body + off;
+        off += static_cast<size_t>(name_len);
+        if (!get_field(body, len, &off, &msg_len)) return -1;
+        if (msg_len > FED_MAX_MESSAGE || msg_len > len - off) return -1;
+        const uint8_t *msg = body + off;
+        off += static_cast<size_t>(msg_len);
+        if (!valid_message(msg, static_cast<size_t>(msg_len))) return -1;
+
+        if (seq <= origin.seq) {
+            metrics_.duplicates.add();
+            continue;
+        }
+        origin.seq = seq;
+        uint32_t channel = room_id(std::string(reinterpret_cast<const char *>(name), static_cast<size_t>(name_len)));
+        if (channel == NO_CHANNEL) continue;
+        Frame *f = frame_alloc(static_cast<size_t>(msg_len));
+        if (!f) continue;
+        std::memcpy(f->data(), msg, static_cast<size_t>(msg_len));
+        WireFrames w;
+        w.v[WIRE_V2] = f;
+        deliver_(channel, w, deliver_ctx_);
+        wire_frames_unref(w);
+        metrics_.received.add();
+    }
+    return 0;
+}
+
+void Federation::close_link(Link *l) {
+    if (l->closed) return;
+    l->closed = true;
+    if (l->fd >= 0) {
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, l->fd, nullptr);
+        close(l->fd);
+        l->fd = -1;
+    }
+    uint64_t now = monotonic_ms();
+    if (l->peer >= 0) {
+        Peer &p = peers_[static_cast<size_t>(l->peer)];
+        p.dialing = false;
+        p.redial_ms = now + REDIAL_MS;
+    }
+    if (!l->greeted) return;
+    metrics_.links_down.add();
+    metrics_.links.fetch_sub(1, std::memory_order_relaxed);
+    log_msg(LOG_INFO, "Federation: link to node %u down", l->node);
+    // a standby link to the same node takes over; with none left, a peer
+    // we stopped dialling because that node dialled us dials again
+    bool linked = false;
+    for (std::unique_ptr<Link> &o : links_) {
+        if (o.get() == l || o->closed || !o->greeted || o->node != l->node) continue;
+        if (l->primary && !linked) o->primary = true;
+        linked = true;
+    }
+    if (linked) return;
+    for (Peer &p : peers_) {
+        if (!p.dialing && p.node == l->node) p.redial_ms = now;
+    }
+}
+
+void Federation::flush_link(Link *l) {
+    if (l->connecting) return;
+    size_t before = l->out.length;
+    int r = flush_buffered_writes(l->fd, l->out);
+    metrics_.bytes_out.add(before - l->out.length);
+    if (r < 0) close_link(l);
+    else if (r == 1) l->out.trim();
+}
+
+// Appends op's message to the batch being built. Records are numbered
+// whether or not a link is up to take them; peers only need the numbers to
+// grow.
+void Federation::encode(Op *op) {
+    ++seq_;
+    bool any = false;
+    for (const std::unique_ptr<Link> &l : links_) any = any || (!l->closed && l->primary);
+    if (!any) return;
+    Frame *converted = op->wire == WIRE_V2 ? nullptr : frame_v1_to_v2(op->frame);
+    const Frame *msg = op->wire == WIRE_V2 ? op->frame : converted;
+    const std::string &name = room_name(op->channel);
+    if (msg && !name.empty()) {
+        uint8_t fields[30];
+        size_t flen = varint_put(seq_, fields);
+        size_t nlen = varint_put(name.size(), fields + flen);
+        uint8_t mlen[10];
+        size_t mlen_len = varint_put(msg->size, mlen);
+        size_t need = flen + nlen + name.size() + mlen_len + msg->size;
+        if (batch_.size() + need > FED_MAX_BODY) seal_batch();
+        try {
+            batch_.insert(batch_.end(), fields, fields + flen + nlen);
+            batch_.insert(batch_.end(), name.begin(), name.end());
+            batch_.insert(batch_.end(), mlen, mlen + mlen_len);
+            batch_.insert(batch_.end(), msg->data(), msg->data() + msg->size);
+            ++batch_records_;
+        } catch (...) {
+            // out of memory: peers see a gap in the numbering
+        }
+    }
+    if (converted) frame_unref(converted);
+}
+
+// Frames the records built so far and queues the same bytes on every
+// primary link. A link whose backlog passes MAX_BACKLOG is dropped; it
+// comes back when redialled.
+void Federation::seal_batch() {
+    if (batch_records_ == 0) return;
+    uint8_t hdr[V2_MAX_HEADER];
+    size_t hlen = v2_put_header(FED_BATCH, static_cast<uint32_t>(batch_.size()), hdr);
+    for (std::unique_ptr<Link> &l : links_) {
+        if (l->closed || !l->primary) continue;
+        if (l->out.append(hdr, hlen) != 0 || l->out.append(batch_.data(), batch_.size()) != 0 ||
+            l->out.length > MAX_BACKLOG) {
+            metrics_.overflows.add();
+            close_link(l.get());
+            continue;
+        }
+        metrics_.sent.add(batch_records_);
+        metrics_.batches.add();
+    }
+    metrics_.batch.record(batch_records_);
+    batch_.clear();
+    batch_records_ = 0;
+}
+
+void Federation::reap() {
+    size_t kept = 0;
+    for (size_t i = 0; i < links_.size(); ++i) {
+        if (links_[i]->closed) continue;
+        if (kept != i) links_[kept] = std::move(links_[i]);
+        ++kept;
+    }
+    links_.resize(kept);
+}
+
+// Room ids never change meaning within a process, so both directions are
+// cached here instead of taking the directory's lock per record.
+const std::string &Federation::room_name(uint32_t channel) {
+    static const std::string none;
+    try {
+        if (channel >= names_.size()) names_.resize(channel + 1);
+        if (names_[channel].empty()) names_[channel] = channels_->name(channel);
+        return names_[channel];
+    } catch (...) {
+        return none;
+    }
+}
+
+uint32_t Federation::room_id(const std::string &name) {
+    auto it = ids_.find(name);
+    if (it != ids_.end()) return it->second;
+    uint32_t id = channels_->intern(name);
+    if (id == NO_CHANNEL) return id;
+    try {
+        ids_.emplace(name, id);
+    } catch (...) {
+        // uncached: looked up again next time
+    }
+    return id;
+}
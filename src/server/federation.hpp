@@ -0,0 +1,170 @@
+// Federation: server processes relay room broadcasts to each other over
+// TCP peer links, so one room spans every node
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+
+#include "../common/common.hpp"
+#include "../common/frame.hpp"
+#include "channels.hpp"
+#include "metrics.hpp"
+#include "mpsc_queue.hpp"
+
+// Link protocol. Both ends send FED_MAGIC and a FED_HELLO as soon as the
+// TCP connection is up, then FED_BATCH frames. Frames are laid out like v2
+// ones (type, varint body length, body) but allow bodies up to
+// FED_MAX_BODY.
+//   FED_HELLO: varint node id, varint incarnation (differs on every start)
+//   FED_BATCH: records of varint seq, varint room name length, room name,
+//              varint message length, the message as a V2_MSG or V2_BATCH
+//              frame
+// A node relays only the broadcasts its own clients sent, each to every
+// peer once, and never passes on what it received: with every node linked
+// to every other, each message crosses one link. seq numbers a node's
+// records from 1 per incarnation, so a record seen twice (over a second link
+// to the same node) is dropped, and so is any link that claims our own id.
+#define FED_MAGIC "CHF1"
+static const size_t FED_MAGIC_LEN = 4;
+enum FedType : uint8_t {
+    FED_HELLO = 1,
+    FED_BATCH = 2,
+};
+static const size_t FED_MAX_BODY = 256 * 1024;
+
+struct FederationConfig {
+    uint32_t node_id{ 0 };          // 0 picks a random one
+    uint16_t listen_port{ 0 };      // 0 only dials out
+    std::vector<std::string> peers; // HOST:PORT of nodes to dial
+};
+
+// Called on the federation thread for each broadcast a peer relayed, with
+// the local id of its room (interned on first sight) and its V2 encoding.
+// The callee takes its own references; ctx is what start() was given.
+using FederatedDelivery = void (*)(uint32_t channel, const WireFrames &w, void *ctx);
+
+// Written by the federation thread only, like the shard metrics; `dropped`
+// is bumped by the event loops and so is a plain atomic.
+struct FederationMetrics {
+    Counter links_up;   // handshakes completed
+    Counter links_down; // links closed after their handshake
+    Counter overflows;  // links dropped for falling MAX_BACKLOG behind
+    Counter sent;       // records written to links
+    Counter batches;    // FED_BATCH frames written to links
+    Counter bytes_out;
+    Counter bytes_in;
+    Counter received;   // records handed to the event loops
+    Counter duplicates; // records dropped as already seen
+    std::atomic<uint64_t> links{ 0 };   // links up right now
+    std::atomic<uint64_t> dropped{ 0 }; // forwards refused while the thread lagged
+    Histogram batch;    // records per FED_BATCH frame
+};
+
+// The event loops hand each local broadcast (a reference to its encoding)
+// to the federation thread through an MPSC queue. The thread drains
+// everything queued per wakeup and encodes it once into FED_BATCH frames
+// shared by every link, so a burst costs one frame and one write per peer
+// however many messages it holds. Links that drop are redialled every
+// REDIAL_MS; what was queued on a link when it dropped is lost.
+class Federation {
+public:
+    static constexpr size_t MAX_PENDING = 1u << 18;
+    static constexpr size_t MAX_BACKLOG = 64u << 20; // unsent bytes per link
+    static constexpr uint64_t REDIAL_MS = 1000;
+
+    Federation() = default;
+    Federation(const Federation &) = delete;
+    Federation &operator=(const Federation &) = delete;
+    ~Federation();
+
+    // Resolves the peers and opens the peer listener, or adopts listen_fd
+    // when it is not -1 (hot restart). Returns -1 on error.
+    int open(const FederationConfig &cfg, ChannelDirectory *channels, int listen_fd);
+    int start(FederatedDelivery deliver, void *ctx);
+    // Writes what is queued to the links that take it and joins the thread.
+    void stop();
+
+    // Event-loop side. Takes a reference to the sender's encoding of w.
+    void forward(uint32_t channel, const WireFrames &w);
+
+    uint32_t node_id() const { return node_id_; }
+    int listen_fd() const { return listen_fd_; }
+    const FederationMetrics &metrics() const { return metrics_; }
+
+private:
+    struct Op {
+        Op *next{ nullptr };
+        Frame *frame{ nullptr };
+        uint8_t wire{ 0 };
+        uint32_t channel{ 0 };
+    };
+    struct Peer {
+        std::string name; // as configured
+        sockaddr_in addr{};
+        uint32_t node{ 0 };    // learned from its hello
+        bool dialing{ false }; // one of our links is (or is becoming) up
+        uint64_t redial_ms{ 0 };
+    };
+    struct Link {
+        int fd{ -1 };
+        int peer{ -1 }; // index in peers_ for links we dialled
+        bool connecting{ false };
+        bool opened{ false };  // its magic arrived
+        bool greeted{ false }; // and then its hello
+        bool primary{ false }; // the link we send that node's records on
+        bool closed{ false };
+        uint32_t node{ 0 };
+        Buffer in{};
+        Buffer out{};
+    };
+    // What we last accepted from one node
+    struct Origin {
+        uint64_t incarnation{ 0 };
+        uint64_t seq{ 0 };
+    };
+
+    void run();
+    void dial(size_t peer);
+    void add_link(std::unique_ptr<Link> link);
+    void accept_links();
+    void on_link_event(Link *l, uint32_t events);
+    int read_link(Link *l);
+    int handle_frame(Link *l, uint8_t type, const uint8_t *body, size_t len);
+    int handle_batch(Link *l, const uint8_t *body, size_t len);
+    void close_link(Link *l);
+    void flush_link(Link *l);
+    void encode(Op *op);
+    void seal_batch();
+    void reap();
+    const std::string &room_name(uint32_t channel);
+    uint32_t room_id(const std::string &name);
+
+    uint32_t node_id_{ 0 };
+    uint64_t incarnation_{ 0 };
+    ChannelDirectory *channels_{ nullptr };
+    int listen_fd_{ -1 };
+    int epfd_{ -1 };
+    int wake_fd_{ -1 };
+    std::vector<Peer> peers_;
+    std::vector<std::unique_ptr<Link>> links_;
+    std::unordered_map<uint32_t, Origin> origins_;
+    std::vector<std::string> names_;                 // room names by id, cached
+    std::unordered_map<std::string, uint32_t> ids_; // and ids by name
+    std::vector<uint8_t> batch_; // records not yet sealed into a frame
+    uint32_t batch_records_{ 0 };
+    uint64_t seq_{ 0 };
+    MpscQueue<Op> queue_{};
+    std::atomic<size_t> pending_{ 0 };
+    std::atomic<bool> stopping_{ false };
+    FederatedDelivery deliver_{ nullptr };
+    void *deliver_ctx_{ nullptr };
+    std::thread thread_{};
+    FederationMetrics metrics_{};
+};
@@ -0,0 +1,217 @@
+#include "handoff.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Every packet starts with its kind. Fds ride on FDS packets in batches
+// below the kernel's per-message limit, and the blob follows in DATA
+// chunks; END closes the stream and the receiver answers with ACK.
+enum PacketKind : uint8_t { PACKET_FDS = 'F', PACKET_DATA = 'D', PACKET_END = 'E', PACKET_ACK = 'A' };
+
+static const size_t CHUNK = 32 * 1024;
+static const size_t FDS_PER_PACKET = 200; // SCM_MAX_FD is 253
+
+void HandoffWriter::u32(uint32_t v) {
+    for (int i = 0; i < 4; ++i) data_.push_back(static_cast<uint8_t>(v >> (8 * i)));
+}
+
+void HandoffWriter::u64(uint64_t v) {
+    for (int i = 0; i < 8; ++i) data_.push_back(static_cast<uint8_t>(v >> (8 * i)));
+}
+
+void HandoffWriter::raw(const void *p, size_t len) {
+    const uint8_t *b = static_cast<const uint8_t *>(p);
+    data_.insert(data_.end(), b, b + len);
+}
+
+void HandoffWriter::str(const std::string &s) {
+    u32(static_cast<uint32_t>(s.size()));
+    raw(s.data(), s.size());
+}
+
+void HandoffWriter::fd(int fd) {
+    if (fd < 0) {
+        u32(NO_FD);
+        return;
+    }
+    u32(static_cast<uint32_t>(fds_.size()));
+    fds_.push_back(fd);
+}
+
+bool HandoffReader::raw(size_t len, const uint8_t **p) {
+    if (!ok_ || data_.size() - off_ < len) return ok_ = false;
+    *p = data_.data() + off_;
+    off_ += len;
+    return true;
+}
+
+bool HandoffReader::u8(uint8_t *v) {
+    const uint8_t *p = nullptr;
+    if (!raw(1, &p)) return false;
+    *v = p[0];
+    return true;
+}
+
+bool HandoffReader::u32(uint32_t *v) {
+    const uint8_t *p = nullptr;
+    if (!raw(4, &p)) return false;
+    *v = 0;
+    for (int i = 0; i < 4; ++i) *v |= static_cast<uint32_t>(p[i]) << (8 * i);
+    return true;
+}
+
+bool HandoffReader::u64(uint64_t *v) {
+    const uint8_t *p = nullptr;
+    if (!raw(8, &p)) return false;
+    *v = 0;
+    for (int i = 0; i < 8; ++i) *v |= static_cast<uint64_t>(p[i]) << (8 * i);
+    return true;
+}
+
+bool HandoffReader::str(std::string *s) {
+    uint32_t len = 0;
+    const uint8_t *p = nullptr;
+    if (!u32(&len) || !raw(len, &p)) return false;
+    s->assign(reinterpret_cast<const char *>(p), len);
+    return true;
+}
+
+bool HandoffReader::fd(int *fd) {
+    uint32_t index = 0;
+    if (!u32(&index)) return false;
+    if (index == HandoffWriter::NO_FD) {
+        *fd = -1;
+        return true;
+    }
+    if (index >= fds_.size()) return ok_ = false;
+    *fd = fds_[index];
+    return true;
+}
+
+static int unix_address(const char *path, sockaddr_un *addr) {
+    std::memset(addr, 0, sizeof(*addr));
+    if (std::strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr->sun_family = AF_UNIX;
+    std::strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char *path) {
+    sockaddr_un addr;
+    if (unix_address(path, &addr) != 0) return -1;
+    int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    ::unlink(path);
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || ::listen(fd, 1) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_connect(const char *path) {
+    sockaddr_un addr;
+    if (unix_address(path, &addr) != 0) return -1;
+    int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_packet(int sock, uint8_t kind, const uint8_t *p, size_t len, const int *fds, size_t nfds) {
+    iovec iov[2];
+    iov[0].iov_base = &kind;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = const_cast<uint8_t *>(p);
+    iov[1].iov_len = len;
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len > 0 ? 2 : 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * FDS_PER_PACKET)];
+    if (nfds > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        std::memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+    for (;;) {
+        ssize_t r = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (r >= 0) return 0;
+        if (errno != EINTR) return -1;
+    }
+}
+
+int handoff_send(int sock, const HandoffWriter &w) {
+    // the peer reads at its own pace; blocking sends keep this simple
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags >= 0) fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+
+    const std::vector<int> &fds = w.fds();
+    for (size_t i = 0; i < fds.size(); i += FDS_PER_PACKET) {
+        size_t n = fds.size() - i < FDS_PER_PACKET ? fds.size() - i : FDS_PER_PACKET;
+        if (send_packet(sock, PACKET_FDS, nullptr, 0, fds.data() + i, n) != 0) return -1;
+    }
+    const std::vector<uint8_t> &data = w.data();
+    for (size_t off = 0; off < data.size(); off += CHUNK) {
+        size_t n = data.size() - off < CHUNK ? data.size() - off : CHUNK;
+        if (send_packet(sock, PACKET_DATA, data.data() + off, n, nullptr, 0) != 0) return -1;
+    }
+    if (send_packet(sock, PACKET_END, nullptr, 0, nullptr, 0) != 0) return -1;
+
+    uint8_t ack = 0;
+    ssize_t r;
+    do {
+        r = ::recv(sock, &ack, 1, 0);
+    } while (r < 0 && errno == EINTR);
+    return r == 1 && ack == PACKET_ACK ? 0 : -1;
+}
+
+int handoff_recv(int sock, std::vector<uint8_t> *data, std::vector<int> *fds) {
+    std::vector<uint8_t> buf(1 + CHUNK);
+    for (;;) {
+        iovec iov;
+        iov.iov_base = buf.data();
+        iov.iov_len = buf.size();
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * FDS_PER_PACKET)];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t r = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) return -1;
+
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+            size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const uint8_t *p = CMSG_DATA(cm);
+            for (size_t i = 0; i < n; ++i) {
+                int fd;
+                std::memcpy(&fd, p + i * sizeof(int), sizeof(int));
+                fds->push_back(fd);
+            }
+        }
+        if (buf[0] == PACKET_DATA) {
+            data->insert(data->end(), buf.begin() + 1, buf.begin() + r);
+        } else if (buf[0] == PACKET_END) {
+            uint8_t ack = PACKET_ACK;
+            return ::send(sock, &ack, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+        } else if (buf[0] != PACKET_FDS) {
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,66 @@
+// Hot restart: a running server hands its sockets and per-connection state
+// to a new server process over a Unix socket
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Builds the state blob. Integers are fixed-width little-endian; file
+// descriptors are collected on the side and written as their index in the
+// list, which travels as SCM_RIGHTS ancillary data.
+class HandoffWriter {
+public:
+    static constexpr uint32_t NO_FD = UINT32_MAX;
+
+    void u8(uint8_t v) { data_.push_back(v); }
+    void u32(uint32_t v);
+    void u64(uint64_t v);
+    void raw(const void *p, size_t len);
+    // Length-prefixed byte string
+    void str(const std::string &s);
+    // fd < 0 is written as NO_FD
+    void fd(int fd);
+
+    const std::vector<uint8_t> &data() const { return data_; }
+    const std::vector<int> &fds() const { return fds_; }
+
+private:
+    std::vector<uint8_t> data_;
+    std::vector<int> fds_;
+};
+
+// Reads a blob written by HandoffWriter. Every getter returns false once
+// the input runs short, so callers can check once at the end of a record.
+class HandoffReader {
+public:
+    HandoffReader(const std::vector<uint8_t> &data, const std::vector<int> &fds) : data_(data), fds_(fds) {}
+
+    bool u8(uint8_t *v);
+    bool u32(uint32_t *v);
+    bool u64(uint64_t *v);
+    // Points *p at len bytes inside the blob
+    bool raw(size_t len, const uint8_t **p);
+    bool str(std::string *s);
+    // Resolves an fd index; NO_FD becomes -1
+    bool fd(int *fd);
+    bool ok() const { return ok_; }
+
+private:
+    const std::vector<uint8_t> &data_;
+    const std::vector<int> &fds_;
+    size_t off_{ 0 };
+    bool ok_{ true };
+};
+
+// SOCK_SEQPACKET listener at path (a stale socket file is replaced), non-blocking.
+int handoff_listen(const char *path);
+// Connects to a running server's handoff socket. Returns -1 when nobody is
+// listening there, which simply means there is nothing to take over.
+int handoff_connect(const char *path);
+// Sends the blob and its fds, then waits for the receiver to confirm it
+// holds them. Returns 0 once confirmed, -1 otherwise.
+int handoff_send(int sock, const HandoffWriter &w);
+// Receives a blob and its fds and confirms receipt. Returns 0 or -1.
+int handoff_recv(int sock, std::vector<uint8_t> *data, std::vector<int> *fds);
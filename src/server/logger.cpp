@@ -0,0 +1,316 @@
+#include "logger.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "../common/common.hpp"
+
+LogLevel g_log_threshold = LOG_INFO;
+
+namespace {
+
+// Single-producer ring owned by one thread. Like the buffer pool's caches,
+// rings are never freed: the logger may still be reading one whose thread
+// has exited.
+struct LogRing {
+    alignas(64) std::atomic<uint64_t> tail{ 0 }; // written by the owner
+    alignas(64) std::atomic<uint64_t> head{ 0 }; // written by the logger
+    std::atomic<uint64_t> dropped{ 0 };          // written by the owner
+    LogEntry slots[LOG_RING_ENTRIES];
+};
+
+// How long the logger sleeps when every ring was empty. Producers never
+// wake it, so an idle logger costs them nothing.
+const int IDLE_SLEEP_MS = 10;
+
+std::mutex g_rings_mu;
+std::vector<LogRing *> *g_rings = nullptr; // outlives static destructors
+std::atomic<bool> g_running{ false };
+std::atomic<bool> g_stopping{ false };
+std::thread g_thread;
+std::mutex g_start_mu; // guards g_starts and the thread's start and join
+int g_starts = 0;
+std::atomic<uint64_t> g_lines{ 0 };
+
+thread_local LogRing *tl_ring = nullptr;
+
+LogRing *thread_ring() {
+    if (tl_ring) return tl_ring;
+    LogRing *r = new (std::nothrow) LogRing();
+    if (!r) return nullptr;
+    std::lock_guard<std::mutex> lock(g_rings_mu);
+    try {
+        if (!g_rings) g_rings = new std::vector<LogRing *>();
+        g_rings->push_back(r);
+    } catch (...) {
+        delete r;
+        return nullptr;
+    }
+    tl_ring = r;
+    return r;
+}
+
+const char *level_name(uint8_t level) {
+    static const char *names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+    return level <= LOG_ERROR ? names[level] : "?    ";
+}
+
+void append_format(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void append_format(std::string &out, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = std::vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n > 0) out.append(buf, static_cast<size_t>(n) < sizeof(buf) ? static_cast<size_t>(n) : sizeof(buf) - 1);
+}
+
+// Entry times are monotonic; printing wants the wall clock
+int64_t wall_offset_ns() {
+    static const int64_t offset =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count() -
+        static_cast<int64_t>(monotonic_ns());
+    return offset;
+}
+
+// Renders one entry as a line: wall-clock time, level, message
+void format_entry(std::string &out, const LogEntry &e) {
+    int64_t wall = static_cast<int64_t>(e.time_ns) + wall_offset_ns();
+    time_t secs = static_cast<time_t>(wall / 1000000000);
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    char stamp[32];
+    size_t n = std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    out.append(stamp, n);
+    append_format(out, ".%03d %s ", static_cast<int>((wall / 1000000) % 1000), level_name(e.level));
+
+    int arg = 0;
+    for (const char *p = e.fmt; *p; ++p) {
+        if (*p != '%' || p[1] == '\0') {
+            out.push_back(*p);
+            continue;
+        }
+        char spec = *++p;
+        if (spec == '%') {
+            out.push_back('%');
+            continue;
+        }
+        if (arg >= e.nargs) {
+            out.append("<missing>");
+            continue;
+        }
+        uint64_t v = e.args[arg++];
+        switch (spec) {
+        case 'u':
+            append_format(out, "%llu", static_cast<unsigned long long>(v));
+            break;
+        case 'd':
+            append_format(out, "%lld", static_cast<long long>(v));
+            break;
+        case 'x':
+            append_format(out, "%llx", static_cast<unsigned long long>(v));
+            break;
+        case 's': {
+            const char *s = reinterpret_cast<const char *>(static_cast<uintptr_t>(v));
+            out.append(s ? s : "(null)");
+            break;
+        }
+        case 'e': {
+            char buf[128];
+            out.append(strerror_r(static_cast<int>(v), buf, sizeof(buf)));
+            break;
+        }
+        case 'a': {
+            in_addr addr;
+            addr.s_addr = static_cast<uint32_t>(v >> 16);
+            char ip[INET_ADDRSTRLEN];
+            if (!inet_ntop(AF_INET, &addr, ip, sizeof(ip))) std::strcpy(ip, "?");
+            append_format(out, "%s:%u", ip, static_cast<unsigned>(ntohs(static_cast<uint16_t>(v & 0xffff))));
+            break;
+        }
+        default:
+            out.push_back('%');
+            out.push_back(spec);
+            break;
+        }
+    }
+    out.push_back('\n');
+}
+
+void write_all(int fd, const std::string &s) {
+    size_t off = 0;
+    while (off < s.size()) {
+        ssize_t n = write(fd, s.data() + off, s.size() - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        off += static_cast<size_t>(n);
+    }
+}
+
+// Writes a batch with one write per stream
+void write_entries(std::vector<LogEntry> &batch, std::string &out, std::string &err) {
+    // rings are drained one after another; the merged batch is put back
+    // in time order
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](const LogEntry &a, const LogEntry &b) { return a.time_ns < b.time_ns; });
+    for (const LogEntry &e : batch) format_entry(e.level >= LOG_WARN ? err : out, e);
+    if (!out.empty()) write_all(STDOUT_FILENO, out);
+    if (!err.empty()) write_all(STDERR_FILENO, err);
+    g_lines.fetch_add(batch.size(), std::memory_order_relaxed);
+    batch.clear();
+    out.clear();
+    err.clear();
+}
+
+uint64_t total_dropped() {
+    uint64_t n = 0;
+    std::lock_guard<std::mutex> lock(g_rings_mu);
+    if (g_rings) {
+        for (const LogRing *r : *g_rings) n += r->dropped.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+// Moves every entry queued so far into batch. Returns how many.
+size_t drain_rings(std::vector<LogEntry> &batch) {
+    std::vector<LogRing *> rings;
+    {
+        std::lock_guard<std::mutex> lock(g_rings_mu);
+        if (g_rings) rings = *g_rings;
+    }
+    size_t taken = 0;
+    for (LogRing *r : rings) {
+        uint64_t head = r->head.load(std::memory_order_relaxed);
+        uint64_t tail = r->tail.load(std::memory_order_acquire);
+        for (; head != tail; ++head, ++taken) batch.push_back(r->slots[head & (LOG_RING_ENTRIES - 1)]);
+        r->head.store(head, std::memory_order_release);
+    }
+    return taken;
+}
+
+void run_logger() {
+    std::vector<LogEntry> batch;
+    std::string out, err;
+    uint64_t reported = 0; // drops already announced
+    for (;;) {
+        bool stopping = g_stopping.load(std::memory_order_acquire);
+        size_t n = 0;
+        try {
+            n = drain_rings(batch);
+            uint64_t dropped = total_dropped();
+            if (dropped > reported) {
+                LogEntry e{};
+                e.time_ns = monotonic_ns();
+                e.fmt = "Logger: %u messages dropped";
+                e.args[0] = dropped - reported;
+                e.nargs = 1;
+                e.level = LOG_WARN;
+                batch.push_back(e);
+                reported = dropped;
+            }
+            if (!batch.empty()) write_entries(batch, out, err);
+        } catch (...) {
+            // out of memory: what was drained is lost, the next pass retries
+            batch.clear();
+            out.clear();
+            err.clear();
+        }
+        if (stopping && n == 0) break;
+        if (n == 0) std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_SLEEP_MS));
+    }
+}
+
+} // namespace
+
+void log_push(LogLevel level, const char *fmt, const uint64_t *args, int nargs) {
+    LogEntry e;
+    e.time_ns = monotonic_ns();
+    e.fmt = fmt;
+    for (int i = 0; i < nargs; ++i) e.args[i] = args[i];
+    e.level = level;
+    e.nargs = static_cast<uint8_t>(nargs);
+    if (!g_running.load(std::memory_order_acquire)) {
+        try {
+            std::string line;
+            format_entry(line, e);
+            write_all(level >= LOG_WARN ? STDERR_FILENO : STDOUT_FILENO, line);
+        } catch (...) {
+        }
+        return;
+    }
+    LogRing *r = thread_ring();
+    if (!r) return;
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+    if (tail - r->head.load(std::memory_order_acquire) >= LOG_RING_ENTRIES) {
+        r->dropped.store(r->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    r->slots[tail & (LOG_RING_ENTRIES - 1)] = e;
+    r->tail.store(tail + 1, std::memory_order_release);
+}
+
+const char *log_intern(const char *s) {
+    static std::mutex mu;
+    static auto *names = new std::unordered_set<std::string>(); // never freed
+    std::lock_guard<std::mutex> lock(mu);
+    try {
+        return names->insert(s).first->c_str();
+    } catch (...) {
+        return "?";
+    }
+}
+
+int log_start() {
+    std::lock_guard<std::mutex> lock(g_start_mu);
+    if (g_starts > 0) {
+        ++g_starts;
+        return 0;
+    }
+    g_stopping.store(false);
+    try {
+        g_thread = std::thread(run_logger);
+    } catch (...) {
+        return -1;
+    }
+    g_starts = 1;
+    g_running.store(true, std::memory_order_release);
+    return 0;
+}
+
+void log_stop() {
+    std::lock_guard<std::mutex> lock(g_start_mu);
+    if (g_starts == 0 || --g_starts > 0) return;
+    g_running.store(false, std::memory_order_release);
+    g_stopping.store(true, std::memory_order_release);
+    g_thread.join();
+}
+
+void logger_stats(LoggerStats *out) {
+    out->lines = g_lines.load(std::memory_order_relaxed);
+    out->dropped = total_dropped();
+}
+
+int parse_log_level(const char *text, LogLevel *out) {
+    static const char *names[] = { "debug", "info", "warn", "error" };
+    for (int i = 0; i <= LOG_ERROR; ++i) {
+        if (std::strcmp(text, names[i]) == 0) {
+            *out = static_cast<LogLevel>(i);
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,84 @@
+// Leveled console logging that keeps formatting and terminal I/O off the
+// event loops
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+enum LogLevel : uint8_t { LOG_DEBUG = 0, LOG_INFO = 1, LOG_WARN = 2, LOG_ERROR = 3 };
+
+static const int LOG_MAX_ARGS = 5;
+static const size_t LOG_RING_ENTRIES = 4096; // per thread, a power of two
+
+// One message as the hot path leaves it: a format string with static
+// storage and its raw arguments. Formatting, timestamps and the write
+// happen on the logger thread.
+struct LogEntry {
+    uint64_t time_ns; // monotonic
+    const char *fmt;
+    uint64_t args[LOG_MAX_ARGS];
+    uint8_t level;
+    uint8_t nargs;
+    uint8_t pad[6];
+};
+static_assert(sizeof(LogEntry) == 64, "one cache line per entry");
+
+// Messages below this level are discarded before anything is written
+extern LogLevel g_log_threshold;
+
+// Writes an entry to the calling thread's ring, a fixed-size copy and one
+// release store. A full ring drops the entry and counts it; nothing on
+// this path locks, allocates (after a thread's first message) or makes a
+// syscall. Before log_start() and after log_stop() the entry is formatted
+// and written on the spot instead.
+void log_push(LogLevel level, const char *fmt, const uint64_t *args, int nargs);
+
+// Format directives, each taking one argument:
+//   %u %d %x  unsigned, signed and hex integers
+//   %s        a string that outlives the logger (a literal, argv or one
+//             from log_intern())
+//   %e        an errno value, printed as its text
+//   %a        an IPv4 address and port packed by log_ipv4()
+//   %%        a literal percent sign
+inline uint64_t log_arg(const char *s) { return reinterpret_cast<uintptr_t>(s); }
+template <typename T>
+inline uint64_t log_arg(T v) {
+    static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "log arguments are integers or strings");
+    return static_cast<uint64_t>(v);
+}
+// addr and port in network byte order, as in a sockaddr_in
+inline uint64_t log_ipv4(uint32_t addr, uint16_t port) { return static_cast<uint64_t>(addr) << 16 | port; }
+
+template <typename... A>
+inline void log_msg(LogLevel level, const char *fmt, A... args) {
+    static_assert(sizeof...(A) <= LOG_MAX_ARGS, "too many log arguments");
+    if (level < g_log_threshold) return;
+    uint64_t v[sizeof...(A) + 1] = { log_arg(args)... };
+    log_push(level, fmt, v, static_cast<int>(sizeof...(A)));
+}
+
+// A copy of s that is never freed, for a %s whose own storage may go away
+// while the entry is still queued (the logger is shared by every server in
+// the process). Equal strings share one copy. Locks: call it once per name,
+// not per message.
+const char *log_intern(const char *s);
+
+// Starts the thread that drains every ring, merges the entries by time and
+// writes them in batches: INFO and below to stdout, WARN and above to
+// stderr. Returns -1 if it could not start (messages stay synchronous).
+// Calls are counted, so several servers in one process can share it.
+int log_start();
+// Undoes one successful log_start(); the last one writes everything still
+// queued and joins the thread. Call once the other threads that log have
+// stopped.
+void log_stop();
+
+struct LoggerStats {
+    uint64_t lines{ 0 };   // messages written
+    uint64_t dropped{ 0 }; // messages lost to full rings
+};
+void logger_stats(LoggerStats *out);
+
+// Parses debug, info, warn or error
+int parse_log_level(const char *text, LogLevel *out);
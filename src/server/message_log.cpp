@@ -0,0 +1,402 @@
+#include "message_log.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../common/common.hpp"
+#include "logger.hpp"
+
+static const char SEGMENT_MAGIC[8] = { 'C', 'H', 'A', 'T', 'L', 'O', 'G', '1' };
+static const size_t SEGMENT_HEADER = 16; // magic + reserved
+
+// Record header as laid out in the segment. `size` is stored last, so a
+// record cut short by a crash reads as the end of the segment.
+struct RecordHeader {
+    uint32_t size; // frame bytes that follow
+    uint8_t wire;
+    uint8_t pad[3];
+    uint32_t channel;
+    uint32_t prev; // offset of the room's previous record here, 0 if none
+    uint64_t seq;
+    uint64_t time_ms;
+};
+static_assert(sizeof(RecordHeader) == 32, "record header layout");
+
+static size_t record_bytes(uint32_t size) { return (sizeof(RecordHeader) + size + 7) & ~static_cast<size_t>(7); }
+
+static uint64_t wall_ms() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+static uint64_t segment_number(const char *name) {
+    char *end = nullptr;
+    unsigned long long n = std::strtoull(name, &end, 10);
+    if (end == name || std::strcmp(end, ".log") != 0) return 0;
+    return n;
+}
+
+MessageLog::~MessageLog() {
+    stop();
+    // appends that raced the stop (a federation peer's last broadcasts
+    // published during a handoff) are dropped
+    for (Op *op = queue_.pop_all(); op;) {
+        Op *next = op->next;
+        if (op->frame) frame_unref(op->frame);
+        delete op;
+        op = next;
+    }
+    for (Segment &seg : segments_) {
+        if (seg.base) munmap(seg.base, seg.size);
+    }
+    if (wake_fd_ >= 0) close(wake_fd_);
+}
+
+std::string MessageLog::segment_path(uint64_t number) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llu.log", static_cast<unsigned long long>(number));
+    return dir_ + "/" + name;
+}
+
+// The mapping keeps the file; the descriptor is closed once it is made.
+int MessageLog::map_segment(Segment &seg, bool create) {
+    std::string path = segment_path(seg.number);
+    int fd = ::open(path.c_str(), create ? O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC : O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        // runs on the log thread when a segment rolls over
+        log_msg(LOG_ERROR, "Message log %s: segment %u: %e", log_dir_, seg.number, errno);
+        return -1;
+    }
+    if (create) {
+        // reserve the blocks up front: a store into a mapped hole on a full
+        // disk would be a SIGBUS rather than an error
+        int r = posix_fallocate(fd, 0, static_cast<off_t>(segment_bytes_));
+        if (r != 0) {
+            log_msg(LOG_ERROR, "Message log %s: segment %u: posix_fallocate: %e", log_dir_, seg.number, r);
+            close(fd);
+            return -1;
+        }
+        seg.size = segment_bytes_;
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            log_msg(LOG_ERROR, "Message log %s: segment %u: fstat: %e", log_dir_, seg.number, errno);
+            close(fd);
+            return -1;
+        }
+        seg.size = static_cast<size_t>(st.st_size);
+        if (seg.size < SEGMENT_HEADER || seg.size > MAX_SEGMENT) {
+            log_msg(LOG_ERROR, "Message log %s: segment %u has a bad size", log_dir_, seg.number);
+            close(fd);
+            return -1;
+        }
+    }
+    void *p = mmap(nullptr, seg.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        log_msg(LOG_ERROR, "Message log %s: segment %u: mmap: %e", log_dir_, seg.number, errno);
+        return -1;
+    }
+    seg.base = static_cast<uint8_t *>(p);
+    if (create) {
+        std::memcpy(seg.base, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+        seg.end = SEGMENT_HEADER;
+    } else if (std::memcmp(seg.base, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0) {
+        log_msg(LOG_ERROR, "Message log %s: segment %u is not a message log segment", log_dir_, seg.number);
+        return -1;
+    }
+    return 0;
+}
+
+// Rebuilds the room links as it goes, so they are right even where the
+// file holds stale ones.
+int MessageLog::scan_segment(Segment &seg) {
+    size_t off = SEGMENT_HEADER;
+    try {
+        for (;;) {
+            RecordHeader h;
+            if (off + sizeof(h) > seg.size) break;
+            std::memcpy(&h, seg.base + off, sizeof(h));
+            if (h.size == 0 || h.seq == 0 || off + record_bytes(h.size) > seg.size) break;
+            uint32_t &newest = seg.newest[h.channel];
+            if (h.prev != newest) {
+                std::memcpy(seg.base + off + offsetof(RecordHeader, prev), &newest, sizeof(newest));
+            }
+            newest = static_cast<uint32_t>(off);
+            if (off == SEGMENT_HEADER) seg.first_ms = h.time_ms;
+            seg.last_ms = h.time_ms;
+            if (h.seq > last_seq_) last_seq_ = h.seq;
+            off += record_bytes(h.size);
+        }
+    } catch (...) {
+        return -1;
+    }
+    seg.end = seg.synced = off;
+    return 0;
+}
+
+int MessageLog::open(const std::string &dir, size_t segment_bytes, size_t retain_bytes) {
+    if (segment_bytes > MAX_SEGMENT) {
+        std::fprintf(stderr, "Message log segments are at most 4G\n");
+        return -1;
+    }
+    dir_ = dir;
+    log_dir_ = log_intern(dir.c_str());
+    segment_bytes_ = segment_bytes < MIN_SEGMENT ? MIN_SEGMENT : segment_bytes;
+    retain_bytes_ = retain_bytes;
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::perror(dir.c_str());
+        return -1;
+    }
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        std::perror(dir.c_str());
+        return -1;
+    }
+    std::vector<uint64_t> numbers;
+    while (dirent *e = readdir(d)) {
+        uint64_t n = segment_number(e->d_name);
+        if (n != 0) numbers.push_back(n);
+    }
+    closedir(d);
+    std::sort(numbers.begin(), numbers.end());
+
+    segments_.reserve(numbers.size() + 1);
+    for (uint64_t n : numbers) {
+        segments_.emplace_back();
+        Segment &seg = segments_.back();
+        seg.number = n;
+        if (map_segment(seg, false) != 0 || scan_segment(seg) != 0) return -1;
+    }
+    if (segments_.empty() && roll() != 0) return -1;
+    retire_old();
+
+    wake_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd_ < 0) {
+        std::perror("eventfd");
+        return -1;
+    }
+    return 0;
+}
+
+int MessageLog::roll() {
+    if (!segments_.empty()) sync_active();
+    Segment seg;
+    seg.number = segments_.empty() ? 1 : segments_.back().number + 1;
+    if (map_segment(seg, true) != 0) return -1;
+    seg.synced = 0;
+    uint8_t *base = seg.base;
+    try {
+        segments_.push_back(std::move(seg));
+    } catch (...) {
+        munmap(base, segment_bytes_);
+        return -1;
+    }
+    retire_old();
+    return 0;
+}
+
+// Deletes the oldest segments while all of them together are over the
+// retention limit. The one being appended to always stays.
+void MessageLog::retire_old() {
+    if (retain_bytes_ == 0) return;
+    size_t total = 0;
+    for (const Segment &seg : segments_) total += seg.size;
+    size_t n = 0;
+    while (total > retain_bytes_ && n + 1 < segments_.size()) {
+        Segment &seg = segments_[n++];
+        total -= seg.size;
+        munmap(seg.base, seg.size);
+        if (unlink(segment_path(seg.number).c_str()) != 0) {
+            log_msg(LOG_ERROR, "Message log %s: segment %u: unlink: %e", log_dir_, seg.number, errno);
+        }
+    }
+    segments_.erase(segments_.begin(), segments_.begin() + static_cast<long>(n));
+}
+
+int MessageLog::start(HistoryReply reply, void *ctx) {
+    reply_ = reply;
+    reply_ctx_ = ctx;
+    try {
+        thread_ = std::thread([this] { run(); });
+    } catch (...) {
+        return -1;
+    }
+    return 0;
+}
+
+void MessageLog::stop() {
+    if (!thread_.joinable()) return;
+    stopping_.store(true, std::memory_order_release);
+    uint64_t one = 1;
+    ssize_t r = write(wake_fd_, &one, sizeof(one));
+    (void)r;
+    thread_.join();
+}
+
+void MessageLog::push(Op *op) {
+    if (!queue_.push(op)) return;
+    uint64_t one = 1;
+    ssize_t r = write(wake_fd_, &one, sizeof(one));
+    (void)r;
+}
+
+void MessageLog::append(uint64_t seq, uint32_t channel, const WireFrames &w) {
+    int wire = w.v[WIRE_V2] ? WIRE_V2 : WIRE_V1;
+    if (!w.v[wire]) return;
+    if (pending_.fetch_add(1, std::memory_order_relaxed) >= MAX_PENDING) {
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        metrics_.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Op *op = new (std::nothrow) Op();
+    if (!op) {
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        metrics_.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    op->frame = w.v[wire];
+    frame_ref(op->frame);
+    op->seq = seq;
+    op->channel = channel;
+    op->wire = static_cast<uint8_t>(wire);
+    push(op);
+}
+
+void MessageLog::query(const HistoryQuery &q) {
+    Op *op = new (std::nothrow) Op();
+    if (!op) return;
+    op->query = q;
+    push(op);
+}
+
+void MessageLog::write_record(const Op &op) {
+    size_t need = record_bytes(op.frame->size);
+    if (need > segment_bytes_ - SEGMENT_HEADER) {
+        metrics_.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (segments_.back().end + need > segments_.back().size && roll() != 0) {
+        metrics_.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Segment &seg = segments_.back();
+    uint32_t *newest;
+    try {
+        newest = &seg.newest[op.channel];
+    } catch (...) {
+        metrics_.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    RecordHeader h{};
+    h.wire = op.wire;
+    h.channel = op.channel;
+    h.prev = *newest;
+    h.seq = op.seq;
+    h.time_ms = wall_ms();
+    uint8_t *at = seg.base + seg.end;
+    std::memcpy(at + sizeof(h), op.frame->data(), op.frame->size);
+    std::memcpy(at, &h, sizeof(h));
+    __atomic_store_n(reinterpret_cast<uint32_t *>(at), op.frame->size, __ATOMIC_RELEASE);
+    if (seg.end == SEGMENT_HEADER) seg.first_ms = h.time_ms;
+    seg.last_ms = h.time_ms;
+    *newest = static_cast<uint32_t>(seg.end);
+    seg.end += need;
+    metrics_.records.add();
+    metrics_.bytes.add(need);
+}
+
+void MessageLog::sync_active() {
+    Segment &seg = segments_.back();
+    if (seg.synced >= seg.end) return;
+    static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t from = seg.synced & ~(page - 1);
+    uint64_t start = monotonic_ns();
+    if (msync(seg.base + from, seg.end - from, MS_SYNC) != 0) {
+        log_msg(LOG_ERROR, "Message log %s: segment %u: msync: %e", log_dir_, seg.number, errno);
+    }
+    metrics_.sync_ns.record(monotonic_ns() - start);
+    metrics_.syncs.add();
+    seg.synced = seg.end;
+}
+
+void MessageLog::answer(const HistoryQuery &q) {
+    std::vector<LogRecord> found; // newest first until the end
+    try {
+        bool older = false; // reached records before from_ms
+        for (size_t si = segments_.size(); si-- > 0 && found.size() < q.limit && !older;) {
+            const Segment &seg = segments_[si];
+            if (q.to_ms && seg.first_ms > q.to_ms) continue;
+            auto it = seg.newest.find(q.channel);
+            if (it == seg.newest.end()) continue;
+            // offsets only fall along a room's links, so this ends
+            for (size_t off = it->second; off != 0 && found.size() < q.limit;) {
+                RecordHeader h;
+                std::memcpy(&h, seg.base + off, sizeof(h));
+                if (q.from_ms && h.time_ms < q.from_ms) {
+                    older = true;
+                    break;
+                }
+                if (!q.to_ms || h.time_ms <= q.to_ms) {
+                    LogRecord r;
+                    r.seq = h.seq;
+                    r.time_ms = h.time_ms;
+                    r.channel = h.channel;
+                    r.wire = h.wire;
+                    r.frame = seg.base + off + sizeof(h);
+                    r.size = h.size;
+                    found.push_back(r);
+                }
+                off = h.prev;
+            }
+        }
+    } catch (...) {
+        // out of memory: answer with what was found
+    }
+    if (found.size() > q.limit) found.resize(q.limit);
+    std::reverse(found.begin(), found.end());
+    metrics_.queries.add();
+    reply_(q, found, reply_ctx_);
+}
+
+void MessageLog::run() {
+    for (;;) {
+        uint64_t n;
+        ssize_t r = read(wake_fd_, &n, sizeof(n));
+        (void)r;
+        bool stopping = stopping_.load(std::memory_order_acquire);
+        uint64_t batch = 0;
+        for (Op *op = queue_.pop_all(); op;) {
+            Op *next = op->next;
+            if (op->frame) {
+                write_record(*op);
+                frame_unref(op->frame);
+                pending_.fetch_sub(1, std::memory_order_relaxed);
+                ++batch;
+            } else {
+                // appends queued ahead of the query are visible to it,
+                // synced or not
+                answer(op->query);
+            }
+            delete op;
+            op = next;
+        }
+        if (batch > 0) {
+            sync_active();
+            metrics_.batch.record(batch);
+        }
+        if (stopping && queue_.empty()) break;
+    }
+}
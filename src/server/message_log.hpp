@@ -0,0 +1,146 @@
+// Durable broadcast history: append-only mmap'd segment files written by a
+// background thread with group-commit syncs
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/frame.hpp"
+#include "metrics.hpp"
+#include "mpsc_queue.hpp"
+
+// One logged broadcast as the log thread hands it out. `frame` points into
+// the mapped segment and is only valid during the callback it is given to.
+struct LogRecord {
+    uint64_t seq{ 0 };
+    uint64_t time_ms{ 0 }; // wall clock when it was logged
+    uint32_t channel{ 0 };
+    uint8_t wire{ 0 };     // WireVersion of the frame
+    const uint8_t *frame{ nullptr };
+    uint32_t size{ 0 };
+};
+
+// Up to `limit` of the newest messages in `channel` logged within
+// [from_ms, to_ms] (0 leaves a bound open), for the client with registry
+// token `token` on shard `shard`.
+struct HistoryQuery {
+    int shard{ -1 };
+    uint64_t token{ 0 };
+    uint32_t channel{ 0 };
+    uint32_t limit{ 0 };
+    uint64_t from_ms{ 0 };
+    uint64_t to_ms{ 0 };
+};
+
+// Called on the log thread with a query's matches, oldest first; ctx is
+// what start() was given.
+using HistoryReply = void (*)(const HistoryQuery &q, const std::vector<LogRecord> &records, void *ctx);
+
+// Written by the log thread only, like the shard metrics; `dropped` is bumped
+// by the event loops and so is a plain atomic.
+struct LogMetrics {
+    Counter records;   // broadcasts written
+    Counter bytes;     // segment bytes written, headers included
+    Counter syncs;     // group commits
+    Counter queries;   // history queries answered
+    std::atomic<uint64_t> dropped{ 0 }; // appends refused while the writer lagged
+    Histogram batch;   // records per group commit
+    Histogram sync_ns; // msync time per group commit
+};
+
+// Each segment is a preallocated file mapped shared and filled front to
+// back with 8-byte aligned records (header, then the frame exactly as it was
+// broadcast), so appending is a memcpy and reading history touches mapped
+// pages without a read syscall. Every record header links to the previous
+// record of its room in the same segment, and each segment remembers the
+// newest record of every room, so a query walks back through its own room
+// only: O(limit) records, however busy the other rooms are. Once the
+// segments take more than the retention limit, the oldest are deleted.
+//
+// The event loops only allocate an op and push it onto an MPSC queue; the
+// log thread writes every queued record, then makes the whole batch durable
+// with one msync, so a burst costs one sync however many records it holds.
+// History queries run on the same thread, behind the appends queued before
+// them.
+class MessageLog {
+public:
+    static constexpr size_t MAX_PENDING = 1u << 18;
+    static constexpr size_t MIN_SEGMENT = 1u << 20;
+    // record offsets are 32-bit
+    static constexpr size_t MAX_SEGMENT = static_cast<size_t>(1) << 32;
+
+    MessageLog() = default;
+    MessageLog(const MessageLog &) = delete;
+    MessageLog &operator=(const MessageLog &) = delete;
+    ~MessageLog();
+
+    // Maps every segment already in dir (creating dir if needed), rebuilding
+    // their indexes and finding where the last one ends. Segments beyond
+    // retain_bytes (0 keeps all) are deleted, oldest first, here and
+    // whenever a new one is started. Returns -1 on error, including a
+    // segment size over MAX_SEGMENT.
+    int open(const std::string &dir, size_t segment_bytes, size_t retain_bytes);
+    // Highest sequence number found on disk by open()
+    uint64_t last_seq() const { return last_seq_; }
+    int start(HistoryReply reply, void *ctx);
+    // Writes and syncs everything queued, answers pending queries and joins
+    // the log thread.
+    void stop();
+
+    // Event-loop side. Takes a reference to the sender's encoding of w.
+    void append(uint64_t seq, uint32_t channel, const WireFrames &w);
+    void query(const HistoryQuery &q);
+
+    const LogMetrics &metrics() const { return metrics_; }
+
+private:
+    struct Op {
+        Op *next{ nullptr };
+        Frame *frame{ nullptr }; // appends hold a reference; null for queries
+        uint64_t seq{ 0 };
+        uint32_t channel{ 0 };
+        uint8_t wire{ 0 };
+        HistoryQuery query{};
+    };
+    struct Segment {
+        uint64_t number{ 0 };
+        uint8_t *base{ nullptr };
+        size_t size{ 0 };
+        size_t end{ 0 };    // first unused byte
+        size_t synced{ 0 }; // bytes known durable
+        uint64_t first_ms{ 0 }; // wall clock of the first and last records
+        uint64_t last_ms{ 0 };
+        std::unordered_map<uint32_t, uint32_t> newest; // room -> its last record
+    };
+
+    void run();
+    void push(Op *op);
+    std::string segment_path(uint64_t number) const;
+    int map_segment(Segment &seg, bool create);
+    int scan_segment(Segment &seg);
+    int roll();
+    void retire_old();
+    void write_record(const Op &op);
+    void sync_active();
+    void answer(const HistoryQuery &q);
+
+    std::string dir_;
+    const char *log_dir_{ "" }; // dir_ for %s, interned (see log_intern)
+    size_t segment_bytes_{ 0 };
+    size_t retain_bytes_{ 0 };
+    std::vector<Segment> segments_; // oldest first; the last one is appended to
+    uint64_t last_seq_{ 0 };
+    MpscQueue<Op> queue_{};
+    std::atomic<size_t> pending_{ 0 };
+    std::atomic<bool> stopping_{ false };
+    int wake_fd_{ -1 };
+    HistoryReply reply_{ nullptr };
+    void *reply_ctx_{ nullptr };
+    std::thread thread_{};
+    LogMetrics metrics_{};
+};
@@ -0,0 +1,51 @@
+// Per-shard counters and histograms served by the stats endpoint
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "../common/histogram.hpp"
+
+// Event counter written only by the shard that owns it. Relaxed load+store
+// keeps the hot path free of locked instructions; the stats reader on
+// another thread still sees a recent, untorn value.
+class Counter {
+public:
+    void add(uint64_t n = 1) { v_.store(v_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return v_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> v_{ 0 };
+};
+
+struct ShardMetrics {
+    Counter accepted;
+    Counter disconnected;
+    Counter frames_in;      // complete frames parsed from clients
+    Counter bytes_in;       // wire bytes of those frames
+    Counter frames_out;     // frame deliveries queued, one per recipient
+    Counter bytes_out;      // bytes written to client sockets
+    Counter broadcasts;     // fan-outs run on this shard, local or forwarded
+    Counter epollout_arms;  // EPOLLOUT re-arms after a short write
+    Counter uring_sends;    // sendmsg SQEs submitted
+    Counter unicasts;       // direct messages routed to one client
+    Counter streams;        // transfers started
+    Counter spliced_bytes;  // transfer bytes relayed socket-to-socket by splice
+    Counter resumes;        // V2_RESUME requests served
+    Counter replayed;       // broadcasts replayed from the rings
+    Counter replay_gaps;    // resumes that asked for already evicted messages
+    Counter pings;          // heartbeats sent to silent v2 clients
+    Counter idle_timeouts;  // closed for sending nothing for --idle-timeout
+    Counter heartbeat_timeouts; // closed for not answering a ping
+    Counter write_timeouts; // closed for queued output not moving
+    Counter local_accepted; // connections on the Unix socket
+    Counter shm_links;      // local clients switched to shared-memory rings
+    Counter shm_doorbells;  // wakeups sent to a client parked on its ring
+    Counter text_rejected;  // messages or batches dropped by --text-policy reject
+    Counter text_sanitized; // messages --text-policy sanitize rewrote
+    Histogram loop_ns;      // busy time of one loop iteration
+    Histogram batch_size;   // events (or CQEs) handled per wakeup
+    Histogram fanout;       // recipients per broadcast
+    Histogram broadcast_ns; // time to queue one broadcast on this shard
+    Histogram inbox_ns;     // cross-shard handoff delay, forward to drain
+};
@@ -0,0 +1,39 @@
+// Intrusive multi-producer / single-consumer queue for cross-shard handoff
+#pragma once
+
+#include <atomic>
+
+// T must expose a `T *next` member. Producers push with a single CAS on the
+// head; the owning shard detaches the whole list at once and restores FIFO
+// order, so the consumer never contends with producers per element.
+template <typename T>
+class MpscQueue {
+public:
+    // Returns true when the queue was empty before the push, meaning the
+    // consumer may be asleep and the caller should ring its doorbell.
+    bool push(T *node) {
+        T *head = head_.load(std::memory_order_relaxed);
+        do {
+            node->next = head;
+        } while (!head_.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+        return head == nullptr;
+    }
+
+    // Detaches every queued node and returns them oldest first.
+    T *pop_all() {
+        T *head = head_.exchange(nullptr, std::memory_order_acquire);
+        T *prev = nullptr;
+        while (head) {
+            T *next = head->next;
+            head->next = prev;
+            prev = head;
+            head = next;
+        }
+        return prev;
+    }
+
+    bool empty() const { return head_.load(std::memory_order_acquire) == nullptr; }
+
+private:
+    std::atomic<T *> head_{ nullptr };
+};
@@ -0,0 +1,44 @@
+#include "nick_table.hpp"
+
+#include <mutex>
+#include <random>
+
+int NickTable::bind(const std::string &nick, const ClientRoute &route, uint64_t key) {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    auto it = routes_.find(nick);
+    if (it != routes_.end() && !(it->second.route == route)) return -1;
+    routes_[nick] = Entry{ route, key };
+    return 0;
+}
+
+int NickTable::reclaim(const std::string &nick, const ClientRoute &route, uint64_t key, uint64_t new_key,
+                       ClientRoute *prev) {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    auto it = routes_.find(nick);
+    if (it == routes_.end() || key == 0 || it->second.key != key) return -1;
+    *prev = it->second.route;
+    it->second = Entry{ route, new_key };
+    return 0;
+}
+
+bool NickTable::find(const std::string &nick, ClientRoute *out) const {
+    std::shared_lock<std::shared_mutex> lock(mu_);
+    auto it = routes_.find(nick);
+    if (it == routes_.end()) return false;
+    *out = it->second.route;
+    return true;
+}
+
+void NickTable::unbind(const std::string &nick, const ClientRoute &route) {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    auto it = routes_.find(nick);
+    if (it != routes_.end() && it->second.route == route) routes_.erase(it);
+}
+
+uint64_t nick_key_new() {
+    // binds are rare, so reading the kernel's generator each time is fine
+    std::random_device rd;
+    uint64_t key = 0;
+    while (key == 0) key = static_cast<uint64_t>(rd()) << 32 | rd();
+    return key;
+}
@@ -0,0 +1,57 @@
+// Server-wide nickname -> connection routing table for direct messages
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+static const size_t MAX_NICK = 32;
+
+// Where a connection lives: its shard and registry token. A token outlives
+// its client only as a stale handle that misses on lookup, so a route that
+// raced with a disconnect is dropped by the owning shard instead of hitting
+// whatever reused the slot.
+struct ClientRoute {
+    int shard{ -1 };
+    uint64_t token{ 0 };
+
+    bool operator==(const ClientRoute &o) const { return shard == o.shard && token == o.token; }
+};
+
+// Lookups take a shared lock and one hash probe; binds and unbinds (nick
+// changes, disconnects) take it exclusively.
+//
+// A nick belongs to the connection that bound it until that connection
+// unbinds it or goes away. Each bind carries a secret key, handed only to
+// the client that bound it: a client reconnecting before its old socket
+// was noticed dead proves with it that it is the same client, and nobody
+// else can take the nick over.
+class NickTable {
+public:
+    // Binds nick to route under key. Returns 0, or -1 when another
+    // connection holds the nick.
+    int bind(const std::string &nick, const ClientRoute &route, uint64_t key);
+    // Moves nick from whatever connection holds it to route, if key is the
+    // one it was bound under; it is then held under new_key. The displaced
+    // route is stored in *prev. Returns 0, or -1 when the nick is not bound
+    // or the key does not match.
+    int reclaim(const std::string &nick, const ClientRoute &route, uint64_t key, uint64_t new_key, ClientRoute *prev);
+    bool find(const std::string &nick, ClientRoute *out) const;
+    // Removes nick only if it still points at route, so a connection whose
+    // nick was reclaimed cannot unbind its successor.
+    void unbind(const std::string &nick, const ClientRoute &route);
+
+private:
+    struct Entry {
+        ClientRoute route;
+        uint64_t key;
+    };
+
+    mutable std::shared_mutex mu_;
+    std::unordered_map<std::string, Entry> routes_;
+};
+
+// A fresh, unguessable, non-zero key for NickTable::bind
+uint64_t nick_key_new();
@@ -0,0 +1,54 @@
+#include "replay_ring.hpp"
+
+static size_t entry_bytes(const ReplayEntry &e) {
+    size_t n = e.seq_frame ? e.seq_frame->size : 0;
+    for (const Frame *f : e.frames.v) {
+        if (f) n += f->size;
+    }
+    return n;
+}
+
+void replay_entry_unref(ReplayEntry &e) {
+    if (e.seq_frame) frame_unref(e.seq_frame);
+    e.seq_frame = nullptr;
+    wire_frames_unref(e.frames);
+}
+
+ReplayRing::~ReplayRing() {
+    while (count_ > 0) evict_oldest();
+}
+
+int ReplayRing::init(size_t max_msgs, size_t max_bytes) {
+    try {
+        slots_.resize(max_msgs);
+    } catch (...) {
+        return -1;
+    }
+    max_bytes_ = max_bytes;
+    return 0;
+}
+
+void ReplayRing::evict_oldest() {
+    ReplayEntry &e = slots_[head_];
+    bytes_ -= entry_bytes(e);
+    evicted_ = e.seq;
+    replay_entry_unref(e);
+    head_ = (head_ + 1) % slots_.size();
+    --count_;
+}
+
+void ReplayRing::append(uint64_t seq, uint32_t channel, Frame *seq_frame, const WireFrames &w) {
+    if (slots_.empty()) return;
+    std::lock_guard<std::mutex> lock(mu_);
+    ReplayEntry e;
+    e.seq = seq;
+    e.channel = channel;
+    e.seq_frame = seq_frame;
+    frame_ref(seq_frame);
+    wire_frames_ref(w, &e.frames);
+    size_t size = entry_bytes(e);
+    while (count_ > 0 && (count_ == slots_.size() || bytes_ + size > max_bytes_)) evict_oldest();
+    slots_[(head_ + count_) % slots_.size()] = e;
+    ++count_;
+    bytes_ += size;
+}
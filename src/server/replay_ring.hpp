@@ -0,0 +1,78 @@
+// Recent sequenced broadcasts kept for clients that reconnect and resume
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "../common/frame.hpp"
+
+// One retained broadcast: its sequence number, room, the V2_SEQ frame that
+// announces it and the message encodings that existed when it was sent.
+struct ReplayEntry {
+    uint64_t seq{ 0 };
+    uint32_t channel{ 0 };
+    Frame *seq_frame{ nullptr };
+    WireFrames frames{};
+};
+
+void replay_entry_unref(ReplayEntry &e);
+
+// The newest sequenced broadcasts, oldest first, bounded by a count and by
+// the bytes of the frames they pin. Entries hold references to the frames
+// that went out live, so replaying one re-encodes nothing. Only the shard
+// that numbers broadcasts appends, but any shard may copy entries out while
+// serving a resume, so both take the lock; outside resumes it is never
+// contended.
+class ReplayRing {
+public:
+    ReplayRing() = default;
+    ReplayRing(const ReplayRing &) = delete;
+    ReplayRing &operator=(const ReplayRing &) = delete;
+    ~ReplayRing();
+
+    // Sizes the ring before first use. Returns -1 on allocation failure.
+    int init(size_t max_msgs, size_t max_bytes);
+    bool enabled() const { return !slots_.empty(); }
+
+    // Takes new references to seq_frame and w's encodings. seq must grow
+    // with every call.
+    void append(uint64_t seq, uint32_t channel, Frame *seq_frame, const WireFrames &w);
+
+    // Appends copies (with their own references) of every entry newer than
+    // `after` whose room keep(channel) accepts. Returns the newest sequence
+    // number evicted so far, 0 if none: anything after `after` up to that
+    // one is gone.
+    template <typename F>
+    uint64_t collect(uint64_t after, F keep, std::vector<ReplayEntry> &out) const {
+        std::lock_guard<std::mutex> lock(mu_);
+        // walk back from the newest; a resume usually wants only the tail
+        size_t n = 0;
+        while (n < count_ && at(count_ - 1 - n).seq > after) ++n;
+        for (size_t i = count_ - n; i < count_; ++i) {
+            const ReplayEntry &e = at(i);
+            if (!keep(e.channel)) continue;
+            ReplayEntry copy;
+            copy.seq = e.seq;
+            copy.channel = e.channel;
+            copy.seq_frame = e.seq_frame;
+            frame_ref(copy.seq_frame);
+            wire_frames_ref(e.frames, &copy.frames);
+            out.push_back(copy);
+        }
+        return evicted_;
+    }
+
+private:
+    const ReplayEntry &at(size_t i) const { return slots_[(head_ + i) % slots_.size()]; }
+    void evict_oldest();
+
+    mutable std::mutex mu_;
+    std::vector<ReplayEntry> slots_;
+    size_t head_{ 0 };  // oldest entry
+    size_t count_{ 0 };
+    size_t bytes_{ 0 }; // wire bytes of every frame held
+    size_t max_bytes_{ 0 };
+    uint64_t evicted_{ 0 };
+};
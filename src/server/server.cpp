@@ -1,248 +1,173 @@
-#include <cstdio>
-#include <cstdlib>
-#include <cstdint>
-#include <cstring>
-#include <cerrno>
-#include <csignal>
-#include <unistd.h>
-#include <sys/epoll.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-
-#include "../common/common.hpp"
-
-struct Client {
-    int fd{ -1 };
-    Buffer inbuf{};
-    Buffer outbuf{};
-    bool closed{ false };
-    Client *next{ nullptr };
-};
-
-static volatile sig_atomic_t g_should_terminate = 0;
-
-static void handle_sigint(int /*sig*/) {
-    g_should_terminate = 1;
-}
-
-static void epoll_update_events(int epfd, int fd, uint32_t events, bool enable_out) {
-    epoll_event ev{};
-    ev.data.fd = fd;
-    ev.events = events | EPOLLET | EPOLLRDHUP;
-    if (enable_out) ev.events |= EPOLLOUT;
-    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
-        // Try add if mod fails (e.g., not present yet)
-        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
-    }
-}
-
-static void remove_client(int epfd, Client **list, Client *c) {
-    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, nullptr);
-    close(c->fd);
-    // Buffers free automatically
-    // unlink
-    Client **pp = list;
-    while (*pp) {
-        if (*pp == c) { *pp = c->next; break; }
-        pp = &(*pp)->next;
-    }
-    delete c;
-}
-
-static void broadcast_to_others(int epfd, Client *clients, int sender_fd, const uint8_t *data, uint32_t len) {
-    for (Client *c = clients; c != nullptr; c = c->next) {
-        if (c->fd == sender_fd) continue;
-        if (send_framed_or_buffer(c->fd, c->outbuf, data, len) < 0) {
-            c->closed = true;
-            continue;
-        }
-        if (c->outbuf.length > 0) {
-            epoll_update_events(epfd, c->fd, EPOLLIN, true);
-        }
-    }
-}
-
-int main(int argc, char **argv) {
-    uint16_t tcp_port = DEFAULT_TCP_PORT;
-    uint16_t disc_port = DEFAULT_DISCOVERY_PORT;
-
-    for (int i = 1; i < argc; ++i) {
-        if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0) && i + 1 < argc) {
-            tcp_port = static_cast<uint16_t>(atoi(argv[++i]));
-        } else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--discover-port") == 0) && i + 1 < argc) {
-            disc_port = static_cast<uint16_t>(atoi(argv[++i]));
-        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-            std::printf("Usage: %s [-p PORT] [-d DISCOVERY_PORT]\n", argv[0]);
-            return 0;
-        }
-    }
-
-    std::signal(SIGINT, handle_sigint);
-    std::signal(SIGTERM, handle_sigint);
-
-    int listen_fd = create_tcp_listener(tcp_port);
-    if (listen_fd < 0) {
-        std::perror("listen socket");
-        return 1;
-    }
-
-    int udp_fd = create_udp_discovery_socket(disc_port);
-    if (udp_fd < 0) {
-        std::perror("udp discovery socket");
-        close(listen_fd);
-        return 1;
-    }
-
-    int epfd = epoll_create1(0);
-    if (epfd < 0) {
-        std::perror("epoll_create1");
-        close(listen_fd);
-        close(udp_fd);
-        return 1;
-    }
-
-    epoll_event ev{};
-    ev.events = EPOLLIN | EPOLLET;
-    ev.data.fd = listen_fd;
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
-        std::perror("epoll add listen");
-        return 1;
-    }
-    ev.events = EPOLLIN | EPOLLET;
-    ev.data.fd = udp_fd;
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, udp_fd, &ev) < 0) {
-        std::perror("epoll add udp");
-        return 1;
-    }
-
-    Client *clients = nullptr;
-
-    std::printf("Server listening on TCP %u, discovery UDP %u\n", tcp_port, disc_port);
-
-    const int MAX_EVENTS = 128;
-    epoll_event events[128];
-
-    while (!g_should_terminate) {
-        int n = epoll_wait(epfd, events, MAX_EVENTS, 500);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            std::perror("epoll_wait");
-            break;
-        }
-
-        for (int i = 0; i < n; ++i) {
-            int fd = events[i].data.fd;
-            uint32_t e = events[i].events;
-
-            if (fd == listen_fd) {
-                // accept all
-                for (;;) {
-                    sockaddr_in addr{};
-                    socklen_t alen = sizeof(addr);
-                    int cfd = accept(listen_fd, reinterpret_cast<sockaddr *>(&addr), &alen);
-                    if (cfd < 0) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-                        std::perror("accept");
-                        break;
-                    }
-                    set_socket_nonblocking(cfd);
-
-                    Client *c = new (std::nothrow) Client();
-                    if (!c) { close(cfd); continue; }
-                    c->fd = cfd;
-                    c->closed = false;
-                    c->next = clients;
-                    clients = c;
-
-                    epoll_event cev{};
-                    cev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                    cev.data.fd = cfd;
-                    epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &cev);
-
-                    char ipstr[64];
-                    inet_ntop(AF_INET, &addr.sin_addr, ipstr, sizeof(ipstr));
-                    std::printf("Client connected: %s:%u (fd=%d)\n", ipstr, ntohs(addr.sin_port), cfd);
-                }
-            } else if (fd == udp_fd) {
-                for (;;) {
-                    uint8_t buf[512];
-                    sockaddr_in src{};
-                    socklen_t slen = sizeof(src);
-                    ssize_t r = recvfrom(udp_fd, buf, sizeof(buf) - 1, 0, reinterpret_cast<sockaddr *>(&src), &slen);
-                    if (r < 0) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-                        std::perror("recvfrom");
-                        break;
-                    }
-                    buf[r] = 0;
-                    if (r >= static_cast<ssize_t>(std::strlen(DISCOVER_REQUEST)) && std::memcmp(buf, DISCOVER_REQUEST, std::strlen(DISCOVER_REQUEST)) == 0) {
-                        char reply[128];
-                        int m = std::snprintf(reply, sizeof(reply), "%s %u", DISCOVER_RESPONSE, static_cast<unsigned>(tcp_port));
-                        sendto(udp_fd, reply, static_cast<size_t>(m), 0, reinterpret_cast<sockaddr *>(&src), slen);
-                    }
-                }
-            } else {
-                // find client by fd
-                Client *c = clients;
-                while (c && c->fd != fd) c = c->next;
-                if (!c) {
-                    // Might be stale
-                    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
-                    close(fd);
-                    continue;
-                }
-
-                if (e & (EPOLLHUP | EPOLLRDHUP)) {
-                    c->closed = true;
-                }
-
-                if (e & EPOLLIN) {
-                    ssize_t r = read_into_buffer_nonblocking(fd, c->inbuf);
-                    if (r < 0) {
-                        c->closed = true;
-                    } else if (r == 0) {
-                        c->closed = true; // peer closed
-                    } else {
-                        for (;;) {
-                            uint32_t mlen = 0;
-                            int hr = has_complete_frame(c->inbuf, &mlen);
-                            if (hr == -2) { c->closed = true; break; }
-                            if (hr != 1) break;
-                            const uint8_t *payload = nullptr;
-                            get_frame_view(c->inbuf, &payload, &mlen);
-                            broadcast_to_others(epfd, clients, c->fd, payload, mlen);
-                            c->inbuf.consume(4 + mlen);
-                        }
-                    }
-                }
-
-                if ((e & EPOLLOUT) && c->outbuf.length > 0) {
-                    int flushed = flush_buffered_writes(fd, c->outbuf);
-                    if (flushed < 0) c->closed = true;
-                    if (c->outbuf.length == 0) epoll_update_events(epfd, fd, EPOLLIN, false);
-                }
-
-                if (c->closed) {
-                    std::printf("Client disconnected (fd=%d)\n", c->fd);
-                    remove_client(epfd, &clients, c);
-                }
-            }
-        }
-    }
-
-    // Cleanup
-    for (Client *c = clients; c;) {
-        Client *next = c->next;
-        remove_client(epfd, &clients, c);
-        c = next;
-    }
-    close(udp_fd);
-    close(listen_fd);
-    close(epfd);
-    std::printf("Server terminated.\n");
-    return 0;
-}
-
-
+// Command-line front end of the chat server: options map onto a
+// ChatServerConfig, and SIGINT/SIGTERM stop the server.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <csignal>
+
+#include "chat_server.hpp"
+#include "logger.hpp"
+
+static ChatServer *g_server = nullptr;
+
+static void handle_sigint(int /*sig*/) {
+    if (g_server) g_server->stop();
+}
+
+// Accepts plain byte counts or a K/M/G suffix. Returns 0 on success.
+static int parse_size(const char *text, size_t *out) {
+    char *end = nullptr;
+    unsigned long long v = std::strtoull(text, &end, 10);
+    if (end == text) return -1;
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; ++end; break;
+    case 'm': case 'M': v <<= 20; ++end; break;
+    case 'g': case 'G': v <<= 30; ++end; break;
+    default: break;
+    }
+    if (*end != '\0') return -1;
+    *out = static_cast<size_t>(v);
+    return 0;
+}
+
+static int parse_text_policy(const char *text, TextPolicy *out) {
+    if (strcmp(text, "pass") == 0) *out = TextPolicy::Pass;
+    else if (strcmp(text, "reject") == 0) *out = TextPolicy::Reject;
+    else if (strcmp(text, "sanitize") == 0) *out = TextPolicy::Sanitize;
+    else return -1;
+    return 0;
+}
+
+static int parse_slow_policy(const char *text, SlowPolicy *out) {
+    if (strcmp(text, "drop-oldest") == 0) *out = SlowPolicy::DropOldest;
+    else if (strcmp(text, "drop-newest") == 0) *out = SlowPolicy::DropNewest;
+    else if (strcmp(text, "disconnect") == 0) *out = SlowPolicy::Disconnect;
+    else return -1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    ChatServerConfig cfg;
+
+    for (int i = 1; i < argc; ++i) {
+        if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0) && i + 1 < argc) {
+            cfg.tcp_port = static_cast<uint16_t>(atoi(argv[++i]));
+        } else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--discover-port") == 0) && i + 1 < argc) {
+            cfg.discovery_port = static_cast<uint16_t>(atoi(argv[++i]));
+        } else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) {
+            cfg.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            cfg.io_uring = true;
+        } else if (strcmp(argv[i], "--stats-port") == 0 && i + 1 < argc) {
+            cfg.stats_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats-socket") == 0 && i + 1 < argc) {
+            cfg.stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-client-outbuf") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &cfg.limits.per_client) != 0) {
+                std::fprintf(stderr, "Invalid size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-total-outbuf") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &cfg.limits.total) != 0) {
+                std::fprintf(stderr, "Invalid size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--read-budget") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &cfg.sched.read_budget) != 0 || cfg.sched.read_budget == 0) {
+                std::fprintf(stderr, "Invalid size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc) {
+            int v = atoi(argv[++i]);
+            cfg.sched.frame_budget = v > 0 ? static_cast<uint32_t>(v) : 1;
+        } else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc) {
+            cfg.sched.rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--rate-burst") == 0 && i + 1 < argc) {
+            cfg.sched.burst = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--slow-policy") == 0 && i + 1 < argc) {
+            if (parse_slow_policy(argv[++i], &cfg.limits.policy) != 0) {
+                std::fprintf(stderr, "Unknown slow consumer policy: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--text-policy") == 0 && i + 1 < argc) {
+            if (parse_text_policy(argv[++i], &cfg.text_policy) != 0) {
+                std::fprintf(stderr, "Unknown text policy: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--replay-msgs") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &cfg.replay.msgs) != 0) {
+                std::fprintf(stderr, "Invalid count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--replay-bytes") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &cfg.replay.bytes) != 0) {
+                std::fprintf(stderr, "Invalid size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--log-dir") == 0 && i + 1 < argc) {
+            cfg.log.dir = argv[++i];
+        } else if (strcmp(argv[i], "--log-segment") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &cfg.log.segment_bytes) != 0) {
+                std::fprintf(stderr, "Invalid size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--log-retain") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &cfg.log.retain_bytes) != 0) {
+                std::fprintf(stderr, "Invalid size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--handoff") == 0 && i + 1 < argc) {
+            cfg.handoff_path = argv[++i];
+        } else if (strcmp(argv[i], "--unix-socket") == 0 && i + 1 < argc) {
+            cfg.unix_path = argv[++i];
+        } else if (strcmp(argv[i], "--shm-ring") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &cfg.shm_ring) != 0) {
+                std::fprintf(stderr, "Invalid size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--node-id") == 0 && i + 1 < argc) {
+            cfg.federation.node_id = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--peer-port") == 0 && i + 1 < argc) {
+            cfg.federation.listen_port = static_cast<uint16_t>(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+            cfg.federation.peers.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            cfg.deadlines.idle_ms = static_cast<uint64_t>(atof(argv[++i]) * 1000);
+        } else if (strcmp(argv[i], "--ping-interval") == 0 && i + 1 < argc) {
+            cfg.deadlines.ping_ms = static_cast<uint64_t>(atof(argv[++i]) * 1000);
+        } else if (strcmp(argv[i], "--write-timeout") == 0 && i + 1 < argc) {
+            cfg.deadlines.write_ms = static_cast<uint64_t>(atof(argv[++i]) * 1000);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            if (parse_log_level(argv[++i], &g_log_threshold) != 0) {
+                std::fprintf(stderr, "Unknown log level: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            std::printf("Usage: %s [-p PORT] [-d DISCOVERY_PORT] [-t THREADS] [--io-uring]\n"
+                        "          [--stats-port PORT | --stats-socket PATH]\n"
+                        "          [--max-client-outbuf BYTES] [--max-total-outbuf BYTES]\n"
+                        "          [--slow-policy drop-oldest|drop-newest|disconnect] [--text-policy pass|reject|sanitize]\n"
+                        "          [--read-budget BYTES] [--frame-budget N] [--rate-limit MSGS_PER_SEC] [--rate-burst N]\n"
+                        "          [--idle-timeout SECS] [--ping-interval SECS] [--write-timeout SECS]\n"
+                        "          [--replay-msgs N] [--replay-bytes BYTES] [--log-dir DIR] [--log-segment BYTES]\n"
+                        "          [--log-retain BYTES] [--unix-socket PATH] [--shm-ring BYTES] [--handoff PATH]\n"
+                        "          [--node-id N] [--peer-port PORT] [--peer HOST:PORT]...\n"
+                        "          [--log-level debug|info|warn|error]\n", argv[0]);
+            return 0;
+        }
+    }
+
+    std::signal(SIGINT, handle_sigint);
+    std::signal(SIGTERM, handle_sigint);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    ChatServer server(cfg);
+    g_server = &server;
+    if (server.open() != 0) return 1;
+    server.run();
+    g_server = nullptr;
+    log_msg(LOG_INFO, "Server terminated.");
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include "splice_relay.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+SpliceRelay::~SpliceRelay() {
+    if (pipe_r_ >= 0) close(pipe_r_);
+    if (pipe_w_ >= 0) close(pipe_w_);
+}
+
+int SpliceRelay::open(uint64_t stream_id, uint64_t src_token) {
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) return -1;
+    pipe_r_ = fds[0];
+    pipe_w_ = fds[1];
+    id = stream_id;
+    src = src_token;
+    return 0;
+}
+
+ssize_t SpliceRelay::fill(int src_fd, size_t max) {
+    if (max > V2_STREAM_CHUNK) max = V2_STREAM_CHUNK;
+    ssize_t n;
+    do {
+        n = splice(src_fd, nullptr, pipe_w_, nullptr, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    if (n == 0) return -2;
+    piped_ = static_cast<size_t>(n);
+
+    uint8_t idbuf[10];
+    size_t idlen = varint_put(id, idbuf);
+    size_t hlen = v2_put_header(V2_STREAM_DATA, static_cast<uint32_t>(idlen + piped_), hdr_);
+    std::memcpy(hdr_ + hlen, idbuf, idlen);
+    hdr_len_ = static_cast<uint32_t>(hlen + idlen);
+    hdr_off_ = 0;
+    return n;
+}
+
+int SpliceRelay::drain(int dst_fd) {
+    while (hdr_off_ < hdr_len_) {
+        ssize_t w = send(dst_fd, hdr_ + hdr_off_, hdr_len_ - hdr_off_, MSG_NOSIGNAL | MSG_MORE);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        hdr_off_ += static_cast<uint32_t>(w);
+    }
+    while (piped_ > 0) {
+        ssize_t w = splice(pipe_r_, nullptr, dst_fd, nullptr, piped_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        piped_ -= static_cast<size_t>(w);
+    }
+    return 1;
+}
@@ -0,0 +1,53 @@
+// Zero-copy socket-to-socket relay for streamed transfers to one recipient
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h> // for ssize_t
+
+#include "../common/wire_v2.hpp"
+
+// Moves a sender's raw stream into a recipient socket as V2_STREAM_DATA
+// frames without the payload passing through user space: each chunk is
+// spliced from the sender socket into a pipe, then from the pipe into the
+// recipient socket behind a few header bytes written normally. At most one
+// chunk sits in the pipe, so a transfer holds V2_STREAM_CHUNK bytes of
+// kernel memory however large it is, and a recipient that stops reading
+// stalls the sender through TCP instead of growing a queue.
+//
+// Lives on the recipient, because the staged chunk belongs to its stream:
+// until pending() is false, nothing else may be written to that socket.
+struct SpliceRelay {
+    uint64_t id{ 0 };       // stream id named in every chunk header
+    uint64_t src{ 0 };      // sender's token, 0 once the sender is gone
+    bool complete{ false }; // the sender delivered every byte before leaving
+
+    SpliceRelay() = default;
+    SpliceRelay(const SpliceRelay &) = delete;
+    SpliceRelay &operator=(const SpliceRelay &) = delete;
+    ~SpliceRelay();
+
+    // Creates the pipe. Returns 0 on success, -1 with errno set.
+    int open(uint64_t stream_id, uint64_t src_token);
+
+    // Stages the next chunk: splices up to max bytes from src_fd into the
+    // pipe and builds its frame header. Only valid when nothing is pending.
+    // Returns the chunk size, 0 if src_fd has nothing to read, -1 on error
+    // and -2 at end of stream.
+    ssize_t fill(int src_fd, size_t max);
+    // Writes the staged header and chunk to dst_fd. Returns 1 when all of it
+    // went out, 0 when the socket is full, -1 on error.
+    int drain(int dst_fd);
+
+    bool pending() const { return hdr_off_ < hdr_len_ || piped_ > 0; }
+    // Bytes still staged, header included.
+    size_t staged() const { return (hdr_len_ - hdr_off_) + piped_; }
+
+private:
+    int pipe_r_{ -1 };
+    int pipe_w_{ -1 };
+    size_t piped_{ 0 }; // chunk bytes in the pipe
+    uint8_t hdr_[V2_MAX_HEADER + 10]{};
+    uint32_t hdr_len_{ 0 };
+    uint32_t hdr_off_{ 0 };
+};
@@ -0,0 +1,58 @@
+#include "timer_wheel.hpp"
+
+TimerWheel::TimerWheel(uint64_t tick_ms) : tick_ms_(tick_ms ? tick_ms : 1) {
+    for (TimerNode &head : slots_) head.prev = head.next = &head;
+    expired_.prev = expired_.next = &expired_;
+}
+
+void TimerWheel::link(TimerNode *head, TimerNode *n) {
+    n->prev = head->prev;
+    n->next = head;
+    head->prev->next = n;
+    head->prev = n;
+}
+
+void TimerWheel::unlink(TimerNode *n) {
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->prev = n->next = nullptr;
+}
+
+void TimerWheel::schedule(TimerNode *n, uint64_t due_ms) {
+    if (n->armed()) unlink(n);
+    else ++count_;
+    uint64_t tick = (due_ms + tick_ms_ - 1) / tick_ms_;
+    if (tick <= current_) tick = current_ + 1;
+    n->due = tick;
+    link(&slot(tick), n);
+}
+
+void TimerWheel::cancel(TimerNode *n) {
+    if (!n->armed()) return;
+    unlink(n);
+    --count_;
+}
+
+int TimerWheel::next_timeout_ms(uint64_t now_ms) const {
+    if (count_ == 0) return -1;
+    if (expired_.next != &expired_) return 0;
+    for (uint64_t t = current_ + 1; t <= current_ + SLOTS; ++t) {
+        const TimerNode &head = slots_[t % SLOTS];
+        if (head.next == &head) continue;
+        uint64_t at = t * tick_ms_;
+        return at > now_ms ? static_cast<int>(at - now_ms) : 0;
+    }
+    return -1;
+}
+
+void TimerWheel::collect(TimerNode &head, uint64_t now) {
+    TimerNode *n = head.next;
+    while (n != &head) {
+        TimerNode *next = n->next;
+        if (n->due <= now) {
+            unlink(n);
+            link(&expired_, n);
+        }
+        n = next;
+    }
+}
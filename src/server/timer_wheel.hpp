@@ -0,0 +1,77 @@
+// Hashed timing wheel for per-connection deadlines
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Intrusive wheel entry, embedded in whatever owns the deadline. `owner`
+// is handed back on expiry; for clients it is the registry token, so a
+// timer racing with a disconnect simply misses on lookup.
+struct TimerNode {
+    TimerNode *prev{ nullptr };
+    TimerNode *next{ nullptr };
+    uint64_t due{ 0 }; // tick it fires on
+    uint64_t owner{ 0 };
+
+    bool armed() const { return prev != nullptr; }
+};
+
+// Deadlines hash into SLOTS lists by tick, so arming, re-arming and
+// cancelling are O(1) list splices however many connections there are.
+// A slot is only walked when its tick comes round; entries due in a
+// later revolution stay put. Deadlines are rounded up to the next tick,
+// which batches wakeups for timers that fall close together.
+class TimerWheel {
+public:
+    static constexpr uint32_t SLOTS = 512;
+
+    explicit TimerWheel(uint64_t tick_ms = 100);
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // Starts the clock; nothing scheduled before this is due earlier.
+    void start(uint64_t now_ms) { current_ = now_ms / tick_ms_; }
+    // Arms n for due_ms, moving it if it is already armed.
+    void schedule(TimerNode *n, uint64_t due_ms);
+    void cancel(TimerNode *n);
+    // When n fires, in ms on the same clock (meaningless if not armed).
+    uint64_t due_ms(const TimerNode *n) const { return n->due * tick_ms_; }
+    size_t size() const { return count_; }
+
+    // Milliseconds until the next occupied slot comes due, -1 if the wheel
+    // is empty. A slot holding only later-revolution entries costs one
+    // early wakeup per revolution.
+    int next_timeout_ms(uint64_t now_ms) const;
+
+    // Unlinks every entry due by now_ms and calls fire(owner) for each.
+    // fire may re-arm the entry it is given.
+    template <typename F>
+    void advance(uint64_t now_ms, F fire) {
+        uint64_t now = now_ms / tick_ms_;
+        if (now <= current_) return;
+        if (count_ > 0) {
+            uint64_t steps = now - current_;
+            if (steps > SLOTS) steps = SLOTS;
+            for (uint64_t t = current_ + 1; t <= current_ + steps; ++t) collect(slot(t), now);
+        }
+        current_ = now;
+        while (expired_.next != &expired_) {
+            TimerNode *n = expired_.next;
+            unlink(n);
+            --count_;
+            fire(n->owner);
+        }
+    }
+
+private:
+    TimerNode &slot(uint64_t tick) { return slots_[tick % SLOTS]; }
+    void collect(TimerNode &head, uint64_t now);
+    static void link(TimerNode *head, TimerNode *n);
+    static void unlink(TimerNode *n);
+
+    TimerNode slots_[SLOTS]; // list sentinels
+    TimerNode expired_;      // due entries waiting for their callback
+    uint64_t tick_ms_;
+    uint64_t current_{ 0 };  // last tick processed
+    size_t count_{ 0 };      // armed entries, expired ones included
+};
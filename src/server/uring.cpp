@@ -0,0 +1,180 @@
+#include "uring.hpp"
+
+#ifdef CHAT_IO_URING
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params *p) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+// Multishot recv with provided buffer rings landed in Linux 6.0.
+static bool kernel_has_multishot_recv() {
+    utsname u{};
+    if (::uname(&u) != 0) return false;
+    int major = 0;
+    if (std::sscanf(u.release, "%d", &major) != 1) return false;
+    return major >= 6;
+}
+
+IoUring::~IoUring() {
+    if (buf_ring_) std::free(buf_ring_);
+    if (buf_base_) std::free(buf_base_);
+    if (sqes_) ::munmap(sqes_, sqes_len_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) ::munmap(cq_ptr_, cq_ptr_len_);
+    if (sq_ptr_) ::munmap(sq_ptr_, sq_ptr_len_);
+    if (ring_fd_ >= 0) ::close(ring_fd_);
+}
+
+int IoUring::init(unsigned entries) {
+    if (!kernel_has_multishot_recv()) return -ENOSYS;
+
+    io_uring_params p{};
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 4;
+    int fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0 && errno == EINVAL) {
+        // older kernels: no single-issuer / deferred task work
+        std::memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        fd = sys_io_uring_setup(entries, &p);
+    }
+    if (fd < 0) return -errno;
+    ring_fd_ = fd;
+
+    const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_EXT_ARG;
+    if ((p.features & needed) != needed) return -ENOSYS;
+
+    sq_ptr_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ptr_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (cq_ptr_len_ > sq_ptr_len_) sq_ptr_len_ = cq_ptr_len_;
+    cq_ptr_len_ = sq_ptr_len_;
+
+    void *rings = ::mmap(nullptr, sq_ptr_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) return -errno;
+    sq_ptr_ = cq_ptr_ = rings;
+
+    sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = ::mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return -errno;
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+    uint8_t *sq = static_cast<uint8_t *>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_entries_ = p.sq_entries;
+    sq_local_tail_ = sq_submitted_tail_ = *sq_tail_;
+
+    uint8_t *cq = static_cast<uint8_t *>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    return 0;
+}
+
+io_uring_sqe *IoUring::get_sqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sq_local_tail_ - head >= sq_entries_) {
+        if (submit() < 0) return nullptr;
+        head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (sq_local_tail_ - head >= sq_entries_) return nullptr;
+    }
+    unsigned idx = sq_local_tail_ & sq_mask_;
+    io_uring_sqe *sqe = &sqes_[idx];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[idx] = idx;
+    ++sq_local_tail_;
+    return sqe;
+}
+
+int IoUring::submit() {
+    unsigned pending = sq_local_tail_ - sq_submitted_tail_;
+    if (pending == 0) return 0;
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    int r = sys_io_uring_enter(ring_fd_, pending, 0, 0, nullptr, 0);
+    if (r < 0) return -errno;
+    sq_submitted_tail_ += static_cast<unsigned>(r);
+    return r;
+}
+
+int IoUring::submit_and_wait(int timeout_ms) {
+    unsigned pending = sq_local_tail_ - sq_submitted_tail_;
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+
+    __kernel_timespec ts{};
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000LL;
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    // a negative timeout waits for the first completion however long it takes
+    if (timeout_ms >= 0) arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+    int r = sys_io_uring_enter(ring_fd_, pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (r < 0) return -errno;
+    sq_submitted_tail_ += static_cast<unsigned>(r);
+    return r;
+}
+
+io_uring_cqe *IoUring::peek_cqe() {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return nullptr;
+    return &cqes_[head & cq_mask_];
+}
+
+void IoUring::cqe_seen() {
+    __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+}
+
+int IoUring::setup_buf_ring(uint16_t bgid, unsigned count, unsigned size) {
+    // the ring itself must be page aligned; count must be a power of two
+    void *ring = nullptr;
+    if (posix_memalign(&ring, 4096, count * sizeof(io_uring_buf)) != 0) return -ENOMEM;
+    std::memset(ring, 0, count * sizeof(io_uring_buf));
+    buf_ring_ = static_cast<io_uring_buf *>(ring);
+    buf_base_ = static_cast<uint8_t *>(std::malloc(static_cast<size_t>(count) * size));
+    if (!buf_base_) return -ENOMEM;
+    buf_count_ = count;
+    buf_size_ = size;
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if (sys_io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -errno;
+
+    for (unsigned i = 0; i < count; ++i) recycle_buf(static_cast<uint16_t>(i));
+    return 0;
+}
+
+void IoUring::recycle_buf(uint16_t bid) {
+    io_uring_buf *b = &buf_ring_[buf_tail_ & (buf_count_ - 1)];
+    b->addr = reinterpret_cast<uint64_t>(buf_addr(bid));
+    b->len = buf_size_;
+    b->bid = bid;
+    ++buf_tail_;
+    // the ring tail overlays the resv field of the first entry
+    uint16_t *tail = reinterpret_cast<uint16_t *>(reinterpret_cast<uint8_t *>(buf_ring_) + 14);
+    __atomic_store_n(tail, buf_tail_, __ATOMIC_RELEASE);
+}
+
+#endif // CHAT_IO_URING
@@ -0,0 +1,71 @@
+// Thin io_uring wrapper over the raw syscalls, used by the server's
+// alternative I/O engine. Compiled only when CHAT_IO_URING is defined.
+#pragma once
+
+#ifdef CHAT_IO_URING
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+class IoUring {
+public:
+    IoUring() = default;
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+    ~IoUring();
+
+    // Sets up the rings. Returns 0, or -errno when the kernel lacks a feature
+    // the engine depends on (multishot recv, provided buffer rings, ext arg
+    // waits), in which case the caller should stay on epoll.
+    int init(unsigned entries);
+
+    // Returns a zeroed SQE, submitting queued ones first if the SQ is full.
+    io_uring_sqe *get_sqe();
+    // Submits queued SQEs without waiting.
+    int submit();
+    // Submits queued SQEs and waits up to timeout_ms for one completion.
+    // Returns >= 0, -ETIME on timeout or another -errno.
+    int submit_and_wait(int timeout_ms);
+
+    // Next unconsumed CQE, or nullptr. Call cqe_seen() once done with it.
+    io_uring_cqe *peek_cqe();
+    void cqe_seen();
+
+    // Registers count provided buffers of size bytes under group bgid.
+    int setup_buf_ring(uint16_t bgid, unsigned count, unsigned size);
+    uint8_t *buf_addr(uint16_t bid) const { return buf_base_ + static_cast<size_t>(bid) * buf_size_; }
+    // Hands a consumed buffer back to the kernel.
+    void recycle_buf(uint16_t bid);
+
+private:
+    int ring_fd_{ -1 };
+    unsigned sq_entries_{ 0 };
+
+    void *sq_ptr_{ nullptr };
+    size_t sq_ptr_len_{ 0 };
+    void *cq_ptr_{ nullptr };
+    size_t cq_ptr_len_{ 0 };
+    io_uring_sqe *sqes_{ nullptr };
+    size_t sqes_len_{ 0 };
+
+    unsigned *sq_head_{ nullptr };
+    unsigned *sq_tail_{ nullptr };
+    unsigned *sq_array_{ nullptr };
+    unsigned sq_mask_{ 0 };
+    unsigned sq_local_tail_{ 0 };
+    unsigned sq_submitted_tail_{ 0 };
+
+    unsigned *cq_head_{ nullptr };
+    unsigned *cq_tail_{ nullptr };
+    io_uring_cqe *cqes_{ nullptr };
+    unsigned cq_mask_{ 0 };
+
+    io_uring_buf *buf_ring_{ nullptr };
+    uint8_t *buf_base_{ nullptr };
+    unsigned buf_count_{ 0 };
+    unsigned buf_size_{ 0 };
+    uint16_t buf_tail_{ 0 };
+};
+
+#endif // CHAT_IO_URING